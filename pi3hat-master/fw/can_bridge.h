@@ -12,7 +12,9 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <algorithm>
 #include <atomic>
+#include <cstddef>
 #include <cstring>
 
 #include "mbed.h"
@@ -31,7 +33,7 @@ namespace fw {
 /// cannot be read or written piecemeal.
 ///
 /// 0: Protocol version
-///    byte 0: the constant value 3
+///    byte 0: the constant value 9
 /// 1: Interface type
 ///    byte 0: the constant value 1
 /// 2: Receive status
@@ -40,7 +42,8 @@ namespace fw {
 ///      number of bytes that must be read from register 3 to get a
 ///      complete frame
 /// 3: Received frame: reading this register returns exactly one frame
-///    from the received queue.
+///    from the received queue.  The queue holds up to
+///    'rx_queue_depth' frames from each bus.
 ///   byte 0 (0x00 means no data)
 ///     bit 7 - CAN bus
 ///     bits 6-0 - size of payload + 1 (1-65)
@@ -93,16 +96,63 @@ namespace fw {
 ///   bytes: The contents of the 'Configuration' structure
 /// 10: Write configuration 2
 ///   bytes: The contents of the 'Configuration' structure
+/// 11: Send multiple CAN frames
+///   Zero or more records, back to back, each formatted identically
+///   to register 4.  The number of records is determined by the
+///   total length of the transaction.  Only as many records as there
+///   are free transmit buffers, see register 15, are accepted.  The
+///   remainder are discarded and counted in register 13.
+/// 12: Receive all frames
+///   Reading this register consumes up to kBufferItems frames from the
+///   received queue in one transaction.  If exactly kBufferItems are
+///   returned, more may remain.
+///   byte 0 - number of frames which follow (0-kBufferItems)
+///   byte 1, 2 - total number of bytes which follow, LSB first
+///   byte 3+ - each frame, back to back, formatted identically to
+///     register 3
+/// 13: Statistics
+///   The contents of the 'Statistics' structure, one 'Bus' for each
+///   of CAN1 and CAN2, followed by the transmit counters.  All
+///   counters wrap.
+///   byte 0-3 - frames received
+///   byte 4-7 - frames dropped because the receive queue was full
+///   byte 8-11 - hardware receive FIFO overflow events
+///   byte 12 - maximum number of frames ever queued
+///   byte 26-29 - frames written to register 4, 5 or 11 which were
+///     discarded because no transmit buffer was free
+///   byte 30-33 - malformed or truncated records written to register
+///     11
+/// 14: IRQ target reply count (write only)
+///   byte 0 - the IRQ line is not asserted until at least this many
+///     frames are queued.  Once reached, the target reverts to 0,
+///     where the IRQ is asserted whenever any frame is queued.
+/// 15: Transmit status
+///   byte 0 - the number of free transmit buffers (0-kBufferItems).
+///     Each frame written to register 4, 5 or 11 occupies one until
+///     it has been handed to the FDCAN peripheral.
 
 
 // Protocol history:
 //
 // Version 3: Added register 7-10 for configuration.
+// Version 4: Added register 11 for batched transmission.
+// Version 5: Added register 12 for batched reception.
+// Version 6: Added register 13, 'rx_queue_depth' to the
+//            configuration, and a deeper receive queue.
+// Version 7: Added acceptance filters to the configuration.
+// Version 8: Added register 14, the IRQ target reply count.
+// Version 9: Added register 15 and the transmit counters to register
+//            13.
 
 class CanBridge {
  public:
   static constexpr int kMaxSpiFrameSize = 70;
   static constexpr int kBufferItems = 6;
+  static constexpr int kMaxBatchSize = kBufferItems * kMaxSpiFrameSize;
+
+  // Each bus may have up to this many received frames queued.
+  static constexpr int kMaxRxQueueDepth = 24;
+  static constexpr int kRxQueueCapacity = 2 * kMaxRxQueueDepth;
 
   struct Pins {
     PinName irq_name = NC;
@@ -126,6 +176,31 @@ class CanBridge {
     }
   } __attribute__((packed));
 
+  static constexpr int kMaxFilters = 8;
+
+  struct Filter {
+    uint32_t id1 = 0;
+    uint32_t id2 = 0;
+    // 0 = range, 1 = dual, 2 = mask, as per FDCan::FilterMode
+    uint8_t mode = 0;
+    // 0 = disable, 1 = accept, 2 = reject, as per FDCan::FilterAction
+    uint8_t action = 0;
+    // 0 = standard, 1 = extended, as per FDCan::FilterType
+    uint8_t type = 0;
+
+    bool operator==(const Filter& rhs) const {
+      return id1 == rhs.id1 &&
+          id2 == rhs.id2 &&
+          mode == rhs.mode &&
+          action == rhs.action &&
+          type == rhs.type;
+    }
+
+    bool operator!=(const Filter& rhs) const {
+      return !(*this == rhs);
+    }
+  } __attribute__((packed));
+
   struct Configuration {
     int32_t slow_bitrate = 1000000;
     int32_t fast_bitrate = 5000000;
@@ -141,7 +216,22 @@ class CanBridge {
     Rate std_rate;
     Rate fd_rate;
 
+    // The maximum number of received frames from this bus which will
+    // be queued awaiting the host, from 1 to kMaxRxQueueDepth.
+    int8_t rx_queue_depth = kMaxRxQueueDepth;
+
+    // The action applied to frames which match no filter, using the
+    // same encoding as Filter::action.  'disable' is equivalent to
+    // 'accept'.
+    int8_t global_std_action = 1;
+    int8_t global_ext_action = 1;
+
+    Filter filters[kMaxFilters] = {};
+
     bool operator==(const Configuration& rhs) const {
+      for (int i = 0; i < kMaxFilters; i++) {
+        if (filters[i] != rhs.filters[i]) { return false; }
+      }
       return slow_bitrate == rhs.slow_bitrate &&
           fast_bitrate == rhs.fast_bitrate &&
           fdcan_frame == rhs.fdcan_frame &&
@@ -150,7 +240,10 @@ class CanBridge {
           restricted_mode == rhs.restricted_mode &&
           bus_monitor == rhs.bus_monitor &&
           std_rate == rhs.std_rate &&
-          fd_rate == rhs.fd_rate;
+          fd_rate == rhs.fd_rate &&
+          rx_queue_depth == rhs.rx_queue_depth &&
+          global_std_action == rhs.global_std_action &&
+          global_ext_action == rhs.global_ext_action;
     }
 
     bool operator!=(const Configuration& rhs) const {
@@ -158,9 +251,34 @@ class CanBridge {
     }
   } __attribute__((packed));
 
+  // Hosts which predate version 6 read and write only this much of
+  // the configuration.
+  static constexpr int kLegacyConfigurationSize =
+      offsetof(Configuration, rx_queue_depth);
+  // And hosts which predate version 7 this much.
+  static constexpr int kV6ConfigurationSize =
+      offsetof(Configuration, global_std_action);
+
+  struct Statistics {
+    struct Bus {
+      uint32_t received = 0;
+      uint32_t queue_overflow = 0;
+      uint32_t fifo_overflow = 0;
+      uint8_t high_water = 0;
+    } __attribute__((packed));
+
+    Bus bus[2];
+
+    uint32_t tx_dropped = 0;
+    uint32_t tx_malformed = 0;
+  } __attribute__((packed));
+
+  /// @p filters must have room for kMaxFilters, and remain valid for
+  /// as long as the result is in use.
   static FDCan::Options MakeCanOptions(
       const FDCan::Options& source,
-      const Configuration& config) {
+      const Configuration& config,
+      FDCan::Filter* filters) {
 
     FDCan::Options result;
     result.td = source.td;
@@ -184,9 +302,41 @@ class CanBridge {
     result.fdrate_override.time_seg1 = config.fd_rate.time_seg1;
     result.fdrate_override.time_seg2 = config.fd_rate.time_seg2;
 
+    for (int i = 0; i < kMaxFilters; i++) {
+      const auto& in = config.filters[i];
+      auto& out = filters[i];
+      out.id1 = in.id1;
+      out.id2 = in.id2;
+      out.mode = MapFilterMode(in.mode);
+      out.action = MapFilterAction(in.action);
+      out.type = (in.type == 1) ?
+          FDCan::FilterType::kExtended : FDCan::FilterType::kStandard;
+    }
+    result.filter_begin = &filters[0];
+    result.filter_end = &filters[kMaxFilters];
+
+    result.global_std_action = MapFilterAction(config.global_std_action);
+    result.global_ext_action = MapFilterAction(config.global_ext_action);
+
     return result;
   }
 
+  static FDCan::FilterMode MapFilterMode(uint8_t value) {
+    switch (value) {
+      case 1: return FDCan::FilterMode::kDual;
+      case 2: return FDCan::FilterMode::kMask;
+    }
+    return FDCan::FilterMode::kRange;
+  }
+
+  static FDCan::FilterAction MapFilterAction(uint8_t value) {
+    switch (value) {
+      case 1: return FDCan::FilterAction::kAccept;
+      case 2: return FDCan::FilterAction::kReject;
+    }
+    return FDCan::FilterAction::kDisable;
+  }
+
   static Configuration GetCanConfig(const FDCan::Options& source) {
     Configuration result;
     result.slow_bitrate = source.slow_bitrate;
@@ -226,16 +376,28 @@ class CanBridge {
       can_config2_ = GetCanConfig(can2_->options());
       can_config2_shadow_ = can_config2_;
     }
+
+    // Frames are moved from the hardware FIFO into our queue as soon
+    // as they arrive, so that a burst of replies can not overflow the
+    // FIFO before the main loop gets around to polling.
+    if (can1_) {
+      can1_->EnableRxInterrupt([this]() { this->ISR_DrainCan(0); });
+    }
+    if (can2_) {
+      can2_->EnableRxInterrupt([this]() { this->ISR_DrainCan(1); });
+    }
   }
 
   void Poll() {
     if (reset_can_.load()) {
       reset_can_.store(false);
       if (can1_) {
-        can1_->Reset(MakeCanOptions(can1_->options(), can_config1_));
+        can1_->Reset(
+            MakeCanOptions(can1_->options(), can_config1_, can_filters1_));
       }
       if (can2_) {
-        can2_->Reset(MakeCanOptions(can2_->options(), can_config2_));
+        can2_->Reset(
+            MakeCanOptions(can2_->options(), can_config2_, can_filters2_));
       }
     }
 
@@ -264,51 +426,6 @@ class CanBridge {
         (*reset_count)++;
         can->RecoverBusOff();
       }
-
-      const bool rx = can->Poll(&can_header_, rx_buffer_);
-      if (!rx) {
-        return;
-      }
-
-      auto* this_buf = [&]() -> CanReceiveBuf* {
-        for (auto& buf : can_buf_) {
-          if (!buf.active) { return &buf; }
-        }
-        return nullptr;
-      }();
-
-      if (this_buf == nullptr) {
-        // Record an error.
-        return;
-      }
-
-      this_buf->active = true;
-
-      const int size = ParseDlc(can_header_.DataLength);
-
-      this_buf->data[0] = ((bus_id == 2) ? 0x80 : 0x00) | (size + 1);
-      const auto id = can_header_.Identifier;
-      this_buf->data[1] = (id >> 24) & 0xff;
-      this_buf->data[2] = (id >> 16) & 0xff;
-      this_buf->data[3] = (id >> 8) & 0xff;
-      this_buf->data[4] = (id >> 0) & 0xff;
-      this_buf->size = size;
-      std::memcpy(&this_buf->data[5], rx_buffer_, size);
-
-      // Insert this item into the receive queue.
-      __disable_irq();
-      [&]() {
-        for (auto& item : can_rx_queue_) {
-          if (item == nullptr) {
-            item = this_buf;
-            return;
-          }
-        }
-        // Hmm, we couldn't.  Just throw it away.
-        this_buf->active = false;
-      }();
-      irq_.write(1);
-      __enable_irq();
     };
 
     if (can1_) {
@@ -338,17 +455,17 @@ class CanBridge {
   }
 
   uint8_t queue_size() const {
-    return can_rx_queue_[0] ? 1 : 0;
+    return std::min<uint32_t>(rx_head_ - rx_tail_, 255);
   }
 
   static bool IsSpiAddress(uint16_t address) {
-    return address <= 10;
+    return address <= 15;
   }
 
   RegisterSPISlave::Buffer ISR_Start(uint16_t address) {
     if (address == 0) {
       return {
-        std::string_view("\x03", 1),
+        std::string_view("\x09", 1),
         {},
       };
     }
@@ -361,7 +478,7 @@ class CanBridge {
     if (address == 2) {
       address16_buf_[kBufferItems] = 0;
       for (size_t i = 0; i < kBufferItems; i++) {
-        const auto item = can_rx_queue_[i];
+        const auto item = ISR_PeekRx(i);
         address16_buf_[i] = (item == nullptr) ? 0 : (item->size + 5);
         address16_buf_[kBufferItems] += address16_buf_[i];
       }
@@ -374,20 +491,12 @@ class CanBridge {
       };
     }
     if (address == 3) {
-      if (!can_rx_queue_[0]) {
-        current_can_buf_ = nullptr;
+      // The buffer remains active until ISR_End, so that it is not
+      // overwritten while being transmitted.
+      current_can_buf_ = ISR_PopRx();
+      if (!current_can_buf_) {
         return { {}, {} };
       }
-      current_can_buf_ = can_rx_queue_[0];
-
-      // Shift everything over.
-      for (size_t i = 1; i < kBufferItems; i++) {
-        can_rx_queue_[i - 1] = can_rx_queue_[i];
-      }
-      can_rx_queue_[kBufferItems - 1] = nullptr;
-      if (can_rx_queue_[0] == nullptr) {
-        irq_.write(0);
-      }
 
       return {
         std::string_view(current_can_buf_->data, current_can_buf_->size + 5),
@@ -403,8 +512,7 @@ class CanBridge {
           }
         }
         // All our buffers are full.  There must be something wrong on the CAN bus.
-        //
-        // TODO: Log an error.
+        statistics_.tx_dropped++;
         return nullptr;
       }();
 
@@ -458,13 +566,76 @@ class CanBridge {
             sizeof(can_config2_shadow_)),
       };
     }
+    if (address == 11) {
+      return {
+        {},
+        mjlib::base::string_span(batch_buf_, sizeof(batch_buf_)),
+      };
+    }
+    if (address == 12) {
+      // The frames are copied out so that they can be returned in a
+      // single DMA transfer, and their receive buffers released
+      // immediately.
+      int offset = 3;
+      int count = 0;
+      for (size_t i = 0; i < kBufferItems; i++) {
+        auto* const item = ISR_PopRx();
+        if (item == nullptr) { break; }
+
+        std::memcpy(&rx_stream_buf_[offset], item->data, item->size + 5);
+        offset += item->size + 5;
+        count++;
+
+        item->active = false;
+      }
+
+      rx_stream_buf_[0] = count;
+      rx_stream_buf_[1] = (offset - 3) & 0xff;
+      rx_stream_buf_[2] = ((offset - 3) >> 8) & 0xff;
+
+      return {
+        std::string_view(rx_stream_buf_, offset),
+        {},
+      };
+    }
+    if (address == 13) {
+      statistics_copy_ = statistics_;
+      return {
+        std::string_view(
+            reinterpret_cast<const char*>(&statistics_copy_),
+            sizeof(statistics_copy_)),
+        {},
+      };
+    }
+
+    if (address == 14) {
+      return {
+        {},
+        mjlib::base::string_span(
+            reinterpret_cast<char*>(&irq_target_shadow_),
+            sizeof(irq_target_shadow_)),
+      };
+    }
+
+    if (address == 15) {
+      tx_free_buf_ = 0;
+      for (const auto& buf : spi_buf_) {
+        if (!buf.active) { tx_free_buf_++; }
+      }
+      return {
+        std::string_view(reinterpret_cast<const char*>(&tx_free_buf_), 1),
+        {},
+      };
+    }
 
     return { {}, {} };
   }
 
   void ISR_End(uint16_t address, int bytes) {
     if ((address == 9 || address == 10) &&
-        bytes == sizeof(can_config1_shadow_)) {
+        (bytes == sizeof(can_config1_shadow_) ||
+         bytes == kV6ConfigurationSize ||
+         bytes == kLegacyConfigurationSize)) {
       if (can_config1_ != can_config1_shadow_) {
         can_config1_ = can_config1_shadow_;
         reset_can_.store(true);
@@ -475,6 +646,17 @@ class CanBridge {
       }
     }
 
+    if (address == 11) {
+      ISR_SplitBatch(bytes);
+    }
+
+    if (address == 14 && bytes >= 1) {
+      // The FDCAN interrupts are of lower priority, so they cannot
+      // observe this half-updated.
+      irq_target_ = irq_target_shadow_;
+      ISR_UpdateIrq();
+    }
+
     if (current_can_buf_) {
       current_can_buf_->active = false;
       current_can_buf_ = nullptr;
@@ -499,9 +681,150 @@ class CanBridge {
   struct CanReceiveBuf {
     char data[kMaxSpiFrameSize] = {};
     int size = 0;
+    int bus_index = 0;
     std::atomic<bool> active{false};
   };
 
+  int rx_queue_depth(int bus_index) const {
+    const auto& config = (bus_index == 0) ? can_config1_ : can_config2_;
+    return std::max<int>(
+        1, std::min<int>(kMaxRxQueueDepth, config.rx_queue_depth));
+  }
+
+  /// Called from the FDCAN interrupt to move every frame in the
+  /// hardware FIFO into the receive queue.
+  void ISR_DrainCan(int bus_index) {
+    auto* const can = (bus_index == 0) ? can1_ : can2_;
+    auto& stats = statistics_.bus[bus_index];
+
+    if (can->ReadRxLost()) {
+      stats.fifo_overflow++;
+    }
+
+    while (true) {
+      // The SPI interrupt only ever consumes, so if there is room now
+      // there will still be room once this frame is filled in.
+      auto* const this_buf = [&]() -> CanReceiveBuf* {
+        if ((rx_head_ - rx_tail_) >= static_cast<uint32_t>(kRxQueueCapacity)) {
+          return nullptr;
+        }
+        if (rx_count_[bus_index] >= rx_queue_depth(bus_index)) {
+          return nullptr;
+        }
+        auto* const result = &can_buf_[rx_head_ % kRxQueueCapacity];
+        // This may still be in the middle of being read by the host.
+        if (result->active) { return nullptr; }
+        return result;
+      }();
+
+      FDCAN_RxHeaderTypeDef header = {};
+
+      if (this_buf == nullptr) {
+        // We have no room.  The frame is discarded so that the
+        // hardware FIFO does not back up.
+        if (!can->Poll(&header, rx_discard_)) { return; }
+        stats.queue_overflow++;
+        continue;
+      }
+
+      if (!can->Poll(&header, mjlib::base::string_span(
+                         &this_buf->data[5], 64))) {
+        return;
+      }
+
+      const int size = ParseDlc(header.DataLength);
+
+      this_buf->data[0] = ((bus_index == 1) ? 0x80 : 0x00) | (size + 1);
+      const auto id = header.Identifier;
+      this_buf->data[1] = (id >> 24) & 0xff;
+      this_buf->data[2] = (id >> 16) & 0xff;
+      this_buf->data[3] = (id >> 8) & 0xff;
+      this_buf->data[4] = (id >> 0) & 0xff;
+      this_buf->size = size;
+      this_buf->bus_index = bus_index;
+      this_buf->active = true;
+
+      stats.received++;
+
+      // Publish this item to the SPI interrupt.
+      __disable_irq();
+      rx_head_++;
+      rx_count_[bus_index]++;
+      if (rx_count_[bus_index] > stats.high_water) {
+        stats.high_water = rx_count_[bus_index];
+      }
+      ISR_UpdateIrq();
+      __enable_irq();
+    }
+  }
+
+  /// Only call from the SPI interrupt.
+  CanReceiveBuf* ISR_PeekRx(size_t index) {
+    if (index >= (rx_head_ - rx_tail_)) { return nullptr; }
+    return &can_buf_[(rx_tail_ + index) % kRxQueueCapacity];
+  }
+
+  /// Only call from the SPI interrupt.  The returned buffer is still
+  /// marked active, and must be released by the caller.
+  CanReceiveBuf* ISR_PopRx() {
+    if (rx_head_ == rx_tail_) { return nullptr; }
+    auto* const result = &can_buf_[rx_tail_ % kRxQueueCapacity];
+    rx_tail_++;
+    rx_count_[result->bus_index]--;
+    ISR_UpdateIrq();
+    return result;
+  }
+
+  /// Assert the IRQ line if enough frames are queued to satisfy the
+  /// target reply count.  Must be called with the FDCAN interrupts
+  /// masked, or from the SPI interrupt.
+  void ISR_UpdateIrq() {
+    const uint32_t queued = rx_head_ - rx_tail_;
+    if (irq_target_ != 0 && queued >= irq_target_) {
+      irq_target_ = 0;
+    }
+    irq_.write((queued != 0 && irq_target_ == 0) ? 1 : 0);
+  }
+
+  /// Distribute the records of a batched transmit into individual
+  /// SPI receive buffers, as if each had been written to register 4.
+  void ISR_SplitBatch(int bytes) {
+    constexpr int kHeaderSize = 5;
+
+    int offset = 0;
+    while (offset + kHeaderSize <= bytes) {
+      const int size = u8(batch_buf_[offset]) & 0x7f;
+      const int record_size = kHeaderSize + size;
+      if (size > 64 || offset + record_size > bytes) {
+        // This is malformed or truncated.
+        statistics_.tx_malformed++;
+        return;
+      }
+
+      auto* const this_buf = [&]() -> SpiReceiveBuf* {
+        for (auto& buf : spi_buf_) {
+          if (!buf.active) { return &buf; }
+        }
+        return nullptr;
+      }();
+
+      if (this_buf == nullptr) {
+        // All our buffers are full, so this record is lost.
+        statistics_.tx_dropped++;
+        offset += record_size;
+        continue;
+      }
+
+      this_buf->active = true;
+      this_buf->address = 4;
+      std::memcpy(this_buf->data, &batch_buf_[offset], record_size);
+      this_buf->size = record_size;
+      this_buf->ready_to_send = true;
+
+      offset += record_size;
+    }
+  }
+
   fw::FDCan::SendResult SendCan(const SpiReceiveBuf* spi) {
     const int min_size = (spi->address == 4) ? 5 : 3;
     if (spi->size < min_size) {
@@ -575,13 +898,24 @@ class CanBridge {
 
   SpiReceiveBuf spi_buf_[kBufferItems] = {};
   SpiReceiveBuf* current_spi_buf_ = nullptr;
-
-  CanReceiveBuf can_buf_[kBufferItems] = {};
-  CanReceiveBuf* can_rx_queue_[kBufferItems] = {};
+  char batch_buf_[kMaxBatchSize] = {};
+
+  // This is a ring buffer, written only from the FDCAN interrupts
+  // and consumed only from the SPI interrupt.
+  CanReceiveBuf can_buf_[kRxQueueCapacity] = {};
+  volatile uint32_t rx_head_ = 0;
+  volatile uint32_t rx_tail_ = 0;
+  volatile int rx_count_[2] = {};
   CanReceiveBuf* current_can_buf_ = nullptr;
+  char rx_stream_buf_[3 + kMaxBatchSize] = {};
+  char rx_discard_[64] = {};
 
-  FDCAN_RxHeaderTypeDef can_header_ = {};
-  char rx_buffer_[64] = {};
+  Statistics statistics_;
+  Statistics statistics_copy_;
+
+  volatile uint8_t irq_target_ = 0;
+  uint8_t irq_target_shadow_ = 0;
+  uint8_t tx_free_buf_ = 0;
 
   uint8_t can1_reset_count_ = 0;
   uint8_t can2_reset_count_ = 0;
@@ -589,6 +923,9 @@ class CanBridge {
   uint8_t address16_buf_[kBufferItems + 1] = {};
   uint8_t status_buf_[12] = {};
 
+  FDCan::Filter can_filters1_[kMaxFilters] = {};
+  FDCan::Filter can_filters2_[kMaxFilters] = {};
+
   Configuration can_config1_;
   Configuration can_config1_shadow_;
   Configuration can_config2_;
@@ -0,0 +1,263 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include "fw/euler.h"
+#include "fw/point3d.h"
+#include "fw/quaternion.h"
+#include "fw/ukf_filter.h"
+
+namespace fw {
+
+/// Provides the same estimates as AttitudeReference, but with a
+/// multiplicative, or error state, filter.
+///
+/// The attitude and gyro bias are held outside the filter.  The
+/// filter itself estimates only the error in each, as a 3 element
+/// rotation vector in the body frame and a 3 element bias.  After
+/// every step the estimated error is folded back into the attitude
+/// and bias, and reset to zero.
+///
+/// Compared to AttitudeReference, this has 12 rather than 14 sigma
+/// points and smaller matrices.  The accelerometer and yaw rate
+/// measurements are also fused into a single update, so one rather
+/// than two Cholesky decompositions are made for each measurement.
+///
+/// The frame conventions are the same as for AttitudeReference.
+class ErrorStateAttitudeReference {
+ public:
+  enum {
+    kNumStates = 6,
+  };
+
+  using Filter = UkfFilter<float, kNumStates>;
+  using Error = Filter::Error;
+
+  struct Options {
+    // Attitude terms are in rad^2, rather than the quaternion
+    // component units of AttitudeReference, which are about half the
+    // angle.
+    float process_noise_gyro_rps = (1e-3f * 1e-3f);
+    float process_noise_bias_rps = (7e-5f * 7e-5f);
+    float measurement_noise_accel = (0.5f * 0.5f);
+    float initial_noise_attitude = (1.0f * 1.0f);
+    float initial_noise_bias_rps = (0.1f * 0.1f);
+    float accelerometer_reject_mps2 = 2.0f;
+    float zero_yaw_noise_rps = (10.0f * 10.0f);
+
+    Options() {}
+  };
+
+  ErrorStateAttitudeReference(const Options& options = Options())
+      : options_(options),
+        ukf_{
+    Filter::State::Zero(),
+        Eigen::DiagonalMatrix<float, 6, 6>(
+            (Filter::State() <<
+             options.initial_noise_attitude,
+             options.initial_noise_attitude,
+             options.initial_noise_attitude,
+             options.initial_noise_bias_rps,
+             options.initial_noise_bias_rps,
+             options.initial_noise_bias_rps).finished()),
+        Eigen::DiagonalMatrix<float, 6, 6>(
+            (Filter::State() <<
+             options.process_noise_gyro_rps,
+             options.process_noise_gyro_rps,
+             options.process_noise_gyro_rps,
+             options.process_noise_bias_rps,
+             options.process_noise_bias_rps,
+             options.process_noise_bias_rps).finished())} {
+  }
+
+  Filter::Error error() const { return ukf_.error(); }
+
+  void ProcessMeasurement(float delta_s,
+                          const Point3D& rate_B_rps,
+                          const Point3D& accel_mps2) {
+    current_gyro_rps_ = rate_B_rps;
+    current_accel_mps2_ = accel_mps2;
+
+    const Point3D norm_g = accel_mps2.normalized();
+
+    if (!initialized_) {
+      initialized_ = true;
+      attitude_ = AccelToOrientation(norm_g);
+    }
+
+    // The attitude itself is integrated directly, and the filter only
+    // has to propagate errors relative to it.
+    nominal_delta_ = Quaternion::IntegrateRotationRate(
+        current_gyro_rps_ + bias_rps_, delta_s);
+
+    ukf_.UpdateState(
+        delta_s,
+        [this](const auto& _1, const auto& _2) {
+          return this->ProcessFunction(_1, _2);
+        });
+
+    attitude_ = (attitude_ * nominal_delta_).normalized();
+    Inject();
+
+    const float accel_norm_mps2 = accel_mps2.norm();
+    const float accel_err_mps2 = std::abs(accel_norm_mps2 - 9.81f);
+
+    // As with AttitudeReference, the acceleration is only used when
+    // close to 1g, and the yaw rate is always constrained to 0.
+    if (accel_err_mps2 < options_.accelerometer_reject_mps2) {
+      ukf_.UpdateMeasurement(
+          [this](const auto& _1) { return this->MeasureAccelYawRate(_1); },
+          (Eigen::Vector4f() << norm_g, 0.f).finished(),
+          (Eigen::DiagonalMatrix<float, 4, 4>(
+              (Eigen::Vector4f() <<
+               options_.measurement_noise_accel,
+               options_.measurement_noise_accel,
+               options_.measurement_noise_accel,
+               options_.zero_yaw_noise_rps).finished())));
+    } else {
+      ukf_.UpdateMeasurement(
+          [this](const auto& _1) { return this->MeasureYawRate(_1); },
+          Eigen::Matrix<float, 1, 1>(0.f),
+          (Eigen::Matrix<float, 1, 1>(options_.zero_yaw_noise_rps)));
+    }
+    Inject();
+  }
+
+  Quaternion attitude() const {
+    return attitude_;
+  }
+
+  Point3D rate_rps() const {
+    return current_gyro_rps_ + bias_rps();
+  }
+
+  Point3D acceleration_mps2() const {
+    return current_accel_mps2_ - 9.81f * OrientationToAccel(attitude());
+  }
+
+  Point3D bias_rps() const {
+    return bias_rps_;
+  }
+
+  /// This is reported in quaternion component units, to match
+  /// AttitudeReference.  The scalar component is always reported as 0.
+  Eigen::Vector4f attitude_uncertainty() const {
+    const Eigen::Vector3f angle =
+        ukf_.covariance().diagonal().head(3).cwiseSqrt();
+    return (Eigen::Vector4f() << 0.f, 0.5f * angle).finished();
+  }
+
+  Eigen::Vector3f bias_uncertainty_rps() const {
+    return ukf_.covariance().diagonal().tail(3).cwiseSqrt();
+  }
+
+ private:
+  // The error is mapped to and from quaternions with the true
+  // exponential map.  Cheaper approximations, like that used by
+  // Quaternion::IntegrateRotationRate, do not compose rotations about
+  // the same axis additively, which makes the covariance grow without
+  // bound when the attitude and bias errors are correlated.
+  static Point3D ToRotationVector(const Quaternion& q_in) {
+    const Quaternion q = (q_in.w() < 0.0f) ?
+        Quaternion(-q_in.w(), -q_in.x(), -q_in.y(), -q_in.z()) : q_in;
+    const Point3D v(q.x(), q.y(), q.z());
+    const float norm = v.norm();
+    if (norm < kSmallAngle) {
+      return (2.0f / q.w()) * v;
+    }
+    return (2.0f * std::atan2(norm, q.w()) / norm) * v;
+  }
+
+  static Quaternion FromRotationVector(const Point3D& v) {
+    const float angle = v.norm();
+    if (angle < kSmallAngle) {
+      return Quaternion::IntegrateRotationRate(v, 1.0f);
+    }
+    const float s = std::sin(0.5f * angle) / angle;
+    return Quaternion(std::cos(0.5f * angle), s * v.x(), s * v.y(), s * v.z());
+  }
+
+  static constexpr float kSmallAngle = 1e-4f;
+
+  Quaternion ErrorAttitude(const Filter::State& s) const {
+    return attitude_ * FromRotationVector(s.head(3));
+  }
+
+  void Inject() {
+    auto& s = ukf_.state();
+    attitude_ = ErrorAttitude(s).normalized();
+    bias_rps_ += s.tail(3);
+    s.setZero();
+  }
+
+  Filter::State ProcessFunction(
+      const Filter::State& state, float dt_s) const {
+    // The error relative to the propagated nominal attitude is:
+    //   (q * dn)^-1 * (q * e * d) = dn^-1 * e * d
+    const Quaternion delta = Quaternion::IntegrateRotationRate(
+        current_gyro_rps_ + bias_rps_ + state.tail(3), dt_s);
+    const Quaternion next_error =
+        nominal_delta_.conjugated() * FromRotationVector(state.head(3)) *
+        delta;
+
+    return (Filter::State() <<
+            ToRotationVector(next_error),
+            state.tail(3)).finished();
+  }
+
+  static Eigen::Matrix<float, 3, 1> OrientationToAccel(
+      const Quaternion& attitude) {
+    const Point3D gravity(0.f, 0.f, -1.f);
+    return attitude.conjugated().Rotate(gravity);
+  }
+
+  float YawRate(const Quaternion& attitude, const Filter::State& s) const {
+    const Eigen::Vector3f rate_rps = current_gyro_rps_ + bias_rps_ + s.tail(3);
+    return attitude.conjugated().Rotate(rate_rps).z();
+  }
+
+  Eigen::Matrix<float, 4, 1> MeasureAccelYawRate(
+      const Filter::State& s) const {
+    const Quaternion attitude = ErrorAttitude(s);
+    return (Eigen::Vector4f() <<
+            OrientationToAccel(attitude),
+            YawRate(attitude, s)).finished();
+  }
+
+  Eigen::Matrix<float, 1, 1> MeasureYawRate(const Filter::State& s) const {
+    return Eigen::Matrix<float, 1, 1>(YawRate(ErrorAttitude(s), s));
+  }
+
+  static Quaternion AccelToOrientation(const Point3D& n_inv) {
+    const Point3D n = -1.0 * n_inv;
+    Euler euler_rad;
+    euler_rad.roll = std::atan2(-n.x(), n.z());
+    euler_rad.pitch = std::atan2(n.y(), std::sqrt(n.x() * n.x() +
+                                                  n.z() * n.z()));
+
+    return Quaternion::FromEuler(euler_rad);
+  }
+
+  const Options options_;
+  Filter ukf_;
+  bool initialized_ = false;
+  Quaternion attitude_;
+  Point3D bias_rps_ = Point3D::Zero();
+  Quaternion nominal_delta_;
+  Point3D current_gyro_rps_;
+  Point3D current_accel_mps2_;
+};
+
+}
@@ -98,11 +98,47 @@ FDCan::Rate ApplyRateOverride(FDCan::Rate base, FDCan::Rate overlay) {
 }
 }
 
+namespace {
+FDCan* g_instances[3] = {};
+
+int InstanceIndex(FDCAN_GlobalTypeDef* can) {
+  if (can == FDCAN1) { return 0; }
+#if defined (FDCAN2)
+  if (can == FDCAN2) { return 1; }
+#endif
+#if defined (FDCAN3)
+  if (can == FDCAN3) { return 2; }
+#endif
+  mbed_die();
+  return 0;
+}
+
+IRQn_Type InstanceIrq(int index) {
+  switch (index) {
+    case 0: return FDCAN1_IT0_IRQn;
+#if defined (FDCAN2)
+    case 1: return FDCAN2_IT0_IRQn;
+#endif
+#if defined (FDCAN3)
+    case 2: return FDCAN3_IT0_IRQn;
+#endif
+  }
+  mbed_die();
+  return FDCAN1_IT0_IRQn;
+}
+}
+
 FDCan::FDCan(const Options& options) {
   Reset(options);
 }
 
 void FDCan::Reset(const Options& options) {
+  // No interrupts may be serviced while the peripheral is being
+  // re-initialized.
+  if (irq_enabled_) {
+    HAL_NVIC_DisableIRQ(irq_);
+  }
+
   options_ = options;
 
   __HAL_RCC_FDCAN_CLK_ENABLE();
@@ -295,8 +331,52 @@ void FDCan::Reset(const Options& options) {
           &can, FDCAN_IT_RX_FIFO0_NEW_MESSAGE, 0) != HAL_OK) {
     mbed_die();
   }
+
+  if (irq_enabled_) {
+    HAL_NVIC_EnableIRQ(irq_);
+  }
+}
+
+void FDCan::EnableRxInterrupt(RxCallback callback, uint32_t priority) {
+  const int index = InstanceIndex(can_);
+  g_instances[index] = this;
+  rx_callback_ = callback;
+  irq_ = InstanceIrq(index);
+
+  const auto handler = [&]() {
+    switch (index) {
+      case 0: return &FDCan::GlobalInterruptFDCAN1;
+      case 1: return &FDCan::GlobalInterruptFDCAN2;
+      case 2: return &FDCan::GlobalInterruptFDCAN3;
+    }
+    mbed_die();
+  }();
+
+  NVIC_SetVector(irq_, reinterpret_cast<uint32_t>(handler));
+  HAL_NVIC_SetPriority(irq_, priority, 0);
+  HAL_NVIC_EnableIRQ(irq_);
+  irq_enabled_ = true;
+}
+
+bool FDCan::ReadRxLost() {
+  if (!__HAL_FDCAN_GET_FLAG(&hfdcan1_, FDCAN_FLAG_RX_FIFO0_MESSAGE_LOST)) {
+    return false;
+  }
+  __HAL_FDCAN_CLEAR_FLAG(&hfdcan1_, FDCAN_FLAG_RX_FIFO0_MESSAGE_LOST);
+  return true;
 }
 
+void FDCan::ISR_Handle() {
+  // Acknowledge before draining, so that any frame which arrives
+  // while the callback runs raises the interrupt again.
+  __HAL_FDCAN_CLEAR_FLAG(&hfdcan1_, FDCAN_FLAG_RX_FIFO0_NEW_MESSAGE);
+  if (rx_callback_) { rx_callback_(); }
+}
+
+void FDCan::GlobalInterruptFDCAN1() { g_instances[0]->ISR_Handle(); }
+void FDCan::GlobalInterruptFDCAN2() { g_instances[1]->ISR_Handle(); }
+void FDCan::GlobalInterruptFDCAN3() { g_instances[2]->ISR_Handle(); }
+
 namespace {
 bool ApplyOverride(bool value, FDCan::Override o) {
   using OV = FDCan::Override;
@@ -18,6 +18,7 @@
 
 #include "mbed.h"
 
+#include "mjlib/base/inplace_function.h"
 #include "mjlib/base/string_span.h"
 
 namespace fw {
@@ -129,6 +130,17 @@ class FDCan {
   /// @return true if a packet was available.
   bool Poll(FDCAN_RxHeaderTypeDef* header, mjlib::base::string_span);
 
+  using RxCallback = mjlib::base::inplace_function<void ()>;
+
+  /// Invoke @p callback from interrupt context whenever a new frame
+  /// arrives in the receive FIFO.  It is expected to drain the FIFO
+  /// using Poll.  The registration persists across Reset.
+  void EnableRxInterrupt(RxCallback callback, uint32_t priority = 1);
+
+  /// @return true if the hardware receive FIFO has overflowed and
+  /// lost a frame since the last call.
+  bool ReadRxLost();
+
   void RecoverBusOff();
 
   FDCAN_ProtocolStatusTypeDef status();
@@ -145,9 +157,19 @@ class FDCan {
   static int ParseDlc(uint32_t dlc_code);
 
  private:
+  void ISR_Handle();
+
+  static void GlobalInterruptFDCAN1();
+  static void GlobalInterruptFDCAN2();
+  static void GlobalInterruptFDCAN3();
+
   Options options_;
   Config config_;
 
+  RxCallback rx_callback_;
+  IRQn_Type irq_ = {};
+  bool irq_enabled_ = false;
+
   FDCAN_GlobalTypeDef* can_ = nullptr;
   FDCAN_HandleTypeDef hfdcan1_;
   uint32_t last_tx_request_ = 0;
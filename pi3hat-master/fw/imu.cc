@@ -16,6 +16,50 @@
 
 namespace fw {
 
+template <typename Reference>
+uint32_t Imu::UpdateAttitude(Reference* reference, const fw::ImuData& data,
+                             AttitudeRegister* my_att) {
+  reference->ProcessMeasurement(
+      period_s_,
+      (static_cast<float>(M_PI) / 180.0f) * data.rate_dps,
+      data.accel_mps2);
+
+  my_att->present = 1;
+  const Quaternion att = reference->attitude();
+  my_att->w = att.w();
+  my_att->x = att.x();
+  my_att->y = att.y();
+  my_att->z = att.z();
+  const Point3D rate_dps = (180.0f / static_cast<float>(M_PI)) *
+                           reference->rate_rps();
+  my_att->x_dps = rate_dps.x();
+  my_att->y_dps = rate_dps.y();
+  my_att->z_dps = rate_dps.z();
+  const Point3D a_mps2 = reference->acceleration_mps2();
+  my_att->a_x_mps2 = a_mps2.x();
+  my_att->a_y_mps2 = a_mps2.y();
+  my_att->a_z_mps2 = a_mps2.z();
+  const Point3D bias_dps = (180.0f / static_cast<float>(M_PI)) *
+                           reference->bias_rps();
+  my_att->bias_x_dps = bias_dps.x();
+  my_att->bias_y_dps = bias_dps.y();
+  my_att->bias_z_dps = bias_dps.z();
+  const Eigen::Vector4f attitude_uncertainty =
+      reference->attitude_uncertainty();
+  my_att->uncertainty_w = attitude_uncertainty(0);
+  my_att->uncertainty_x = attitude_uncertainty(1);
+  my_att->uncertainty_y = attitude_uncertainty(2);
+  my_att->uncertainty_z = attitude_uncertainty(3);
+  const Eigen::Vector3f bias_uncertainty_dps =
+      (180.0f / static_cast<float>(M_PI)) *
+      reference->bias_uncertainty_rps();
+  my_att->uncertainty_bias_x_dps = bias_uncertainty_dps.x();
+  my_att->uncertainty_bias_y_dps = bias_uncertainty_dps.y();
+  my_att->uncertainty_bias_z_dps = bias_uncertainty_dps.z();
+
+  return static_cast<uint32_t>(reference->error());
+}
+
 void Imu::DoImu() {
   const auto start = timer_->read_us();
 
@@ -26,7 +70,7 @@ void Imu::DoImu() {
     } else {
       ConfigureIcm42688();
     }
-    attitude_reference_.emplace();
+    ResetEstimator();
   }
 
 
@@ -37,6 +81,18 @@ void Imu::DoImu() {
   data.rate_dps = mounting_.Rotate(data.rate_dps);
   data.accel_mps2 = mounting_.Rotate(data.accel_mps2);
 
+  {
+    ImuFifo::Sample sample;
+    sample.timestamp_us = start;
+    sample.gx_dps = data.rate_dps.x();
+    sample.gy_dps = data.rate_dps.y();
+    sample.gz_dps = data.rate_dps.z();
+    sample.ax_mps2 = data.accel_mps2.x();
+    sample.ay_mps2 = data.accel_mps2.y();
+    sample.az_mps2 = data.accel_mps2.z();
+    fifo_.Push(sample);
+  }
+
   auto& imu_data = [&]() -> ImuData& {
     for (auto& item : imu_data_buffer_) {
       if (item.active.load() == false) {
@@ -50,44 +106,13 @@ void Imu::DoImu() {
 
   imu_data.imu = ImuRegister{data};
 
-  attitude_reference_->ProcessMeasurement(
-      period_s_,
-      (static_cast<float>(M_PI) / 180.0f) * data.rate_dps,
-      data.accel_mps2);
-
   AttitudeRegister& my_att = imu_data.attitude;
-  my_att.present = 1;
-  const Quaternion att = attitude_reference_->attitude();
-  my_att.w = att.w();
-  my_att.x = att.x();
-  my_att.y = att.y();
-  my_att.z = att.z();
-  const Point3D rate_dps = (180.0f / static_cast<float>(M_PI)) *
-                           attitude_reference_->rate_rps();
-  my_att.x_dps = rate_dps.x();
-  my_att.y_dps = rate_dps.y();
-  my_att.z_dps = rate_dps.z();
-  const Point3D a_mps2 = attitude_reference_->acceleration_mps2();
-  my_att.a_x_mps2 = a_mps2.x();
-  my_att.a_y_mps2 = a_mps2.y();
-  my_att.a_z_mps2 = a_mps2.z();
-  const Point3D bias_dps = (180.0f / static_cast<float>(M_PI)) *
-                           attitude_reference_->bias_rps();
-  my_att.bias_x_dps = bias_dps.x();
-  my_att.bias_y_dps = bias_dps.y();
-  my_att.bias_z_dps = bias_dps.z();
-  const Eigen::Vector4f attitude_uncertainty =
-      attitude_reference_->attitude_uncertainty();
-  my_att.uncertainty_w = attitude_uncertainty(0);
-  my_att.uncertainty_x = attitude_uncertainty(1);
-  my_att.uncertainty_y = attitude_uncertainty(2);
-  my_att.uncertainty_z = attitude_uncertainty(3);
-  const Eigen::Vector3f bias_uncertainty_dps =
-      (180.0f / static_cast<float>(M_PI)) *
-      attitude_reference_->bias_uncertainty_rps();
-  my_att.uncertainty_bias_x_dps = bias_uncertainty_dps.x();
-  my_att.uncertainty_bias_y_dps = bias_uncertainty_dps.y();
-  my_att.uncertainty_bias_z_dps = bias_uncertainty_dps.z();
+  const uint32_t this_error =
+      error_state_reference_ ?
+      UpdateAttitude(&*error_state_reference_, data, &my_att) :
+      UpdateAttitude(&*attitude_reference_, data, &my_att);
+
+  my_att.timestamp_us = start;
 
   const auto end = timer_->read_us();
   my_att.update_time_10us = std::min<decltype(end)>(255, (end - start) / 10);
@@ -102,9 +127,8 @@ void Imu::DoImu() {
     old_imu_data->active.store(false);
   }
 
-  const auto this_error = attitude_reference_->error();
-  if (this_error != AttitudeReference::Error::kNone) {
-    my_att.last_error = static_cast<uint32_t>(this_error);
+  if (this_error != 0) {
+    my_att.last_error = this_error;
     my_att.error_count++;
     reset_estimator_.store(true);
   }
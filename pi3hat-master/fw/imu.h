@@ -22,7 +22,9 @@
 
 #include "fw/attitude_reference.h"
 #include "fw/bmi088.h"
+#include "fw/error_state_attitude_reference.h"
 #include "fw/icm42688.h"
+#include "fw/imu_fifo.h"
 #include "fw/millisecond_timer.h"
 #include "fw/quaternion.h"
 #include "fw/register_spi_slave.h"
@@ -32,7 +34,7 @@ namespace fw {
 /// Exposes an IMU through the following SPI registers.
 ///
 ///  32: Protocol version:
-///     byte 0: the constant value 0x20
+///     byte 0: the constant value 0x23
 ///  33: Raw IMU data
 ///     bytes: The contents of the 'ImuRegister' structure
 ///  34: Attitude data
@@ -43,6 +45,8 @@ namespace fw {
 ///     bytes: The contents of the 'Configuration' structure
 ///  37: Error status
 ///     byte 0-3: A bitmask of error flags
+///  38: Raw IMU sample FIFO
+///     bytes: The contents of the 'ImuFifo::Register' structure
 class Imu {
  public:
   struct ImuRegister {
@@ -79,6 +83,9 @@ class Imu {
     float a_x_mps2 = 0;
     float a_y_mps2 = 0;
     float a_z_mps2 = 0;
+    // The time at which the sample was taken, in microseconds from
+    // MillisecondTimer.  This was added in version 0x23.
+    uint32_t timestamp_us = 0;
     float bias_x_dps = 0;
     float bias_y_dps = 0;
     float bias_z_dps = 0;
@@ -93,11 +100,20 @@ class Imu {
     uint32_t last_error = 0;
   } __attribute__((packed));
 
+  enum Filter : uint32_t {
+    kQuaternionFilter = 0,
+    kErrorStateFilter = 1,
+  };
+
   struct Configuration {
     float roll_deg = 0;
     float pitch_deg = 0;
     float yaw_deg = 0;
     uint32_t rate_hz = 400;
+    // One of the 'Filter' values.  This was added in version 0x22,
+    // and configurations written without it select the quaternion
+    // filter.
+    uint32_t filter = kQuaternionFilter;
 
     Quaternion quaternion() {
       return Quaternion::FromEuler(
@@ -110,7 +126,8 @@ class Imu {
       return yaw_deg == rhs.yaw_deg &&
           pitch_deg == rhs.pitch_deg &&
           roll_deg == rhs.roll_deg &&
-          rate_hz == rhs.rate_hz;
+          rate_hz == rhs.rate_hz &&
+          filter == rhs.filter;
     }
 
     bool operator!=(const Configuration& rhs) const {
@@ -133,7 +150,7 @@ class Imu {
         return;
       }
     }
-    attitude_reference_.emplace();
+    ResetEstimator();
 
     // We do this here after everything has been initialized.
     next_imu_sample_ = timer_->read_us();
@@ -157,6 +174,8 @@ class Imu {
         DoImu();
       }
     }
+
+    fifo_.Poll();
   }
 
   void PollMillisecond() {}
@@ -166,13 +185,13 @@ class Imu {
   }
 
   static bool IsSpiAddress(uint16_t address) {
-    return address >= 32 && address <= 37;
+    return address >= 32 && address <= 38;
   }
 
   RegisterSPISlave::Buffer ISR_Start(uint16_t address) {
     if (address == 32) {
       return {
-        std::string_view("\x20", 1),
+        std::string_view("\x23", 1),
         {},
       };
     }
@@ -233,12 +252,26 @@ class Imu {
             sizeof(error_flags_)),
       };
     }
+    if (address == 38) {
+      return {
+        fifo_.ISR_Start(),
+        {},
+      };
+    }
     return {};
   }
 
   void ISR_End(uint16_t address, int bytes) {
+    // Hosts which predate the filter selection write everything but
+    // it.
+    constexpr int kLegacyConfigurationSize =
+        sizeof(spi_config_shadow_) - sizeof(spi_config_shadow_.filter);
+    if (address == 36 && bytes == kLegacyConfigurationSize) {
+      spi_config_shadow_.filter = kQuaternionFilter;
+    }
     if (address == 36 &&
-        bytes == sizeof(spi_config_shadow_)) {
+        (bytes == sizeof(spi_config_shadow_) ||
+         bytes == kLegacyConfigurationSize)) {
       if (spi_config_ != spi_config_shadow_) {
         spi_config_ = spi_config_shadow_;
         // This is a data race, but we're about to throw away our entire
@@ -247,6 +280,9 @@ class Imu {
         reset_estimator_.store(true);
       }
     }
+    if (address == 38) {
+      fifo_.ISR_End(bytes);
+    }
   }
 
  private:
@@ -304,6 +340,21 @@ class Imu {
     imu_isr_bitmask_ = 0;
   }
 
+  void ResetEstimator() {
+    if (spi_config_.filter == kErrorStateFilter) {
+      attitude_reference_.reset();
+      error_state_reference_.emplace();
+    } else {
+      error_state_reference_.reset();
+      attitude_reference_.emplace();
+    }
+  }
+
+  /// Returns the filter error, or 0 if there was none.
+  template <typename Reference>
+  uint32_t UpdateAttitude(Reference* reference, const fw::ImuData& data,
+                          AttitudeRegister* my_att);
+
   void DoImu();
 
   mjlib::micro::Pool* const pool_;
@@ -339,8 +390,13 @@ class Imu {
   // Used to keep track of when we need to grab new data in the ISR.
   uint32_t imu_isr_bitmask_ = 3;
 
+  ImuFifo fifo_;
+
   Bmi088::SetupData setup_data_;
+  // Exactly one of these is present, depending upon the configured
+  // filter.
   std::optional<AttitudeReference> attitude_reference_;
+  std::optional<ErrorStateAttitudeReference> error_state_reference_;
 
   std::atomic<bool> reset_estimator_{false};
 };
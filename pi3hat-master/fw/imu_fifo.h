@@ -0,0 +1,180 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <string_view>
+
+#include "mbed.h"
+
+namespace fw {
+
+/// Queues every IMU sample so that a host which reads less often than
+/// the IMU rate can still receive all of them in one SPI transaction.
+///
+/// The SPI start handler has no time to copy samples out of a ring
+/// buffer, so the main loop keeps a contiguous image of the queue up
+/// to date, and hands it to the ISR in the same manner as Imu does
+/// with ImuData.  The ISR reports back how many samples were read,
+/// and only those are removed.
+class ImuFifo {
+ public:
+  struct Sample {
+    uint32_t timestamp_us = 0;
+    float gx_dps = 0;
+    float gy_dps = 0;
+    float gz_dps = 0;
+    float ax_mps2 = 0;
+    float ay_mps2 = 0;
+    float az_mps2 = 0;
+  } __attribute__((packed));
+
+  // This must be a power of 2.
+  static constexpr uint32_t kSize = 64;
+
+  struct Register {
+    uint16_t count = 0;
+    uint16_t reserved = 0;
+    // The total number of samples discarded because the queue was
+    // full.
+    uint32_t overflow_count = 0;
+    Sample samples[kSize] = {};
+  } __attribute__((packed));
+
+  static constexpr int kHeaderSize = 8;
+
+  // The DMA can run this many bytes ahead of what was actually
+  // clocked out.  A sample counts as read only once this many more
+  // bytes have been read after it.
+  static constexpr int kSlack = 4;
+
+  /// Called from the main loop for each new sample.
+  void Push(const Sample& sample) {
+    Acknowledge();
+    if (head_ - tail_ >= kSize) {
+      // The host isn't keeping up.  Older samples may already be in
+      // the ISR's hands, so drop this one instead.
+      overflow_count_++;
+      return;
+    }
+    ring_[head_ & (kSize - 1)] = sample;
+    head_++;
+  }
+
+  /// Called from the main loop as often as possible.
+  void Poll() {
+    Acknowledge();
+    if (head_ == published_head_ && tail_ == published_tail_) { return; }
+
+    auto& buffer = [&]() -> Buffer& {
+      for (auto& item : buffers_) {
+        if (item.active.load() == false) {
+          // Nothing is using it, and we're the only one who can set
+          // it to true, so this won't change.
+          return item;
+        }
+      }
+      mbed_die();
+    }();
+
+    const uint32_t count = head_ - tail_;
+    buffer.reg.count = count;
+    buffer.reg.overflow_count = overflow_count_;
+    for (uint32_t i = 0; i < count; i++) {
+      buffer.reg.samples[i] = ring_[(tail_ + i) & (kSize - 1)];
+    }
+    buffer.first = tail_;
+
+    buffer.active.store(true);
+    auto* old = to_isr_.exchange(&buffer);
+    if (old) { old->active.store(false); }
+
+    published_head_ = head_;
+    published_tail_ = tail_;
+  }
+
+  std::string_view ISR_Start() {
+    auto* next = to_isr_.exchange(nullptr);
+    if (next) {
+      if (in_isr_) { in_isr_->active.store(false); }
+      in_isr_ = next;
+    }
+
+    // If some of what we have was already read, we must wait for the
+    // main loop to publish what remains, or the host would see those
+    // samples twice.
+    serving_ = in_isr_ && in_isr_->first == read_.load();
+    if (!serving_) {
+      return std::string_view(empty_, sizeof(empty_));
+    }
+    return std::string_view(
+        reinterpret_cast<const char*>(&in_isr_->reg),
+        kHeaderSize + in_isr_->reg.count * sizeof(Sample) + kSlack);
+  }
+
+  void ISR_End(int bytes) {
+    if (!serving_) { return; }
+    if (bytes < kHeaderSize + kSlack) { return; }
+
+    const uint32_t read = std::min<uint32_t>(
+        in_isr_->reg.count,
+        (bytes - kHeaderSize - kSlack) / sizeof(Sample));
+    if (read == 0) { return; }
+
+    read_.store(in_isr_->first + read);
+  }
+
+ private:
+  void Acknowledge() {
+    const uint32_t read = read_.load();
+    if (static_cast<int32_t>(read - tail_) > 0) { tail_ = read; }
+  }
+
+  struct Buffer {
+    Register reg;
+    // So that the slack is always within the buffer.
+    uint8_t padding[kSlack] = {};
+
+    // The counter value of the first sample.
+    uint32_t first = 0;
+    std::atomic<bool> active{false};
+  };
+
+  // These are only used by the main loop.  'head_' and 'tail_' are
+  // free running sample counters.
+  Sample ring_[kSize] = {};
+  uint32_t head_ = 0;
+  uint32_t tail_ = 0;
+  uint32_t overflow_count_ = 0;
+  uint32_t published_head_ = 0;
+  uint32_t published_tail_ = 0;
+
+  // As with ImuData, one for the ISR to work from, one queued up for
+  // it, and one for the main loop to fill in.
+  Buffer buffers_[3] = {};
+  std::atomic<Buffer*> to_isr_{nullptr};
+  // The counter value through which the ISR has seen samples read.
+  std::atomic<uint32_t> read_{0};
+
+  // These are only used by the ISR.
+  Buffer* in_isr_ = nullptr;
+  bool serving_ = false;
+  // A header with a count of 0.
+  char empty_[kHeaderSize + kSlack] = {};
+};
+
+}
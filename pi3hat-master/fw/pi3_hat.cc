@@ -26,6 +26,7 @@
 #include "fw/fdcan.h"
 #include "fw/imu.h"
 #include "fw/millisecond_timer.h"
+#include "fw/profiler.h"
 #include "fw/register_spi_slave.h"
 #include "fw/rf_transceiver.h"
 
@@ -52,15 +53,22 @@ CanBridge::Pins MakeCanPins() {
 class CanApplication {
  public:
   CanApplication(fw::MillisecondTimer* timer)
-      : timer_(timer) {}
+      : timer_(timer) {
+    spi_.set_isr_time_handler([this](uint32_t start) {
+        profiler_.Record(Profiler::kSpiIsr, start);
+      });
+  }
 
   void Poll() {
     cpu_meter_.Poll();
+    const auto start = Profiler::now();
     bridge_.Poll();
+    profiler_.Record(Profiler::kCanPoll, start);
   }
 
   void PollMillisecond() {
     cpu_meter_.PollMillisecond();
+    profiler_.PollMillisecond();
     spi_.PollMillisecond();
   }
 
@@ -92,6 +100,7 @@ class CanApplication {
   };
 
   CpuMeter cpu_meter_;
+  Profiler profiler_;
   CanBridge bridge_{timer_, &can1_, &can2_, MakeCanPins()};
   DeviceInfo device_info_;
 
@@ -102,6 +111,9 @@ class CanApplication {
       if (CpuMeter::IsSpiAddress(address)) {
         return cpu_meter_.ISR_Start(address);
       }
+      if (Profiler::IsSpiAddress(address)) {
+        return profiler_.ISR_Start(address);
+      }
       if (CanBridge::IsSpiAddress(address)) {
         return bridge_.ISR_Start(address);
       }
@@ -114,6 +126,9 @@ class CanApplication {
       if (CpuMeter::IsSpiAddress(address)) {
         cpu_meter_.ISR_End(address, bytes);
       }
+      if (Profiler::IsSpiAddress(address)) {
+        profiler_.ISR_End(address, bytes);
+      }
       if (CanBridge::IsSpiAddress(address)) {
         bridge_.ISR_End(address, bytes);
       }
@@ -139,17 +154,25 @@ class AuxApplication {
  public:
   AuxApplication(mjlib::micro::Pool* pool, fw::MillisecondTimer* timer)
       : pool_(pool), timer_(timer) {
+    spi_.set_isr_time_handler([this](uint32_t start) {
+        profiler_.Record(Profiler::kSpiIsr, start);
+      });
   }
 
   void Poll() {
     cpu_meter_.Poll();
+    auto start = Profiler::now();
     bridge_.Poll();
+    start = profiler_.Record(Profiler::kCanPoll, start);
     imu_.Poll();
+    start = profiler_.Record(Profiler::kImu, start);
     rf_.Poll();
+    profiler_.Record(Profiler::kRf, start);
   }
 
   void PollMillisecond() {
     cpu_meter_.PollMillisecond();
+    profiler_.PollMillisecond();
     spi_.PollMillisecond();
     imu_.PollMillisecond();
     rf_.PollMillisecond();
@@ -169,6 +192,9 @@ class AuxApplication {
     if (CpuMeter::IsSpiAddress(address)) {
       return cpu_meter_.ISR_Start(address);
     }
+    if (Profiler::IsSpiAddress(address)) {
+      return profiler_.ISR_Start(address);
+    }
     if (address == 96) {
       // This is a multiplexing register which allows clients to
       // determine what is ready to read.
@@ -203,6 +229,9 @@ class AuxApplication {
     if (CpuMeter::IsSpiAddress(address)) {
       cpu_meter_.ISR_End(address, bytes);
     }
+    if (Profiler::IsSpiAddress(address)) {
+      profiler_.ISR_End(address, bytes);
+    }
   }
 
   mjlib::micro::Pool* const pool_;
@@ -222,6 +251,7 @@ class AuxApplication {
   };
 
   CpuMeter cpu_meter_;
+  Profiler profiler_;
   CanBridge bridge_{timer_, &can1_, nullptr, MakeCanPins()};
 
   DigitalOut can_shdn_{PC_6, 0};
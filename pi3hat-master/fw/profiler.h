@@ -0,0 +1,155 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <string_view>
+
+#include "mbed.h"
+
+#include "fw/register_spi_slave.h"
+
+namespace fw {
+
+/// Measures how many CPU cycles each subsystem consumes, using the
+/// DWT cycle counter.  For each, it keeps the worst case duration, a
+/// log2 histogram of durations, and the load over the last 20ms in
+/// the same manner as CpuMeter.
+class Profiler {
+ public:
+  enum Subsystem {
+    kSpiIsr,
+    kCanPoll,
+    kImu,
+    kRf,
+    kNumSubsystems,
+  };
+
+  static constexpr int kBuckets = 16;
+  static constexpr int kFirstBucketLog2 = 4;
+
+  Profiler() {
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    result_.clock_hz = SystemCoreClock;
+  }
+
+  static uint32_t now() {
+    return DWT->CYCCNT;
+  }
+
+  /// Account for @p subsystem having run since @p start, and return
+  /// the current time so that calls can be chained.
+  uint32_t Record(Subsystem subsystem, uint32_t start) {
+    const uint32_t end = now();
+    const uint32_t cycles = end - start;
+
+    auto& r = result_.subsystems[subsystem];
+    if (cycles > r.max_cycles) { r.max_cycles = cycles; }
+    r.count++;
+    const int log2 = 31 - __builtin_clz(cycles | 1);
+    const int bucket =
+        std::max(0, std::min(kBuckets - 1, log2 - kFirstBucketLog2));
+    if (r.histogram[bucket] != 0xffff) { r.histogram[bucket]++; }
+
+    ms_cycles_[subsystem] += cycles;
+    return end;
+  }
+
+  void PollMillisecond() {
+    if (reset_) {
+      reset_ = false;
+      for (auto& r : result_.subsystems) { r = {}; }
+    }
+
+    for (int i = 0; i < kNumSubsystems; i++) {
+      auto& window = window_[i];
+      // This races with Record from the SPI ISR.  At worst it loses
+      // one measurement.
+      window[window_pos_] = ms_cycles_[i];
+      ms_cycles_[i] = 0;
+
+      uint32_t total = 0;
+      uint32_t peak = 0;
+      for (auto value : window) {
+        total += value;
+        if (value > peak) { peak = value; }
+      }
+
+      auto& r = result_.subsystems[i];
+      r.average_cycles_per_ms = total / kWindow;
+      if (peak > r.peak_cycles_per_ms) { r.peak_cycles_per_ms = peak; }
+    }
+    window_pos_ = (window_pos_ + 1) % kWindow;
+  }
+
+  static bool IsSpiAddress(uint16_t address) {
+    return address == 101 || address == 102;
+  }
+
+  RegisterSPISlave::Buffer ISR_Start(uint16_t address) {
+    if (address == 101) {
+      // As with CpuMeter, this may be torn by a concurrent update.
+      return {
+        std::string_view(
+            reinterpret_cast<const char*>(&result_),
+            sizeof(result_)),
+        {}
+      };
+    }
+    if (address == 102) {
+      return {{}, mjlib::base::string_span(&reset_buf_, 1)};
+    }
+
+    return {{}, {}};
+  }
+
+  void ISR_End(uint16_t address, int bytes) {
+    if (address == 102 && bytes > 0) {
+      reset_ = true;
+    }
+  }
+
+ private:
+  static constexpr int kWindow = 20;
+
+  struct Stats {
+    uint32_t max_cycles = 0;
+    uint32_t count = 0;
+    uint32_t average_cycles_per_ms = 0;
+    uint32_t peak_cycles_per_ms = 0;
+    // Bucket N counts durations of [2^(N+4), 2^(N+5)) cycles, with
+    // the first and last being open ended.  Each saturates at 0xffff.
+    uint16_t histogram[kBuckets] = {};
+  } __attribute__((packed));
+
+  struct Result {
+    uint32_t clock_hz = 0;
+    Stats subsystems[kNumSubsystems] = {};
+  } __attribute__((packed));
+
+  Result result_;
+
+  uint32_t ms_cycles_[kNumSubsystems] = {};
+  uint32_t window_[kNumSubsystems][kWindow] = {};
+  uint8_t window_pos_ = 0;
+
+  char reset_buf_ = 0;
+  volatile bool reset_ = false;
+};
+
+}
@@ -52,6 +52,7 @@ class RegisterSPISlave {
 
   using StartHandler = mjlib::base::inplace_function<Buffer (uint16_t)>;
   using EndHandler = mjlib::base::inplace_function<void (uint16_t, int)>;
+  using IsrTimeHandler = mjlib::base::inplace_function<void (uint32_t)>;
 
   struct Pins {
     PinName mosi = NC;
@@ -158,6 +159,12 @@ class RegisterSPISlave {
     g_impl_->ISR_SPI();
   }
 
+  /// If set, this is invoked at the end of every interrupt this
+  /// class handles, with the DWT cycle counter from its start.
+  void set_isr_time_handler(IsrTimeHandler handler) {
+    isr_time_handler_ = handler;
+  }
+
   void Init() {
     EnableSPI(spi_);
 
@@ -188,6 +195,8 @@ class RegisterSPISlave {
   }
 
   void ISR_HandleNssRise() {
+    const uint32_t start = DWT->CYCCNT;
+
     // Stop all DMA and figure out how much was transferred.
     dma_tx_->CCR &= ~(DMA_CCR_EN);
     dma_rx_->CCR &= ~(DMA_CCR_EN);
@@ -214,9 +223,13 @@ class RegisterSPISlave {
     Init();
 
     mode_ = kInactive;
+
+    if (isr_time_handler_) { isr_time_handler_(start); }
   }
 
   void ISR_HandleNssFall() {
+    const uint32_t start = DWT->CYCCNT;
+
     status_led_.write(0);
 
     __HAL_SPI_ENABLE(&spi_handle_);
@@ -229,11 +242,15 @@ class RegisterSPISlave {
 
     // Queue up our response for the address byte.
     *(__IO uint16_t *)spi_->DR = 0x0000;
+
+    if (isr_time_handler_) { isr_time_handler_(start); }
   }
 
   void ISR_SPI() {
     if (mode_ == kTransfer) { return; }
 
+    const uint32_t start = DWT->CYCCNT;
+
     if (spi_->SR & SPI_SR_RXNE) {
       switch (mode_) {
         case kInactive: {
@@ -257,6 +274,8 @@ class RegisterSPISlave {
         }
       }
     }
+
+    if (isr_time_handler_) { isr_time_handler_(start); }
   }
 
   void ISR_StartDMA() {
@@ -392,6 +411,7 @@ class RegisterSPISlave {
 
   StartHandler start_handler_;
   EndHandler end_handler_;
+  IsrTimeHandler isr_time_handler_;
 
   enum Mode {
     kInactive,
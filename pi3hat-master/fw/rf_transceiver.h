@@ -14,6 +14,7 @@
 
 #pragma once
 
+#include <atomic>
 #include <optional>
 
 #include "fw/millisecond_timer.h"
@@ -24,7 +25,7 @@ namespace fw {
 
 /// Exposes the RF transceiver through the following SPI registers.
 ///  48: Protocol version:
-///   byte0: 0x10
+///   byte0: 0x12
 ///  49: Read ID
 ///   byte0-3: ID
 ///  50: Write ID
@@ -36,6 +37,23 @@ namespace fw {
 ///  52: Read status
 ///   byte0-3: uint32 with 2 bits per field
 ///   byte4-7: uint32 ms since last lock from tx
+///  53: Read changed slots
+///   bytes: The contents of the 'BulkRead' structure, with 'count'
+///          entries.  Slots count as read only once all of their
+///          bytes, and 4 more, have been read.
+///  54: Write several slots
+///   byte0: count
+///   byte1+: 'count' instances of:
+///     byte0: slot number
+///     byte1: size
+///     byte2-5: priority (little endian)
+///     byte6+: slot data
+///  55: Write read bitfield
+///   byte0-3: the bitfield that register 53 treats as already read
+///  56: Read schedule
+///   bytes: The contents of the 'SlotRfProtocol::Schedule' structure
+///  57: Write schedule
+///   bytes: The contents of the 'SlotRfProtocol::Schedule' structure
 ///  64-79: Read slot data
 ///   byte0-3: uint32 age in ms (little endian)
 ///   byte4: size
@@ -44,6 +62,33 @@ class RfTransceiver {
  public:
   static inline constexpr int kTimeoutMs = 1000;
 
+  struct BulkSlot {
+    uint8_t slot = 0;
+    uint8_t size = 0;
+    uint32_t age_ms = 0;
+    uint8_t data[16] = {};
+  } __attribute__((packed));
+
+  struct BulkRead {
+    // If 0, nothing is available right now, and the remaining fields
+    // should be ignored.
+    uint8_t present = 0;
+    uint8_t count = 0;
+    uint16_t reserved = 0;
+    // The slot bitfield as of these slots.
+    uint32_t bitfield = 0;
+    // The read bitfield these slots were selected against.  Each slot
+    // whose bits differ between 'basis' and 'bitfield' is included,
+    // in order.
+    uint32_t basis = 0;
+    BulkSlot slots[SlotRfProtocol::kNumSlots] = {};
+  } __attribute__((packed));
+
+  static constexpr int kBulkHeaderSize = 12;
+  // As with the IMU FIFO, the DMA can run this far ahead of what was
+  // actually clocked out.
+  static constexpr int kBulkSlack = 4;
+
   RfTransceiver(fw::MillisecondTimer* timer, PinName irq_name)
       : timer_(timer),
         irq_(irq_name) {
@@ -57,6 +102,12 @@ class RfTransceiver {
       irq_.write(1);
       last_bitfield_ = this_bitfield;
     }
+
+    if (bulk_stale_ ||
+        this_bitfield != published_bitfield_ ||
+        read_bitfield_.load() != published_basis_) {
+      PublishBulk();
+    }
   }
 
   void PollMillisecond() {
@@ -77,6 +128,9 @@ class RfTransceiver {
     }
     rf_->PollMillisecond();
 
+    // The ages of any slots waiting to be read have changed.
+    if (published_count_) { bulk_stale_ = true; }
+
     if (rf_->locked()) {
       lock_age_ms_ = 0;
     } else {
@@ -98,7 +152,7 @@ class RfTransceiver {
   RegisterSPISlave::Buffer ISR_Start(uint16_t address) {
     if (address == 48) {
       return {
-        std::string_view("\x10", 1),
+        std::string_view("\x12", 1),
         {},
       };
     }
@@ -135,6 +189,61 @@ class RfTransceiver {
         {},
       };
     }
+    if (address == 53) {
+      auto* next = bulk_to_isr_.exchange(nullptr);
+      if (next) {
+        if (bulk_in_isr_) { bulk_in_isr_->active.store(false); }
+        bulk_in_isr_ = next;
+      }
+
+      // Until the main loop publishes slots selected against what has
+      // now been read, we have nothing to offer.
+      bulk_serving_ = bulk_in_isr_ &&
+          bulk_in_isr_->reg.basis == read_bitfield_.load();
+      if (!bulk_serving_) {
+        return {
+          std::string_view(bulk_empty_, sizeof(bulk_empty_)),
+          {},
+        };
+      }
+      return {
+        std::string_view(
+            reinterpret_cast<const char*>(&bulk_in_isr_->reg),
+            kBulkHeaderSize + bulk_in_isr_->reg.count * sizeof(BulkSlot) +
+            kBulkSlack),
+        {},
+      };
+    }
+    if (address == 54) {
+      return {
+        {},
+        mjlib::base::string_span(
+            reinterpret_cast<char*>(bulk_write_buf_), sizeof(bulk_write_buf_)),
+      };
+    }
+    if (address == 55) {
+      return {
+        {},
+        mjlib::base::string_span(
+            reinterpret_cast<char*>(&staged_read_bitfield_),
+            sizeof(staged_read_bitfield_)),
+      };
+    }
+    if (address == 56) {
+      return {
+        std::string_view(reinterpret_cast<const char*>(&schedule_),
+                         sizeof(schedule_)),
+        {},
+      };
+    }
+    if (address == 57) {
+      return {
+        {},
+        mjlib::base::string_span(
+            reinterpret_cast<char*>(&staged_schedule_),
+            sizeof(staged_schedule_)),
+      };
+    }
     if (address >= 64 && address <= 79) {
       const int slot_num = address - 64;
       const auto slot = rf_->remote()->rx_slot(slot_num);
@@ -167,6 +276,55 @@ class RfTransceiver {
       rf_->remote()->tx_slot(slot_num, slot);
       remaining_timeout_ms_.store(kTimeoutMs);
     }
+    if (address == 53 && bulk_serving_ &&
+        bytes >= kBulkHeaderSize + kBulkSlack) {
+      const auto& reg = bulk_in_isr_->reg;
+      const int read = std::min<int>(
+          reg.count,
+          (bytes - kBulkHeaderSize - kBulkSlack) / sizeof(BulkSlot));
+      uint32_t mask = 0;
+      for (int i = 0; i < read; i++) {
+        mask |= 0x03 << (reg.slots[i].slot * 2);
+      }
+      if (mask) {
+        read_bitfield_.store(
+            (reg.basis & ~mask) | (reg.bitfield & mask));
+      }
+    }
+    if (address == 54 && bytes > 1) {
+      const int count = std::min<int>(
+          SlotRfProtocol::kNumSlots, bulk_write_buf_[0]);
+      int pos = 1;
+      for (int i = 0; i < count; i++) {
+        constexpr int kEntryHeaderSize = 6;
+        if (pos + kEntryHeaderSize > bytes) { break; }
+        const uint8_t* const entry = &bulk_write_buf_[pos];
+        const int size = std::min<int>(16, entry[1]);
+        if (pos + kEntryHeaderSize + size > bytes) { break; }
+
+        const auto slot_num =
+            std::min<int>(SlotRfProtocol::kNumSlots - 1, entry[0]);
+        SlotRfProtocol::Slot slot;
+        slot.priority =
+            (entry[2] << 0) |
+            (entry[3] << 8) |
+            (entry[4] << 16) |
+            (entry[5] << 24);
+        slot.size = size;
+        std::memcpy(slot.data, &entry[kEntryHeaderSize], size);
+        rf_->remote()->tx_slot(slot_num, slot);
+        remaining_timeout_ms_.store(kTimeoutMs);
+
+        pos += kEntryHeaderSize + size;
+      }
+    }
+    if (address == 55 && bytes == sizeof(staged_read_bitfield_)) {
+      read_bitfield_.store(staged_read_bitfield_);
+    }
+    if (address == 57 && bytes == sizeof(staged_schedule_)) {
+      schedule_ = staged_schedule_;
+      rf_->remote()->set_schedule(schedule_);
+    }
   }
 
  private:
@@ -189,9 +347,56 @@ class RfTransceiver {
         return options;
       }());
     rf_->Start();
+    rf_->remote()->set_schedule(schedule_);
+    // The new instance starts with an empty bitfield.
+    read_bitfield_.store(0);
     __enable_irq();
   }
 
+  /// Make a contiguous image of every slot which has changed since it
+  /// was last read through register 53, and hand it to the ISR as Imu
+  /// does with its data.  The ISR has no time to assemble it.
+  void PublishBulk() {
+    auto& buffer = [&]() -> BulkBuffer& {
+      for (auto& item : bulk_buffers_) {
+        if (item.active.load() == false) {
+          // Nothing is using it, and we're the only one who can set
+          // it to true, so this won't change.
+          return item;
+        }
+      }
+      mbed_die();
+    }();
+
+    auto* const remote = rf_->remote();
+    auto& reg = buffer.reg;
+    reg.present = 1;
+    reg.bitfield = remote->slot_bitfield();
+    reg.basis = read_bitfield_.load();
+
+    const uint32_t changed = reg.bitfield ^ reg.basis;
+    int count = 0;
+    for (int i = 0; i < SlotRfProtocol::kNumSlots; i++) {
+      if ((changed & (0x03 << (i * 2))) == 0) { continue; }
+      const auto& slot = remote->rx_slot(i);
+      auto& out = reg.slots[count++];
+      out.slot = i;
+      out.size = slot.size;
+      out.age_ms = slot.age;
+      std::memcpy(out.data, slot.data, sizeof(out.data));
+    }
+    reg.count = count;
+
+    buffer.active.store(true);
+    auto* old = bulk_to_isr_.exchange(&buffer);
+    if (old) { old->active.store(false); }
+
+    published_bitfield_ = reg.bitfield;
+    published_basis_ = reg.basis;
+    published_count_ = count;
+    bulk_stale_ = false;
+  }
+
   void Disable() {
     for (int slot_index = 0;
          slot_index < SlotRfProtocol::kNumSlots;
@@ -209,6 +414,38 @@ class RfTransceiver {
   uint32_t staged_id_ = id_.load();
   char write_buf_[64] = {};
   char read_buf_[24] = {};
+
+  struct BulkBuffer {
+    BulkRead reg;
+    // So that the slack is always within the buffer.
+    uint8_t padding[kBulkSlack] = {};
+    std::atomic<bool> active{false};
+  };
+
+  // One for the ISR to work from, one queued up for it, and one for
+  // the main loop to fill in.
+  BulkBuffer bulk_buffers_[3] = {};
+  std::atomic<BulkBuffer*> bulk_to_isr_{nullptr};
+  // Each slot's bits as of when it was last read through register 53.
+  std::atomic<uint32_t> read_bitfield_{0};
+
+  // These are only used by the main loop.
+  uint32_t published_bitfield_ = 0;
+  uint32_t published_basis_ = 0;
+  int published_count_ = 0;
+  bool bulk_stale_ = true;
+
+  // These are only used by the ISR.
+  BulkBuffer* bulk_in_isr_ = nullptr;
+  bool bulk_serving_ = false;
+  // A header with 'present' of 0.
+  char bulk_empty_[kBulkHeaderSize + kBulkSlack] = {};
+  uint8_t bulk_write_buf_[
+      1 + SlotRfProtocol::kNumSlots * (6 + 16)] = {};
+  uint32_t staged_read_bitfield_ = 0;
+
+  SlotRfProtocol::Schedule schedule_;
+  SlotRfProtocol::Schedule staged_schedule_;
   std::atomic<int32_t> remaining_timeout_ms_ = 0;
   std::atomic<bool> reset_{false};
   std::atomic<uint32_t> lock_age_ms_ = 0;
@@ -26,6 +26,9 @@ namespace fw {
 namespace {
 constexpr int kSlotPeriodMs = 20;
 constexpr int kNumChannels = 23;
+constexpr int kMaxPacketSize = 32;
+// Unchanged rate scheduled slots are still sent this often.
+constexpr int kRefreshPackets = 1000 / kSlotPeriodMs;
 
 uint64_t SelectShockburstId(uint32_t slot_id) {
   const auto byte_lsb = 0xc0 | (slot_id & 0x0f);
@@ -180,7 +183,12 @@ class SlotRfProtocol::Impl {
     }
 
     void tx_slot(int slot_idx, const Slot& slot) override {
-      tx_slots_[slot_idx] = slot;
+      auto& current = tx_slots_[slot_idx];
+      if (slot.size != current.size ||
+          std::memcmp(slot.data, current.data, slot.size) != 0) {
+        changed_ |= (1 << slot_idx);
+      }
+      current = slot;
     }
 
     const Slot& tx_slot(int slot_idx) const override {
@@ -191,6 +199,14 @@ class SlotRfProtocol::Impl {
       return rx_slots_[slot_idx];
     }
 
+    void set_schedule(const Schedule& schedule) override {
+      schedule_ = schedule;
+    }
+
+    const Schedule& schedule() const override {
+      return schedule_;
+    }
+
     bool enabled() const {
       return enabled_;
     }
@@ -272,8 +288,27 @@ class SlotRfProtocol::Impl {
       for (auto& slot : tx_slots_) {
         slot.age++;
       }
+      for (auto& count : unsent_packets_) {
+        if (count < 0xffff) { count++; }
+      }
 
       // Pick a set of slots to send out.
+      packet->size = 0;
+      const int limit = UpdateBudget();
+
+      // First, those which are due according to their rate, the most
+      // overdue first.
+      auto due_slots = FindDueSlots();
+      std::sort(due_slots.begin(), due_slots.end(),
+                [&](auto lhs, auto rhs) {
+                  return credit_[lhs] > credit_[rhs];
+                });
+      for (auto slot_idx : due_slots) {
+        if (Fits(*packet, slot_idx, limit)) {
+          EmitSlot(packet, slot_idx);
+          credit_[slot_idx] -= 1.0f;
+        }
+      }
 
       // For all slots which are enabled for this priority window, fill
       // our transmission buffer with those with the oldest age.
@@ -283,15 +318,17 @@ class SlotRfProtocol::Impl {
                   return tx_slots_[lhs].age > tx_slots_[rhs].age;
                 });
 
-      packet->size = 0;
       // Now loop through by age filling up whatever we can.
       for (auto slot_idx : enabled_slots) {
-        const int remaining_size = 32 - packet->size;
-        if ((tx_slots_[slot_idx].size + 1) < remaining_size) {
+        if (Fits(*packet, slot_idx, limit)) {
           EmitSlot(packet, slot_idx);
         }
       }
 
+      if (schedule_.budget_bytes_per_s) {
+        budget_bytes_ -= packet->size;
+      }
+
       // The NRF won't send anything if there are no bytes at all.
       // Thus, use a placeholder if that is the case.  We need to send
       // something in order to give the receiver a chance to ack.
@@ -309,11 +346,59 @@ class SlotRfProtocol::Impl {
       micro::StaticVector<uint8_t, kNumSlots> result;
       uint32_t mask = 1 << current_priority;
       for (int i = 0; i < kNumSlots; i++) {
+        if (schedule_.rate_hz[i] > 0.0f) { continue; }
         if (tx_slots_[i].priority & mask) { result.push_back(i); }
       }
       return result;
     }
 
+    micro::StaticVector<uint8_t, kNumSlots> FindDueSlots() {
+      micro::StaticVector<uint8_t, kNumSlots> result;
+      for (int i = 0; i < kNumSlots; i++) {
+        const float rate_hz = schedule_.rate_hz[i];
+        if (!(rate_hz > 0.0f) || tx_slots_[i].priority == 0) {
+          credit_[i] = 0.0f;
+          continue;
+        }
+
+        // A slot which could not be sent when due stays due, but does
+        // not then get to make up for lost time.
+        credit_[i] = std::min(
+            1.0f, credit_[i] + rate_hz * (kSlotPeriodMs / 1000.0f));
+        // Allow for rounding, so that 5 packets of 0.2 add up to 1.
+        if (credit_[i] < 0.999f) { continue; }
+
+        const bool changed = (changed_ & (1 << i)) != 0;
+        if (!changed && unsent_packets_[i] < kRefreshPackets) {
+          continue;
+        }
+        result.push_back(i);
+      }
+      return result;
+    }
+
+    /// Return the most bytes this packet may hold.
+    int UpdateBudget() {
+      if (schedule_.budget_bytes_per_s == 0) {
+        budget_bytes_ = 0.0f;
+        return kMaxPacketSize;
+      }
+
+      // Unused budget can carry over, but only for about a packet.
+      const float per_packet =
+          schedule_.budget_bytes_per_s * (kSlotPeriodMs / 1000.0f);
+      budget_bytes_ = std::min(
+          budget_bytes_ + per_packet,
+          std::max(per_packet, static_cast<float>(kMaxPacketSize)));
+      return std::max(
+          0, std::min(kMaxPacketSize, static_cast<int>(budget_bytes_)));
+    }
+
+    bool Fits(const Nrf24l01::Packet& packet, int slot_idx, int limit) const {
+      const int remaining_size = limit - packet.size;
+      return (tx_slots_[slot_idx].size + 1) < remaining_size;
+    }
+
     void EmitSlot(Nrf24l01::Packet* packet, int slot_index) {
       auto& size = packet->size;
 
@@ -327,6 +412,8 @@ class SlotRfProtocol::Impl {
       std::memcpy(&packet->data[size], slot.data, slot.size);
       size += slot.size;
       slot.age = 0;
+      changed_ &= ~(1 << slot_index);
+      unsent_packets_[slot_index] = 0;
     }
 
     bool EvaluatePossibleChannel(uint8_t possible_channel, int channel_count) {
@@ -369,6 +456,15 @@ class SlotRfProtocol::Impl {
     uint32_t slot_bitfield_ = 0;
     Slot tx_slots_[kNumSlots] = {};
     Slot rx_slots_[kNumSlots] = {};
+
+    Schedule schedule_;
+    // Slots whose data differs from what was last sent.
+    uint32_t changed_ = 0;
+    // Unlike a slot's age, this is not reset when it is written.
+    uint16_t unsent_packets_[kNumSlots] = {};
+    // How many sends each rate scheduled slot is owed.
+    float credit_[kNumSlots] = {};
+    float budget_bytes_ = 0.0f;
   };
 
   void SwitchChannel() {
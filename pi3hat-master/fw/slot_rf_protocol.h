@@ -56,6 +56,21 @@ class SlotRfProtocol {
     uint8_t data[16] = {};
   };
 
+  /// Each packet is filled first with the slots which are due
+  /// according to their rate, then with those enabled by their
+  /// priority bitmask for this window, oldest first.
+  struct Schedule {
+    /// If non-zero, the slot is sent at up to this rate, and its
+    /// priority only serves to enable it.  Such slots are skipped
+    /// while their data is unchanged since it was last sent, except
+    /// for a refresh once a second in case that packet was lost.
+    float rate_hz[kNumSlots] = {};
+
+    /// If non-zero, at most this many bytes of slot data, including
+    /// each slot's 1 byte header, are sent per second.
+    uint32_t budget_bytes_per_s = 0;
+  } __attribute__((packed));
+
   class Remote {
    public:
     /// Return a bitfield with 2 bits per slot.  The 2 bit number
@@ -72,6 +87,9 @@ class SlotRfProtocol {
 
     /// Return the current value of the given receive slot.
     virtual const Slot& rx_slot(int slot_idx) const = 0;
+
+    virtual void set_schedule(const Schedule&) = 0;
+    virtual const Schedule& schedule() const = 0;
   };
 
   // Return one of the possible remotes.  When in receive mode, only
@@ -22,6 +22,17 @@
 
 #include "mjlib/base/assert.h"
 
+#include "fw/ukf_kernels.h"
+
+/// When non-zero, the covariance propagation, Cholesky and gain
+/// computation use the fixed size kernels in ukf_kernels.h rather than
+/// generic Eigen expressions.  The measurement update then solves
+/// against the Cholesky factor of the innovation covariance instead of
+/// inverting it.
+#ifndef FW_UKF_FIXED_KERNELS
+#define FW_UKF_FIXED_KERNELS 0
+#endif
+
 namespace fw {
 
 /// An Unscented Kalman Filter, as described in "Optimal State
@@ -74,7 +85,11 @@ class UkfFilter {
     Covariance Pminus = Covariance::Zero();
     for (int i = 0; i < N; i++) {
       State c = xhat[i] - xhatminus;
+#if FW_UKF_FIXED_KERNELS
+      ukf_kernels::AddSymmetricOuter(c, &Pminus);
+#else
       Pminus += c * c.transpose();
+#endif
     }
     Pminus *= (1.0 / N);
     Pminus += dt_s * process_noise_;
@@ -89,7 +104,12 @@ class UkfFilter {
     }
 
     state_ = xhatminus;
+#if FW_UKF_FIXED_KERNELS
+    ukf_kernels::MirrorLower(&Pminus);
+    covariance_ = Pminus;
+#else
     covariance_ = ConditionCovariance(Pminus);
+#endif
   }
 
   template <typename Array>
@@ -134,7 +154,12 @@ class UkfFilter {
                           Measurement::RowsAtCompileTime> PyMatrix;
     PyMatrix Py = PyMatrix::Zero();
     for (int i = 0; i < N; i++) {
+#if FW_UKF_FIXED_KERNELS
+      const Measurement d = yhatin[i] - yhat;
+      ukf_kernels::AddSymmetricOuter(d, &Py);
+#else
       Py += (yhatin[i] - yhat) * (yhatin[i] - yhat).transpose();
+#endif
     }
     Py *= (1.0 / N);
     Py += measurement_noise;
@@ -145,10 +170,37 @@ class UkfFilter {
                           Measurement::RowsAtCompileTime> PxyMatrix;
     PxyMatrix Pxy = PxyMatrix::Zero();
     for (int i = 0; i < N; i++) {
+#if FW_UKF_FIXED_KERNELS
+      const State dx = sigma_points[i] - state_;
+      const Measurement dy = yhatin[i] - yhat;
+      ukf_kernels::AddOuter(dx, dy, &Pxy);
+#else
       Pxy += (sigma_points[i] - state_) * (yhatin[i] - yhat).transpose();
+#endif
     }
     Pxy *= (1.0 / N);
 
+#if FW_UKF_FIXED_KERNELS
+    // With Py = L * L', the gain K = Pxy * Py^-1 never has to be
+    // formed.  If W = L^-1 * Pxy' and u = L^-1 * (measurement - yhat),
+    // then K * (measurement - yhat) = W' * u and K * Py * K' = W' * W.
+    PyMatrix L;
+    ukf_kernels::ScaledCholesky(Py, static_cast<_Scalar>(1), &L);
+
+    Eigen::Matrix<_Scalar,
+                  Measurement::RowsAtCompileTime,
+                  State::RowsAtCompileTime> W = Pxy.transpose();
+    ukf_kernels::ForwardSubstitute(L, &W);
+    Measurement u = measurement - yhat;
+    ukf_kernels::ForwardSubstitute(L, &u);
+
+    State xplus = state_;
+    ukf_kernels::AddTransposeProduct(W, u, &xplus);
+    Covariance Pplus = covariance_;
+    ukf_kernels::SubtractSymmetricCross(W, &Pplus);
+    ukf_kernels::MirrorLower(&Pplus);
+#else
+
     // Equation 14.67
     typedef Eigen::Matrix<_Scalar,
                           State::RowsAtCompileTime,
@@ -156,6 +208,7 @@ class UkfFilter {
     KMatrix K = Pxy * Py.inverse();
     State xplus = state_ + K * (measurement - yhat);
     Covariance Pplus = covariance_ - ((K * Py) * K.transpose());
+#endif
 
     if (error_ == kNone) {
       for (size_t i = 0; i < _NumStates; i++) {
@@ -167,7 +220,11 @@ class UkfFilter {
     }
 
     state_ = xplus;
+#if FW_UKF_FIXED_KERNELS
+    covariance_ = Pplus;
+#else
     covariance_ = ConditionCovariance(Pplus);
+#endif
   }
 
   template <typename Array>
@@ -176,7 +233,12 @@ class UkfFilter {
 
     // Lower Cholesky decomposition to calculate the matrix square
     // root.
+#if FW_UKF_FIXED_KERNELS
+    Covariance delta;
+    ukf_kernels::ScaledCholesky(covariance_, n, &delta);
+#else
     Covariance delta = (n * covariance_).llt().matrixL();
+#endif
 
     for (int i = 0; i < _NumStates; i++) {
       array[i] = state_ + delta.col(i);
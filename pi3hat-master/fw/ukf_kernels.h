@@ -0,0 +1,147 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include <Eigen/Core>
+
+/// Fixed size kernels for the linear algebra in UkfFilter.
+///
+/// Every loop bound is a compile time constant, so the compiler
+/// unrolls them fully.  With the single precision FPU of the
+/// Cortex-M4F and contraction enabled, each inner product becomes a
+/// chain of fused multiply-adds.  Results are written into the
+/// caller's storage, so no Eigen temporaries are created.
+///
+/// Symmetric matrices are only ever computed in their lower triangle,
+/// and the upper triangle is filled in at the end by
+/// 'MirrorLower'.
+
+namespace fw {
+namespace ukf_kernels {
+
+/// Store the lower Cholesky factor of (scale * P) in L.  Only the
+/// lower triangle of P is read.
+///
+/// Rounding can leave a covariance very slightly indefinite.  A pivot
+/// below a small fraction of its diagonal is then treated as a
+/// direction with almost no variance: the pivot is raised to that
+/// fraction, and the rest of its column of L is zero.  Its diagonal
+/// thus stays positive, so that ForwardSubstitute never divides by
+/// zero.  NaNs still propagate, so that UkfFilter can report them.
+template <typename Scalar, int N>
+void ScaledCholesky(const Eigen::Matrix<Scalar, N, N>& P, Scalar scale,
+                    Eigen::Matrix<Scalar, N, N>* L_out) {
+  constexpr Scalar kEpsilon = std::numeric_limits<Scalar>::epsilon();
+  auto& L = *L_out;
+  for (int j = 0; j < N; j++) {
+    const Scalar diagonal = scale * P(j, j);
+    Scalar d = diagonal;
+    for (int k = 0; k < j; k++) { d -= L(j, k) * L(j, k); }
+    const Scalar min_pivot =
+        kEpsilon * std::max(std::abs(diagonal), kEpsilon);
+    if (d < min_pivot) {
+      for (int i = 0; i < N; i++) { L(i, j) = 0; }
+      L(j, j) = std::sqrt(min_pivot);
+      continue;
+    }
+    const Scalar ljj = std::sqrt(d);
+    const Scalar inv_ljj = static_cast<Scalar>(1) / ljj;
+    L(j, j) = ljj;
+    for (int i = j + 1; i < N; i++) {
+      Scalar s = scale * P(i, j);
+      for (int k = 0; k < j; k++) { s -= L(i, k) * L(j, k); }
+      L(i, j) = s * inv_ljj;
+    }
+    for (int i = 0; i < j; i++) { L(i, j) = 0; }
+  }
+}
+
+/// P += a * a', in the lower triangle only.
+template <typename Scalar, int N>
+void AddSymmetricOuter(const Eigen::Matrix<Scalar, N, 1>& a,
+                       Eigen::Matrix<Scalar, N, N>* P) {
+  for (int j = 0; j < N; j++) {
+    for (int i = j; i < N; i++) {
+      (*P)(i, j) += a(i) * a(j);
+    }
+  }
+}
+
+/// P += a * b'
+template <typename Scalar, int N, int M>
+void AddOuter(const Eigen::Matrix<Scalar, N, 1>& a,
+              const Eigen::Matrix<Scalar, M, 1>& b,
+              Eigen::Matrix<Scalar, N, M>* P) {
+  for (int j = 0; j < M; j++) {
+    for (int i = 0; i < N; i++) {
+      (*P)(i, j) += a(i) * b(j);
+    }
+  }
+}
+
+/// Solve L * X = B in place, where L is lower triangular.
+template <typename Scalar, int M, int C>
+void ForwardSubstitute(const Eigen::Matrix<Scalar, M, M>& L,
+                       Eigen::Matrix<Scalar, M, C>* B) {
+  for (int c = 0; c < C; c++) {
+    for (int i = 0; i < M; i++) {
+      Scalar s = (*B)(i, c);
+      for (int k = 0; k < i; k++) { s -= L(i, k) * (*B)(k, c); }
+      (*B)(i, c) = s / L(i, i);
+    }
+  }
+}
+
+/// P -= W' * W, in the lower triangle only.
+template <typename Scalar, int M, int N>
+void SubtractSymmetricCross(const Eigen::Matrix<Scalar, M, N>& W,
+                            Eigen::Matrix<Scalar, N, N>* P) {
+  for (int j = 0; j < N; j++) {
+    for (int i = j; i < N; i++) {
+      Scalar s = 0;
+      for (int k = 0; k < M; k++) { s += W(k, i) * W(k, j); }
+      (*P)(i, j) -= s;
+    }
+  }
+}
+
+/// x += W' * u
+template <typename Scalar, int M, int N>
+void AddTransposeProduct(const Eigen::Matrix<Scalar, M, N>& W,
+                         const Eigen::Matrix<Scalar, M, 1>& u,
+                         Eigen::Matrix<Scalar, N, 1>* x) {
+  for (int i = 0; i < N; i++) {
+    Scalar s = 0;
+    for (int k = 0; k < M; k++) { s += W(k, i) * u(k); }
+    (*x)(i) += s;
+  }
+}
+
+/// Copy the lower triangle of P into its upper triangle.
+template <typename Scalar, int N>
+void MirrorLower(Eigen::Matrix<Scalar, N, N>* P) {
+  for (int j = 0; j < N; j++) {
+    for (int i = j + 1; i < N; i++) {
+      (*P)(j, i) = (*P)(i, j);
+    }
+  }
+}
+
+}
+}
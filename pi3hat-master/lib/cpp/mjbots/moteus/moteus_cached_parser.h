@@ -0,0 +1,312 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include "mjbots/moteus/moteus_fixed_encoder.h"
+#include "mjbots/moteus/moteus_protocol.h"
+
+/// @file
+///
+/// A query reply parser which caches the register layout of replies.
+/// Once learned, each frame is checked against the cached framing
+/// bytes and its values are decoded from fixed offsets, without
+/// walking the multiplex structure.  Any frame which does not match
+/// causes the layout to be re-learned from that frame.
+
+namespace mjbots {
+namespace moteus {
+
+/// The results for many servos at once, stored as one array per
+/// register.  Registers which were not present in a reply are NaN,
+/// or 0 for the integral ones.
+struct QueryResultSoa {
+  std::vector<int16_t> mode;
+  std::vector<float> position;
+  std::vector<float> velocity;
+  std::vector<float> torque;
+  std::vector<float> q_current;
+  std::vector<float> d_current;
+  std::vector<int16_t> rezero_state;
+  std::vector<float> voltage;
+  std::vector<float> temperature;
+  std::vector<int16_t> fault;
+
+  void resize(size_t size) {
+    mode.resize(size);
+    position.resize(size);
+    velocity.resize(size);
+    torque.resize(size);
+    q_current.resize(size);
+    d_current.resize(size);
+    rezero_state.resize(size);
+    voltage.resize(size);
+    temperature.resize(size);
+    fault.resize(size);
+  }
+
+  size_t size() const { return mode.size(); }
+};
+
+class CachedQueryParser {
+ public:
+  /// Seed the cached layout from the reply that @p query is expected
+  /// to produce.  This is optional, as the layout will otherwise be
+  /// learned from the first frame.
+  void Learn(const QueryCommand& query) {
+    detail::FixedLayout layout;
+    detail::AppendQuery(layout, query, Multiplex::kReplyBase, true);
+    Learn(layout.data, layout.size);
+  }
+
+  /// Learn the layout from the reply frame @p data.
+  void Learn(const uint8_t* data, size_t size) {
+    entries_count_ = 0;
+    framing_count_ = 0;
+    size_ = size;
+
+    bool is_value[64] = {};
+    MultiplexParser parser(data, size);
+    while (true) {
+      const auto entry = parser.next();
+      if (!std::get<0>(entry)) { break; }
+      const auto reg = std::get<1>(entry);
+      const auto res = std::get<2>(entry);
+      const size_t offset = parser.offset();
+      const int bytes = detail::ResolutionBytes(res);
+      for (int i = 0; i < bytes && (offset + i) < 64; i++) {
+        is_value[offset + i] = true;
+      }
+      parser.Ignore(res);
+
+      const int field = FieldForRegister(reg);
+      if (field < 0) { continue; }
+
+      auto& out = entries_[entries_count_++];
+      out.field = static_cast<Field>(field);
+      out.res = res;
+      out.offset = static_cast<uint8_t>(offset);
+      out.scale = ScaleFor(out.field, res);
+    }
+
+    for (size_t i = 0; i < size && i < 64; i++) {
+      if (is_value[i]) { continue; }
+      framing_offset_[framing_count_] = static_cast<uint8_t>(i);
+      framing_value_[framing_count_] = data[i];
+      framing_count_++;
+    }
+    learned_ = true;
+  }
+
+  bool learned() const { return learned_; }
+
+  /// Return true if @p data has the cached layout.
+  bool Matches(const uint8_t* data, size_t size) const {
+    if (!learned_ || size != size_) { return false; }
+    for (int i = 0; i < framing_count_; i++) {
+      if (data[framing_offset_[i]] != framing_value_[i]) { return false; }
+    }
+    return true;
+  }
+
+  /// A drop in replacement for ParseQueryResult.
+  QueryResult Parse(const uint8_t* data, size_t size) {
+    if (!Matches(data, size)) { Learn(data, size); }
+
+    QueryResult result;
+    for (int i = 0; i < entries_count_; i++) {
+      const auto& entry = entries_[i];
+      const double value = Decode(entry, data);
+      switch (entry.field) {
+        case kModeField: {
+          result.mode = static_cast<Mode>(ToInt(value));
+          break;
+        }
+        case kPositionField: { result.position = value; break; }
+        case kVelocityField: { result.velocity = value; break; }
+        case kTorqueField: { result.torque = value; break; }
+        case kQCurrentField: { result.q_current = value; break; }
+        case kDCurrentField: { result.d_current = value; break; }
+        case kRezeroStateField: {
+          result.rezero_state = ToInt(value) != 0;
+          break;
+        }
+        case kVoltageField: { result.voltage = value; break; }
+        case kTemperatureField: { result.temperature = value; break; }
+        case kFaultField: { result.fault = ToInt(value); break; }
+      }
+    }
+    return result;
+  }
+
+  /// Decode @p data into entry @p index of @p soa.  Any register not
+  /// present in this reply is reset.
+  void Parse(const uint8_t* data, size_t size,
+             QueryResultSoa* soa, size_t index) {
+    if (!Matches(data, size)) { Learn(data, size); }
+
+    constexpr float kNaN = std::numeric_limits<float>::quiet_NaN();
+    soa->mode[index] = 0;
+    soa->position[index] = kNaN;
+    soa->velocity[index] = kNaN;
+    soa->torque[index] = kNaN;
+    soa->q_current[index] = kNaN;
+    soa->d_current[index] = kNaN;
+    soa->rezero_state[index] = 0;
+    soa->voltage[index] = kNaN;
+    soa->temperature[index] = kNaN;
+    soa->fault[index] = 0;
+
+    for (int i = 0; i < entries_count_; i++) {
+      const auto& entry = entries_[i];
+      const double value = Decode(entry, data);
+      switch (entry.field) {
+        case kModeField: {
+          soa->mode[index] = ToInt(value);
+          break;
+        }
+        case kPositionField: { soa->position[index] = value; break; }
+        case kVelocityField: { soa->velocity[index] = value; break; }
+        case kTorqueField: { soa->torque[index] = value; break; }
+        case kQCurrentField: { soa->q_current[index] = value; break; }
+        case kDCurrentField: { soa->d_current[index] = value; break; }
+        case kRezeroStateField: {
+          soa->rezero_state[index] = ToInt(value);
+          break;
+        }
+        case kVoltageField: { soa->voltage[index] = value; break; }
+        case kTemperatureField: { soa->temperature[index] = value; break; }
+        case kFaultField: {
+          soa->fault[index] = ToInt(value);
+          break;
+        }
+      }
+    }
+  }
+
+ private:
+  enum Field : uint8_t {
+    kModeField,
+    kPositionField,
+    kVelocityField,
+    kTorqueField,
+    kQCurrentField,
+    kDCurrentField,
+    kRezeroStateField,
+    kVoltageField,
+    kTemperatureField,
+    kFaultField,
+  };
+
+  struct Entry {
+    Field field = kModeField;
+    Resolution res = Resolution::kInt8;
+    uint8_t offset = 0;
+    double scale = 1.0;
+  };
+
+  static int FieldForRegister(uint32_t reg) {
+    switch (static_cast<Register>(reg)) {
+      case Register::kMode: return kModeField;
+      case Register::kPosition: return kPositionField;
+      case Register::kVelocity: return kVelocityField;
+      case Register::kTorque: return kTorqueField;
+      case Register::kQCurrent: return kQCurrentField;
+      case Register::kDCurrent: return kDCurrentField;
+      case Register::kRezeroState: return kRezeroStateField;
+      case Register::kVoltage: return kVoltageField;
+      case Register::kTemperature: return kTemperatureField;
+      case Register::kFault: return kFaultField;
+      default: { break; }
+    }
+    return -1;
+  }
+
+  /// These match the scales used by MultiplexParser.
+  static double ScaleFor(Field field, Resolution res) {
+    if (res == Resolution::kFloat) { return 1.0; }
+    const int index =
+        (res == Resolution::kInt8) ? 0 :
+        (res == Resolution::kInt16) ? 1 : 2;
+    static constexpr double kPosition[] = {0.01, 0.0001, 0.00001};
+    static constexpr double kVelocity[] = {0.1, 0.00025, 0.00001};
+    static constexpr double kTorque[] = {0.5, 0.01, 0.001};
+    static constexpr double kCurrent[] = {1.0, 0.1, 0.001};
+    static constexpr double kVoltage[] = {0.5, 0.1, 0.001};
+    switch (field) {
+      case kPositionField: { return kPosition[index]; }
+      case kVelocityField: { return kVelocity[index]; }
+      case kTorqueField: { return kTorque[index]; }
+      case kQCurrentField:
+      case kDCurrentField:
+      case kTemperatureField: { return kCurrent[index]; }
+      case kVoltageField: { return kVoltage[index]; }
+      case kModeField:
+      case kRezeroStateField:
+      case kFaultField: {
+        break;
+      }
+    }
+    return 1.0;
+  }
+
+  static int ToInt(double value) {
+    return std::isnan(value) ? 0 : static_cast<int>(value);
+  }
+
+  template <typename T>
+  static double ReadScaled(const uint8_t* data, double scale) {
+    T value = {};
+    std::memcpy(&value, data, sizeof(value));
+    if (value == std::numeric_limits<T>::min()) {
+      return std::numeric_limits<double>::quiet_NaN();
+    }
+    return value * scale;
+  }
+
+  static double Decode(const Entry& entry, const uint8_t* data) {
+    const uint8_t* ptr = &data[entry.offset];
+    switch (entry.res) {
+      case Resolution::kInt8: return ReadScaled<int8_t>(ptr, entry.scale);
+      case Resolution::kInt16: return ReadScaled<int16_t>(ptr, entry.scale);
+      case Resolution::kInt32: return ReadScaled<int32_t>(ptr, entry.scale);
+      case Resolution::kFloat: {
+        float value = 0.0f;
+        std::memcpy(&value, ptr, sizeof(value));
+        return value;
+      }
+      case Resolution::kIgnore: { break; }
+    }
+    return 0.0;
+  }
+
+  bool learned_ = false;
+  size_t size_ = 0;
+
+  Entry entries_[64] = {};
+  int entries_count_ = 0;
+
+  uint8_t framing_offset_[64] = {};
+  uint8_t framing_value_[64] = {};
+  int framing_count_ = 0;
+};
+
+}
+}
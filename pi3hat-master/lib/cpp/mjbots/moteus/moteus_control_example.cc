@@ -23,26 +23,33 @@
 /// multiple translation units or structured for longer term
 /// maintenance.
 
-#include <sys/mman.h>
-
 #include <chrono>
 #include <iomanip>
 #include <iostream>
 #include <future>
 #include <limits>
 #include <map>
+#include <memory>
 #include <sstream>
 #include <stdexcept>
 #include <string>
 #include <thread>
 #include <vector>
 
+#include "mjbots/pi3hat/socketcan_transport.h"
+#include "mjbots/pi3hat/transport.h"
+
 #include "mjbots/moteus/moteus_protocol.h"
+#include "mjbots/moteus/moteus_simulator.h"
+#include "mjbots/moteus/periodic_executor.h"
 #include "mjbots/moteus/pi3hat_moteus_interface.h"
+#include "mjbots/moteus/pi3hat_moteus_spsc_interface.h"
+#include "mjbots/moteus/realtime.h"
 
 using namespace mjbots;
 
 using MoteusInterface = moteus::Pi3HatMoteusInterface;
+using SpscMoteusInterface = moteus::Pi3HatMoteusSpscInterface;
 
 namespace {
 struct Arguments {
@@ -65,6 +72,24 @@ struct Arguments {
         secondary_id = std::stoull(args.at(++i));
       } else if (arg == "--secondary-bus") {
         secondary_bus = std::stoull(args.at(++i));
+      } else if (arg == "--spin-us") {
+        spin_us = std::stoi(args.at(++i));
+      } else if (arg == "--move-irqs") {
+        move_irqs = true;
+      } else if (arg == "--latency-test-ms") {
+        latency_test_ms = std::stoi(args.at(++i));
+      } else if (arg == "--spsc") {
+        spsc = true;
+      } else if (arg == "--simulate") {
+        simulate = true;
+      } else if (arg == "--replay") {
+        replay = args.at(++i);
+      } else if (arg == "--socketcan") {
+        std::istringstream stream(args.at(++i));
+        std::string name;
+        while (std::getline(stream, name, ',')) {
+          socketcan.push_back(name);
+        }
       } else {
         throw std::runtime_error("Unknown argument: " + arg);
       }
@@ -79,6 +104,13 @@ struct Arguments {
   int primary_bus = 1;
   int secondary_id = 2;
   int secondary_bus = 2;
+  int spin_us = 0;
+  bool move_irqs = false;
+  int latency_test_ms = 0;
+  bool spsc = false;
+  bool simulate = false;
+  std::string replay;
+  std::vector<std::string> socketcan;
 };
 
 void DisplayUsage() {
@@ -92,17 +124,13 @@ void DisplayUsage() {
   std::cout << "  --primary-bus BUS    bus of primary servo\n";
   std::cout << "  --secondary-id ID    servo ID of secondary, driven servo\n";
   std::cout << "  --secondary-bus BUS  bus of secondary servo\n";
-}
-
-void LockMemory() {
-  // We lock all memory so that we don't end up having to page in
-  // something later which can take time.
-  {
-    const int r = ::mlockall(MCL_CURRENT | MCL_FUTURE);
-    if (r < 0) {
-      throw std::runtime_error("Error locking memory");
-    }
-  }
+  std::cout << "  --spin-us US         spin for the last part of each period\n";
+  std::cout << "  --move-irqs          move IRQs off the main and CAN CPUs\n";
+  std::cout << "  --latency-test-ms MS measure wakeup latency before starting\n";
+  std::cout << "  --spsc               use the lock-free spinning CAN interface\n";
+  std::cout << "  --simulate           use simulated servos, as fast as possible\n";
+  std::cout << "  --replay FILE        replay a flight record, as fast as possible\n";
+  std::cout << "  --socketcan IF,IF    use SocketCAN interfaces as buses 1, 2, ...\n";
 }
 
 std::pair<double, double> MinMaxVoltage(
@@ -218,10 +246,55 @@ void Run(const Arguments& args, Controller* controller) {
     return;
   }
 
-  moteus::ConfigureRealtime(args.main_cpu);
-  MoteusInterface::Options moteus_options;
-  moteus_options.cpu = args.can_cpu;
-  MoteusInterface moteus_interface{moteus_options};
+  // We lock all memory so that we don't end up having to page in
+  // something later which can take time.
+  moteus::RealtimeOptions realtime_options;
+  realtime_options.cpu = args.main_cpu;
+  if (args.move_irqs) {
+    realtime_options.irq_free_cpus = {args.main_cpu, args.can_cpu};
+  }
+  realtime_options.latency_test_ms = args.latency_test_ms;
+  const auto realtime = moteus::SetupRealtime(realtime_options);
+  if (realtime.latency.samples) {
+    std::cout << "Wakeup latency: mean "
+              << realtime.latency.mean_ns / 1000 << "us  p99 "
+              << realtime.latency.p99_ns / 1000 << "us  max "
+              << realtime.latency.max_ns / 1000 << "us\n";
+  }
+  for (const auto& warning : realtime.warnings) {
+    std::cout << "Warning: " << warning << "\n";
+  }
+
+  // With no hardware, there is nothing to keep pace with, so the
+  // control loop runs as fast as it can.
+  std::unique_ptr<pi3hat::Transport> transport;
+  if (args.simulate) {
+    transport = std::make_unique<moteus::SimulatedMoteusTransport>();
+  } else if (!args.replay.empty()) {
+    transport = std::make_unique<pi3hat::ReplayTransport>(args.replay);
+  }
+  const bool paced = !transport;
+
+  // SocketCAN talks to real servos, so it is paced like the pi3hat.
+  if (!args.socketcan.empty()) {
+    transport = std::make_unique<pi3hat::SocketCanTransport>(
+        pi3hat::SocketCanTransport::MakeOptions(args.socketcan));
+  }
+
+  // Only one of these two is constructed, depending upon --spsc.
+  std::unique_ptr<MoteusInterface> moteus_interface;
+  std::unique_ptr<SpscMoteusInterface> spsc_interface;
+  if (args.spsc) {
+    SpscMoteusInterface::Options spsc_options;
+    spsc_options.cpu = args.can_cpu;
+    spsc_options.transport = transport.get();
+    spsc_interface = std::make_unique<SpscMoteusInterface>(spsc_options);
+  } else {
+    MoteusInterface::Options moteus_options;
+    moteus_options.cpu = args.can_cpu;
+    moteus_options.transport = transport.get();
+    moteus_interface = std::make_unique<MoteusInterface>(moteus_options);
+  }
 
   std::vector<MoteusInterface::ServoCommand> commands;
   for (const auto& pair : controller->servo_bus_map()) {
@@ -241,25 +314,24 @@ void Run(const Arguments& args, Controller* controller) {
 
   std::future<MoteusInterface::Output> can_result;
 
-  const auto period =
-      std::chrono::microseconds(static_cast<int64_t>(args.period_s * 1e6));
-  auto next_cycle = std::chrono::steady_clock::now() + period;
+  moteus::PeriodicExecutor::Options executor_options;
+  executor_options.period_ns = static_cast<int64_t>(args.period_s * 1e9);
+  executor_options.spin_ns = static_cast<int64_t>(args.spin_us) * 1000;
+  moteus::PeriodicExecutor executor{executor_options};
 
   const auto status_period = std::chrono::milliseconds(100);
-  auto next_status = next_cycle + status_period;
+  auto next_status = std::chrono::steady_clock::now() + status_period;
   uint64_t cycle_count = 0;
-  double total_margin = 0.0;
-  uint64_t margin_cycles = 0;
 
   // We will run at a fixed cycle time.
   while (true) {
     cycle_count++;
-    margin_cycles++;
     {
       const auto now = std::chrono::steady_clock::now();
       if (now > next_status) {
         // NOTE: iomanip is not a recommended pattern.  We use it here
         // simply to not require any external dependencies, like 'fmt'.
+        const auto& timing = executor.stats();
         const auto volts = MinMaxVoltage(saved_replies);
         const std::string modes = [&]() {
           std::ostringstream result;
@@ -275,55 +347,54 @@ void Run(const Arguments& args, Controller* controller) {
         }();
         std::cout << std::setprecision(6) << std::fixed
                   << "Cycles " << cycle_count
-                  << "  margin: " << (total_margin / margin_cycles)
+                  << "  margin: " << (timing.mean_margin_ns() * 1e-9)
+                  << "  skipped: " << timing.skipped
                   << std::setprecision(1)
                   << "  volts: " << volts.first << "/" << volts.second
                   << "  modes: " << modes
                   << "   \r";
         std::cout.flush();
         next_status += status_period;
-        total_margin = 0;
-        margin_cycles = 0;
-      }
-
-      int skip_count = 0;
-      while (now > next_cycle) {
-        skip_count++;
-        next_cycle += period;
-      }
-      if (skip_count) {
-        std::cout << "\nSkipped " << skip_count << " cycles\n";
+        executor.ResetStats();
       }
     }
-    // Wait for the next control cycle to come up.
-    {
-      const auto pre_sleep = std::chrono::steady_clock::now();
-      std::this_thread::sleep_until(next_cycle);
-      const auto post_sleep = std::chrono::steady_clock::now();
-      std::chrono::duration<double> elapsed = post_sleep - pre_sleep;
-      total_margin += elapsed.count();
+    // Wait for the next control cycle to come up.  Any cycles we
+    // overran are counted in the executor's statistics.
+    if (paced) {
+      executor.Wait();
     }
-    next_cycle += period;
 
 
     controller->Run(saved_replies, &commands);
 
 
-    if (can_result.valid()) {
-      // Now we get the result of our last query and send off our new
-      // one.
-      const auto current_values = can_result.get();
-
+    auto copy_replies = [&](const MoteusInterface::Output& current_values) {
       // We copy out the results we just got out.
       const auto rx_count = current_values.query_result_size;
       saved_replies.resize(rx_count);
       std::copy(replies.begin(), replies.begin() + rx_count,
                 saved_replies.begin());
+    };
+
+    if (spsc_interface) {
+      // With the lock-free interface, we spin for our last result,
+      // then hand off the next request without any allocation.
+      if (spsc_interface->outstanding()) {
+        copy_replies(spsc_interface->Wait());
+      }
+      spsc_interface->Cycle(moteus_data);
+      continue;
+    }
+
+    if (can_result.valid()) {
+      // Now we get the result of our last query and send off our new
+      // one.
+      copy_replies(can_result.get());
     }
 
     // Then we can immediately ask them to be used again.
     auto promise = std::make_shared<std::promise<MoteusInterface::Output>>();
-    moteus_interface.Cycle(
+    moteus_interface->Cycle(
         moteus_data,
         [promise](const MoteusInterface::Output& output) {
           // This is called from an arbitrary thread, so we just set
@@ -338,9 +409,6 @@ void Run(const Arguments& args, Controller* controller) {
 int main(int argc, char** argv) {
   Arguments args({argv + 1, argv + argc});
 
-  // Lock memory for the whole process.
-  LockMemory();
-
   SampleController sample_controller{args};
   Run(args, &sample_controller);
 
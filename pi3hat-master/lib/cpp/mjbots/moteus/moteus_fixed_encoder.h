@@ -0,0 +1,232 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+#include "mjbots/moteus/moteus_protocol.h"
+
+/// @file
+///
+/// Command encoders whose register layout is fixed at compile time.
+/// They produce byte-for-byte the same frames as EmitPositionCommand
+/// / EmitStopCommand followed by EmitQueryCommand, but all of the
+/// WriteCombiner framing is computed once by the compiler, leaving
+/// only the scaled values to be stored at known offsets.
+
+namespace mjbots {
+namespace moteus {
+
+namespace detail {
+
+constexpr int ResolutionBytes(Resolution res) {
+  switch (res) {
+    case Resolution::kInt8: return 1;
+    case Resolution::kInt16: return 2;
+    case Resolution::kInt32: return 4;
+    case Resolution::kFloat: return 4;
+    case Resolution::kIgnore: return 0;
+  }
+  return 0;
+}
+
+constexpr uint8_t ResolutionCode(Resolution res) {
+  switch (res) {
+    case Resolution::kInt8: return 0x00;
+    case Resolution::kInt16: return 0x04;
+    case Resolution::kInt32: return 0x08;
+    case Resolution::kFloat: return 0x0c;
+    case Resolution::kIgnore: return 0x00;
+  }
+  return 0x00;
+}
+
+struct FixedLayout {
+  uint8_t data[64] = {};
+  int size = 0;
+
+  // The offset of each position command value within 'data', or -1
+  // if it is not sent.
+  int offsets[8] = { -1, -1, -1, -1, -1, -1, -1, -1 };
+
+  constexpr void Push(uint8_t value) {
+    if (size < 64) { data[size] = value; }
+    size++;
+  }
+};
+
+/// This mirrors WriteCombiner exactly.  When @p with_values is set,
+/// space is reserved after each framing for the corresponding value.
+template <size_t N>
+constexpr void AppendCombined(FixedLayout& layout,
+                              uint8_t base_command,
+                              uint32_t start_register,
+                              const std::array<Resolution, N>& resolutions,
+                              bool with_values) {
+  Resolution current = Resolution::kIgnore;
+  for (size_t i = 0; i < N; i++) {
+    const auto res = resolutions[i];
+    if (res != current) {
+      current = res;
+      if (res != Resolution::kIgnore) {
+        int count = 1;
+        for (size_t j = i + 1; j < N && resolutions[j] == res; j++) {
+          count++;
+        }
+        const uint8_t write_command = base_command + ResolutionCode(res);
+        if (count <= 3) {
+          layout.Push(write_command + count);
+        } else {
+          layout.Push(write_command);
+          layout.Push(count);
+        }
+        layout.Push(start_register + i);
+      }
+    }
+    if (with_values && current != Resolution::kIgnore) {
+      layout.offsets[i] = layout.size;
+      layout.size += ResolutionBytes(current);
+    }
+  }
+}
+
+/// With the default arguments this produces the query itself.  With
+/// kReplyBase and @p with_values, it is the reply a servo sends.
+constexpr void AppendQuery(FixedLayout& layout, const QueryCommand& query,
+                           uint8_t base_command = Multiplex::kReadBase,
+                           bool with_values = false) {
+  AppendCombined<6>(
+      layout, base_command, Register::kMode,
+      {{ query.mode, query.position, query.velocity,
+          query.torque, query.q_current, query.d_current }},
+      with_values);
+  AppendCombined<4>(
+      layout, base_command, Register::kRezeroState,
+      {{ query.rezero_state, query.voltage,
+          query.temperature, query.fault }},
+      with_values);
+}
+
+constexpr FixedLayout MakeStopLayout(const QueryCommand& query) {
+  FixedLayout result;
+  result.Push(Multiplex::kWriteInt8 | 0x01);
+  result.Push(Register::kMode);
+  result.Push(static_cast<uint8_t>(Mode::kStopped));
+  AppendQuery(result, query);
+  return result;
+}
+
+constexpr FixedLayout MakePositionLayout(const PositionResolution& res,
+                                         const QueryCommand& query) {
+  FixedLayout result;
+  result.Push(Multiplex::kWriteInt8 | 0x01);
+  result.Push(Register::kMode);
+  result.Push(static_cast<uint8_t>(Mode::kPosition));
+  AppendCombined<8>(
+      result, 0x00, Register::kCommandPosition,
+      {{ res.position, res.velocity, res.feedforward_torque,
+          res.kp_scale, res.kd_scale, res.maximum_torque,
+          res.stop_position, res.watchdog_timeout }},
+      true);
+  AppendQuery(result, query);
+  return result;
+}
+
+template <Resolution Res>
+void StoreMapped(uint8_t* data, int offset, double value,
+                 double int8_scale, double int16_scale, double int32_scale) {
+  if constexpr (Res == Resolution::kInt8) {
+    const int8_t v = Saturate<int8_t>(value, int8_scale);
+    std::memcpy(&data[offset], &v, sizeof(v));
+  } else if constexpr (Res == Resolution::kInt16) {
+    const int16_t v = Saturate<int16_t>(value, int16_scale);
+    std::memcpy(&data[offset], &v, sizeof(v));
+  } else if constexpr (Res == Resolution::kInt32) {
+    const int32_t v = Saturate<int32_t>(value, int32_scale);
+    std::memcpy(&data[offset], &v, sizeof(v));
+  } else if constexpr (Res == Resolution::kFloat) {
+    const float v = static_cast<float>(value);
+    std::memcpy(&data[offset], &v, sizeof(v));
+  }
+}
+
+}
+
+/// Encodes position and stop commands, each followed by a query, for
+/// a resolution and query set known at compile time.  Both are
+/// referenced as constexpr objects with static storage duration:
+///
+///   constexpr PositionResolution kRes = ...;
+///   constexpr QueryCommand kQuery = ...;
+///   using Encoder = FixedCommandEncoder<kRes, kQuery>;
+///   Encoder::EncodePosition(command, &frame);
+template <const PositionResolution& Res, const QueryCommand& Query>
+class FixedCommandEncoder {
+ public:
+  static constexpr detail::FixedLayout kPositionLayout =
+      detail::MakePositionLayout(Res, Query);
+  static constexpr detail::FixedLayout kStopLayout =
+      detail::MakeStopLayout(Query);
+
+  static_assert(kPositionLayout.size <= 64, "position command overflows");
+  static_assert(kStopLayout.size <= 64, "stop command overflows");
+
+  static void EncodePosition(const PositionCommand& command,
+                             uint8_t* data, uint8_t* size) {
+    constexpr const auto& l = kPositionLayout;
+    std::memcpy(data, l.data, l.size);
+
+    detail::StoreMapped<Res.position>(
+        data, l.offsets[0], command.position, 0.01, 0.0001, 0.00001);
+    detail::StoreMapped<Res.velocity>(
+        data, l.offsets[1], command.velocity, 0.1, 0.00025, 0.00001);
+    detail::StoreMapped<Res.feedforward_torque>(
+        data, l.offsets[2], command.feedforward_torque, 0.5, 0.01, 0.001);
+    detail::StoreMapped<Res.kp_scale>(
+        data, l.offsets[3], command.kp_scale,
+        1.0 / 127.0, 1.0 / 32767.0, 1.0 / 2147483647.0);
+    detail::StoreMapped<Res.kd_scale>(
+        data, l.offsets[4], command.kd_scale,
+        1.0 / 127.0, 1.0 / 32767.0, 1.0 / 2147483647.0);
+    detail::StoreMapped<Res.maximum_torque>(
+        data, l.offsets[5], command.maximum_torque, 0.5, 0.01, 0.001);
+    detail::StoreMapped<Res.stop_position>(
+        data, l.offsets[6], command.stop_position, 0.01, 0.0001, 0.00001);
+    // WriteTime narrows to float before scaling, so we do too.
+    detail::StoreMapped<Res.watchdog_timeout>(
+        data, l.offsets[7], static_cast<float>(command.watchdog_timeout),
+        0.01, 0.001, 0.000001);
+
+    *size = l.size;
+  }
+
+  static void EncodePosition(const PositionCommand& command, CanFrame* frame) {
+    EncodePosition(command, frame->data, &frame->size);
+  }
+
+  static void EncodeStop(uint8_t* data, uint8_t* size) {
+    std::memcpy(data, kStopLayout.data, kStopLayout.size);
+    *size = kStopLayout.size;
+  }
+
+  static void EncodeStop(CanFrame* frame) {
+    EncodeStop(frame->data, &frame->size);
+  }
+};
+
+}
+}
@@ -32,6 +32,9 @@ namespace moteus {
 
 enum {
   kCurrentRegisterMapVersion = 4,
+
+  // Frames sent to this ID are acted on by every servo on the bus.
+  kBroadcastId = 0x7f,
 };
 
 enum Multiplex : uint32_t {
@@ -501,6 +504,9 @@ class MultiplexParser {
     offset_ += ResolutionSize(res);
   }
 
+  /// The byte offset of the next value to be read.
+  size_t offset() const { return offset_; }
+
  private:
   int ResolutionSize(Resolution res) {
     switch (res) {
@@ -609,6 +615,36 @@ struct QueryCommand {
   Resolution temperature = Resolution::kInt8;
   Resolution fault = Resolution::kInt8;
 
+  // Pi3HatMoteusInterface reads each register only on every Nth
+  // cycle, and reports its last value in between.  Values below 2
+  // read it every cycle.  EmitQueryCommand ignores these.
+  struct Divisor {
+    int mode = 1;
+    int position = 1;
+    int velocity = 1;
+    int torque = 1;
+    int q_current = 1;
+    int d_current = 1;
+    int rezero_state = 1;
+    int voltage = 1;
+    int temperature = 1;
+    int fault = 1;
+  };
+  Divisor divisor;
+
+  bool any_decimated() const {
+    return divisor.mode > 1 ||
+        divisor.position > 1 ||
+        divisor.velocity > 1 ||
+        divisor.torque > 1 ||
+        divisor.q_current > 1 ||
+        divisor.d_current > 1 ||
+        divisor.rezero_state > 1 ||
+        divisor.voltage > 1 ||
+        divisor.temperature > 1 ||
+        divisor.fault > 1;
+  }
+
   bool any_set() const {
     return mode != Resolution::kIgnore ||
         position != Resolution::kIgnore ||
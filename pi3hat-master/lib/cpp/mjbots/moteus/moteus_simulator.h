@@ -0,0 +1,397 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <thread>
+#include <utility>
+
+#include "mjbots/pi3hat/transport.h"
+
+#include "mjbots/moteus/moteus_protocol.h"
+
+/// @file
+///
+/// A pi3hat transport which answers moteus commands from a simple
+/// simulation of each servo, for use in testing and benchmarking
+/// control software away from the hardware.
+
+namespace mjbots {
+namespace moteus {
+
+class SimulatedMoteusTransport : public pi3hat::Transport {
+ public:
+  struct Options {
+    // The time taken by each cycle, in addition to that needed to
+    // send the frames.
+    int64_t cycle_ns = 100000;
+
+    // The time for each frame on a bus, including its reply.  Buses
+    // operate in parallel.
+    int64_t frame_ns = 30000;
+
+    // If true, Cycle sleeps for the simulated duration.  Otherwise
+    // it returns immediately, and only the virtual clock advances.
+    bool realtime = false;
+
+    // The servo model.  Each servo behaves like a PD controlled
+    // inertia, with the gains of position mode at a scale of 1.0.
+    double kp = 4.0;
+    double kd = 0.1;
+    double inertia = 0.01;
+    double max_torque = 10.0;
+
+    double torque_constant = 0.1;
+    double voltage = 24.0;
+    double temperature = 30.0;
+
+    Options() {}
+  };
+
+  static constexpr int kMaxBus = 31;
+
+  struct Servo {
+    Mode mode = Mode::kStopped;
+    double position = 0.0;
+    double velocity = 0.0;
+    double torque = 0.0;
+
+    PositionCommand command;
+  };
+
+  SimulatedMoteusTransport(const Options& options = Options())
+      : options_(options) {}
+
+  pi3hat::Pi3Hat::Output Cycle(const pi3hat::Pi3Hat::Input& input) override {
+    // Commands take effect at the start of the cycle, and replies
+    // reflect the state at its end.
+    int bus_frames[kMaxBus + 1] = {};
+    for (const auto& frame : input.tx_can) {
+      if ((frame.id & 0x7f) == kBroadcastId) {
+        for (auto& pair : servos_) {
+          if (pair.first.first == frame.bus) {
+            ProcessCommand(frame, &pair.second);
+          }
+        }
+      } else {
+        ProcessCommand(frame, &servo(frame.bus, frame.id & 0x7f));
+      }
+      if (frame.bus >= 0 && frame.bus <= kMaxBus) {
+        bus_frames[frame.bus]++;
+      }
+    }
+    const int busiest = *std::max_element(std::begin(bus_frames), std::end(bus_frames));
+    const int64_t duration = options_.cycle_ns + busiest * options_.frame_ns;
+
+    Advance(duration * 1e-9);
+
+    pi3hat::Pi3Hat::Output result;
+    int bus_index[kMaxBus + 1] = {};
+    for (const auto& frame : input.tx_can) {
+      if (!frame.expect_reply) { continue; }
+
+      // A reply only makes it if its frame completed before the
+      // timeout.
+      const int index = (frame.bus >= 0 && frame.bus <= kMaxBus) ?
+          ++bus_index[frame.bus] : 1;
+      const int64_t arrival_ns = options_.cycle_ns + index * options_.frame_ns;
+      if (input.timeout_ns != 0 && arrival_ns > input.timeout_ns) { continue; }
+      if (result.rx_can_size >= input.rx_can.size()) { continue; }
+
+      auto& reply = input.rx_can[result.rx_can_size];
+      if (EmitReply(frame, servo(frame.bus, frame.id & 0x7f), &reply)) {
+        result.rx_can_size++;
+      }
+    }
+
+    if (input.request_attitude && input.attitude) {
+      *input.attitude = pi3hat::Attitude();
+      input.attitude->timestamp_ns = now_ns_;
+      result.attitude_present = true;
+    }
+
+    if (options_.realtime) {
+      std::this_thread::sleep_for(std::chrono::nanoseconds(duration));
+    }
+    now_ns_ += duration;
+
+    return result;
+  }
+
+  /// Returns the simulated time, which starts at 0.
+  int64_t now_ns() override { return now_ns_; }
+
+  /// Access the state of a servo, creating it if necessary.  This may
+  /// be used to set initial conditions.
+  Servo& servo(int bus, int id) {
+    return servos_[std::make_pair(bus, id)];
+  }
+
+ private:
+  void Advance(double dt) {
+    for (auto& pair : servos_) {
+      auto& servo = pair.second;
+      const auto& cmd = servo.command;
+      if (servo.mode == Mode::kPosition || servo.mode == Mode::kZeroVelocity) {
+        const bool zero = servo.mode == Mode::kZeroVelocity;
+        const double position_error =
+            (!zero && std::isfinite(cmd.position)) ?
+            (cmd.position - servo.position) : 0.0;
+        const double kp_scale = std::isfinite(cmd.kp_scale) ? cmd.kp_scale : 1.0;
+        const double kd_scale = std::isfinite(cmd.kd_scale) ? cmd.kd_scale : 1.0;
+        const double max_torque = std::isfinite(cmd.maximum_torque) ?
+            std::min(cmd.maximum_torque, options_.max_torque) :
+            options_.max_torque;
+        const double feedforward = std::isfinite(cmd.feedforward_torque) ?
+            cmd.feedforward_torque : 0.0;
+        const double velocity =
+            (!zero && std::isfinite(cmd.velocity)) ? cmd.velocity : 0.0;
+
+        const double torque =
+            kp_scale * options_.kp * position_error +
+            kd_scale * options_.kd * (velocity - servo.velocity) +
+            feedforward;
+        servo.torque = std::max(-max_torque, std::min(max_torque, torque));
+      } else {
+        servo.torque = 0.0;
+      }
+
+      servo.velocity += servo.torque / options_.inertia * dt;
+      if (servo.mode == Mode::kStopped) {
+        // A stopped servo coasts to a halt with a 10ms time constant.
+        servo.velocity *= std::exp(-dt / 0.01);
+      }
+      servo.position += servo.velocity * dt;
+    }
+  }
+
+  /// Apply all the register writes in @p frame.  Reads are handled
+  /// by EmitReply.
+  static void ProcessCommand(const pi3hat::CanFrame& frame, Servo* servo) {
+    ForEachRegister(
+        frame, 0x00,
+        [&](uint32_t reg, Resolution res, const uint8_t* data) {
+          const auto value = [&](double s8, double s16, double s32) {
+            return ReadMapped(data, res, s8, s16, s32);
+          };
+          auto& cmd = servo->command;
+          switch (static_cast<Register>(reg)) {
+            case Register::kMode: {
+              const double mode = value(1.0, 1.0, 1.0);
+              if (std::isfinite(mode)) {
+                servo->mode = static_cast<Mode>(static_cast<int>(mode));
+              }
+              // As with the real controller, any command register not
+              // sent along with the mode reverts to its default.
+              cmd = PositionCommand();
+              cmd.maximum_torque = std::numeric_limits<double>::quiet_NaN();
+              break;
+            }
+            case Register::kCommandPosition: {
+              cmd.position = value(0.01, 0.0001, 0.00001);
+              break;
+            }
+            case Register::kCommandVelocity: {
+              cmd.velocity = value(0.1, 0.00025, 0.00001);
+              break;
+            }
+            case Register::kCommandFeedforwardTorque: {
+              cmd.feedforward_torque = value(0.5, 0.01, 0.001);
+              break;
+            }
+            case Register::kCommandKpScale: {
+              cmd.kp_scale = value(1.0 / 127.0, 1.0 / 32767.0,
+                                   1.0 / 2147483647.0);
+              break;
+            }
+            case Register::kCommandKdScale: {
+              cmd.kd_scale = value(1.0 / 127.0, 1.0 / 32767.0,
+                                   1.0 / 2147483647.0);
+              break;
+            }
+            case Register::kCommandPositionMaxTorque: {
+              cmd.maximum_torque = value(0.5, 0.01, 0.001);
+              break;
+            }
+            default: {
+              break;
+            }
+          }
+        });
+  }
+
+  /// Answer every register read in @p frame.  Returns false if there
+  /// was nothing to reply with.
+  bool EmitReply(const pi3hat::CanFrame& frame, const Servo& servo,
+                 pi3hat::CanFrame* reply) const {
+    reply->id = (frame.id & 0x7f) << 8;
+    reply->bus = frame.bus;
+    reply->size = 0;
+    reply->expect_reply = false;
+
+    WriteCanFrame out(reply->data, &reply->size);
+    ForEachRegister(
+        frame, 0x10,
+        [&](uint32_t reg, Resolution res, const uint8_t*) {
+          // Each register gets its own single entry block, which
+          // parses just the same as a combined one.
+          out.Write<int8_t>(Multiplex::kReplyBase +
+                            ResolutionCode(res) * 4 + 1);
+          out.Write<int8_t>(reg);
+
+          switch (static_cast<Register>(reg)) {
+            case Register::kMode: {
+              out.WriteMapped(static_cast<int>(servo.mode), 1.0, 1.0, 1.0, res);
+              break;
+            }
+            case Register::kPosition: {
+              out.WritePosition(servo.position, res);
+              break;
+            }
+            case Register::kVelocity: {
+              out.WriteVelocity(servo.velocity, res);
+              break;
+            }
+            case Register::kTorque: {
+              out.WriteTorque(servo.torque, res);
+              break;
+            }
+            case Register::kQCurrent: {
+              out.WriteMapped(servo.torque / options_.torque_constant,
+                              1.0, 0.1, 0.001, res);
+              break;
+            }
+            case Register::kVoltage: {
+              out.WriteVoltage(options_.voltage, res);
+              break;
+            }
+            case Register::kTemperature: {
+              out.WriteTemperature(options_.temperature, res);
+              break;
+            }
+            default: {
+              // Everything else, including faults, reads as zero.
+              out.WriteMapped(0.0, 1.0, 1.0, 1.0, res);
+              break;
+            }
+          }
+        });
+    return reply->size != 0;
+  }
+
+  static int ResolutionCode(Resolution res) {
+    switch (res) {
+      case Resolution::kInt8: return 0;
+      case Resolution::kInt16: return 1;
+      case Resolution::kInt32: return 2;
+      case Resolution::kFloat: return 3;
+      case Resolution::kIgnore: { break; }
+    }
+    return 0;
+  }
+
+  static int ResolutionSize(Resolution res) {
+    switch (res) {
+      case Resolution::kInt8: return 1;
+      case Resolution::kInt16: return 2;
+      case Resolution::kInt32: return 4;
+      case Resolution::kFloat: return 4;
+      case Resolution::kIgnore: { break; }
+    }
+    return 0;
+  }
+
+  template <typename T>
+  static double ReadScaled(const uint8_t* data, double scale) {
+    T value = {};
+    std::memcpy(&value, data, sizeof(value));
+    if (value == std::numeric_limits<T>::min()) {
+      return std::numeric_limits<double>::quiet_NaN();
+    }
+    return value * scale;
+  }
+
+  static double ReadMapped(const uint8_t* data, Resolution res,
+                           double s8, double s16, double s32) {
+    switch (res) {
+      case Resolution::kInt8: return ReadScaled<int8_t>(data, s8);
+      case Resolution::kInt16: return ReadScaled<int16_t>(data, s16);
+      case Resolution::kInt32: return ReadScaled<int32_t>(data, s32);
+      case Resolution::kFloat: {
+        float value = 0.0f;
+        std::memcpy(&value, data, sizeof(value));
+        return value;
+      }
+      case Resolution::kIgnore: { break; }
+    }
+    return 0.0;
+  }
+
+  /// Invoke @p handler for each register in the write (@p base ==
+  /// 0x00) or read (@p base == 0x10) blocks of @p frame.  For writes,
+  /// the value's data is passed too.
+  template <typename Handler>
+  static void ForEachRegister(const pi3hat::CanFrame& frame,
+                              uint8_t base, Handler handler) {
+    size_t offset = 0;
+    const size_t size = frame.size;
+    while (offset < size) {
+      const uint8_t cmd = frame.data[offset++];
+      if (cmd == Multiplex::kNop) { continue; }
+      if (cmd >= 0x20) { return; }
+
+      const bool is_write = cmd < 0x10;
+      const Resolution res = [&]() {
+        switch ((cmd >> 2) & 0x03) {
+          case 0: return Resolution::kInt8;
+          case 1: return Resolution::kInt16;
+          case 2: return Resolution::kInt32;
+        }
+        return Resolution::kFloat;
+      }();
+
+      int count = cmd & 0x03;
+      if (count == 0) {
+        if (offset >= size) { return; }
+        count = frame.data[offset++];
+      }
+      if (offset >= size) { return; }
+      const uint32_t start = frame.data[offset++];
+
+      const int value_size = is_write ? ResolutionSize(res) : 0;
+      for (int i = 0; i < count; i++) {
+        if (offset + value_size > size) { return; }
+        if ((cmd & 0xf0) == base) {
+          handler(start + i, res, &frame.data[offset]);
+        }
+        offset += value_size;
+      }
+    }
+  }
+
+  const Options options_;
+  std::map<std::pair<int, int>, Servo> servos_;
+  int64_t now_ns_ = 0;
+};
+
+}
+}
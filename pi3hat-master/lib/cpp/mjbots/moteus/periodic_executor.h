@@ -0,0 +1,195 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <time.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace mjbots {
+namespace moteus {
+
+/// Paces a control loop at a fixed period on CLOCK_MONOTONIC.
+///
+///   PeriodicExecutor executor{options};
+///   while (true) {
+///     executor.Wait();
+///     // ... one control cycle ...
+///   }
+///
+/// Deadlines fall at exact multiples of the period, offset by a
+/// phase, so they do not drift however long each cycle takes.  A
+/// cycle which overruns skips the deadlines it missed rather than
+/// running several cycles back to back.  Nothing is printed; the
+/// timing of each cycle is available from stats().
+class PeriodicExecutor {
+ public:
+  struct Options {
+    int64_t period_ns = 1000000;
+
+    // Deadlines are phase_ns after a multiple of period_ns.  See
+    // also AlignTo.
+    int64_t phase_ns = 0;
+
+    // If non-zero, the sleep ends this long before each deadline,
+    // and the remainder is spent spinning.  This trades a CPU for
+    // less wakeup jitter.
+    int64_t spin_ns = 0;
+
+    Options() {}
+  };
+
+  struct Stats {
+    uint64_t cycles = 0;
+    // Cycles which started after their deadline had already passed.
+    uint64_t overruns = 0;
+    // Deadlines which were not run at all as a result.
+    uint64_t skipped = 0;
+
+    // How long was left before each deadline when Wait was called.
+    int64_t min_margin_ns = 0;
+    int64_t max_margin_ns = 0;
+    int64_t total_margin_ns = 0;
+
+    // How late Wait returned after each deadline.
+    int64_t max_latency_ns = 0;
+
+    double mean_margin_ns() const {
+      return cycles ? static_cast<double>(total_margin_ns) / cycles : 0.0;
+    }
+  };
+
+  PeriodicExecutor(const Options& options = Options())
+      : options_(options),
+        phase_ns_(Modulo(options.phase_ns, options.period_ns)) {
+    if (options.period_ns <= 0) {
+      throw std::invalid_argument("period_ns must be positive");
+    }
+    if (options.spin_ns < 0 || options.spin_ns > options.period_ns) {
+      throw std::invalid_argument("spin_ns must be in [0, period_ns]");
+    }
+  }
+
+  /// Block until the next deadline.  Returns the number of deadlines
+  /// skipped because the previous cycle overran.
+  int Wait() {
+    const int64_t now = NowNs();
+
+    int skipped = 0;
+    if (!started_) {
+      deadline_ns_ = NextAligned(now);
+      started_ = true;
+    } else {
+      deadline_ns_ += options_.period_ns;
+      if (now > deadline_ns_) {
+        skipped = static_cast<int>(
+            (now - deadline_ns_ - 1) / options_.period_ns + 1);
+        deadline_ns_ += skipped * options_.period_ns;
+      }
+    }
+
+    const int64_t margin = deadline_ns_ - now;
+
+    if (deadline_ns_ - options_.spin_ns > now) {
+      SleepUntil(deadline_ns_ - options_.spin_ns);
+    }
+    int64_t woke = NowNs();
+    while (woke < deadline_ns_) { woke = NowNs(); }
+
+    if (stats_.cycles == 0) {
+      stats_.min_margin_ns = margin;
+      stats_.max_margin_ns = margin;
+    }
+    stats_.cycles++;
+    if (skipped) { stats_.overruns++; }
+    stats_.skipped += skipped;
+    stats_.min_margin_ns = std::min(stats_.min_margin_ns, margin);
+    stats_.max_margin_ns = std::max(stats_.max_margin_ns, margin);
+    stats_.total_margin_ns += margin;
+    stats_.max_latency_ns = std::max(stats_.max_latency_ns,
+                                     woke - deadline_ns_);
+
+    return skipped;
+  }
+
+  /// Move future deadlines so that they fall @p offset_ns after
+  /// @p reference_ns, plus some number of periods.  This can be used
+  /// to keep the loop in a fixed phase relative to the CAN cycle, by
+  /// passing the time a cycle completed.  The next deadline is the
+  /// first aligned one at least a period after the current deadline,
+  /// so one period may be stretched, never shortened.
+  void AlignTo(int64_t reference_ns, int64_t offset_ns = 0) {
+    phase_ns_ = Modulo(reference_ns + offset_ns, options_.period_ns);
+    if (started_) {
+      deadline_ns_ = NextAligned(deadline_ns_ + options_.period_ns - 1) -
+          options_.period_ns;
+    }
+  }
+
+  /// The deadline of the cycle most recently started by Wait.
+  int64_t deadline_ns() const { return deadline_ns_; }
+
+  const Stats& stats() const { return stats_; }
+  void ResetStats() { stats_ = Stats(); }
+
+  static int64_t NowNs() {
+    struct timespec ts = {};
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000ll + ts.tv_nsec;
+  }
+
+ private:
+  static int64_t Modulo(int64_t value, int64_t period) {
+    if (period <= 0) { return 0; }
+    const int64_t result = value % period;
+    return result < 0 ? result + period : result;
+  }
+
+  /// The first aligned deadline strictly after @p time_ns.
+  int64_t NextAligned(int64_t time_ns) const {
+    const int64_t offset = Modulo(time_ns - phase_ns_, options_.period_ns);
+    return time_ns - offset + options_.period_ns;
+  }
+
+  static void SleepUntil(int64_t time_ns) {
+    struct timespec ts = {};
+    ts.tv_sec = time_ns / 1000000000ll;
+    ts.tv_nsec = time_ns % 1000000000ll;
+    // clock_nanosleep returns the error rather than setting errno.
+    int result = 0;
+    while ((result = ::clock_nanosleep(
+                CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr)) == EINTR) {}
+    if (result != 0) {
+      throw std::runtime_error(
+          std::string("Error sleeping: ") + std::strerror(result));
+    }
+  }
+
+  const Options options_;
+  int64_t phase_ns_ = 0;
+
+  bool started_ = false;
+  int64_t deadline_ns_ = 0;
+
+  Stats stats_;
+};
+
+}
+}
@@ -14,8 +14,11 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cmath>
 #include <condition_variable>
 #include <functional>
+#include <limits>
 #include <map>
 #include <memory>
 #include <mutex>
@@ -24,9 +27,11 @@
 #include <vector>
 
 #include "mjbots/pi3hat/pi3hat.h"
+#include "mjbots/pi3hat/transport.h"
 
 #include "mjbots/moteus/moteus_protocol.h"
 #include "mjbots/moteus/realtime.h"
+#include "mjbots/moteus/realtime_allocation.h"
 
 namespace mjbots {
 namespace moteus {
@@ -39,10 +44,37 @@ class Pi3HatMoteusInterface {
  public:
   struct Options {
     int cpu = -1;
+
+    // If set, every cycle is recorded here, whether it goes to the
+    // hardware or to 'transport'.  It must outlive this object.
+    pi3hat::FlightRecorder* flight_recorder = nullptr;
+
+    // If set, this is used instead of the pi3hat hardware, for
+    // instance to replay a log or simulate the servos.  It must
+    // outlive this object.
+    pi3hat::Transport* transport = nullptr;
+
+    // If non-zero, buffers for this many commands are preallocated,
+    // and Cycle rejects any larger request.  Otherwise, they grow on
+    // first use.
+    int max_commands = 0;
   };
 
+  /// Creates the transport when 'transport' is not given.
+  using HardwareFactory =
+      std::unique_ptr<pi3hat::Transport> (*)(const Options&);
+
+  /// Cycles 'options.transport' if set, otherwise the pi3hat.
   Pi3HatMoteusInterface(const Options& options)
-      : options_(options),
+      : Pi3HatMoteusInterface(options, &MakePi3HatTransport) {}
+
+  /// As above, but the transport is created on the CAN thread with
+  /// @p hardware when 'options.transport' is not set.  If @p hardware
+  /// is nullptr, 'options.transport' is required, and nothing refers
+  /// to the pi3hat itself, so libpi3hat need not be linked.
+  Pi3HatMoteusInterface(const Options& options, HardwareFactory hardware)
+      : options_(CheckTransport(options, hardware)),
+        hardware_(hardware),
         thread_(std::bind(&Pi3HatMoteusInterface::CHILD_Run, this)) {
   }
 
@@ -72,6 +104,10 @@ class Pi3HatMoteusInterface {
     int id = 0;
     int bus = 0;
     moteus::QueryResult result;
+
+    // Only used with Data::fixed_servos.  True if 'result' was
+    // refreshed in the most recent cycle.
+    bool updated = false;
   };
 
   // This describes what you would like to do in a given control cycle
@@ -80,8 +116,43 @@ class Pi3HatMoteusInterface {
     pi3hat::Span<ServoCommand> commands;
 
     pi3hat::Span<ServoReply> replies;
+
+    // If true, the set of servos in 'commands' (and the storage
+    // backing it) is the same from cycle to cycle.  'replies' must be
+    // at least as large as 'commands', and the reply from
+    // commands[i] is always parsed directly into replies[i],
+    // regardless of the order in which servos answer.  Commands which
+    // have not changed since the previous cycle are not re-encoded.
+    //
+    // Several sets of storage may be used in turn, as when more than
+    // one cycle is in flight, if each lists the same servos in the
+    // same order.  Registers skipped by QueryCommand::divisor then
+    // keep the value last read into that same 'replies'.
+    bool fixed_servos = false;
+
+    // If true, a bus whose commands are all identical, apart from
+    // the ID, and which query nothing, is sent a single broadcast
+    // frame instead of one frame per servo.  Since every servo on
+    // that bus acts on it, only set this if 'commands' lists every
+    // servo on each bus it names.  It cannot be combined with
+    // 'fixed_servos'.
+    bool group_commands = false;
+
+    // If non-zero, with 'fixed_servos', a command identical to the
+    // last one sent in full is replaced by a frame carrying only its
+    // query, or by nothing if it queries nothing.  The full command
+    // is still resent once this long has passed, or half its
+    // watchdog_timeout if that is shorter, so that the servo's
+    // watchdog never expires.  A watchdog_timeout of 0, or one which
+    // is not sent, selects the servo's own default, which is taken to
+    // be kDefaultWatchdogTimeoutS.
+    int64_t unchanged_keepalive_ns = 0;
   };
 
+  /// The watchdog timeout moteus applies when a position command does
+  /// not specify one.
+  static constexpr double kDefaultWatchdogTimeoutS = 0.1;
+
   struct Output {
     size_t query_result_size = 0;
   };
@@ -95,6 +166,8 @@ class Pi3HatMoteusInterface {
   /// All memory pointed to by @p data must remain valid until the
   /// callback is invoked.
   void Cycle(const Data& data, CallbackFunction callback) {
+    CheckCapacity(data, options_.max_commands);
+
     std::lock_guard<std::mutex> lock(mutex_);
     if (active_) {
       throw std::logic_error(
@@ -108,11 +181,519 @@ class Pi3HatMoteusInterface {
     condition_.notify_all();
   }
 
+  /// Scratch storage used by ExecuteCycle.  It is kept persistently
+  /// so that no allocation happens once it has reached steady state.
+  struct CycleBuffers {
+    std::vector<pi3hat::CanFrame> tx_can;
+    std::vector<pi3hat::CanFrame> rx_can;
+
+    // The remainder are only used for Data::fixed_servos.  Up to 31
+    // buses are permitted, so that several boards may be combined with
+    // a pi3hat::MultiTransport.
+    static constexpr int kMaxBus = 31;
+    static constexpr int kMaxId = 127;
+
+    const ServoCommand* mapped_commands = nullptr;
+    size_t mapped_size = 0;
+    std::vector<ServoCommand> last_commands;
+    // Indexed by [bus][id], and holds the reply slot or -1.
+    int16_t reply_slot[kMaxBus + 1][kMaxId + 1] = {};
+
+    // Only used with Data::unchanged_keepalive_ns.  The query alone
+    // for each command, the frames actually sent this cycle, and when
+    // each command must next be sent in full.
+    std::vector<pi3hat::CanFrame> query_can;
+    std::vector<pi3hat::CanFrame> send_can;
+    std::vector<int64_t> next_full_ns;
+
+    // The query encoded for each command, which differs from the one
+    // requested when QueryCommand::divisor skips registers.
+    std::vector<QueryCommand> sent_query;
+    uint64_t cycle = 0;
+
+    /// Preallocate room for @p max_commands so that no cycle within
+    /// that size allocates.
+    void Reserve(int max_commands) {
+      tx_can.reserve(max_commands);
+      rx_can.reserve(max_commands * 2);
+      last_commands.reserve(max_commands);
+      query_can.reserve(max_commands);
+      send_can.reserve(max_commands);
+      next_full_ns.reserve(max_commands);
+      sent_query.reserve(max_commands);
+    }
+  };
+
+  /// Throw if @p data needs more room than buffers sized with
+  /// CycleBuffers::Reserve(@p max_commands).  A @p max_commands of 0
+  /// permits anything.
+  static void CheckCapacity(const Data& data, int max_commands) {
+    if (max_commands != 0 &&
+        data.commands.size() > static_cast<size_t>(max_commands)) {
+      throw std::logic_error("more commands than max_commands");
+    }
+  }
+
+  /// Encode @p data into CAN frames, perform a single cycle of
+  /// @p transport, and decode any replies into @p data.replies.
+  ///
+  /// This is shared by all the threading front ends in this
+  /// directory.
+  static Output ExecuteCycle(pi3hat::Transport* transport,
+                             const Data& data,
+                             CycleBuffers* buffers) {
+    if (!data.fixed_servos) {
+      if (data.unchanged_keepalive_ns != 0) {
+        throw std::logic_error("unchanged_keepalive_ns requires fixed_servos");
+      }
+      for (const auto& cmd : data.commands) {
+        if (cmd.query.any_decimated()) {
+          throw std::logic_error("QueryCommand::divisor requires fixed_servos");
+        }
+      }
+    }
+    if (data.fixed_servos) {
+      if (data.group_commands) {
+        throw std::logic_error(
+            "group_commands cannot be combined with fixed_servos");
+      }
+      return ExecuteMappedCycle(transport, data, buffers);
+    }
+
+    auto& tx_can = buffers->tx_can;
+    auto& rx_can = buffers->rx_can;
+
+    tx_can.resize(data.commands.size());
+    size_t tx_size = 0;
+    if (data.group_commands) {
+      tx_size = EncodeGroupedCommands(data.commands, tx_can.data());
+    } else {
+      for (const auto& cmd : data.commands) {
+        EncodeCommand(cmd, &tx_can[tx_size++]);
+      }
+    }
+
+    rx_can.resize(data.commands.size() * 2);
+
+    pi3hat::Pi3Hat::Input input;
+    input.tx_can = { tx_can.data(), tx_size };
+    input.rx_can = { rx_can.data(), rx_can.size() };
+
+    Output result;
+
+    const auto output = transport->Cycle(input);
+    for (size_t i = 0; i < output.rx_can_size && i < data.replies.size(); i++) {
+      const auto& can = rx_can[i];
+
+      data.replies[i].id = (can.id & 0x7f00) >> 8;
+      data.replies[i].bus = can.bus;
+      data.replies[i].result = moteus::ParseQueryResult(can.data, can.size);
+      result.query_result_size = i + 1;
+    }
+
+    return result;
+  }
+
+  static void EncodeCommand(const ServoCommand& cmd, pi3hat::CanFrame* can) {
+    can->expect_reply = cmd.query.any_set();
+    can->id = cmd.id | (can->expect_reply ? 0x8000 : 0x0000);
+    can->bus = cmd.bus;
+    can->size = 0;
+
+    moteus::WriteCanFrame write_frame(can->data, &can->size);
+    switch (cmd.mode) {
+      case Mode::kStopped: {
+        moteus::EmitStopCommand(&write_frame);
+        break;
+      }
+      case Mode::kPosition:
+      case Mode::kZeroVelocity: {
+        moteus::EmitPositionCommand(&write_frame, cmd.position, cmd.resolution);
+        break;
+      }
+      default: {
+        throw std::logic_error("unsupported mode");
+      }
+    }
+    moteus::EmitQueryCommand(&write_frame, cmd.query);
+  }
+
+  /// Encode only the query portion of @p cmd.
+  static void EncodeQuery(const ServoCommand& cmd, pi3hat::CanFrame* can) {
+    can->expect_reply = cmd.query.any_set();
+    can->id = cmd.id | (can->expect_reply ? 0x8000 : 0x0000);
+    can->bus = cmd.bus;
+    can->size = 0;
+
+    moteus::WriteCanFrame write_frame(can->data, &can->size);
+    moteus::EmitQueryCommand(&write_frame, cmd.query);
+  }
+
+  /// Encode @p commands into @p tx_can as for Data::group_commands,
+  /// and return the number of frames used, which is at most
+  /// commands.size().
+  static size_t EncodeGroupedCommands(
+      const pi3hat::Span<ServoCommand>& commands, pi3hat::CanFrame* tx_can) {
+    constexpr int kMaxBus = CycleBuffers::kMaxBus;
+    int first[kMaxBus + 1];
+    int count[kMaxBus + 1] = {};
+    bool uniform[kMaxBus + 1] = {};
+
+    for (size_t i = 0; i < commands.size(); i++) {
+      const auto& cmd = commands[i];
+      if (cmd.bus < 1 || cmd.bus > kMaxBus) { continue; }
+      if (count[cmd.bus]++ == 0) {
+        first[cmd.bus] = static_cast<int>(i);
+        uniform[cmd.bus] = !cmd.query.any_set();
+      } else if (uniform[cmd.bus]) {
+        uniform[cmd.bus] = SamePayload(cmd, commands[first[cmd.bus]]);
+      }
+    }
+
+    size_t result = 0;
+    for (size_t i = 0; i < commands.size(); i++) {
+      const auto& cmd = commands[i];
+      const bool broadcast =
+          cmd.bus >= 1 && cmd.bus <= kMaxBus &&
+          uniform[cmd.bus] && count[cmd.bus] > 1;
+      if (!broadcast) {
+        EncodeCommand(cmd, &tx_can[result++]);
+      } else if (first[cmd.bus] == static_cast<int>(i)) {
+        ServoCommand group = cmd;
+        group.id = kBroadcastId;
+        EncodeCommand(group, &tx_can[result++]);
+      }
+    }
+    return result;
+  }
+
  private:
+  /// The Data::fixed_servos version of ExecuteCycle.  The frame and
+  /// reply slot tables are rebuilt only when the command storage
+  /// changes.
+  static Output ExecuteMappedCycle(pi3hat::Transport* transport,
+                                   const Data& data,
+                                   CycleBuffers* buffers) {
+    if (buffers->mapped_commands != data.commands.data() ||
+        buffers->mapped_size != data.commands.size()) {
+      if (SameServos(data, *buffers)) {
+        MoveMap(data, buffers);
+      } else {
+        BuildMap(data, buffers);
+      }
+    }
+
+    auto& tx_can = buffers->tx_can;
+    auto& rx_can = buffers->rx_can;
+
+    const bool suppress = data.unchanged_keepalive_ns > 0;
+    const int64_t now = suppress ? transport->now_ns() : 0;
+    size_t send_size = 0;
+
+    const auto cycle = buffers->cycle++;
+
+    for (size_t i = 0; i < data.commands.size(); i++) {
+      const auto& cmd = data.commands[i];
+      auto& last = buffers->last_commands[i];
+      auto& sent_query = buffers->sent_query[i];
+      const bool changed = !SameCommand(cmd, last);
+      // Slots are staggered, so that the slow registers of different
+      // servos are not all read in the same cycle.
+      const auto query = cmd.query.any_decimated() ?
+          DecimatedQuery(cmd.query, cycle + i) : cmd.query;
+      if (changed || !SameQuery(query, sent_query)) {
+        ServoCommand effective = cmd;
+        effective.query = query;
+        EncodeCommand(effective, &tx_can[i]);
+        EncodeQuery(effective, &buffers->query_can[i]);
+        last = cmd;
+        sent_query = query;
+      }
+      if (!suppress) { continue; }
+
+      auto& next_full = buffers->next_full_ns[i];
+      if (changed || now >= next_full) {
+        buffers->send_can[send_size++] = tx_can[i];
+        next_full = now + KeepaliveNs(cmd, data.unchanged_keepalive_ns);
+      } else if (buffers->query_can[i].expect_reply) {
+        buffers->send_can[send_size++] = buffers->query_can[i];
+      }
+    }
+
+    pi3hat::Pi3Hat::Input input;
+    if (suppress) {
+      input.tx_can = { buffers->send_can.data(), send_size };
+    } else {
+      input.tx_can = { tx_can.data(), tx_can.size() };
+    }
+    input.rx_can = { rx_can.data(), rx_can.size() };
+
+    for (size_t i = 0; i < data.replies.size(); i++) {
+      data.replies[i].updated = false;
+    }
+
+    Output result;
+
+    const auto output = transport->Cycle(input);
+    for (size_t i = 0; i < output.rx_can_size; i++) {
+      const auto& can = rx_can[i];
+      const int id = (can.id >> 8) & 0x7f;
+      if (can.bus < 1 || can.bus > CycleBuffers::kMaxBus) { continue; }
+      const int slot = buffers->reply_slot[can.bus][id];
+      if (slot < 0) { continue; }
+
+      auto& reply = data.replies[slot];
+      const auto previous = reply.result;
+      reply.result = moteus::ParseQueryResult(can.data, can.size);
+      KeepUnread(data.commands[slot].query, buffers->sent_query[slot],
+                 previous, &reply.result);
+      reply.updated = true;
+      result.query_result_size++;
+    }
+
+    return result;
+  }
+
+  /// True if @p data lists the same servos, in the same order, as
+  /// the map in @p buffers, so that only the storage has moved.
+  static bool SameServos(const Data& data, const CycleBuffers& buffers) {
+    if (buffers.mapped_commands == nullptr ||
+        buffers.mapped_size != data.commands.size()) {
+      return false;
+    }
+    for (size_t i = 0; i < data.commands.size(); i++) {
+      const auto& cmd = data.commands[i];
+      if (cmd.bus < 1 || cmd.bus > CycleBuffers::kMaxBus ||
+          cmd.id < 0 || cmd.id > CycleBuffers::kMaxId ||
+          buffers.reply_slot[cmd.bus][cmd.id] != static_cast<int>(i)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /// Point the map in @p buffers at new storage for the same servos,
+  /// keeping what has been sent to each.
+  static void MoveMap(const Data& data, CycleBuffers* buffers) {
+    if (data.replies.size() < data.commands.size()) {
+      throw std::logic_error("fixed_servos requires a reply for each command");
+    }
+    for (size_t i = 0; i < data.commands.size(); i++) {
+      data.replies[i].id = data.commands[i].id;
+      data.replies[i].bus = data.commands[i].bus;
+    }
+    buffers->mapped_commands = data.commands.data();
+  }
+
+  static void BuildMap(const Data& data, CycleBuffers* buffers) {
+    if (data.replies.size() < data.commands.size()) {
+      throw std::logic_error("fixed_servos requires a reply for each command");
+    }
+
+    for (auto& bus : buffers->reply_slot) {
+      for (auto& slot : bus) { slot = -1; }
+    }
+
+    const auto size = data.commands.size();
+    buffers->tx_can.resize(size);
+    buffers->rx_can.resize(size * 2);
+    buffers->last_commands.resize(size);
+    buffers->query_can.resize(size);
+    buffers->send_can.resize(size);
+    buffers->next_full_ns.assign(size, std::numeric_limits<int64_t>::min());
+    buffers->sent_query.resize(size);
+
+    for (size_t i = 0; i < size; i++) {
+      const auto& cmd = data.commands[i];
+      if (cmd.bus < 1 || cmd.bus > CycleBuffers::kMaxBus ||
+          cmd.id < 0 || cmd.id > CycleBuffers::kMaxId) {
+        throw std::logic_error("servo bus or id out of range");
+      }
+      auto& slot = buffers->reply_slot[cmd.bus][cmd.id];
+      if (slot >= 0) {
+        throw std::logic_error("Servos on the same bus must have unique IDs");
+      }
+      slot = static_cast<int16_t>(i);
+
+      data.replies[i].id = cmd.id;
+      data.replies[i].bus = cmd.bus;
+      data.replies[i].updated = false;
+
+      EncodeCommand(cmd, &buffers->tx_can[i]);
+      EncodeQuery(cmd, &buffers->query_can[i]);
+      buffers->last_commands[i] = cmd;
+      buffers->sent_query[i] = cmd.query;
+    }
+
+    buffers->mapped_commands = data.commands.data();
+    buffers->mapped_size = size;
+  }
+
+  /// The registers of @p query which are due in cycle @p phase.
+  static QueryCommand DecimatedQuery(const QueryCommand& query,
+                                     uint64_t phase) {
+    const auto skip = [&](int divisor, Resolution* res) {
+      if (divisor > 1 && (phase % divisor) != 0) {
+        *res = Resolution::kIgnore;
+      }
+    };
+    QueryCommand result = query;
+    const auto& d = query.divisor;
+    skip(d.mode, &result.mode);
+    skip(d.position, &result.position);
+    skip(d.velocity, &result.velocity);
+    skip(d.torque, &result.torque);
+    skip(d.q_current, &result.q_current);
+    skip(d.d_current, &result.d_current);
+    skip(d.rezero_state, &result.rezero_state);
+    skip(d.voltage, &result.voltage);
+    skip(d.temperature, &result.temperature);
+    skip(d.fault, &result.fault);
+    return result;
+  }
+
+  /// Copy into @p result, from @p previous, every register which
+  /// @p wanted asks for but was left out of @p sent.
+  static void KeepUnread(const QueryCommand& wanted, const QueryCommand& sent,
+                         const QueryResult& previous, QueryResult* result) {
+    const auto unread = [](Resolution want, Resolution got) {
+      return want != Resolution::kIgnore && got == Resolution::kIgnore;
+    };
+    if (unread(wanted.mode, sent.mode)) {
+      result->mode = previous.mode;
+    }
+    if (unread(wanted.position, sent.position)) {
+      result->position = previous.position;
+    }
+    if (unread(wanted.velocity, sent.velocity)) {
+      result->velocity = previous.velocity;
+    }
+    if (unread(wanted.torque, sent.torque)) {
+      result->torque = previous.torque;
+    }
+    if (unread(wanted.q_current, sent.q_current)) {
+      result->q_current = previous.q_current;
+    }
+    if (unread(wanted.d_current, sent.d_current)) {
+      result->d_current = previous.d_current;
+    }
+    if (unread(wanted.rezero_state, sent.rezero_state)) {
+      result->rezero_state = previous.rezero_state;
+    }
+    if (unread(wanted.voltage, sent.voltage)) {
+      result->voltage = previous.voltage;
+    }
+    if (unread(wanted.temperature, sent.temperature)) {
+      result->temperature = previous.temperature;
+    }
+    if (unread(wanted.fault, sent.fault)) {
+      result->fault = previous.fault;
+    }
+  }
+
+  static int64_t KeepaliveNs(const ServoCommand& cmd, int64_t keepalive_ns) {
+    // A NaN timeout disables the watchdog entirely.
+    double watchdog_s = cmd.position.watchdog_timeout;
+    if (cmd.resolution.watchdog_timeout == Resolution::kIgnore ||
+        watchdog_s <= 0.0) {
+      watchdog_s = kDefaultWatchdogTimeoutS;
+    }
+    if (std::isfinite(watchdog_s)) {
+      return std::min(keepalive_ns, static_cast<int64_t>(watchdog_s * 0.5e9));
+    }
+    return keepalive_ns;
+  }
+
+  static bool Same(double a, double b) {
+    return a == b || (std::isnan(a) && std::isnan(b));
+  }
+
+  static bool SameCommand(const ServoCommand& a, const ServoCommand& b) {
+    return a.id == b.id && a.bus == b.bus && SamePayload(a, b);
+  }
+
+  /// True if @p a and @p b differ at most in where they are sent.
+  static bool SamePayload(const ServoCommand& a, const ServoCommand& b) {
+    const auto& ap = a.position;
+    const auto& bp = b.position;
+    const auto& ar = a.resolution;
+    const auto& br = b.resolution;
+    const auto& ad = a.query.divisor;
+    const auto& bd = b.query.divisor;
+    return a.mode == b.mode &&
+        Same(ap.position, bp.position) &&
+        Same(ap.velocity, bp.velocity) &&
+        Same(ap.feedforward_torque, bp.feedforward_torque) &&
+        Same(ap.kp_scale, bp.kp_scale) &&
+        Same(ap.kd_scale, bp.kd_scale) &&
+        Same(ap.maximum_torque, bp.maximum_torque) &&
+        Same(ap.stop_position, bp.stop_position) &&
+        Same(ap.watchdog_timeout, bp.watchdog_timeout) &&
+        ar.position == br.position &&
+        ar.velocity == br.velocity &&
+        ar.feedforward_torque == br.feedforward_torque &&
+        ar.kp_scale == br.kp_scale &&
+        ar.kd_scale == br.kd_scale &&
+        ar.maximum_torque == br.maximum_torque &&
+        ar.stop_position == br.stop_position &&
+        ar.watchdog_timeout == br.watchdog_timeout &&
+        SameQuery(a.query, b.query) &&
+        ad.mode == bd.mode &&
+        ad.position == bd.position &&
+        ad.velocity == bd.velocity &&
+        ad.torque == bd.torque &&
+        ad.q_current == bd.q_current &&
+        ad.d_current == bd.d_current &&
+        ad.rezero_state == bd.rezero_state &&
+        ad.voltage == bd.voltage &&
+        ad.temperature == bd.temperature &&
+        ad.fault == bd.fault;
+  }
+
+  static bool SameQuery(const QueryCommand& aq, const QueryCommand& bq) {
+    return aq.mode == bq.mode &&
+        aq.position == bq.position &&
+        aq.velocity == bq.velocity &&
+        aq.torque == bq.torque &&
+        aq.q_current == bq.q_current &&
+        aq.d_current == bq.d_current &&
+        aq.rezero_state == bq.rezero_state &&
+        aq.voltage == bq.voltage &&
+        aq.temperature == bq.temperature &&
+        aq.fault == bq.fault;
+  }
+
+  static std::unique_ptr<pi3hat::Transport> MakePi3HatTransport(
+      const Options& options) {
+    // The hardware records for itself.
+    pi3hat::Pi3Hat::Configuration config;
+    config.flight_recorder = options.flight_recorder;
+    return std::unique_ptr<pi3hat::Transport>(
+        new pi3hat::Pi3HatTransport(config));
+  }
+
+  static const Options& CheckTransport(const Options& options,
+                                       HardwareFactory hardware) {
+    if (!options.transport && !hardware) {
+      throw std::logic_error("a transport is required without hardware");
+    }
+    return options;
+  }
+
   void CHILD_Run() {
     ConfigureRealtime(options_.cpu);
 
-    pi3hat_.reset(new pi3hat::Pi3Hat({}));
+    transport_ = options_.transport;
+    if (!transport_) {
+      hardware_transport_ = hardware_(options_);
+      transport_ = hardware_transport_.get();
+    } else if (options_.flight_recorder) {
+      recording_.reset(new pi3hat::RecordingTransport(
+                           transport_, options_.flight_recorder));
+      transport_ = recording_.get();
+    }
+
+    buffers_.Reserve(options_.max_commands);
 
     while (true) {
       {
@@ -137,58 +718,12 @@ class Pi3HatMoteusInterface {
   }
 
   Output CHILD_Cycle() {
-    tx_can_.resize(data_.commands.size());
-    int out_idx = 0;
-    for (const auto& cmd : data_.commands) {
-      const auto& query = cmd.query;
-
-      auto& can = tx_can_[out_idx++];
-
-      can.expect_reply = query.any_set();
-      can.id = cmd.id | (can.expect_reply ? 0x8000 : 0x0000);
-      can.bus = cmd.bus;
-      can.size = 0;
-
-      moteus::WriteCanFrame write_frame(can.data, &can.size);
-      switch (cmd.mode) {
-        case Mode::kStopped: {
-          moteus::EmitStopCommand(&write_frame);
-          break;
-        }
-        case Mode::kPosition:
-        case Mode::kZeroVelocity: {
-          moteus::EmitPositionCommand(&write_frame, cmd.position, cmd.resolution);
-          break;
-        }
-        default: {
-          throw std::logic_error("unsupported mode");
-        }
-      }
-      moteus::EmitQueryCommand(&write_frame, cmd.query);
-    }
-
-    rx_can_.resize(data_.commands.size() * 2);
-
-    pi3hat::Pi3Hat::Input input;
-    input.tx_can = { tx_can_.data(), tx_can_.size() };
-    input.rx_can = { rx_can_.data(), rx_can_.size() };
-
-    Output result;
-
-    const auto output = pi3hat_->Cycle(input);
-    for (size_t i = 0; i < output.rx_can_size && i < data_.replies.size(); i++) {
-      const auto& can = rx_can_[i];
-
-      data_.replies[i].id = (can.id & 0x7f00) >> 8;
-      data_.replies[i].bus = can.bus;
-      data_.replies[i].result = moteus::ParseQueryResult(can.data, can.size);
-      result.query_result_size = i + 1;
-    }
-
-    return result;
+    NoAllocationScope no_allocation;
+    return ExecuteCycle(transport_, data_, &buffers_);
   }
 
   const Options options_;
+  const HardwareFactory hardware_;
 
 
   /// This block of variables are all controlled by the mutex.
@@ -199,17 +734,20 @@ class Pi3HatMoteusInterface {
   CallbackFunction callback_;
   Data data_;
 
-  std::thread thread_;
-
 
-  /// All further variables are only used from within the child thread.
+  /// These variables are only used from within the child thread.
 
-  std::unique_ptr<pi3hat::Pi3Hat> pi3hat_;
+  std::unique_ptr<pi3hat::Transport> hardware_transport_;
+  std::unique_ptr<pi3hat::RecordingTransport> recording_;
+  pi3hat::Transport* transport_ = nullptr;
 
   // These are kept persistently so that no memory allocation is
   // required in steady state.
-  std::vector<pi3hat::CanFrame> tx_can_;
-  std::vector<pi3hat::CanFrame> rx_can_;
+  CycleBuffers buffers_;
+
+  // This is declared last so that everything the child uses is
+  // constructed before it starts.
+  std::thread thread_;
 };
 
 
@@ -0,0 +1,252 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "mjbots/pi3hat/pi3hat.h"
+#include "mjbots/pi3hat/transport.h"
+
+#include "mjbots/moteus/moteus_protocol.h"
+#include "mjbots/moteus/pi3hat_moteus_interface.h"
+#include "mjbots/moteus/realtime.h"
+#include "mjbots/moteus/spsc_queue.h"
+
+namespace mjbots {
+namespace moteus {
+
+/// This is an alternative to Pi3HatMoteusInterface which hands
+/// requests and results between the application and the CAN thread
+/// through lock-free single-producer single-consumer queues rather
+/// than a mutex, condition variable, and std::function callback.
+///
+/// When 'spin' is set (the default), both sides busy-wait, so that no
+/// system calls or memory allocation are performed per cycle.  That
+/// is intended for use with the CAN thread on an isolated core.
+///
+/// Up to 'slots' cycles may be in flight at once, and results are
+/// returned in the order that cycles were submitted.  This lets the
+/// application queue the next command set while replies from the
+/// previous are still being collected.  The cycles themselves are
+/// performed one after another, so what Data::fixed_servos tracks
+/// about each servo, like the last command sent, keepalives and
+/// QueryCommand::divisor, is shared by every slot and advances once
+/// per cycle.
+class Pi3HatMoteusSpscInterface {
+ public:
+  using ServoCommand = Pi3HatMoteusInterface::ServoCommand;
+  using ServoReply = Pi3HatMoteusInterface::ServoReply;
+  using Data = Pi3HatMoteusInterface::Data;
+  using Output = Pi3HatMoteusInterface::Output;
+
+  static constexpr int kMaxSlots = 8;
+
+  struct Options {
+    int cpu = -1;
+
+    // The number of cycles which may be in flight at once, from 1 to
+    // kMaxSlots.
+    int slots = 1;
+
+    // If non-zero, each slot has room for this many commands
+    // preallocated, and Cycle rejects any larger request.  Otherwise,
+    // its buffers grow on first use.
+    int max_commands = 0;
+
+    // If true, the CAN thread busy-waits for new requests and Wait()
+    // busy-waits for results.  Otherwise, the CAN thread sleeps for
+    // 'idle_sleep_us' between checks and Wait() yields.
+    bool spin = true;
+    int idle_sleep_us = 50;
+
+    // If set, every cycle is recorded here, whether it goes to the
+    // hardware or to 'transport'.  It must outlive this object.
+    pi3hat::FlightRecorder* flight_recorder = nullptr;
+
+    // If set, this is used instead of the pi3hat hardware.  It must
+    // outlive this object.
+    pi3hat::Transport* transport = nullptr;
+  };
+
+  /// Creates the transport when 'transport' is not given.
+  using HardwareFactory =
+      std::unique_ptr<pi3hat::Transport> (*)(const Options&);
+
+  /// Cycles 'options.transport' if set, otherwise the pi3hat.
+  Pi3HatMoteusSpscInterface(const Options& options)
+      : Pi3HatMoteusSpscInterface(options, &MakePi3HatTransport) {}
+
+  /// As above, but the transport is created on the CAN thread with
+  /// @p hardware when 'options.transport' is not set.  If @p hardware
+  /// is nullptr, 'options.transport' is required, and nothing refers
+  /// to the pi3hat itself, so libpi3hat need not be linked.
+  Pi3HatMoteusSpscInterface(const Options& options, HardwareFactory hardware)
+      : options_(CheckOptions(options, hardware)),
+        hardware_(hardware),
+        thread_(std::bind(&Pi3HatMoteusSpscInterface::CHILD_Run, this)) {
+  }
+
+  ~Pi3HatMoteusSpscInterface() {
+    done_.store(true, std::memory_order_release);
+    thread_.join();
+  }
+
+  /// Schedule a cycle of communication with the servos.  The result
+  /// is obtained with Poll() or Wait().
+  ///
+  /// All memory pointed to by @p data must remain valid until the
+  /// result has been retrieved.  When more than one slot is used,
+  /// each in-flight cycle needs its own replies storage.
+  void Cycle(const Data& data) {
+    Pi3HatMoteusInterface::CheckCapacity(data, options_.max_commands);
+    if (!ready()) {
+      throw std::logic_error(
+          "Cycle cannot be called until a slot has completed");
+    }
+    Request request;
+    request.data = data;
+    in_flight_++;
+    // This cannot fail, as no more than kMaxSlots requests are ever
+    // outstanding.
+    requests_.Push(request);
+  }
+
+  /// Return true and fill @p output if the oldest outstanding cycle
+  /// has completed.  This never blocks.
+  bool Poll(Output* output) {
+    if (in_flight_ == 0) { return false; }
+    if (!replies_.Pop(output)) { return false; }
+    in_flight_--;
+    return true;
+  }
+
+  /// Block until the oldest outstanding cycle has completed.
+  Output Wait() {
+    if (in_flight_ == 0) {
+      throw std::logic_error("Wait called with no cycle outstanding");
+    }
+    Output result;
+    while (!Poll(&result)) {
+      if (!options_.spin) { std::this_thread::yield(); }
+    }
+    return result;
+  }
+
+  /// True if any cycle has been submitted and not yet retrieved.
+  bool outstanding() const { return in_flight_ != 0; }
+
+  /// True if another cycle may be submitted.
+  bool ready() const { return in_flight_ < options_.slots; }
+
+  int in_flight() const { return in_flight_; }
+
+ private:
+  struct Request {
+    Data data;
+  };
+
+  static const Options& CheckOptions(const Options& options,
+                                     HardwareFactory hardware) {
+    if (options.slots < 1 || options.slots > kMaxSlots) {
+      throw std::runtime_error("slots must be between 1 and kMaxSlots");
+    }
+    if (!options.transport && !hardware) {
+      throw std::logic_error("a transport is required without hardware");
+    }
+    return options;
+  }
+
+  static std::unique_ptr<pi3hat::Transport> MakePi3HatTransport(
+      const Options& options) {
+    // The hardware records for itself.
+    pi3hat::Pi3Hat::Configuration config;
+    config.flight_recorder = options.flight_recorder;
+    return std::unique_ptr<pi3hat::Transport>(
+        new pi3hat::Pi3HatTransport(config));
+  }
+
+  void CHILD_Run() {
+    ConfigureRealtime(options_.cpu);
+
+    transport_ = options_.transport;
+    if (!transport_) {
+      hardware_transport_ = hardware_(options_);
+      transport_ = hardware_transport_.get();
+    } else if (options_.flight_recorder) {
+      recording_.reset(new pi3hat::RecordingTransport(
+                           transport_, options_.flight_recorder));
+      transport_ = recording_.get();
+    }
+
+    buffers_.Reserve(options_.max_commands);
+
+    while (!done_.load(std::memory_order_acquire)) {
+      Request request;
+      if (!requests_.Pop(&request)) {
+        CHILD_Idle();
+        continue;
+      }
+
+      NoAllocationScope no_allocation;
+      const auto output = Pi3HatMoteusInterface::ExecuteCycle(
+          transport_, request.data, &buffers_);
+      // The reply queue has as much room as the request queue, so
+      // this can always proceed.
+      replies_.Push(output);
+    }
+  }
+
+  void CHILD_Idle() {
+    if (options_.spin) { return; }
+    std::this_thread::sleep_for(
+        std::chrono::microseconds(options_.idle_sleep_us));
+  }
+
+  const Options options_;
+  const HardwareFactory hardware_;
+
+  /// Only used from the application thread.
+  int in_flight_ = 0;
+
+  /// These are shared between the two threads.
+  std::atomic<bool> done_{false};
+  SpscQueue<Request, kMaxSlots> requests_;
+  SpscQueue<Output, kMaxSlots> replies_;
+
+
+  /// These are only used from within the child thread.
+
+  std::unique_ptr<pi3hat::Transport> hardware_transport_;
+  std::unique_ptr<pi3hat::RecordingTransport> recording_;
+  pi3hat::Transport* transport_ = nullptr;
+
+  // This is kept persistently so that no memory allocation is
+  // required in steady state.  Cycles are performed one at a time,
+  // so every slot shares it.
+  Pi3HatMoteusInterface::CycleBuffers buffers_;
+
+  // This is declared last so that everything the child uses is
+  // constructed before it starts.
+  std::thread thread_;
+};
+
+}
+}
@@ -0,0 +1,282 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+///
+/// Measures the per-frame fast paths: encoding moteus commands and
+/// queries, parsing replies, and packing frames for the pi3hat's SPI
+/// registers.  Each is reported in ns/op along with the heap
+/// allocations it made, which should always be zero.
+///
+/// By default the frames are a synthetic corpus, with replies from
+/// the simulated servos.  --record replaces the frames with every
+/// cycle of a flight record, so that real traffic can be measured.
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "mjbots/pi3hat/can_schedule.h"
+#include "mjbots/pi3hat/flight_recorder.h"
+#include "mjbots/pi3hat/spi_framing.h"
+
+#include "mjbots/moteus/moteus_protocol.h"
+#include "mjbots/moteus/moteus_simulator.h"
+#include "mjbots/moteus/pi3hat_moteus_interface.h"
+#include "mjbots/moteus/realtime_allocation.h"
+
+using namespace mjbots;
+
+namespace {
+using Interface = moteus::Pi3HatMoteusInterface;
+
+// Results are folded into this so that nothing is optimized away.
+volatile uint64_t g_sink = 0;
+
+struct Arguments {
+  Arguments(const std::vector<std::string>& args) {
+    for (size_t i = 0; i < args.size(); i++) {
+      const auto& arg = args[i];
+      if (arg == "-h" || arg == "--help") {
+        help = true;
+      } else if (arg == "--record") {
+        record = args.at(++i);
+      } else if (arg == "--min-time-ms") {
+        min_time_ms = std::stoi(args.at(++i));
+      } else if (arg == "--check-allocations") {
+        check_allocations = true;
+      } else {
+        throw std::runtime_error("Unknown argument: " + arg);
+      }
+    }
+  }
+
+  bool help = false;
+  std::string record;
+  int min_time_ms = 200;
+  bool check_allocations = false;
+};
+
+void DisplayUsage() {
+  std::cout << "Usage: protocol_benchmark [options]\n";
+  std::cout << "\n";
+  std::cout << "  -h,--help            display this usage message\n";
+  std::cout << "  --record FILE        use the frames of a flight record\n";
+  std::cout << "  --min-time-ms MS     run each benchmark at least this long\n";
+  std::cout << "  --check-allocations  exit with an error if anything allocated\n";
+}
+
+struct Corpus {
+  std::vector<Interface::ServoCommand> commands;
+  std::vector<pi3hat::CanFrame> tx_can;
+  std::vector<pi3hat::CanFrame> rx_can;
+};
+
+/// A spread of modes, resolutions and queries, with the replies the
+/// simulated servos give to them.
+Corpus MakeSyntheticCorpus() {
+  Corpus result;
+
+  auto coarse = moteus::PositionResolution();
+  coarse.position = moteus::Resolution::kInt16;
+  coarse.velocity = moteus::Resolution::kInt16;
+  coarse.feedforward_torque = moteus::Resolution::kInt16;
+  coarse.kp_scale = moteus::Resolution::kInt8;
+  coarse.kd_scale = moteus::Resolution::kInt8;
+  auto fine = moteus::PositionResolution();
+  fine.position = moteus::Resolution::kFloat;
+  fine.velocity = moteus::Resolution::kFloat;
+  fine.feedforward_torque = moteus::Resolution::kFloat;
+
+  auto brief = moteus::QueryCommand();
+  brief.voltage = moteus::Resolution::kIgnore;
+  brief.temperature = moteus::Resolution::kIgnore;
+  brief.fault = moteus::Resolution::kIgnore;
+  auto full = moteus::QueryCommand();
+  full.q_current = moteus::Resolution::kInt16;
+  full.d_current = moteus::Resolution::kInt16;
+  full.rezero_state = moteus::Resolution::kInt8;
+
+  for (int i = 0; i < 64; i++) {
+    Interface::ServoCommand cmd;
+    cmd.id = 1 + (i % 12);
+    cmd.bus = 1 + (i % 4);
+    cmd.mode = (i % 8) == 0 ? moteus::Mode::kStopped : moteus::Mode::kPosition;
+    cmd.position.position = 0.01 * i;
+    cmd.position.velocity = 0.1 * (i % 5);
+    cmd.position.feedforward_torque = (i % 3) * 0.25;
+    cmd.resolution = (i % 3) == 0 ? moteus::PositionResolution() :
+        (i % 3) == 1 ? coarse : fine;
+    cmd.query = (i % 2) ? brief : full;
+    result.commands.push_back(cmd);
+  }
+
+  result.tx_can.resize(result.commands.size());
+  for (size_t i = 0; i < result.commands.size(); i++) {
+    Interface::EncodeCommand(result.commands[i], &result.tx_can[i]);
+  }
+
+  moteus::SimulatedMoteusTransport sim;
+  result.rx_can.resize(result.tx_can.size());
+  pi3hat::Pi3Hat::Input input;
+  input.tx_can = {result.tx_can.data(), result.tx_can.size()};
+  input.rx_can = {result.rx_can.data(), result.rx_can.size()};
+  result.rx_can.resize(sim.Cycle(input).rx_can_size);
+
+  return result;
+}
+
+/// Keeps the synthetic commands, but takes every frame from @p filename.
+void LoadRecord(const std::string& filename, Corpus* corpus) {
+  corpus->tx_can.clear();
+  corpus->rx_can.clear();
+
+  pi3hat::FlightRecordReader reader{filename};
+  pi3hat::FlightRecordReader::Record record;
+  pi3hat::FlightRecordReader::Cycle cycle;
+  while (reader.Next(&record)) {
+    if (!pi3hat::FlightRecordReader::ParseCycle(record, &cycle)) { continue; }
+    corpus->tx_can.insert(corpus->tx_can.end(),
+                          cycle.tx_can.begin(), cycle.tx_can.end());
+    corpus->rx_can.insert(corpus->rx_can.end(),
+                          cycle.rx_can.begin(), cycle.rx_can.end());
+  }
+  if (corpus->tx_can.empty() || corpus->rx_can.empty()) {
+    throw std::runtime_error("no CAN frames in " + filename);
+  }
+}
+
+struct Result {
+  double ns_per_op = 0.0;
+  double allocations_per_op = 0.0;
+};
+
+/// Call @p op(i) for increasing i until at least @p min_ns has passed
+/// in one batch.
+template <typename Op>
+Result Measure(int64_t min_ns, Op op) {
+  using Clock = std::chrono::steady_clock;
+
+  // Warm up, so that the first batch does not pay for cold caches.
+  for (size_t i = 0; i < 1000; i++) { op(i); }
+
+  for (size_t count = 1000; ; count *= 2) {
+    const auto allocations = moteus::RealtimeAllocationCount();
+    const auto start = Clock::now();
+    {
+      moteus::NoAllocationScope no_allocation;
+      for (size_t i = 0; i < count; i++) { op(i); }
+    }
+    const auto elapsed_ns = std::chrono::duration_cast<
+      std::chrono::nanoseconds>(Clock::now() - start).count();
+    if (elapsed_ns < min_ns) { continue; }
+
+    Result result;
+    result.ns_per_op = static_cast<double>(elapsed_ns) / count;
+    result.allocations_per_op =
+        static_cast<double>(moteus::RealtimeAllocationCount() - allocations) /
+        count;
+    return result;
+  }
+}
+
+int do_main(int argc, char** argv) {
+  Arguments args({argv + 1, argv + argc});
+
+  if (args.help) {
+    DisplayUsage();
+    return 0;
+  }
+
+  auto corpus = MakeSyntheticCorpus();
+  if (!args.record.empty()) {
+    LoadRecord(args.record, &corpus);
+  }
+
+  const auto& commands = corpus.commands;
+  const auto& tx_can = corpus.tx_can;
+  const auto& rx_can = corpus.rx_can;
+  const int64_t min_ns = static_cast<int64_t>(args.min_time_ms) * 1000000;
+
+  std::printf("%zu commands, %zu tx frames, %zu rx frames\n\n",
+              commands.size(), tx_can.size(), rx_can.size());
+  std::printf("%-24s %10s %10s\n", "benchmark", "ns/op", "allocs/op");
+
+  bool allocated = false;
+  const auto report = [&](const char* name, const Result& result) {
+    std::printf("%-24s %10.1f %10.3f\n",
+                name, result.ns_per_op, result.allocations_per_op);
+    if (result.allocations_per_op != 0.0) { allocated = true; }
+  };
+
+  report("EmitPositionCommand", Measure(min_ns, [&](size_t i) {
+        const auto& cmd = commands[i % commands.size()];
+        moteus::CanFrame frame;
+        moteus::WriteCanFrame writer(&frame);
+        moteus::EmitPositionCommand(&writer, cmd.position, cmd.resolution);
+        g_sink += frame.size;
+      }));
+
+  report("EmitQueryCommand", Measure(min_ns, [&](size_t i) {
+        const auto& cmd = commands[i % commands.size()];
+        moteus::CanFrame frame;
+        moteus::WriteCanFrame writer(&frame);
+        moteus::EmitQueryCommand(&writer, cmd.query);
+        g_sink += frame.size;
+      }));
+
+  report("EncodeCommand", Measure(min_ns, [&](size_t i) {
+        pi3hat::CanFrame frame;
+        Interface::EncodeCommand(commands[i % commands.size()], &frame);
+        g_sink += frame.size;
+      }));
+
+  report("ParseQueryResult", Measure(min_ns, [&](size_t i) {
+        const auto& frame = rx_can[i % rx_can.size()];
+        const auto result = moteus::ParseQueryResult(frame.data, frame.size);
+        g_sink += static_cast<int>(result.mode) + result.fault;
+      }));
+
+  report("RoundUpDlc", Measure(min_ns, [&](size_t i) {
+        g_sink += pi3hat::RoundUpDlc(tx_can[i % tx_can.size()].size);
+      }));
+
+  report("EncodeCanFrame", Measure(min_ns, [&](size_t i) {
+        char buf[70];
+        int spi_address = 0;
+        g_sink += pi3hat::EncodeCanFrame(
+            buf, i & 1, tx_can[i % tx_can.size()], false, &spi_address);
+      }));
+
+  report("EncodeCanFrame/batch", Measure(min_ns, [&](size_t i) {
+        char buf[70];
+        int spi_address = 0;
+        g_sink += pi3hat::EncodeCanFrame(
+            buf, i & 1, tx_can[i % tx_can.size()], true, &spi_address);
+      }));
+
+  if (args.check_allocations && allocated) {
+    std::printf("\nFAIL: heap allocations were made\n");
+    return 1;
+  }
+  return 0;
+}
+}
+
+int main(int argc, char** argv) {
+  return do_main(argc, argv);
+}
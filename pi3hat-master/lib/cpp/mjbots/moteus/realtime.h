@@ -14,12 +14,29 @@
 
 #pragma once
 
+#include <alloca.h>
+#include <dirent.h>
 #include <sched.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
 
 namespace mjbots {
 namespace moteus {
 
-inline void ConfigureRealtime(int cpu) {
+inline void ConfigureRealtime(int cpu, int priority = 10) {
   {
     cpu_set_t cpuset = {};
     CPU_ZERO(&cpuset);
@@ -33,7 +50,7 @@ inline void ConfigureRealtime(int cpu) {
 
   {
     struct sched_param params = {};
-    params.sched_priority = 10;
+    params.sched_priority = priority;
     const int r = ::sched_setscheduler(0, SCHED_RR, &params);
     if (r < 0) {
       throw std::runtime_error(
@@ -42,5 +59,291 @@ inline void ConfigureRealtime(int cpu) {
   }
 }
 
+/// Parse a kernel CPU list, like "0-2,5", as found in sysfs and
+/// /proc/irq/*/smp_affinity_list.  Anything malformed is skipped.
+inline std::vector<int> ParseCpuList(const std::string& text) {
+  std::vector<int> result;
+  std::istringstream stream(text);
+  std::string item;
+  while (std::getline(stream, item, ',')) {
+    int first = 0;
+    int last = 0;
+    const int count = std::sscanf(item.c_str(), "%d-%d", &first, &last);
+    if (count < 1 || first < 0) { continue; }
+    if (count == 1) { last = first; }
+    for (int cpu = first; cpu <= last; cpu++) { result.push_back(cpu); }
+  }
+  std::sort(result.begin(), result.end());
+  result.erase(std::unique(result.begin(), result.end()), result.end());
+  return result;
+}
+
+/// The inverse of ParseCpuList, using ranges where possible.
+inline std::string FormatCpuList(std::vector<int> cpus) {
+  std::sort(cpus.begin(), cpus.end());
+  cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+
+  std::ostringstream result;
+  for (size_t i = 0; i < cpus.size();) {
+    size_t end = i;
+    while (end + 1 < cpus.size() && cpus[end + 1] == cpus[end] + 1) { end++; }
+    if (i != 0) { result << ","; }
+    result << cpus[i];
+    if (end != i) { result << "-" << cpus[end]; }
+    i = end + 1;
+  }
+  return result.str();
+}
+
+/// Touch @p bytes of stack, so that a locked process does not take
+/// page faults when its stack later grows that far.
+inline void PrefaultStack(size_t bytes) {
+  volatile uint8_t* stack = static_cast<uint8_t*>(::alloca(bytes));
+  for (size_t i = 0; i < bytes; i += 4096) { stack[i] = 0; }
+}
+
+struct WakeupLatency {
+  int samples = 0;
+  int64_t mean_ns = 0;
+  int64_t p99_ns = 0;
+  int64_t max_ns = 0;
+};
+
+/// Sleep until each of a series of deadlines @p period_ns apart, for
+/// @p duration_ms in total, in the manner of cyclictest, and report
+/// how late each wakeup was.  This measures the calling thread with
+/// its current scheduling, so it should be run after it has been made
+/// realtime.
+inline WakeupLatency MeasureWakeupLatency(int duration_ms, int64_t period_ns) {
+  WakeupLatency result;
+  if (duration_ms <= 0 || period_ns <= 0) { return result; }
+
+  const auto to_ns = [](const struct timespec& ts) {
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000ll + ts.tv_nsec;
+  };
+
+  std::vector<int64_t> latencies(
+      std::max<int64_t>(1, duration_ms * 1000000ll / period_ns));
+
+  struct timespec ts = {};
+  ::clock_gettime(CLOCK_MONOTONIC, &ts);
+  int64_t next = to_ns(ts);
+  for (auto& latency : latencies) {
+    next += period_ns;
+    ts.tv_sec = next / 1000000000ll;
+    ts.tv_nsec = next % 1000000000ll;
+    // clock_nanosleep returns the error rather than setting errno.
+    int error = 0;
+    while ((error = ::clock_nanosleep(
+                CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr)) == EINTR) {}
+    if (error != 0) {
+      throw std::runtime_error(
+          std::string("Error sleeping: ") + std::strerror(error));
+    }
+
+    struct timespec now = {};
+    ::clock_gettime(CLOCK_MONOTONIC, &now);
+    latency = std::max<int64_t>(0, to_ns(now) - next);
+  }
+
+  int64_t total = 0;
+  for (const auto latency : latencies) {
+    total += latency;
+    result.max_ns = std::max(result.max_ns, latency);
+  }
+  result.samples = static_cast<int>(latencies.size());
+  result.mean_ns = total / result.samples;
+  const auto p99 = latencies.begin() + (latencies.size() * 99) / 100;
+  std::nth_element(latencies.begin(), p99, latencies.end());
+  result.p99_ns = *p99;
+  return result;
+}
+
+struct RealtimeOptions {
+  // If non-negative, the calling thread is pinned here and given a
+  // SCHED_RR priority.
+  int cpu = -1;
+  int priority = 10;
+
+  // Lock all current and future memory of the process.
+  bool lock_memory = true;
+  size_t prefault_stack_bytes = 256 * 1024;
+
+  // Move every IRQ which permits it onto the CPUs not listed here.
+  // This normally requires root.
+  std::vector<int> irq_free_cpus;
+
+  // If non-zero, measure wakeup latency for this long once the
+  // thread is realtime.  Warn if the worst case exceeds
+  // 'latency_warn_ns'.
+  int latency_test_ms = 0;
+  int64_t latency_test_period_ns = 1000000;
+  int64_t latency_warn_ns = 100000;
+
+  RealtimeOptions() {}
+};
+
+struct RealtimeReport {
+  // Of 'cpu' and 'irq_free_cpus', those missing from the kernel's
+  // isolcpus and nohz_full lists.
+  std::vector<int> not_isolated;
+  std::vector<int> not_nohz_full;
+
+  int irqs_moved = 0;
+  // IRQs which refused to move, usually because they are per-CPU.
+  int irqs_fixed = 0;
+
+  WakeupLatency latency;
+
+  // Everything found which is likely to cause missed cycles.
+  std::vector<std::string> warnings;
+};
+
+namespace detail {
+inline std::string ReadFirstLine(const std::string& filename) {
+  std::ifstream inf(filename);
+  std::string result;
+  std::getline(inf, result);
+  return result;
+}
+
+inline bool WriteFile(const std::string& filename, const std::string& value) {
+  std::ofstream outf(filename);
+  outf << value << "\n";
+  outf.close();
+  return !outf.fail();
+}
+
+inline std::vector<int> OnlineCpus() {
+  auto result = ParseCpuList(
+      ReadFirstLine("/sys/devices/system/cpu/online"));
+  if (result.empty()) {
+    for (unsigned i = 0; i < std::thread::hardware_concurrency(); i++) {
+      result.push_back(i);
+    }
+  }
+  return result;
+}
+
+inline void MoveIrqs(const std::vector<int>& irq_free_cpus,
+                     RealtimeReport* report) {
+  std::vector<int> allowed;
+  for (const auto cpu : OnlineCpus()) {
+    if (std::find(irq_free_cpus.begin(), irq_free_cpus.end(), cpu) ==
+        irq_free_cpus.end()) {
+      allowed.push_back(cpu);
+    }
+  }
+  if (allowed.empty()) {
+    report->warnings.push_back("no CPUs would remain to service IRQs");
+    return;
+  }
+  const auto allowed_list = FormatCpuList(allowed);
+
+  uint64_t mask = 0;
+  for (const auto cpu : allowed) {
+    if (cpu < 64) { mask |= 1ull << cpu; }
+  }
+  char mask_hex[32] = {};
+  std::snprintf(mask_hex, sizeof(mask_hex), "%llx",
+                static_cast<unsigned long long>(mask));
+  // New IRQs should start out in the right place too.  Failure here
+  // shows up as a failure of the existing IRQs below.
+  WriteFile("/proc/irq/default_smp_affinity", mask_hex);
+
+  DIR* dir = ::opendir("/proc/irq");
+  if (!dir) {
+    report->warnings.push_back("could not read /proc/irq");
+    return;
+  }
+  while (struct dirent* entry = ::readdir(dir)) {
+    char* end = nullptr;
+    std::strtol(entry->d_name, &end, 10);
+    if (end == entry->d_name || *end != 0) { continue; }
+
+    const std::string path =
+        std::string("/proc/irq/") + entry->d_name + "/smp_affinity_list";
+    if (ReadFirstLine(path) == allowed_list) { continue; }
+    if (WriteFile(path, allowed_list)) {
+      report->irqs_moved++;
+    } else {
+      report->irqs_fixed++;
+    }
+  }
+  ::closedir(dir);
+}
+}
+
+/// Prepare the calling thread, and the process, for realtime
+/// operation.  Failure to pin, schedule, or lock memory throws.
+/// Everything else which is likely to cause missed cycles, like a CPU
+/// without isolcpus or high wakeup latency, is only reported.
+inline RealtimeReport SetupRealtime(const RealtimeOptions& options) {
+  RealtimeReport report;
+
+  if (options.lock_memory) {
+    const int r = ::mlockall(MCL_CURRENT | MCL_FUTURE);
+    if (r < 0) {
+      throw std::runtime_error("Error locking memory");
+    }
+  }
+  if (options.prefault_stack_bytes) {
+    PrefaultStack(options.prefault_stack_bytes);
+  }
+
+  std::vector<int> checked = options.irq_free_cpus;
+  if (options.cpu >= 0) { checked.push_back(options.cpu); }
+  std::sort(checked.begin(), checked.end());
+  checked.erase(std::unique(checked.begin(), checked.end()), checked.end());
+
+  const auto isolated = ParseCpuList(
+      detail::ReadFirstLine("/sys/devices/system/cpu/isolated"));
+  const auto nohz_full = ParseCpuList(
+      detail::ReadFirstLine("/sys/devices/system/cpu/nohz_full"));
+  for (const auto cpu : checked) {
+    if (!std::binary_search(isolated.begin(), isolated.end(), cpu)) {
+      report.not_isolated.push_back(cpu);
+    }
+    if (!std::binary_search(nohz_full.begin(), nohz_full.end(), cpu)) {
+      report.not_nohz_full.push_back(cpu);
+    }
+  }
+  if (!report.not_isolated.empty()) {
+    report.warnings.push_back(
+        "CPUs " + FormatCpuList(report.not_isolated) +
+        " are not in isolcpus, so other tasks may run there");
+  }
+  if (!report.not_nohz_full.empty()) {
+    report.warnings.push_back(
+        "CPUs " + FormatCpuList(report.not_nohz_full) +
+        " are not in nohz_full, so the scheduler tick interrupts them");
+  }
+
+  if (!options.irq_free_cpus.empty()) {
+    detail::MoveIrqs(options.irq_free_cpus, &report);
+    if (report.irqs_fixed) {
+      report.warnings.push_back(
+          std::to_string(report.irqs_fixed) +
+          " IRQs could not be moved; are we root?");
+    }
+  }
+
+  if (options.cpu >= 0) {
+    ConfigureRealtime(options.cpu, options.priority);
+  }
+
+  if (options.latency_test_ms > 0) {
+    report.latency = MeasureWakeupLatency(
+        options.latency_test_ms, options.latency_test_period_ns);
+    if (report.latency.max_ns > options.latency_warn_ns) {
+      report.warnings.push_back(
+          "worst wakeup latency was " +
+          std::to_string(report.latency.max_ns / 1000) + "us");
+    }
+  }
+
+  return report;
+}
+
 }
 }
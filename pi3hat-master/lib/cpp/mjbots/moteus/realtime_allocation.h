@@ -0,0 +1,95 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+
+/// @file
+///
+/// Support for verifying that realtime threads do not touch the heap.
+///
+/// The CAN threads in this directory mark each cycle with a
+/// NoAllocationScope.  Normally that costs a thread local increment
+/// and nothing else.  When a binary also links
+/// //lib/cpp/mjbots/moteus:realtime_allocation_check, malloc and
+/// friends are wrapped, and every allocation made while a scope is
+/// open on the calling thread is counted, or optionally aborts the
+/// process.
+
+namespace mjbots {
+namespace moteus {
+
+namespace detail {
+inline int& NoAllocationDepth() {
+  static thread_local int depth = 0;
+  return depth;
+}
+
+inline std::atomic<int64_t>& RealtimeAllocationCounter() {
+  static std::atomic<int64_t> count{0};
+  return count;
+}
+
+inline std::atomic<bool>& AbortOnRealtimeAllocationFlag() {
+  static std::atomic<bool> value{false};
+  return value;
+}
+
+/// Called by the wrapped allocation functions.  It must not allocate
+/// itself.
+inline void NoteAllocation() {
+  if (NoAllocationDepth() == 0) { return; }
+  RealtimeAllocationCounter().fetch_add(1, std::memory_order_relaxed);
+  if (AbortOnRealtimeAllocationFlag().load(std::memory_order_relaxed)) {
+    static const char kMessage[] =
+        "heap allocation within a NoAllocationScope\n";
+    const auto ignored = ::write(2, kMessage, sizeof(kMessage) - 1);
+    (void)ignored;
+    std::abort();
+  }
+}
+}
+
+/// While an instance exists, the current thread is expected not to
+/// allocate.  Scopes may be nested.
+class NoAllocationScope {
+ public:
+  NoAllocationScope() { detail::NoAllocationDepth()++; }
+  ~NoAllocationScope() { detail::NoAllocationDepth()--; }
+
+  NoAllocationScope(const NoAllocationScope&) = delete;
+  NoAllocationScope& operator=(const NoAllocationScope&) = delete;
+};
+
+/// The number of allocations made within any NoAllocationScope so far.
+/// This is always 0 unless realtime_allocation_check is linked in.
+inline int64_t RealtimeAllocationCount() {
+  return detail::RealtimeAllocationCounter().load(std::memory_order_relaxed);
+}
+
+/// If true, an allocation within a NoAllocationScope prints a message
+/// and aborts, so that a debugger or core file shows where it was
+/// made.
+inline void SetAbortOnRealtimeAllocation(bool value) {
+  detail::AbortOnRealtimeAllocationFlag().store(
+      value, std::memory_order_relaxed);
+}
+
+}
+}
@@ -0,0 +1,84 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+///
+/// Linking this into an executable replaces the C allocation
+/// functions with wrappers which report calls made inside a
+/// NoAllocationScope, then forward to the glibc implementations.
+/// operator new is implemented in terms of malloc, so it is covered
+/// as well.
+///
+/// This is only intended for executables.  Within a dynamically
+/// loaded library, the first access to a thread local can itself
+/// allocate.
+
+#include "mjbots/moteus/realtime_allocation.h"
+
+#include <cerrno>
+#include <cstddef>
+
+#ifndef __GLIBC__
+#error "realtime_allocation_check requires glibc"
+#endif
+
+extern "C" {
+
+void* __libc_malloc(size_t);
+void* __libc_calloc(size_t, size_t);
+void* __libc_realloc(void*, size_t);
+void* __libc_memalign(size_t, size_t);
+void __libc_free(void*);
+
+void* malloc(size_t size) {
+  mjbots::moteus::detail::NoteAllocation();
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+  mjbots::moteus::detail::NoteAllocation();
+  return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+  mjbots::moteus::detail::NoteAllocation();
+  return __libc_realloc(ptr, size);
+}
+
+void* memalign(size_t alignment, size_t size) {
+  mjbots::moteus::detail::NoteAllocation();
+  return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+  mjbots::moteus::detail::NoteAllocation();
+  return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void** result, size_t alignment, size_t size) {
+  if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) {
+    return EINVAL;
+  }
+  mjbots::moteus::detail::NoteAllocation();
+  void* const ptr = __libc_memalign(alignment, size);
+  if (ptr == nullptr) { return ENOMEM; }
+  *result = ptr;
+  return 0;
+}
+
+void free(void* ptr) {
+  __libc_free(ptr);
+}
+
+}
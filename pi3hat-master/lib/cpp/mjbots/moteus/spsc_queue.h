@@ -0,0 +1,78 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+namespace mjbots {
+namespace moteus {
+
+/// A fixed capacity, lock-free, single-producer single-consumer
+/// queue.  Exactly one thread may call Push and exactly one (possibly
+/// different) thread may call Pop.  Neither operation allocates or
+/// makes a system call.
+///
+/// @p Capacity must be a power of two.
+template <typename T, size_t Capacity>
+class SpscQueue {
+ public:
+  static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0,
+                "Capacity must be a power of two");
+
+  /// Producer only.  Returns false if the queue is full.
+  bool Push(const T& value) {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) >= Capacity) {
+      return false;
+    }
+    items_[head & kMask] = value;
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  /// Consumer only.  Returns false if the queue is empty.
+  bool Pop(T* value) {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    *value = items_[tail & kMask];
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  /// These may be called from either side, but are only a snapshot.
+  size_t size() const {
+    return head_.load(std::memory_order_acquire) -
+        tail_.load(std::memory_order_acquire);
+  }
+
+  bool empty() const { return size() == 0; }
+
+  static constexpr size_t capacity() { return Capacity; }
+
+ private:
+  static constexpr size_t kMask = Capacity - 1;
+
+  // The indices are kept on separate cache lines so that the producer
+  // and consumer do not contend for the same line.
+  alignas(64) std::atomic<size_t> head_{0};
+  alignas(64) std::atomic<size_t> tail_{0};
+  alignas(64) T items_[Capacity] = {};
+};
+
+}
+}
@@ -0,0 +1,284 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mjbots/pi3hat/broker.h"
+
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <boost/test/auto_unit_test.hpp>
+
+using namespace mjbots::pi3hat;
+
+namespace {
+/// Every frame which expects a reply is answered by the ID it was
+/// sent to, as a moteus would.
+class EchoTransport : public Transport {
+ public:
+  Pi3Hat::Output Cycle(const Pi3Hat::Input& input) override {
+    Pi3Hat::Output result;
+    cycle_sizes.push_back(input.tx_can.size());
+    for (const auto& frame : input.tx_can) {
+      if (!frame.expect_reply || result.rx_can_size >= input.rx_can.size()) {
+        continue;
+      }
+      auto& reply = input.rx_can[result.rx_can_size++];
+      reply = frame;
+      reply.id = ((frame.id & 0x7f) << 8) | ((frame.id >> 8) & 0x7f);
+    }
+    if (input.request_attitude && input.attitude) {
+      input.attitude->attitude.w = 0.5;
+      result.attitude_present = true;
+    }
+    return result;
+  }
+
+  int64_t now_ns() override { return detail::BrokerNowNs(); }
+
+  std::vector<size_t> cycle_sizes;
+};
+
+CanFrame MakeFrame(int bus, int id, bool expect_reply = true) {
+  CanFrame result;
+  result.id = 0x8000 | id;
+  result.bus = bus;
+  result.size = 2;
+  result.expect_reply = expect_reply;
+  return result;
+}
+
+struct Fixture {
+  Fixture(const Broker::Options& options = Broker::Options())
+      : shared(new BrokerShared()),
+        broker(&transport, shared.get(), options),
+        thread([this]() { broker.Run(done); }) {}
+
+  ~Fixture() {
+    Stop();
+  }
+
+  void Stop() {
+    done.store(true);
+    if (thread.joinable()) { thread.join(); }
+  }
+
+  EchoTransport transport;
+  std::unique_ptr<BrokerShared> shared;
+  Broker broker;
+  std::atomic<bool> done{false};
+  std::thread thread;
+};
+
+size_t CycleWith(BrokerTransport& client, const std::vector<CanFrame>& tx,
+                 std::vector<CanFrame>* rx) {
+  Pi3Hat::Input input;
+  rx->resize(16);
+  input.tx_can = {const_cast<CanFrame*>(tx.data()), tx.size()};
+  input.rx_can = {rx->data(), rx->size()};
+  const auto output = client.Cycle(input);
+  rx->resize(output.rx_can_size);
+  return output.rx_can_size;
+}
+}
+
+BOOST_AUTO_TEST_CASE(BrokerRingTest) {
+  BrokerRing<int, 4> dut;
+  BOOST_TEST(dut.empty());
+  for (int i = 0; i < 4; i++) { BOOST_TEST(dut.Push(i)); }
+  BOOST_TEST(!dut.Push(4));
+
+  int value = -1;
+  BOOST_TEST(dut.Pop(&value));
+  BOOST_TEST(value == 0);
+  BOOST_TEST(dut.Push(4));
+  for (int i = 1; i <= 4; i++) {
+    BOOST_TEST(dut.Pop(&value));
+    BOOST_TEST(value == i);
+  }
+  BOOST_TEST(!dut.Pop(&value));
+  BOOST_TEST(dut.empty());
+}
+
+BOOST_AUTO_TEST_CASE(BrokerRoutingTest) {
+  Fixture fixture;
+
+  BrokerTransport::Options owner_options;
+  owner_options.priority = 10;
+  owner_options.owned_ids = {{1, 1}};
+  BrokerTransport owner(fixture.shared.get(), owner_options);
+
+  {
+    BrokerTransport::Options conflict_options;
+    conflict_options.owned_ids = {{1, 1}};
+    BOOST_CHECK_THROW(
+        BrokerTransport(fixture.shared.get(), conflict_options), Error);
+  }
+
+  BrokerTransport other(fixture.shared.get());
+
+  BrokerTransport::Options monitor_options;
+  monitor_options.priority = -10;
+  monitor_options.monitor_can = true;
+  BrokerTransport monitor(fixture.shared.get(), monitor_options);
+
+  std::vector<CanFrame> rx;
+
+  // Nobody else may command an owned ID.
+  BOOST_TEST(CycleWith(other, {MakeFrame(1, 1)}, &rx) == 0u);
+  BOOST_TEST(other.rejected_frames() == 1u);
+
+  BOOST_TEST(CycleWith(other, {MakeFrame(1, 2)}, &rx) == 1u);
+  BOOST_TEST(rx[0].id == 0x0200u);
+  BOOST_TEST(rx[0].bus == 1);
+
+  BOOST_TEST(CycleWith(owner, {MakeFrame(1, 1)}, &rx) == 1u);
+  BOOST_TEST(rx[0].id == 0x0100u);
+  BOOST_TEST(owner.rejected_frames() == 0u);
+
+  // The monitor saw every reply, without asking for any.
+  std::vector<CanFrame> monitored(16);
+  BOOST_TEST(monitor.ReadMonitor({monitored.data(), monitored.size()}) == 2u);
+  BOOST_TEST(monitored[0].id == 0x0200u);
+  BOOST_TEST(monitored[1].id == 0x0100u);
+  BOOST_TEST(monitor.dropped_frames() == 0u);
+}
+
+BOOST_AUTO_TEST_CASE(BrokerMergeTest) {
+  Broker::Options options;
+  options.max_merged_frames = 3;
+  // Long enough that the low priority client never gets a cycle of
+  // its own during the test.
+  options.idle_ns = 60000000000ll;
+  Fixture fixture(options);
+
+  BrokerTransport::Options top_options;
+  top_options.priority = 10;
+  BrokerTransport top(fixture.shared.get(), top_options);
+  BrokerTransport low(fixture.shared.get());
+
+  std::vector<CanFrame> rx;
+  BOOST_TEST(CycleWith(top, {MakeFrame(1, 1)}, &rx) == 1u);
+
+  std::vector<CanFrame> low_tx;
+  for (int i = 0; i < 7; i++) { low_tx.push_back(MakeFrame(2, 10 + i)); }
+  std::atomic<bool> low_done{false};
+  size_t low_rx_size = 0;
+  std::thread low_thread([&]() {
+    std::vector<CanFrame> low_rx;
+    low_rx_size = CycleWith(low, low_tx, &low_rx);
+    low_done.store(true);
+  });
+
+  // Wait for the low priority request to be posted.
+  while (true) {
+    bool posted = false;
+    for (const auto& slot : fixture.shared->clients) {
+      if (slot.state.load() == BrokerClientSlot::kActive &&
+          slot.priority == 0 && slot.request_seq.load() != 0) {
+        posted = true;
+      }
+    }
+    if (posted) { break; }
+    std::this_thread::yield();
+  }
+
+  // Each realtime cycle carries at most 3 of the lower priority
+  // frames, so the low priority cycle needs 3 of them.
+  for (int i = 0; i < 3; i++) {
+    BOOST_TEST(!low_done.load());
+    CycleWith(top, {MakeFrame(1, 1)}, &rx);
+    BOOST_TEST(rx.size() == 1u);
+    BOOST_TEST(rx[0].id == 0x0100u);
+  }
+  low_thread.join();
+  BOOST_TEST(low_rx_size == 7u);
+
+  fixture.Stop();
+  const std::vector<size_t> expected = {1, 4, 4, 2};
+  BOOST_TEST(fixture.transport.cycle_sizes == expected,
+             boost::test_tools::per_element());
+}
+
+BOOST_AUTO_TEST_CASE(BrokerAttitudeTest) {
+  Fixture fixture;
+
+  BrokerTransport::Options subscriber_options;
+  subscriber_options.priority = -10;
+  subscriber_options.subscribe_attitude = true;
+  BrokerTransport subscriber(fixture.shared.get(), subscriber_options);
+
+  Attitude attitude;
+  BOOST_TEST(!subscriber.ReadAttitude(&attitude));
+
+  // Another client's cycle is enough to publish a fresh attitude.
+  BrokerTransport control(fixture.shared.get());
+  std::vector<CanFrame> rx;
+  CycleWith(control, {}, &rx);
+
+  BOOST_TEST(subscriber.ReadAttitude(&attitude));
+  BOOST_TEST(attitude.attitude.w == 0.5);
+}
+
+BOOST_AUTO_TEST_CASE(BrokerOversizeTest) {
+  Fixture fixture;
+  BrokerTransport client(fixture.shared.get());
+
+  // A cycle larger than the ring is refused without queuing any of
+  // it, so the next cycle sends only its own frames.
+  std::vector<CanFrame> too_many;
+  for (int i = 0; i < 65; i++) { too_many.push_back(MakeFrame(1, 1 + i)); }
+  std::vector<CanFrame> rx;
+  BOOST_CHECK_THROW(CycleWith(client, too_many, &rx), Error);
+
+  BOOST_TEST(CycleWith(client, {MakeFrame(2, 5)}, &rx) == 1u);
+  BOOST_TEST(rx[0].id == 0x0500u);
+
+  fixture.Stop();
+  BOOST_TEST(fixture.transport.cycle_sizes.back() == 1u);
+}
+
+BOOST_AUTO_TEST_CASE(BrokerDeadClaimTest) {
+  Broker::Options options;
+  options.liveness_check_ns = 1000000;
+  Fixture fixture(options);
+
+  // Slots left behind by clients which died while attaching: one
+  // before writing its pid, and one after.
+  auto& unnamed = fixture.shared->clients[0];
+  unnamed.state.store(BrokerClientSlot::kClaimed);
+  auto& dead = fixture.shared->clients[1];
+  dead.pid = 0x7ffffff0;
+  dead.state.store(BrokerClientSlot::kClaimed);
+
+  // A live client which is part way through attaching is left alone.
+  auto& live = fixture.shared->clients[2];
+  live.pid = ::getpid();
+  live.state.store(BrokerClientSlot::kClaimed);
+
+  for (int i = 0; i < 1000; i++) {
+    if (unnamed.state.load() == BrokerClientSlot::kFree &&
+        dead.state.load() == BrokerClientSlot::kFree) {
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  BOOST_TEST(unnamed.state.load() == BrokerClientSlot::kFree);
+  BOOST_TEST(dead.state.load() == BrokerClientSlot::kFree);
+  BOOST_TEST(live.state.load() == BrokerClientSlot::kClaimed);
+}
@@ -0,0 +1,168 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mjbots/pi3hat/can_schedule.h"
+
+#include <utility>
+#include <vector>
+
+#include <boost/test/auto_unit_test.hpp>
+
+using namespace mjbots::pi3hat;
+
+namespace {
+CanFrame MakeFrame(int bus, int size, bool expect_reply, int id = 1) {
+  CanFrame result;
+  result.id = 0x8000 | id;
+  result.bus = bus;
+  result.size = size;
+  result.expect_reply = expect_reply;
+  return result;
+}
+}
+
+BOOST_AUTO_TEST_CASE(RoundUpDlcTest) {
+  BOOST_TEST(RoundUpDlc(0) == 0u);
+  BOOST_TEST(RoundUpDlc(8) == 8u);
+  BOOST_TEST(RoundUpDlc(9) == 12u);
+  BOOST_TEST(RoundUpDlc(33) == 48u);
+  BOOST_TEST(RoundUpDlc(64) == 64u);
+  BOOST_TEST(RoundUpDlc(65) == 0u);
+}
+
+BOOST_AUTO_TEST_CASE(EstimateCanFrameTest) {
+  Pi3Hat::CanConfiguration config;
+
+  const auto small = EstimateCanFrameNs(config, MakeFrame(1, 8, false));
+  const auto large = EstimateCanFrameNs(config, MakeFrame(1, 64, false));
+  // 51 slow bits and 91 fast ones, with 10% for stuffing.
+  BOOST_TEST(small == 56100 + 20020);
+  BOOST_TEST(large > small);
+  // Sizes are rounded up to a valid DLC.
+  BOOST_TEST(EstimateCanFrameNs(config, MakeFrame(1, 40, false)) ==
+             EstimateCanFrameNs(config, MakeFrame(1, 48, false)));
+
+  config.bitrate_switch = false;
+  BOOST_TEST(EstimateCanFrameNs(config, MakeFrame(1, 64, false)) > 3 * large);
+}
+
+BOOST_AUTO_TEST_CASE(CanTxSchedulerTest) {
+  std::vector<CanFrame> frames = {
+    MakeFrame(1, 8, false, 1),
+    MakeFrame(1, 8, true, 2),
+    MakeFrame(1, 64, true, 3),
+    MakeFrame(2, 8, true, 4),
+    MakeFrame(1, 24, true, 5),
+  };
+
+  Pi3Hat::CanConfiguration config[5] = {};
+  CanTxScheduler::Packets packets;
+  for (size_t i = 0; i < frames.size(); i++) {
+    packets[frames[i].bus].push_back(i);
+  }
+
+  CanTxScheduler dut;
+  dut.Plan({frames.data(), frames.size()}, config, &packets);
+
+  // Replies first, longest first, then the rest.
+  BOOST_TEST(packets[1] == (std::vector<int>{2, 4, 1, 0}),
+             boost::test_tools::per_element());
+  BOOST_TEST(packets[2] == (std::vector<int>{3}),
+             boost::test_tools::per_element());
+  BOOST_TEST(dut.work_ns(2) ==
+             2 * EstimateCanFrameNs(config[1], frames[3]));
+  BOOST_TEST(dut.work_ns(1) > dut.work_ns(2));
+
+  std::vector<std::pair<int, int>> order;
+  const int buses[] = { 1, 2 };
+  dut.Interleave(packets, buses, 2, 10000,
+                 [&](int bus, int index) { order.push_back({bus, index}); });
+
+  // The busiest bus starts first and the other is started while it
+  // is still transmitting.  After that, bus 1 is fed whenever it is
+  // about to go idle.
+  BOOST_TEST_REQUIRE(order.size() == 5u);
+  BOOST_TEST(order[0].first == 1);
+  BOOST_TEST(order[0].second == 2);
+  BOOST_TEST(order[1].first == 2);
+  for (size_t i = 2; i < order.size(); i++) {
+    BOOST_TEST(order[i].first == 1);
+  }
+
+  BOOST_TEST(dut.Finish(packets, &buses[0], 1, 10000) ==
+             10000 + dut.work_ns(1));
+}
+
+BOOST_AUTO_TEST_CASE(CanTxSchedulerSameIdTest) {
+  // A servo queues what it is sent, so its frames keep their order
+  // even when a later one expects a reply or takes longer.
+  std::vector<CanFrame> frames = {
+    MakeFrame(1, 8, false, 1),
+    MakeFrame(1, 8, true, 1),
+    MakeFrame(1, 64, true, 2),
+    MakeFrame(1, 8, true, 1),
+    MakeFrame(1, 48, true, 1),
+  };
+
+  Pi3Hat::CanConfiguration config[5] = {};
+  CanTxScheduler::Packets packets;
+  for (size_t i = 0; i < frames.size(); i++) {
+    packets[frames[i].bus].push_back(i);
+  }
+
+  CanTxScheduler dut;
+  dut.Plan({frames.data(), frames.size()}, config, &packets);
+
+  BOOST_TEST(packets[1] == (std::vector<int>{2, 0, 1, 3, 4}),
+             boost::test_tools::per_element());
+}
+
+BOOST_AUTO_TEST_CASE(CanTxSchedulerRequiresPlanTest) {
+  // Every Pi3Hat cycle path, sequential, parallel and split-phase,
+  // sorts its frames and then sends them with Interleave and Finish.
+  // Those must refuse to run on packets which were not planned for
+  // this cycle rather than read stale or missing estimates.
+  std::vector<CanFrame> frames = {
+    MakeFrame(1, 8, true, 1),
+    MakeFrame(2, 8, true, 2),
+  };
+
+  Pi3Hat::CanConfiguration config[5] = {};
+  CanTxScheduler::Packets packets;
+  for (size_t i = 0; i < frames.size(); i++) {
+    packets[frames[i].bus].push_back(i);
+  }
+
+  const int buses[] = { 1, 2 };
+  int emitted = 0;
+  const auto emit = [&](int, int) { emitted++; };
+
+  CanTxScheduler dut;
+  BOOST_CHECK_THROW(dut.Interleave(packets, buses, 2, 10000, emit), Error);
+  BOOST_CHECK_THROW(dut.Finish(packets, buses, 2, 10000), Error);
+  BOOST_TEST(emitted == 0);
+
+  dut.Plan({frames.data(), frames.size()}, config, &packets);
+  CanTxScheduler::Packets other;
+  BOOST_CHECK_THROW(dut.Interleave(other, buses, 2, 10000, emit), Error);
+
+  dut.Interleave(packets, buses, 2, 10000, emit);
+  BOOST_TEST(emitted == 2);
+  BOOST_TEST(dut.Finish(packets, buses, 2, 10000) > 0);
+
+  // Starting the next cycle discards the plan.
+  dut.Clear();
+  BOOST_CHECK_THROW(dut.Interleave(packets, buses, 2, 10000, emit), Error);
+  BOOST_TEST(emitted == 2);
+}
@@ -0,0 +1,71 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mjbots/pi3hat/clock_sync.h"
+
+#include <cstdlib>
+#include <random>
+
+#include <boost/test/auto_unit_test.hpp>
+
+using mjbots::pi3hat::ClockSync;
+
+BOOST_AUTO_TEST_CASE(ClockSyncTest) {
+  BOOST_TEST(ClockSync().ToHost(1234) == 0);
+
+  for (const double drift : { -50e-6, 0.0, 50e-6 }) {
+    ClockSync dut;
+    std::mt19937 rng(1);
+    // Most reads are late by up to one 1ms sample period, with an
+    // occasional much larger stall.
+    std::uniform_int_distribution<int64_t> latency_ns(5000, 1000000);
+    std::uniform_int_distribution<int> stall(0, 100);
+
+    const int64_t offset_ns = 123456789000ll;
+    // Start just short of the device clock wrapping.
+    const int64_t device_start_us = 0xffffffffll - 5000000;
+
+    int64_t max_error_ns = 0;
+    for (int64_t i = 0; i < 60000; i++) {
+      const int64_t host_ns = offset_ns + i * 1000000;
+      const int64_t device_us = device_start_us +
+          static_cast<int64_t>((host_ns - offset_ns) * (1.0 + drift)) / 1000;
+
+      const int64_t read_ns = host_ns + latency_ns(rng) +
+          ((stall(rng) == 0) ? 20000000 : 0);
+      dut.Observe(static_cast<uint32_t>(device_us), read_ns);
+
+      if (i > 1000) {
+        const int64_t error_ns =
+            dut.ToHost(static_cast<uint32_t>(device_us)) - host_ns;
+        BOOST_TEST_REQUIRE(error_ns >= 0);
+        max_error_ns = std::max(max_error_ns, error_ns);
+      }
+    }
+    // Even though reads were late by up to 1ms, and occasionally
+    // much more, the estimate stays near the lower envelope.
+    BOOST_TEST(max_error_ns < 100000);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(ClockSyncResetTest) {
+  ClockSync dut;
+  dut.Observe(1000000, 5000000000ll);
+  BOOST_TEST(dut.ToHost(1000000) == 5000000000ll);
+
+  // The device restarted its clock.
+  dut.Observe(100, 5001000000ll);
+  BOOST_TEST(dut.ToHost(100) == 5001000000ll);
+  BOOST_TEST(dut.ToHost(1100) == 5002000000ll);
+}
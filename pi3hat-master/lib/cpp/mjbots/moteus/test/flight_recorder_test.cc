@@ -0,0 +1,115 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mjbots/pi3hat/flight_recorder.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <boost/test/auto_unit_test.hpp>
+
+using namespace mjbots::pi3hat;
+
+namespace {
+std::string TempName() {
+  char name[] = "/tmp/flight_recorder_test_XXXXXX";
+  const int fd = ::mkstemp(name);
+  ::close(fd);
+  return name;
+}
+
+void RecordOne(FlightRecorder* dut, int index) {
+  CanFrame tx;
+  tx.id = 0x8001;
+  tx.bus = 1 + (index % 5);
+  tx.size = 3;
+  tx.data[0] = index & 0xff;
+  tx.expect_reply = true;
+
+  std::vector<CanFrame> rx(2);
+  rx[0].id = 0x100;
+  rx[0].bus = tx.bus;
+  rx[0].size = 12;
+  rx[0].data[11] = index & 0xff;
+
+  Attitude attitude;
+  attitude.attitude.w = index;
+
+  Pi3Hat::Input input;
+  input.tx_can = {&tx, 1};
+  input.rx_can = {rx.data(), rx.size()};
+  input.attitude = &attitude;
+
+  Pi3Hat::Output output;
+  output.rx_can_size = 1;
+  output.attitude_present = true;
+
+  dut->RecordCycle(input, output, index * 1000, index * 1000 + 500);
+}
+}
+
+BOOST_AUTO_TEST_CASE(FlightRecorderRoundTripTest) {
+  const auto filename = TempName();
+  {
+    FlightRecorder::Options options;
+    options.size = 4096;
+    options.lock = false;
+    FlightRecorder dut{filename, options};
+
+    // Each cycle is about 300 bytes, so this wraps several times.
+    for (int i = 0; i < 100; i++) {
+      RecordOne(&dut, i);
+    }
+    const char user[] = "hello";
+    dut.Record(FlightRecorder::kUser, 123, user, sizeof(user));
+  }
+
+  FlightRecordReader reader{filename};
+  FlightRecordReader::Record record;
+
+  std::vector<FlightRecordReader::Record> records;
+  while (reader.Next(&record)) { records.push_back(record); }
+
+  BOOST_TEST_REQUIRE(records.size() > 5);
+  BOOST_TEST(records.size() < 20);
+
+  // They are contiguous and end with the most recent.
+  for (size_t i = 1; i < records.size(); i++) {
+    BOOST_TEST(records[i].header.sequence ==
+               records[i - 1].header.sequence + 1);
+  }
+  BOOST_TEST(records.back().header.type == FlightRecorder::kUser);
+  BOOST_TEST(records.back().header.sequence == 100);
+  BOOST_TEST(std::string(
+      reinterpret_cast<const char*>(records.back().data.data())) == "hello");
+
+  const auto& last_cycle = records[records.size() - 2];
+  FlightRecordReader::Cycle cycle;
+  BOOST_TEST_REQUIRE(FlightRecordReader::ParseCycle(last_cycle, &cycle));
+  BOOST_TEST(cycle.header.start_ns == 99000);
+  BOOST_TEST(cycle.header.end_ns == 99500);
+  BOOST_TEST(cycle.header.attitude_present == 1);
+  BOOST_TEST(cycle.header.attitude.attitude.w == 99.0);
+  BOOST_TEST_REQUIRE(cycle.tx_can.size() == 1);
+  BOOST_TEST(cycle.tx_can[0].id == 0x8001);
+  BOOST_TEST(cycle.tx_can[0].bus == 5);
+  BOOST_TEST(cycle.tx_can[0].size == 3);
+  BOOST_TEST(cycle.tx_can[0].data[0] == 99);
+  BOOST_TEST(cycle.tx_can[0].expect_reply);
+  BOOST_TEST_REQUIRE(cycle.rx_can.size() == 1);
+  BOOST_TEST(cycle.rx_can[0].size == 12);
+  BOOST_TEST(cycle.rx_can[0].data[11] == 99);
+
+  ::unlink(filename.c_str());
+}
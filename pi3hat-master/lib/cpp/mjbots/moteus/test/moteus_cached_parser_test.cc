@@ -0,0 +1,100 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mjbots/moteus/moteus_cached_parser.h"
+
+#include <boost/test/auto_unit_test.hpp>
+
+using namespace mjbots::moteus;
+
+namespace {
+// A reply to the default QueryCommand.
+CanFrame MakeReply(int16_t position, int8_t voltage) {
+  CanFrame result;
+  WriteCanFrame writer{&result};
+  writer.Write<int8_t>(0x24);  // int16 x4
+  writer.Write<int8_t>(4);
+  writer.Write<int8_t>(0x00);  // mode
+  writer.Write<int16_t>(10);
+  writer.Write<int16_t>(position);
+  writer.Write<int16_t>(-200);
+  writer.Write<int16_t>(50);
+  writer.Write<int8_t>(0x23);  // int8 x3
+  writer.Write<int8_t>(0x0d);  // voltage
+  writer.Write<int8_t>(voltage);
+  writer.Write<int8_t>(60);
+  writer.Write<int8_t>(0);
+  return result;
+}
+
+bool Same(double a, double b) {
+  return a == b || (std::isnan(a) && std::isnan(b));
+}
+
+void CheckSame(const QueryResult& a, const QueryResult& b) {
+  BOOST_TEST(static_cast<int>(a.mode) == static_cast<int>(b.mode));
+  BOOST_TEST(Same(a.position, b.position));
+  BOOST_TEST(Same(a.velocity, b.velocity));
+  BOOST_TEST(Same(a.torque, b.torque));
+  BOOST_TEST(Same(a.voltage, b.voltage));
+  BOOST_TEST(Same(a.temperature, b.temperature));
+  BOOST_TEST(a.fault == b.fault);
+}
+}
+
+BOOST_AUTO_TEST_CASE(CachedQueryParserTest) {
+  CachedQueryParser dut;
+  dut.Learn(QueryCommand());
+  BOOST_TEST(dut.learned());
+
+  const auto f1 = MakeReply(1234, 24);
+  BOOST_TEST(dut.Matches(f1.data, f1.size));
+  CheckSame(dut.Parse(f1.data, f1.size), ParseQueryResult(f1.data, f1.size));
+
+  const auto f2 = MakeReply(-32768, 30);
+  const auto r2 = dut.Parse(f2.data, f2.size);
+  CheckSame(r2, ParseQueryResult(f2.data, f2.size));
+  BOOST_TEST(std::isnan(r2.position));
+
+  // A different layout is re-learned.
+  CanFrame f3;
+  {
+    WriteCanFrame writer{&f3};
+    writer.Write<int8_t>(0x2d);  // float x1
+    writer.Write<int8_t>(0x01);  // position
+    writer.Write<float>(2.5f);
+  }
+  BOOST_TEST(!dut.Matches(f3.data, f3.size));
+  const auto r3 = dut.Parse(f3.data, f3.size);
+  BOOST_TEST(r3.position == 2.5);
+  BOOST_TEST(std::isnan(r3.velocity));
+}
+
+BOOST_AUTO_TEST_CASE(CachedQueryParserSoaTest) {
+  CachedQueryParser dut;
+  QueryResultSoa soa;
+  soa.resize(2);
+
+  const auto f1 = MakeReply(1000, 24);
+  const auto f2 = MakeReply(2000, 25);
+  dut.Parse(f1.data, f1.size, &soa, 0);
+  dut.Parse(f2.data, f2.size, &soa, 1);
+
+  BOOST_TEST(soa.mode[0] == 10);
+  BOOST_TEST(soa.position[0] == 0.1f);
+  BOOST_TEST(soa.position[1] == 0.2f);
+  BOOST_TEST(soa.voltage[1] == 12.5f);
+  BOOST_TEST(soa.temperature[0] == 60.0f);
+  BOOST_TEST(std::isnan(soa.q_current[0]));
+}
@@ -0,0 +1,103 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mjbots/moteus/moteus_fixed_encoder.h"
+
+#include <string>
+
+#include <boost/test/auto_unit_test.hpp>
+
+using namespace mjbots::moteus;
+
+namespace {
+constexpr PositionResolution kDefaultRes;
+constexpr QueryCommand kDefaultQuery;
+
+constexpr PositionResolution MakeMixedRes() {
+  PositionResolution res;
+  res.position = Resolution::kInt16;
+  res.velocity = Resolution::kInt16;
+  res.feedforward_torque = Resolution::kInt16;
+  res.kp_scale = Resolution::kInt16;
+  res.kd_scale = Resolution::kInt8;
+  res.maximum_torque = Resolution::kIgnore;
+  res.stop_position = Resolution::kIgnore;
+  res.watchdog_timeout = Resolution::kInt32;
+  return res;
+}
+
+constexpr QueryCommand MakeMixedQuery() {
+  QueryCommand query;
+  query.torque = Resolution::kFloat;
+  query.q_current = Resolution::kInt8;
+  query.rezero_state = Resolution::kInt8;
+  query.voltage = Resolution::kIgnore;
+  return query;
+}
+
+constexpr PositionResolution kMixedRes = MakeMixedRes();
+constexpr QueryCommand kMixedQuery = MakeMixedQuery();
+
+std::string Hex(const CanFrame& frame) {
+  const char* digits = "0123456789abcdef";
+  std::string result;
+  for (int i = 0; i < frame.size; i++) {
+    result += digits[frame.data[i] >> 4];
+    result += digits[frame.data[i] & 0x0f];
+  }
+  return result;
+}
+
+template <const PositionResolution& Res, const QueryCommand& Query>
+void CheckMatches() {
+  using Encoder = FixedCommandEncoder<Res, Query>;
+
+  PositionCommand pos;
+  pos.position = 1.25;
+  pos.velocity = -0.5;
+  pos.feedforward_torque = 0.75;
+  pos.kp_scale = 0.8;
+  pos.kd_scale = 0.3;
+  pos.maximum_torque = 2.0;
+  pos.watchdog_timeout = 0.1;
+
+  CanFrame expected;
+  {
+    WriteCanFrame writer{&expected};
+    EmitPositionCommand(&writer, pos, Res);
+    EmitQueryCommand(&writer, Query);
+  }
+  CanFrame actual;
+  Encoder::EncodePosition(pos, &actual);
+  BOOST_TEST(Hex(actual) == Hex(expected));
+
+  CanFrame expected_stop;
+  {
+    WriteCanFrame writer{&expected_stop};
+    EmitStopCommand(&writer);
+    EmitQueryCommand(&writer, Query);
+  }
+  CanFrame actual_stop;
+  Encoder::EncodeStop(&actual_stop);
+  BOOST_TEST(Hex(actual_stop) == Hex(expected_stop));
+}
+}
+
+BOOST_AUTO_TEST_CASE(FixedCommandEncoderDefaultTest) {
+  CheckMatches<kDefaultRes, kDefaultQuery>();
+}
+
+BOOST_AUTO_TEST_CASE(FixedCommandEncoderMixedTest) {
+  CheckMatches<kMixedRes, kMixedQuery>();
+}
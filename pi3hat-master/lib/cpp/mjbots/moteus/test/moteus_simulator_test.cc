@@ -0,0 +1,522 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mjbots/moteus/moteus_simulator.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+
+#include <boost/test/auto_unit_test.hpp>
+
+#include "mjbots/pi3hat/multi_transport.h"
+
+#include "mjbots/moteus/pi3hat_moteus_interface.h"
+
+using namespace mjbots;
+using namespace mjbots::moteus;
+
+using Interface = Pi3HatMoteusInterface;
+
+namespace {
+std::vector<Interface::ServoCommand> MakeCommands() {
+  std::vector<Interface::ServoCommand> result(2);
+  result[0].id = 1;
+  result[0].bus = 1;
+  result[0].mode = Mode::kPosition;
+  result[0].position.position = 0.5;
+  result[0].position.velocity = 0.0;
+
+  result[1].id = 2;
+  result[1].bus = 2;
+  return result;
+}
+}
+
+BOOST_AUTO_TEST_CASE(SimulatedMoteusTransportTest) {
+  SimulatedMoteusTransport dut;
+
+  auto commands = MakeCommands();
+  std::vector<Interface::ServoReply> replies(commands.size());
+  Interface::Data data;
+  data.commands = {commands.data(), commands.size()};
+  data.replies = {replies.data(), replies.size()};
+
+  Interface::CycleBuffers buffers;
+
+  // Several seconds of simulated time pass in much less real time.
+  auto output = Interface::ExecuteCycle(&dut, data, &buffers);
+  for (int i = 0; i < 20000; i++) {
+    output = Interface::ExecuteCycle(&dut, data, &buffers);
+  }
+  BOOST_TEST(dut.now_ns() == 20001ll * 130000);
+
+  BOOST_TEST_REQUIRE(output.query_result_size == 2);
+  BOOST_TEST(replies[0].id == 1);
+  BOOST_TEST(replies[0].bus == 1);
+  BOOST_TEST(static_cast<int>(replies[0].result.mode) ==
+             static_cast<int>(Mode::kPosition));
+  BOOST_TEST(std::abs(replies[0].result.position - 0.5) < 0.01);
+  BOOST_TEST(replies[0].result.voltage == 24.0);
+  BOOST_TEST(replies[1].id == 2);
+  BOOST_TEST(static_cast<int>(replies[1].result.mode) ==
+             static_cast<int>(Mode::kStopped));
+  BOOST_TEST(replies[1].result.position == 0.0);
+
+  BOOST_TEST(dut.servo(1, 1).position == replies[0].result.position,
+             boost::test_tools::tolerance(0.001));
+
+  // Replies which could not arrive within the timeout are lost.
+  pi3hat::CanFrame tx[3];
+  pi3hat::CanFrame rx[3];
+  for (auto& frame : tx) { Interface::EncodeCommand(commands[1], &frame); }
+  pi3hat::Pi3Hat::Input input;
+  input.tx_can = {tx, 3};
+  input.rx_can = {rx, 3};
+  input.timeout_ns = 170000;
+  BOOST_TEST(dut.Cycle(input).rx_can_size == 2);
+}
+
+BOOST_AUTO_TEST_CASE(ReplayTransportTest) {
+  char name[] = "/tmp/replay_transport_test_XXXXXX";
+  ::close(::mkstemp(name));
+
+  auto commands = MakeCommands();
+  std::vector<Interface::ServoReply> replies(commands.size());
+  Interface::Data data;
+  data.commands = {commands.data(), commands.size()};
+  data.replies = {replies.data(), replies.size()};
+  Interface::CycleBuffers buffers;
+
+  // Record a simulated session, then play it back.
+  {
+    pi3hat::FlightRecorder::Options options;
+    options.size = 1 << 20;
+    options.lock = false;
+    pi3hat::FlightRecorder recorder{name, options};
+
+    SimulatedMoteusTransport sim;
+    for (int i = 0; i < 10; i++) {
+      const int64_t start = sim.now_ns();
+      Interface::ExecuteCycle(&sim, data, &buffers);
+
+      pi3hat::Pi3Hat::Input input;
+      input.tx_can = {buffers.tx_can.data(), buffers.tx_can.size()};
+      input.rx_can = {buffers.rx_can.data(), buffers.rx_can.size()};
+      pi3hat::Pi3Hat::Output output;
+      output.rx_can_size = 2;
+      recorder.RecordCycle(input, output, start, sim.now_ns());
+    }
+  }
+
+  const double recorded_position = replies[0].result.position;
+  replies[0] = {};
+
+  pi3hat::ReplayTransport dut{name};
+  for (int i = 0; i < 9; i++) {
+    const auto output = Interface::ExecuteCycle(&dut, data, &buffers);
+    BOOST_TEST(output.query_result_size == 2);
+  }
+  BOOST_TEST(dut.tx_mismatches() == 0);
+
+  // A changed command is noticed, but the recorded replies are
+  // still returned.
+  commands[1].mode = Mode::kZeroVelocity;
+  Interface::ExecuteCycle(&dut, data, &buffers);
+  BOOST_TEST(dut.tx_mismatches() == 1);
+  BOOST_TEST(dut.cycles() == 10);
+  BOOST_TEST(dut.now_ns() == 10 * 130000);
+  BOOST_TEST(replies[0].result.position == recorded_position);
+
+  BOOST_TEST(!dut.finished());
+  const auto output = Interface::ExecuteCycle(&dut, data, &buffers);
+  BOOST_TEST(output.query_result_size == 0);
+  BOOST_TEST(dut.finished());
+
+  ::unlink(name);
+}
+
+BOOST_AUTO_TEST_CASE(MultiTransportTest) {
+  // Long cycles let the servo settle in fewer of them.
+  SimulatedMoteusTransport::Options sim_options;
+  sim_options.cycle_ns = 1000000;
+  SimulatedMoteusTransport sim1{sim_options};
+  SimulatedMoteusTransport sim2{sim_options};
+
+  pi3hat::MultiTransport::Options options;
+  options.devices.resize(2);
+  options.devices[0].transport = &sim1;
+  options.devices[0].primary = true;
+  options.devices[1].transport = &sim2;
+  options.devices[1].bus_offset = 5;
+  options.devices[1].bus_count = 4;
+  options.devices[1].own_thread = true;
+  pi3hat::MultiTransport dut{options};
+
+  std::vector<Interface::ServoCommand> commands(3);
+  commands[0].id = 1;
+  commands[0].bus = 2;
+  commands[1].id = 2;
+  commands[1].bus = 7;
+  commands[2].id = 3;
+  commands[2].bus = 7;
+  commands[2].mode = Mode::kPosition;
+  commands[2].position.position = 0.25;
+  std::vector<Interface::ServoReply> replies(commands.size());
+
+  Interface::Data data;
+  data.commands = {commands.data(), commands.size()};
+  data.replies = {replies.data(), replies.size()};
+  data.fixed_servos = true;
+  Interface::CycleBuffers buffers;
+
+  for (int i = 0; i < 2000; i++) {
+    const auto output = Interface::ExecuteCycle(&dut, data, &buffers);
+    BOOST_TEST_REQUIRE(output.query_result_size == 3);
+  }
+  BOOST_TEST(replies[2].bus == 7);
+  BOOST_TEST(replies[2].updated);
+  BOOST_TEST(std::abs(replies[2].result.position - 0.25) < 0.05);
+
+  // Each device only saw its own buses, with local numbering.
+  BOOST_TEST((sim1.servo(2, 1).mode == Mode::kStopped));
+  BOOST_TEST(std::abs(sim2.servo(2, 3).position - 0.25) < 0.05);
+  BOOST_TEST(sim1.servo(2, 3).position == 0.0);
+  BOOST_TEST(dut.unrouted_frames() == 0);
+}
+
+namespace {
+/// Fails every cycle while 'fail' is set.
+class FailingTransport : public pi3hat::Transport {
+ public:
+  FailingTransport(pi3hat::Transport* base) : base_(base) {}
+
+  pi3hat::Pi3Hat::Output Cycle(const pi3hat::Pi3Hat::Input& input) override {
+    if (fail) { throw pi3hat::Error("device failed"); }
+    return base_->Cycle(input);
+  }
+
+  int64_t now_ns() override { return base_->now_ns(); }
+
+  bool fail = false;
+
+ private:
+  pi3hat::Transport* const base_;
+};
+}
+
+BOOST_AUTO_TEST_CASE(MultiTransportErrorTest) {
+  SimulatedMoteusTransport sim1;
+  SimulatedMoteusTransport sim2;
+  FailingTransport failing{&sim2};
+
+  pi3hat::MultiTransport::Options options;
+  options.devices.resize(2);
+  options.devices[0].transport = &sim1;
+  options.devices[1].transport = &failing;
+  options.devices[1].bus_offset = 5;
+  options.devices[1].own_thread = true;
+  pi3hat::MultiTransport dut{options};
+
+  std::vector<Interface::ServoCommand> commands(2);
+  commands[0].id = 1;
+  commands[0].bus = 1;
+  commands[1].id = 2;
+  commands[1].bus = 6;
+  std::vector<Interface::ServoReply> replies(commands.size());
+
+  Interface::Data data;
+  data.commands = {commands.data(), commands.size()};
+  data.replies = {replies.data(), replies.size()};
+  Interface::CycleBuffers buffers;
+
+  // An error on a device's own thread reaches the caller, and the
+  // thread keeps working afterwards.
+  failing.fail = true;
+  BOOST_CHECK_THROW(Interface::ExecuteCycle(&dut, data, &buffers),
+                    pi3hat::Error);
+  BOOST_CHECK_THROW(Interface::ExecuteCycle(&dut, data, &buffers),
+                    pi3hat::Error);
+
+  failing.fail = false;
+  const auto output = Interface::ExecuteCycle(&dut, data, &buffers);
+  BOOST_TEST(output.query_result_size == 2);
+}
+
+namespace {
+/// Returns the replies of each cycle in reverse order, plus one from
+/// a servo nothing addressed.
+class ShuffledReplyTransport : public pi3hat::Transport {
+ public:
+  ShuffledReplyTransport(pi3hat::Transport* base) : base_(base) {}
+
+  pi3hat::Pi3Hat::Output Cycle(const pi3hat::Pi3Hat::Input& input) override {
+    auto result = base_->Cycle(input);
+    std::reverse(input.rx_can.data(), input.rx_can.data() + result.rx_can_size);
+    if (result.rx_can_size < input.rx_can.size()) {
+      auto& stray = input.rx_can[result.rx_can_size++];
+      stray = input.rx_can[0];
+      stray.id = (9 << 8) | 0x7f;
+      stray.bus = 1;
+    }
+    return result;
+  }
+
+  int64_t now_ns() override { return base_->now_ns(); }
+
+ private:
+  pi3hat::Transport* const base_;
+};
+}
+
+BOOST_AUTO_TEST_CASE(FixedServosReorderTest) {
+  SimulatedMoteusTransport sim;
+  ShuffledReplyTransport dut{&sim};
+
+  std::vector<Interface::ServoCommand> commands(3);
+  commands[0].id = 3;
+  commands[0].bus = 2;
+  commands[1].id = 1;
+  commands[1].bus = 1;
+  commands[2].id = 2;
+  commands[2].bus = 1;
+  for (size_t i = 0; i < commands.size(); i++) {
+    sim.servo(commands[i].bus, commands[i].id).position = 0.1 * (i + 1);
+  }
+  std::vector<Interface::ServoReply> replies(commands.size());
+
+  Interface::Data data;
+  data.commands = {commands.data(), commands.size()};
+  data.replies = {replies.data(), replies.size()};
+  data.fixed_servos = true;
+  Interface::CycleBuffers buffers;
+
+  for (int cycle = 0; cycle < 3; cycle++) {
+    const auto output = Interface::ExecuteCycle(&dut, data, &buffers);
+    // The stray reply is dropped, not parsed into some other slot.
+    BOOST_TEST(output.query_result_size == commands.size());
+    for (size_t i = 0; i < commands.size(); i++) {
+      BOOST_TEST(replies[i].id == commands[i].id);
+      BOOST_TEST(replies[i].bus == commands[i].bus);
+      BOOST_TEST(replies[i].updated);
+      BOOST_TEST(std::abs(replies[i].result.position - 0.1 * (i + 1)) < 1e-3);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(GroupCommandsTest) {
+  QueryCommand no_query;
+  no_query.mode = Resolution::kIgnore;
+  no_query.position = Resolution::kIgnore;
+  no_query.velocity = Resolution::kIgnore;
+  no_query.torque = Resolution::kIgnore;
+  no_query.voltage = Resolution::kIgnore;
+  no_query.temperature = Resolution::kIgnore;
+  no_query.fault = Resolution::kIgnore;
+
+  std::vector<Interface::ServoCommand> commands(5);
+  for (size_t i = 0; i < commands.size(); i++) {
+    auto& cmd = commands[i];
+    cmd.id = i + 1;
+    cmd.bus = i < 3 ? 1 : 2;
+    cmd.mode = Mode::kPosition;
+    cmd.position.position = 0.25;
+    cmd.query = no_query;
+  }
+  // Bus 2 needs individual frames, since one servo there is queried.
+  commands[4].query = QueryCommand();
+
+  pi3hat::CanFrame tx[5];
+  BOOST_TEST(Interface::EncodeGroupedCommands(
+      {commands.data(), commands.size()}, tx) == 3);
+  BOOST_TEST(tx[0].id == static_cast<uint32_t>(kBroadcastId));
+  BOOST_TEST(tx[0].bus == 1);
+  BOOST_TEST(!tx[0].expect_reply);
+  BOOST_TEST(tx[1].id == 4);
+  BOOST_TEST(tx[2].id == 0x8005);
+
+  // Any difference on a bus means nothing there is grouped.
+  commands[2].position.position = 0.5;
+  BOOST_TEST(Interface::EncodeGroupedCommands(
+      {commands.data(), commands.size()}, tx) == 5);
+  commands[2].position.position = 0.25;
+
+  // Every servo on the bus acts on the broadcast.
+  SimulatedMoteusTransport sim;
+  for (const auto& cmd : commands) { sim.servo(cmd.bus, cmd.id); }
+  std::vector<Interface::ServoReply> replies(commands.size());
+  Interface::Data data;
+  data.commands = {commands.data(), commands.size()};
+  data.replies = {replies.data(), replies.size()};
+  data.group_commands = true;
+  Interface::CycleBuffers buffers;
+  for (int i = 0; i < 2000; i++) {
+    Interface::ExecuteCycle(&sim, data, &buffers);
+  }
+  for (const auto& cmd : commands) {
+    BOOST_TEST(std::abs(sim.servo(cmd.bus, cmd.id).position - 0.25) < 0.05);
+  }
+
+  data.fixed_servos = true;
+  BOOST_CHECK_THROW(Interface::ExecuteCycle(&sim, data, &buffers),
+                    std::logic_error);
+}
+
+namespace {
+/// Records how many frames of each cycle carried a full command,
+/// rather than only a query.
+class CommandCountingTransport : public pi3hat::Transport {
+ public:
+  CommandCountingTransport(pi3hat::Transport* base) : base_(base) {}
+
+  pi3hat::Pi3Hat::Output Cycle(const pi3hat::Pi3Hat::Input& input) override {
+    int commands = 0;
+    for (const auto& frame : input.tx_can) {
+      if (frame.size > 0 && frame.data[0] == (Multiplex::kWriteInt8 | 0x01)) {
+        commands++;
+      }
+    }
+    full_commands.push_back(commands);
+    return base_->Cycle(input);
+  }
+
+  int64_t now_ns() override { return base_->now_ns(); }
+
+  std::vector<int> full_commands;
+
+ private:
+  pi3hat::Transport* const base_;
+};
+}
+
+BOOST_AUTO_TEST_CASE(UnchangedKeepaliveTest) {
+  SimulatedMoteusTransport sim;
+  CommandCountingTransport dut{&sim};
+
+  std::vector<Interface::ServoCommand> commands(1);
+  commands[0].id = 1;
+  commands[0].mode = Mode::kPosition;
+  commands[0].position.position = 0.25;
+  std::vector<Interface::ServoReply> replies(commands.size());
+
+  Interface::Data data;
+  data.commands = {commands.data(), commands.size()};
+  data.replies = {replies.data(), replies.size()};
+  data.fixed_servos = true;
+  data.unchanged_keepalive_ns = 1000000;
+  Interface::CycleBuffers buffers;
+
+  // Each simulated cycle takes 130us, so the full command is resent
+  // on the first cycle at or after 1ms.  Every cycle is still queried.
+  for (int i = 0; i < 9; i++) {
+    const auto output = Interface::ExecuteCycle(&dut, data, &buffers);
+    BOOST_TEST(output.query_result_size == 1);
+    BOOST_TEST(replies[0].updated);
+  }
+  const std::vector<int> expected = {1, 0, 0, 0, 0, 0, 0, 0, 1};
+  BOOST_TEST(dut.full_commands == expected, boost::test_tools::per_element());
+
+  // A change is sent straight away.
+  dut.full_commands.clear();
+  commands[0].position.position = 0.5;
+  Interface::ExecuteCycle(&dut, data, &buffers);
+  Interface::ExecuteCycle(&dut, data, &buffers);
+  BOOST_TEST(dut.full_commands == (std::vector<int>{1, 0}),
+             boost::test_tools::per_element());
+
+  // A short watchdog brings the keepalive forward.
+  dut.full_commands.clear();
+  commands[0].position.watchdog_timeout = 0.0005;
+  for (int i = 0; i < 5; i++) {
+    Interface::ExecuteCycle(&dut, data, &buffers);
+  }
+  BOOST_TEST(dut.full_commands == (std::vector<int>{1, 0, 1, 0, 1}),
+             boost::test_tools::per_element());
+
+  // With the default watchdog_timeout of 0, or none sent at all, the
+  // servo uses its own 100ms watchdog, so a long keepalive is cut to
+  // 50ms.  At 130us per cycle, that is every 385 cycles.
+  data.unchanged_keepalive_ns = 1000000000;
+  for (int ignore = 0; ignore < 2; ignore++) {
+    commands[0].position.watchdog_timeout = ignore ? 1.0 : 0.0;
+    commands[0].resolution.watchdog_timeout =
+        ignore ? Resolution::kIgnore : Resolution::kFloat;
+    dut.full_commands.clear();
+    for (int i = 0; i < 1000; i++) {
+      Interface::ExecuteCycle(&dut, data, &buffers);
+    }
+    std::vector<int> full_cycles;
+    for (size_t i = 0; i < dut.full_commands.size(); i++) {
+      if (dut.full_commands[i]) { full_cycles.push_back(i); }
+    }
+    BOOST_TEST(full_cycles == (std::vector<int>{0, 385, 770}),
+               boost::test_tools::per_element());
+  }
+
+  // The servo kept following the command throughout.
+  for (int i = 0; i < 2000; i++) {
+    Interface::ExecuteCycle(&dut, data, &buffers);
+  }
+  BOOST_TEST(std::abs(sim.servo(1, 1).position - 0.5) < 0.05);
+
+  data.fixed_servos = false;
+  BOOST_CHECK_THROW(Interface::ExecuteCycle(&dut, data, &buffers),
+                    std::logic_error);
+}
+
+BOOST_AUTO_TEST_CASE(QueryDivisorTest) {
+  SimulatedMoteusTransport dut;
+
+  std::vector<Interface::ServoCommand> commands(2);
+  for (size_t i = 0; i < commands.size(); i++) {
+    commands[i].id = i + 1;
+    commands[i].query.divisor.voltage = 4;
+    commands[i].query.divisor.temperature = 4;
+    commands[i].query.divisor.fault = 4;
+  }
+  std::vector<Interface::ServoReply> replies(commands.size());
+
+  Interface::Data data;
+  data.commands = {commands.data(), commands.size()};
+  data.replies = {replies.data(), replies.size()};
+  data.fixed_servos = true;
+  Interface::CycleBuffers buffers;
+
+  std::vector<int> sizes;
+  for (int i = 0; i < 8; i++) {
+    const auto output = Interface::ExecuteCycle(&dut, data, &buffers);
+    BOOST_TEST(output.query_result_size == 2);
+    sizes.push_back(buffers.tx_can[0].size);
+
+    // The slow registers hold their last value in between reads.
+    if (i >= 3) {
+      for (const auto& reply : replies) {
+        BOOST_TEST(reply.result.voltage == 24.0);
+        BOOST_TEST(reply.result.temperature == 30.0);
+      }
+    }
+  }
+  BOOST_TEST(sizes[0] > sizes[1]);
+  BOOST_TEST(sizes[1] == sizes[2]);
+  BOOST_TEST(sizes[4] == sizes[0]);
+
+  // The second servo's slow registers are read on other cycles.
+  BOOST_TEST(buffers.tx_can[1].size == sizes[0]);
+
+  data.fixed_servos = false;
+  BOOST_CHECK_THROW(Interface::ExecuteCycle(&dut, data, &buffers),
+                    std::logic_error);
+}
@@ -0,0 +1,90 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mjbots/moteus/periodic_executor.h"
+
+#include <chrono>
+#include <thread>
+
+#include <boost/test/auto_unit_test.hpp>
+
+using namespace mjbots::moteus;
+
+BOOST_AUTO_TEST_CASE(PeriodicExecutorTest) {
+  PeriodicExecutor::Options options;
+  options.period_ns = 2000000;
+  options.phase_ns = 300000;
+  options.spin_ns = 50000;
+  PeriodicExecutor dut{options};
+
+  BOOST_TEST(dut.Wait() == 0);
+  const auto first = dut.deadline_ns();
+  BOOST_TEST(first % options.period_ns == options.phase_ns);
+  BOOST_TEST(PeriodicExecutor::NowNs() >= first);
+
+  // A loaded machine may still overrun a period here and there, but
+  // every deadline remains on the original grid.
+  auto expected = first;
+  uint64_t overruns = 0;
+  for (int i = 1; i < 5; i++) {
+    const int skipped = dut.Wait();
+    if (skipped) { overruns++; }
+    expected += (skipped + 1) * options.period_ns;
+    BOOST_TEST(dut.deadline_ns() == expected);
+  }
+  BOOST_TEST(dut.stats().cycles == 5u);
+  BOOST_TEST(dut.stats().overruns == overruns);
+  BOOST_TEST(dut.stats().min_margin_ns <= dut.stats().max_margin_ns);
+  BOOST_TEST(dut.stats().max_margin_ns <= options.period_ns);
+  BOOST_TEST(dut.stats().max_latency_ns >= 0);
+
+  // A long cycle skips the deadlines it missed, but stays in phase.
+  dut.ResetStats();
+  const auto before = dut.deadline_ns();
+  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  const int skipped = dut.Wait();
+  BOOST_TEST(skipped >= 2);
+  BOOST_TEST(dut.deadline_ns() == before + (skipped + 1) * options.period_ns);
+  BOOST_TEST(dut.stats().overruns == 1u);
+  BOOST_TEST(dut.stats().skipped == static_cast<uint64_t>(skipped));
+}
+
+BOOST_AUTO_TEST_CASE(PeriodicExecutorAlignTest) {
+  PeriodicExecutor::Options options;
+  options.period_ns = 1000000;
+  PeriodicExecutor dut{options};
+
+  dut.Wait();
+  const auto before = dut.deadline_ns();
+
+  // Align to an arbitrary reference; the next period is stretched.
+  dut.AlignTo(123456789, 200000);
+  const int skipped = dut.Wait();
+  const auto after = dut.deadline_ns();
+  BOOST_TEST(after % options.period_ns == 123656789 % options.period_ns);
+  const auto stretch = after - before - skipped * options.period_ns;
+  BOOST_TEST(stretch >= options.period_ns);
+  BOOST_TEST(stretch < 2 * options.period_ns);
+
+  const int skipped2 = dut.Wait();
+  BOOST_TEST(dut.deadline_ns() ==
+             after + (skipped2 + 1) * options.period_ns);
+
+  PeriodicExecutor::Options bad;
+  bad.period_ns = 0;
+  BOOST_CHECK_THROW(PeriodicExecutor{bad}, std::invalid_argument);
+  bad.period_ns = 1000;
+  bad.spin_ns = 2000;
+  BOOST_CHECK_THROW(PeriodicExecutor{bad}, std::invalid_argument);
+}
@@ -0,0 +1,264 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mjbots/moteus/pi3hat_moteus_spsc_interface.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/test/auto_unit_test.hpp>
+
+#include "mjbots/moteus/moteus_simulator.h"
+
+using namespace mjbots;
+using namespace mjbots::moteus;
+
+namespace {
+// Each interface is given a nullptr HardwareFactory, so that only the
+// simulated transports are used and libpi3hat is not needed.
+using Interface = Pi3HatMoteusSpscInterface;
+
+/// Counts the position commands, and the voltage queries, in each
+/// cycle.
+class CountingTransport : public pi3hat::Transport {
+ public:
+  CountingTransport(pi3hat::Transport* base) : base_(base) {
+    full_commands.reserve(1000);
+    voltage_queries.reserve(1000);
+  }
+
+  pi3hat::Pi3Hat::Output Cycle(const pi3hat::Pi3Hat::Input& input) override {
+    int commands = 0;
+    int voltages = 0;
+    for (const auto& frame : input.tx_can) {
+      if (frame.size > 0 && frame.data[0] == (Multiplex::kWriteInt8 | 0x01)) {
+        commands++;
+      }
+      // A read of a register range starting at the voltage.  Nothing
+      // else in these frames looks like one.
+      for (size_t i = 0; i + 1 < frame.size; i++) {
+        if ((frame.data[i] & 0xf0) == Multiplex::kReadBase &&
+            frame.data[i + 1] == Register::kVoltage) {
+          voltages++;
+        }
+      }
+    }
+    full_commands.push_back(commands);
+    voltage_queries.push_back(voltages);
+    return base_->Cycle(input);
+  }
+
+  int64_t now_ns() override { return base_->now_ns(); }
+
+  std::vector<int> full_commands;
+  std::vector<int> voltage_queries;
+
+ private:
+  pi3hat::Transport* const base_;
+};
+
+std::string TempName() {
+  char name[] = "/tmp/pi3hat_moteus_spsc_interface_test_XXXXXX";
+  const int fd = ::mkstemp(name);
+  ::close(fd);
+  return name;
+}
+
+int Sum(const std::vector<int>& values) {
+  int result = 0;
+  for (const auto value : values) { result += value; }
+  return result;
+}
+}
+
+BOOST_AUTO_TEST_CASE(SpscSlotsShareServoStateTest) {
+  SimulatedMoteusTransport sim;
+  CountingTransport counter{&sim};
+
+  Interface::Options options;
+  options.cpu = 0;
+  options.slots = 2;
+  options.spin = false;
+  options.transport = &counter;
+  Interface dut{options, nullptr};
+
+  // Each slot has its own storage, listing the same servo.
+  std::vector<Interface::ServoCommand> commands[2];
+  std::vector<Interface::ServoReply> replies[2];
+  Interface::Data data[2];
+  for (int i = 0; i < 2; i++) {
+    commands[i].resize(1);
+    commands[i][0].id = 1;
+    commands[i][0].mode = Mode::kPosition;
+    commands[i][0].position.position = 0.5;
+    commands[i][0].query.divisor.voltage = 3;
+    replies[i].resize(1);
+    data[i].commands = {commands[i].data(), commands[i].size()};
+    data[i].replies = {replies[i].data(), replies[i].size()};
+    data[i].fixed_servos = true;
+    data[i].unchanged_keepalive_ns = 20000000;
+  }
+
+  // Keep both slots busy for 100 cycles, of 130us each.
+  const int kCycles = 100;
+  int submitted = 0;
+  while (submitted < kCycles) {
+    while (dut.ready() && submitted < kCycles) {
+      dut.Cycle(data[submitted % 2]);
+      submitted++;
+    }
+    const auto output = dut.Wait();
+    BOOST_TEST(output.query_result_size == 1u);
+  }
+  while (dut.outstanding()) { dut.Wait(); }
+
+  BOOST_TEST_REQUIRE(counter.full_commands.size() == size_t(kCycles));
+
+  // The command is sent in full once, not once per slot, and is kept
+  // alive at the requested rate.
+  BOOST_TEST(counter.full_commands[0] == 1);
+  BOOST_TEST(counter.full_commands[1] == 0);
+  BOOST_TEST(Sum(counter.full_commands) == 1);
+
+  // The voltage is read every 3rd cycle, not every 3rd use of a slot.
+  BOOST_TEST(Sum(counter.voltage_queries) == (kCycles + 2) / 3);
+
+  for (int i = 0; i < 2; i++) {
+    BOOST_TEST(replies[i][0].id == 1);
+    BOOST_TEST(replies[i][0].bus == 1);
+    BOOST_TEST(replies[i][0].result.voltage == 24.0);
+    BOOST_TEST(replies[i][0].result.position > 0.0);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(SpscCycleTest) {
+  SimulatedMoteusTransport sim;
+
+  Interface::Options options;
+  options.cpu = 0;
+  options.spin = false;
+  options.max_commands = 2;
+  options.transport = &sim;
+  Interface dut{options, nullptr};
+
+  std::vector<Interface::ServoCommand> commands(2);
+  commands[0].id = 1;
+  commands[0].mode = Mode::kPosition;
+  commands[0].position.position = 0.5;
+  commands[1].id = 2;
+  commands[1].bus = 2;
+  std::vector<Interface::ServoReply> replies(4);
+
+  Interface::Data data;
+  data.commands = {commands.data(), commands.size()};
+  data.replies = {replies.data(), replies.size()};
+
+  BOOST_TEST(dut.ready());
+  BOOST_TEST(!dut.outstanding());
+  BOOST_CHECK_THROW(dut.Wait(), std::logic_error);
+  Interface::Output output;
+  BOOST_TEST(!dut.Poll(&output));
+
+  dut.Cycle(data);
+  BOOST_TEST(!dut.ready());
+  BOOST_TEST(dut.outstanding());
+  BOOST_TEST(dut.in_flight() == 1);
+  // With one slot, nothing more may be submitted until it completes.
+  BOOST_CHECK_THROW(dut.Cycle(data), std::logic_error);
+
+  output = dut.Wait();
+  BOOST_TEST(output.query_result_size == 2u);
+  BOOST_TEST(dut.ready());
+  BOOST_TEST(!dut.outstanding());
+  BOOST_TEST((sim.servo(1, 1).mode == Mode::kPosition));
+
+  // Replies arrive in the order the servos answer, each labeled.
+  for (size_t i = 0; i < output.query_result_size; i++) {
+    const auto& reply = replies[i];
+    BOOST_TEST(reply.id == reply.bus);
+    BOOST_TEST((reply.result.mode ==
+                (reply.id == 1 ? Mode::kPosition : Mode::kStopped)));
+  }
+
+  // Many cycles in a row, using Poll rather than Wait.
+  for (int i = 0; i < 100; i++) {
+    dut.Cycle(data);
+    while (!dut.Poll(&output)) { std::this_thread::yield(); }
+    BOOST_TEST(output.query_result_size == 2u);
+  }
+  BOOST_TEST(sim.servo(1, 1).position > 0.0);
+
+  // Requests larger than 'max_commands' are refused up front.
+  std::vector<Interface::ServoCommand> too_many(3);
+  data.commands = {too_many.data(), too_many.size()};
+  BOOST_CHECK_THROW(dut.Cycle(data), std::logic_error);
+  BOOST_TEST(dut.ready());
+}
+
+BOOST_AUTO_TEST_CASE(SpscRecordSuppliedTransportTest) {
+  const auto filename = TempName();
+  SimulatedMoteusTransport sim;
+  const int kCycles = 10;
+
+  {
+    pi3hat::FlightRecorder::Options recorder_options;
+    recorder_options.size = 1 << 20;
+    recorder_options.lock = false;
+    pi3hat::FlightRecorder recorder{filename, recorder_options};
+
+    Interface::Options options;
+    options.cpu = 0;
+    options.spin = false;
+    options.transport = &sim;
+    options.flight_recorder = &recorder;
+    Interface dut{options, nullptr};
+
+    std::vector<Interface::ServoCommand> commands(1);
+    commands[0].id = 1;
+    std::vector<Interface::ServoReply> replies(1);
+    Interface::Data data;
+    data.commands = {commands.data(), commands.size()};
+    data.replies = {replies.data(), replies.size()};
+
+    for (int i = 0; i < kCycles; i++) {
+      dut.Cycle(data);
+      dut.Wait();
+    }
+  }
+
+  // Cycles against a supplied transport are recorded just as those
+  // against the hardware would be.
+  pi3hat::FlightRecordReader reader{filename};
+  pi3hat::FlightRecordReader::Record record;
+  pi3hat::FlightRecordReader::Cycle cycle;
+  int cycles = 0;
+  int64_t last_end_ns = 0;
+  while (reader.Next(&record)) {
+    if (record.header.type != pi3hat::FlightRecorder::kCycle) { continue; }
+    BOOST_TEST_REQUIRE(pi3hat::FlightRecordReader::ParseCycle(record, &cycle));
+    BOOST_TEST(cycle.tx_can.size() == 1u);
+    BOOST_TEST(cycle.rx_can.size() == 1u);
+    BOOST_TEST(cycle.header.end_ns > cycle.header.start_ns);
+    BOOST_TEST(cycle.header.start_ns >= last_end_ns);
+    last_end_ns = cycle.header.end_ns;
+    cycles++;
+  }
+  BOOST_TEST(cycles == kCycles);
+  ::unlink(filename.c_str());
+}
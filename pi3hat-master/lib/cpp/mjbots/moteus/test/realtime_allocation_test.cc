@@ -0,0 +1,83 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mjbots/moteus/realtime_allocation.h"
+
+#include <boost/test/auto_unit_test.hpp>
+
+#include "mjbots/moteus/moteus_simulator.h"
+#include "mjbots/moteus/pi3hat_moteus_interface.h"
+
+using namespace mjbots::moteus;
+
+using Interface = Pi3HatMoteusInterface;
+
+BOOST_AUTO_TEST_CASE(RealtimeAllocationCountTest) {
+  const auto start = RealtimeAllocationCount();
+
+  {
+    // Outside of a scope, allocations are not counted.
+    int* volatile value = new int(1);
+    delete value;
+  }
+  BOOST_TEST(RealtimeAllocationCount() == start);
+
+  {
+    NoAllocationScope scope;
+    int* volatile value = new int(2);
+    delete value;
+  }
+  BOOST_TEST(RealtimeAllocationCount() == start + 1);
+}
+
+BOOST_AUTO_TEST_CASE(ExecuteCycleDoesNotAllocateTest) {
+  SimulatedMoteusTransport transport;
+
+  std::vector<Interface::ServoCommand> commands(4);
+  for (size_t i = 0; i < commands.size(); i++) {
+    commands[i].id = i + 1;
+    commands[i].bus = 1 + (i % 2);
+    commands[i].mode = Mode::kPosition;
+  }
+  std::vector<Interface::ServoReply> replies(commands.size());
+
+  Interface::Data data;
+  data.commands = {commands.data(), commands.size()};
+  data.replies = {replies.data(), replies.size()};
+
+  Interface::CycleBuffers buffers;
+  buffers.Reserve(commands.size());
+
+  // The simulator itself allocates each servo on first use.
+  Interface::ExecuteCycle(&transport, data, &buffers);
+
+  const auto start = RealtimeAllocationCount();
+  for (const bool fixed_servos : { false, true }) {
+    data.fixed_servos = fixed_servos;
+    for (int i = 0; i < 10; i++) {
+      // Alternate between a full and partial set of commands.
+      data.commands = {commands.data(), (i % 2) ? 2u : commands.size()};
+
+      NoAllocationScope scope;
+      const auto output = Interface::ExecuteCycle(&transport, data, &buffers);
+      BOOST_TEST(output.query_result_size != 0u);
+    }
+  }
+  BOOST_TEST(RealtimeAllocationCount() == start);
+
+  data.commands = {commands.data(), commands.size()};
+  BOOST_CHECK_THROW(Interface::CheckCapacity(data, 3), std::logic_error);
+  Interface::CheckCapacity(data, 4);
+  Interface::CheckCapacity(data, 0);
+}
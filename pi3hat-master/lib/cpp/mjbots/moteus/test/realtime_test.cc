@@ -0,0 +1,58 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mjbots/moteus/realtime.h"
+
+#include <boost/test/auto_unit_test.hpp>
+
+using namespace mjbots::moteus;
+
+BOOST_AUTO_TEST_CASE(CpuListTest) {
+  BOOST_TEST(ParseCpuList("").empty());
+  BOOST_TEST(ParseCpuList("3") == (std::vector<int>{3}),
+             boost::test_tools::per_element());
+  BOOST_TEST(ParseCpuList("0-2,5,4") == (std::vector<int>{0, 1, 2, 4, 5}),
+             boost::test_tools::per_element());
+  BOOST_TEST(ParseCpuList("1,x,1-2") == (std::vector<int>{1, 2}),
+             boost::test_tools::per_element());
+
+  BOOST_TEST(FormatCpuList({}) == "");
+  BOOST_TEST(FormatCpuList({5, 0, 1, 2, 4}) == "0-2,4-5");
+  BOOST_TEST(FormatCpuList({3, 1}) == "1,3");
+  BOOST_TEST(FormatCpuList(ParseCpuList("0,2-3,7")) == "0,2-3,7");
+}
+
+BOOST_AUTO_TEST_CASE(WakeupLatencyTest) {
+  const auto result = MeasureWakeupLatency(20, 1000000);
+  BOOST_TEST(result.samples == 20);
+  BOOST_TEST(result.mean_ns >= 0);
+  BOOST_TEST(result.p99_ns <= result.max_ns);
+  BOOST_TEST(result.mean_ns <= result.max_ns);
+
+  BOOST_TEST(MeasureWakeupLatency(0, 1000000).samples == 0);
+}
+
+BOOST_AUTO_TEST_CASE(SetupRealtimeTest) {
+  // Only what needs no privileges, and changes nothing outside this
+  // process.
+  RealtimeOptions options;
+  options.lock_memory = false;
+  options.latency_test_ms = 5;
+  options.latency_warn_ns = 1000000000;
+  auto report = SetupRealtime(options);
+  BOOST_TEST(report.latency.samples == 5);
+  BOOST_TEST(report.not_isolated.empty());
+  BOOST_TEST(report.irqs_moved == 0);
+  BOOST_TEST(report.warnings.empty());
+}
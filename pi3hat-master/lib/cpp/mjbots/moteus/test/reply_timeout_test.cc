@@ -0,0 +1,144 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mjbots/pi3hat/reply_timeout.h"
+
+#include <stdexcept>
+
+#include <boost/test/auto_unit_test.hpp>
+
+using namespace mjbots::pi3hat;
+
+BOOST_AUTO_TEST_CASE(ReplyTimeoutBucketTest) {
+  using L = ReplyTimeoutLearner;
+  BOOST_TEST(L::Bucket(-5) == 0);
+  BOOST_TEST(L::Bucket(1023) == 0);
+  BOOST_TEST(L::Bucket(1024) == 1);
+  BOOST_TEST(L::Bucket(1280) == 2);
+  BOOST_TEST(L::Bucket(2048) == 5);
+  BOOST_TEST(L::Bucket(int64_t(1) << 40) == L::kBuckets - 1);
+
+  for (int64_t ns : {1500, 10000, 123456, 4000000}) {
+    const int bucket = L::Bucket(ns);
+    BOOST_TEST(L::BucketEndNs(bucket) > ns);
+    BOOST_TEST(L::BucketEndNs(bucket - 1) <= ns);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(ReplyTimeoutLearnTest) {
+  Pi3Hat::AdaptiveTimeout options;
+  options.min_samples = 10;
+  options.decay_samples = 100;
+  options.margin = 1.0;
+  options.guard_ns = 0;
+  options.min_ns = 0;
+
+  ReplyTimeoutLearner dut(options);
+  BOOST_TEST(dut.WindowNs(1, 3) == -1);
+
+  for (int i = 0; i < 9; i++) { dut.Record(1, 3, 100000); }
+  BOOST_TEST(dut.WindowNs(1, 3) == -1);
+  dut.Record(1, 3, 100000);
+  // 100us lies in the bucket [98304, 114688).
+  BOOST_TEST(dut.WindowNs(1, 3) == 114688);
+
+  // Other servos and buses are independent.
+  BOOST_TEST(dut.WindowNs(2, 3) == -1);
+  BOOST_TEST(dut.WindowNs(1, 4) == -1);
+
+  // A single slow reply in ten moves the 99th percentile.
+  dut.Record(1, 3, 1000000);
+  BOOST_TEST(dut.WindowNs(1, 3) > 1000000);
+
+  // Plenty of fast replies age it out again.
+  for (int i = 0; i < 500; i++) { dut.Record(1, 3, 100000); }
+  BOOST_TEST(dut.WindowNs(1, 3) == 114688);
+
+  // Out of range values are ignored.
+  dut.Record(0, 3, 100);
+  dut.Record(6, 3, 100);
+  dut.Record(1, 128, 100);
+  BOOST_TEST(dut.WindowNs(6, 3) == -1);
+}
+
+BOOST_AUTO_TEST_CASE(ReplyTimeoutLimitTest) {
+  Pi3Hat::AdaptiveTimeout options;
+  options.min_samples = 1;
+  options.decay_samples = 2;
+  options.margin = 2.0;
+  options.guard_ns = 1000;
+  options.min_ns = 50000;
+  options.max_ns = 300000;
+
+  ReplyTimeoutLearner dut(options);
+  dut.Record(5, 1, 2000);
+  BOOST_TEST(dut.WindowNs(5, 1) == 50000);
+  dut.Record(5, 2, 100000);
+  BOOST_TEST(dut.WindowNs(5, 2) == 2 * 114688 + 1000);
+  dut.Record(5, 3, 1000000);
+  BOOST_TEST(dut.WindowNs(5, 3) == 300000);
+
+  options.decay_samples = 1;
+  BOOST_CHECK_THROW(ReplyTimeoutLearner{options}, std::invalid_argument);
+  options.decay_samples = 2;
+  options.percentile = 0.0;
+  BOOST_CHECK_THROW(ReplyTimeoutLearner{options}, std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_CASE(ReplyTimeoutDropoutTest) {
+  Pi3Hat::AdaptiveTimeout options;
+  options.min_samples = 10;
+  options.decay_samples = 100;
+  options.margin = 1.0;
+  options.guard_ns = 0;
+  options.min_ns = 0;
+  options.max_ns = 5000000;
+  options.max_misses = 3;
+
+  ReplyTimeoutLearner dut(options);
+  for (int i = 0; i < 50; i++) { dut.Record(2, 7, 100000); }
+  BOOST_TEST(dut.WindowNs(2, 7) == 114688);
+
+  // The servo stops replying mid-run.  Each miss widens the window,
+  // until it is given up on, rather than the window growing to
+  // max_ns.
+  int64_t window_ns = dut.WindowNs(2, 7);
+  int misses = 0;
+  while (window_ns >= 0 && misses < 1000) {
+    dut.RecordMiss(2, 7, window_ns);
+    misses++;
+    window_ns = dut.WindowNs(2, 7);
+  }
+  BOOST_TEST(misses == 3);
+  BOOST_TEST(dut.WindowNs(2, 7) == -1);
+
+  // Further misses are not learned while it is silent...
+  for (int i = 0; i < 100; i++) { dut.RecordMiss(2, 7, 5000000); }
+
+  // ... so once it replies again, the window reflects only the few
+  // misses before it was given up on.
+  dut.Record(2, 7, 100000);
+  BOOST_TEST(dut.WindowNs(2, 7) > 0);
+  BOOST_TEST(dut.WindowNs(2, 7) < 500000);
+
+  // An occasional miss does not disable it.
+  for (int i = 0; i < 20; i++) {
+    dut.RecordMiss(2, 7, 114688);
+    dut.Record(2, 7, 100000);
+    BOOST_TEST(dut.WindowNs(2, 7) >= 0);
+  }
+
+  options.max_misses = 0;
+  BOOST_CHECK_THROW(ReplyTimeoutLearner{options}, std::invalid_argument);
+}
@@ -0,0 +1,168 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mjbots/pi3hat/spi_tuning.h"
+
+#include <boost/test/auto_unit_test.hpp>
+
+using namespace mjbots::pi3hat;
+
+namespace {
+Pi3Hat::SpiTiming MakeTiming(int speed_hz, int hold_us) {
+  Pi3Hat::SpiTiming result;
+  result.speed_hz = speed_hz;
+  result.cs_hold_us = hold_us;
+  result.address_hold_us = hold_us;
+  return result;
+}
+}
+
+BOOST_AUTO_TEST_CASE(QueueSizeChecksumTest) {
+  const uint8_t empty[6] = {};
+  BOOST_TEST(QueueSizeChecksum(empty, 6) == 0xff);
+  const uint8_t sizes[6] = { 69, 13, 0, 0, 200, 0 };
+  BOOST_TEST(QueueSizeChecksum(sizes, 6) == (((69 + 13 + 200) & 0xff) ^ 0xff));
+}
+
+BOOST_AUTO_TEST_CASE(SpiLinkTunerCalibrateTest) {
+  Pi3Hat::SpiTuning options;
+  options.max_speed_hz = 20000000;
+  options.speed_step = 0.5;
+  options.margin_steps = 1;
+  options.min_hold_us = 1;
+
+  SpiLinkTuner dut(options, MakeTiming(4000000, 3));
+  BOOST_TEST(dut.speeds() == (std::vector<int>{20000000, 10000000, 5000000,
+                                               4000000}),
+             boost::test_tools::per_element());
+
+  // Anything above 12MHz, or with holds under 2us, fails.
+  Pi3Hat::SpiTiming last;
+  dut.Calibrate([&](const Pi3Hat::SpiTiming& timing) {
+      last = timing;
+      return timing.speed_hz <= 12000000 && timing.cs_hold_us >= 2;
+    });
+
+  // 10MHz was the fastest, so with the margin 5MHz is used.
+  BOOST_TEST(dut.timing().speed_hz == 5000000);
+  BOOST_TEST(dut.timing().cs_hold_us == 2);
+  BOOST_TEST(dut.timing().address_hold_us == 2);
+  BOOST_TEST(last.speed_hz == 5000000);
+  BOOST_TEST(last.cs_hold_us == 2);
+  BOOST_TEST(dut.status().tuned == true);
+}
+
+BOOST_AUTO_TEST_CASE(SpiLinkTunerUnsupportedTest) {
+  Pi3Hat::SpiTuning options;
+  SpiLinkTuner dut(options, MakeTiming(10000000, 3));
+
+  Pi3Hat::SpiTiming last;
+  dut.Calibrate([&](const Pi3Hat::SpiTiming& timing) {
+      last = timing;
+      return false;
+    });
+  BOOST_TEST(dut.timing().speed_hz == 10000000);
+  BOOST_TEST(dut.timing().cs_hold_us == 3);
+  BOOST_TEST(last.speed_hz == 10000000);
+  BOOST_TEST(dut.status().tuned == false);
+
+  // Without tuning, errors are counted but never cause a fallback.
+  for (int i = 0; i < 10; i++) { BOOST_TEST(dut.Record(false) == false); }
+  BOOST_TEST(dut.status().errors == 10u);
+}
+
+BOOST_AUTO_TEST_CASE(SpiLinkTunerFallbackTest) {
+  Pi3Hat::SpiTuning options;
+  options.max_speed_hz = 16000000;
+  options.speed_step = 0.5;
+  options.margin_steps = 0;
+  options.error_window = 10;
+  options.max_errors = 1;
+
+  SpiLinkTuner dut(options, MakeTiming(4000000, 3));
+  dut.Calibrate([](const Pi3Hat::SpiTiming&) { return true; });
+  BOOST_TEST(dut.timing().speed_hz == 16000000);
+  BOOST_TEST(dut.timing().cs_hold_us == 1);
+
+  // Isolated errors in separate windows are tolerated.
+  for (int window = 0; window < 3; window++) {
+    BOOST_TEST(dut.Record(false) == false);
+    for (int i = 1; i < 10; i++) { BOOST_TEST(dut.Record(true) == false); }
+  }
+  BOOST_TEST(dut.timing().speed_hz == 16000000);
+
+  // But two in one window are not.
+  BOOST_TEST(dut.Record(false) == false);
+  BOOST_TEST(dut.Record(false) == true);
+  BOOST_TEST(dut.timing().speed_hz == 8000000);
+  BOOST_TEST(dut.timing().cs_hold_us == 3);
+
+  BOOST_TEST(dut.Record(false) == false);
+  BOOST_TEST(dut.Record(false) == true);
+  BOOST_TEST(dut.timing().speed_hz == 4000000);
+
+  // There is nowhere further to go.
+  BOOST_TEST(dut.Record(false) == false);
+  BOOST_TEST(dut.Record(false) == false);
+  BOOST_TEST(dut.timing().speed_hz == 4000000);
+
+  const auto status = dut.status();
+  BOOST_TEST(status.fallbacks == 2);
+  BOOST_TEST(status.errors == 9u);
+  BOOST_TEST(status.checks == 36u);
+}
+
+BOOST_AUTO_TEST_CASE(SpiLinkTunerRestoreTest) {
+  Pi3Hat::SpiTuning options;
+  options.max_speed_hz = 16000000;
+  options.speed_step = 0.5;
+
+  int tests = 0;
+  const auto pass = [&](const Pi3Hat::SpiTiming&) { tests++; return true; };
+
+  {
+    SpiLinkTuner dut(options, MakeTiming(4000000, 3));
+    BOOST_TEST(dut.Restore(MakeTiming(8000000, 2), pass) == true);
+    BOOST_TEST(tests == 1);
+    BOOST_TEST(dut.timing().speed_hz == 8000000);
+    BOOST_TEST(dut.timing().cs_hold_us == 2);
+    BOOST_TEST(dut.status().tuned == true);
+  }
+
+  {
+    // Timings which could not have come from these options are
+    // rejected without being tried.
+    SpiLinkTuner dut(options, MakeTiming(4000000, 3));
+    tests = 0;
+    BOOST_TEST(dut.Restore(MakeTiming(9000000, 2), pass) == false);
+    BOOST_TEST(dut.Restore(MakeTiming(8000000, 5), pass) == false);
+    BOOST_TEST(tests == 0);
+    BOOST_TEST(dut.status().tuned == false);
+  }
+
+  {
+    // One which fails puts the link back at the configured timing.
+    SpiLinkTuner dut(options, MakeTiming(4000000, 3));
+    Pi3Hat::SpiTiming last;
+    BOOST_TEST(dut.Restore(
+                   MakeTiming(16000000, 1),
+                   [&](const Pi3Hat::SpiTiming& timing) {
+                     last = timing;
+                     return timing.speed_hz == 4000000;
+                   }) == false);
+    BOOST_TEST(last.speed_hz == 4000000);
+    BOOST_TEST(last.cs_hold_us == 3);
+    BOOST_TEST(dut.timing().speed_hz == 4000000);
+  }
+}
@@ -0,0 +1,67 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mjbots/moteus/spsc_queue.h"
+
+#include <thread>
+
+#include <boost/test/auto_unit_test.hpp>
+
+using namespace mjbots::moteus;
+
+BOOST_AUTO_TEST_CASE(SpscQueueBasicTest) {
+  SpscQueue<int, 4> dut;
+  BOOST_TEST(dut.empty());
+
+  int value = 0;
+  BOOST_TEST(!dut.Pop(&value));
+
+  for (int i = 0; i < 4; i++) {
+    BOOST_TEST(dut.Push(i));
+  }
+  BOOST_TEST(!dut.Push(10));
+  BOOST_TEST(dut.size() == 4);
+
+  BOOST_TEST(dut.Pop(&value));
+  BOOST_TEST(value == 0);
+  BOOST_TEST(dut.Push(4));
+
+  for (int i = 1; i < 5; i++) {
+    BOOST_TEST(dut.Pop(&value));
+    BOOST_TEST(value == i);
+  }
+  BOOST_TEST(dut.empty());
+}
+
+BOOST_AUTO_TEST_CASE(SpscQueueThreadTest) {
+  SpscQueue<int, 8> dut;
+  constexpr int kCount = 100000;
+
+  std::thread producer([&]() {
+      for (int i = 0; i < kCount; i++) {
+        while (!dut.Push(i)) {}
+      }
+    });
+
+  int errors = 0;
+  for (int i = 0; i < kCount; i++) {
+    int value = -1;
+    while (!dut.Pop(&value)) {}
+    if (value != i) { errors++; }
+  }
+  producer.join();
+
+  BOOST_TEST(errors == 0);
+  BOOST_TEST(dut.empty());
+}
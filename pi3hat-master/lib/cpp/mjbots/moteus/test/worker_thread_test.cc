@@ -0,0 +1,58 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mjbots/pi3hat/worker_thread.h"
+
+#include <stdexcept>
+
+#include <boost/test/auto_unit_test.hpp>
+
+using namespace mjbots::pi3hat;
+
+BOOST_AUTO_TEST_CASE(WorkerThreadTest) {
+  int count = 0;
+  WorkerThread dut([&]() { count++; });
+
+  BOOST_TEST(dut.done());
+  for (int i = 1; i <= 3; i++) {
+    dut.Start();
+    dut.Wait();
+    BOOST_TEST(count == i);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(WorkerThreadErrorTest) {
+  bool fail = true;
+  int count = 0;
+  WorkerThread dut([&]() {
+      count++;
+      if (fail) { throw std::runtime_error("broken"); }
+    });
+
+  // The error reaches the caller, and the thread survives it.
+  dut.Start();
+  BOOST_CHECK_THROW(dut.Wait(), std::runtime_error);
+  BOOST_TEST(dut.done());
+
+  dut.Start();
+  BOOST_CHECK_THROW(dut.Wait(), std::runtime_error);
+
+  // A failure which is never waited for is dropped by the next Start.
+  dut.Start();
+  dut.Abandon();
+  fail = false;
+  dut.Start();
+  dut.Wait();
+  BOOST_TEST(count == 4);
+}
@@ -0,0 +1,791 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// We purposefully don't use the full path here so that this file can
+// be compiled in a wide range of build configurations.
+#include "pi3hat.h"
+#include "transport.h"
+
+/// @file
+///
+/// Lets several processes share one pi3hat.  A single broker process
+/// owns the hardware, and clients attach to it through POSIX shared
+/// memory.  Each client has a lock-free ring of frames to send and
+/// one of frames received, and requests cycles with a sequence
+/// number, so neither side makes a system call in the common path.
+///
+/// Clients have a priority.  Whenever the highest priority client
+/// requests a cycle, it is performed immediately, and pending
+/// requests of lower priority clients are merged into it, a few
+/// frames at a time.  Lower priority clients are only given cycles of
+/// their own once the highest priority one has been idle for a
+/// while.  Thus a diagnostic tool can run alongside a realtime
+/// control loop without adding cycles to it.
+///
+/// Clients may claim exclusive ownership of servo IDs on each bus.
+/// No other client may send to an owned ID, and replies from it go
+/// only to its owner.  Replies from unowned IDs go to whichever
+/// client addressed that ID in the same cycle.  Clients may also
+/// ask for a copy of every received frame, and the broker publishes
+/// the most recent attitude for any client to read at any time.
+///
+/// Replies are matched with the moteus convention: the destination
+/// is in bits 0-6 of the arbitration ID and the source of a reply is
+/// in bits 8-14.
+
+namespace mjbots {
+namespace pi3hat {
+
+/// A fixed capacity, lock-free, single-producer single-consumer ring
+/// which may be placed in memory shared between processes.  This is
+/// moteus::SpscQueue with indices that are lock-free, and so address
+/// free, on every platform this runs on.
+template <typename T, uint32_t Capacity>
+class BrokerRing {
+ public:
+  static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0,
+                "Capacity must be a power of two");
+  static_assert(ATOMIC_INT_LOCK_FREE == 2,
+                "shared memory requires lock-free atomics");
+
+  /// Producer only.  Returns false if the ring is full.
+  bool Push(const T& value) {
+    const uint32_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) >= Capacity) {
+      return false;
+    }
+    items_[head & kMask] = value;
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  /// Consumer only.  Returns false if the ring is empty.
+  bool Pop(T* value) {
+    const uint32_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    *value = items_[tail & kMask];
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool empty() const {
+    return head_.load(std::memory_order_acquire) ==
+        tail_.load(std::memory_order_acquire);
+  }
+
+  /// From the producer, this may overestimate, and from the consumer
+  /// underestimate, how many items are queued.
+  uint32_t size() const {
+    return head_.load(std::memory_order_acquire) -
+        tail_.load(std::memory_order_acquire);
+  }
+
+  /// Neither side may be using the ring.
+  void Clear() {
+    head_.store(0, std::memory_order_relaxed);
+    tail_.store(0, std::memory_order_relaxed);
+  }
+
+  static constexpr uint32_t capacity() { return Capacity; }
+
+ private:
+  static constexpr uint32_t kMask = Capacity - 1;
+
+  alignas(64) std::atomic<uint32_t> head_{0};
+  alignas(64) std::atomic<uint32_t> tail_{0};
+  alignas(64) T items_[Capacity];
+};
+
+/// The subset of Pi3Hat::Input a client may request.
+struct BrokerRequest {
+  uint32_t timeout_ns = 0;
+  uint32_t min_tx_wait_ns = 200000;
+  uint32_t rx_extra_wait_ns = 40000;
+  uint32_t force_can_check = 0;
+  bool request_attitude = false;
+};
+
+/// Everything shared between the broker and one client.
+struct BrokerClientSlot {
+  enum State : uint32_t {
+    kFree,
+    // A client is filling in the slot.
+    kClaimed,
+    // The client is waiting for the broker to accept it.
+    kAttaching,
+    kActive,
+    kRejected,
+    // The client has gone, and the broker should free the slot.
+    kDetaching,
+  };
+
+  enum Flags : uint32_t {
+    // Every received frame is copied to 'rx'.
+    kMonitorCan = 1 << 0,
+    // Every cycle reads the attitude, even if no client requests it.
+    kSubscribeAttitude = 1 << 1,
+  };
+
+  static constexpr int kMaxBus = 5;
+  static constexpr int kMaxId = 128;
+
+  std::atomic<uint32_t> state{kFree};
+  // Set by the client after it has claimed the slot.
+  std::atomic<int32_t> pid{0};
+  int32_t priority = 0;
+  uint32_t flags = 0;
+  // One bit per ID, for buses 1 to 5.
+  uint64_t owned[kMaxBus + 1][2] = {};
+
+  // The client sets 'request', then increments 'request_seq'.
+  alignas(64) std::atomic<uint64_t> request_seq{0};
+  BrokerRequest request;
+
+  // The broker sets the remaining reply fields, then sets
+  // 'reply_seq' to the 'request_seq' it serviced.
+  alignas(64) std::atomic<uint64_t> reply_seq{0};
+  int32_t reply_error = 0;
+  bool reply_attitude_present = false;
+  Attitude reply_attitude;
+
+  // Written only by the broker.
+  std::atomic<uint64_t> rejected_frames{0};
+  std::atomic<uint64_t> dropped_frames{0};
+
+  BrokerRing<CanFrame, 64> tx;
+  BrokerRing<CanFrame, 256> rx;
+};
+
+/// The complete contents of the shared memory object.
+struct BrokerShared {
+  static constexpr uint32_t kMagic = 0x70336862;
+  static constexpr uint32_t kVersion = 1;
+  static constexpr int kMaxClients = 8;
+
+  // This is set last by the broker once everything else is ready.
+  std::atomic<uint32_t> magic{0};
+  uint32_t version = kVersion;
+  int32_t broker_pid = 0;
+
+  std::atomic<uint64_t> cycles{0};
+
+  // A sequence lock protecting 'attitude', which is odd while it is
+  // being written.
+  alignas(64) std::atomic<uint32_t> attitude_seq{0};
+  Attitude attitude;
+
+  BrokerClientSlot clients[kMaxClients];
+};
+
+namespace detail {
+inline int64_t BrokerNowNs() {
+  struct timespec ts = {};
+  ::clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000000ll + ts.tv_nsec;
+}
+
+inline bool BrokerOwns(const uint64_t (&owned)[2], int id) {
+  return (owned[id / 64] & (1ull << (id % 64))) != 0;
+}
+}
+
+/// Maps a named POSIX shared memory object holding a BrokerShared.
+class BrokerSharedMemory {
+ public:
+  /// The broker creates the object, replacing any left by a previous
+  /// broker.  Clients open an existing one.
+  enum Mode {
+    kCreate,
+    kOpen,
+  };
+
+  /// This may throw an instance of `Error`.
+  BrokerSharedMemory(const std::string& name, Mode mode)
+      : name_(name), mode_(mode) {
+    if (mode == kCreate) { ::shm_unlink(name.c_str()); }
+    const int fd = ::shm_open(
+        name.c_str(), mode == kCreate ? (O_RDWR | O_CREAT | O_EXCL) : O_RDWR,
+        S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (fd < 0) { ThrowErrno("could not open shared memory"); }
+    if (mode == kCreate && ::ftruncate(fd, sizeof(BrokerShared)) < 0) {
+      ::close(fd);
+      ThrowErrno("could not size shared memory");
+    }
+    void* const ptr = ::mmap(nullptr, sizeof(BrokerShared),
+                             PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (ptr == MAP_FAILED) { ThrowErrno("could not map shared memory"); }
+
+    if (mode == kCreate) {
+      shared_ = new (ptr) BrokerShared();
+      shared_->broker_pid = ::getpid();
+    } else {
+      shared_ = static_cast<BrokerShared*>(ptr);
+      if (shared_->magic.load(std::memory_order_acquire) !=
+          BrokerShared::kMagic ||
+          shared_->version != BrokerShared::kVersion) {
+        ::munmap(ptr, sizeof(BrokerShared));
+        throw Error("pi3hat broker: '" + name + "' is not a compatible broker");
+      }
+    }
+  }
+
+  ~BrokerSharedMemory() {
+    ::munmap(shared_, sizeof(BrokerShared));
+    if (mode_ == kCreate) { ::shm_unlink(name_.c_str()); }
+  }
+
+  BrokerSharedMemory(const BrokerSharedMemory&) = delete;
+  BrokerSharedMemory& operator=(const BrokerSharedMemory&) = delete;
+
+  BrokerShared* get() { return shared_; }
+
+ private:
+  void ThrowErrno(const std::string& message) {
+    throw Error("pi3hat broker: " + message + " '" + name_ + "': " +
+                ::strerror(errno));
+  }
+
+  const std::string name_;
+  const Mode mode_;
+  BrokerShared* shared_ = nullptr;
+};
+
+/// Owns a transport, normally the pi3hat itself, and services the
+/// clients of a BrokerShared.  Poll must be called continuously from
+/// one thread.
+class Broker {
+ public:
+  struct Options {
+    // The most frames sent and received in one cycle.
+    int max_tx_frames = 128;
+    int max_rx_frames = 256;
+
+    // The most frames that lower priority clients may add to a cycle
+    // requested by the highest priority client.
+    int max_merged_frames = 8;
+
+    // Lower priority clients are given cycles of their own once the
+    // highest priority client has not requested one for this long.
+    int64_t idle_ns = 5000000;
+
+    // How often to check that attached client processes still exist.
+    int64_t liveness_check_ns = 100000000;
+
+    Options() {}
+  };
+
+  /// @p transport and @p shared must outlive the Broker.  @p shared
+  /// must be freshly constructed.
+  Broker(Transport* transport, BrokerShared* shared,
+         const Options& options = Options())
+      : transport_(transport),
+        shared_(shared),
+        options_(options),
+        tx_can_(options.max_tx_frames),
+        rx_can_(options.max_rx_frames) {
+    std::memset(owner_, 0, sizeof(owner_));
+    std::memset(requester_, 0, sizeof(requester_));
+    shared_->magic.store(BrokerShared::kMagic, std::memory_order_release);
+  }
+
+  ~Broker() {
+    shared_->magic.store(0, std::memory_order_release);
+  }
+
+  Broker(const Broker&) = delete;
+  Broker& operator=(const Broker&) = delete;
+
+  /// Attach or detach clients as required, then perform one cycle if
+  /// any are due.  Returns true if a cycle was performed.
+  bool Poll() {
+    const int64_t now = detail::BrokerNowNs();
+    Housekeeping(now);
+
+    int top_priority = 0;
+    bool any_active = false;
+    for (int i = 0; i < BrokerShared::kMaxClients; i++) {
+      if (!active_[i]) { continue; }
+      const auto priority = shared_->clients[i].priority;
+      if (!any_active || priority > top_priority) { top_priority = priority; }
+      any_active = true;
+    }
+    if (!any_active) { return false; }
+
+    // Find who wants a cycle, highest priority first.
+    int pending_count = 0;
+    bool top_pending = false;
+    for (int i = 0; i < BrokerShared::kMaxClients; i++) {
+      if (!active_[i]) { continue; }
+      auto& slot = shared_->clients[i];
+      const auto seq = slot.request_seq.load(std::memory_order_acquire);
+      if (seq == served_[i]) { continue; }
+      request_seq_[i] = seq;
+      pending_[pending_count++] = i;
+      if (slot.priority == top_priority) { top_pending = true; }
+    }
+    if (pending_count == 0) { return false; }
+    if (top_pending) {
+      last_top_request_ns_ = now;
+    } else if (now - last_top_request_ns_ < options_.idle_ns) {
+      return false;
+    }
+
+    std::stable_sort(
+        pending_, pending_ + pending_count, [&](int lhs, int rhs) {
+          return shared_->clients[lhs].priority >
+              shared_->clients[rhs].priority;
+        });
+
+    Cycle(pending_, pending_count, top_priority);
+    return true;
+  }
+
+  /// Call Poll until @p done becomes true.
+  void Run(const std::atomic<bool>& done) {
+    while (!done.load(std::memory_order_acquire)) {
+      if (!Poll()) { std::this_thread::yield(); }
+    }
+  }
+
+ private:
+  void Housekeeping(int64_t now) {
+    const bool check_liveness =
+        (now - last_liveness_ns_) >= options_.liveness_check_ns;
+    if (check_liveness) { last_liveness_ns_ = now; }
+
+    for (int i = 0; i < BrokerShared::kMaxClients; i++) {
+      auto& slot = shared_->clients[i];
+      const auto state = slot.state.load(std::memory_order_acquire);
+      if (state == BrokerClientSlot::kAttaching) {
+        Attach(i);
+      } else if (state == BrokerClientSlot::kDetaching) {
+        Free(i);
+      } else if (state != BrokerClientSlot::kFree && check_liveness &&
+                 !ClientAlive(i)) {
+        Free(i);
+      }
+    }
+  }
+
+  /// A client which dies part way through attaching or detaching
+  /// leaves its slot behind, so every state the client moves out of
+  /// itself is checked.
+  bool ClientAlive(int index) {
+    const auto& slot = shared_->clients[index];
+    const int32_t pid = slot.pid.load(std::memory_order_relaxed);
+    if (pid == 0) {
+      // The client has not yet written its pid.  If that is still so
+      // at the next check, it died before it could.
+      const bool alive = !unnamed_[index];
+      unnamed_[index] = true;
+      return alive;
+    }
+    unnamed_[index] = false;
+    return !(::kill(pid, 0) < 0 && errno == ESRCH);
+  }
+
+  void Attach(int index) {
+    auto& slot = shared_->clients[index];
+    for (int bus = 1; bus <= BrokerClientSlot::kMaxBus; bus++) {
+      for (int id = 0; id < BrokerClientSlot::kMaxId; id++) {
+        if (detail::BrokerOwns(slot.owned[bus], id) && owner_[bus][id]) {
+          slot.state.store(BrokerClientSlot::kRejected,
+                           std::memory_order_release);
+          return;
+        }
+      }
+    }
+    for (int bus = 1; bus <= BrokerClientSlot::kMaxBus; bus++) {
+      for (int id = 0; id < BrokerClientSlot::kMaxId; id++) {
+        if (detail::BrokerOwns(slot.owned[bus], id)) {
+          owner_[bus][id] = index + 1;
+        }
+      }
+    }
+    served_[index] = slot.request_seq.load(std::memory_order_acquire);
+    active_[index] = true;
+    slot.state.store(BrokerClientSlot::kActive, std::memory_order_release);
+  }
+
+  void Free(int index) {
+    auto& slot = shared_->clients[index];
+    for (auto& owner : owner_) {
+      for (auto& value : owner) {
+        if (value == index + 1) { value = 0; }
+      }
+    }
+    active_[index] = false;
+    unnamed_[index] = false;
+    slot.tx.Clear();
+    slot.rx.Clear();
+    std::memset(slot.owned, 0, sizeof(slot.owned));
+    slot.flags = 0;
+    slot.priority = 0;
+    slot.pid = 0;
+    slot.request_seq.store(0, std::memory_order_relaxed);
+    slot.reply_seq.store(0, std::memory_order_relaxed);
+    slot.rejected_frames.store(0, std::memory_order_relaxed);
+    slot.dropped_frames.store(0, std::memory_order_relaxed);
+    slot.state.store(BrokerClientSlot::kFree, std::memory_order_release);
+  }
+
+  void Cycle(const int* pending, int pending_count, int top_priority) {
+    std::memset(requester_, 0, sizeof(requester_));
+
+    Pi3Hat::Input input;
+    size_t tx_size = 0;
+    int merged = 0;
+    bool complete[BrokerShared::kMaxClients] = {};
+    bool options_set = false;
+    // 'pending' is sorted, so if the highest priority client is taking
+    // part, it is first.
+    const bool top_in_cycle =
+        shared_->clients[pending[0]].priority == top_priority;
+
+    for (int p = 0; p < pending_count; p++) {
+      const int index = pending[p];
+      auto& slot = shared_->clients[index];
+      const bool top = slot.priority == top_priority;
+
+      // The first pending client, which has the highest priority,
+      // chooses the timeouts.
+      if (!options_set) {
+        input.timeout_ns = slot.request.timeout_ns;
+        input.min_tx_wait_ns = slot.request.min_tx_wait_ns;
+        input.rx_extra_wait_ns = slot.request.rx_extra_wait_ns;
+        options_set = true;
+      }
+      input.force_can_check |= slot.request.force_can_check;
+      if (slot.request.request_attitude) { input.request_attitude = true; }
+
+      CanFrame frame;
+      while (tx_size < tx_can_.size() &&
+             (top || !top_in_cycle || merged < options_.max_merged_frames) &&
+             slot.tx.Pop(&frame)) {
+        const int bus = frame.bus;
+        const int id = frame.id & 0x7f;
+        if (bus < 1 || bus > BrokerClientSlot::kMaxBus ||
+            (owner_[bus][id] != 0 && owner_[bus][id] != index + 1)) {
+          slot.rejected_frames.fetch_add(1, std::memory_order_relaxed);
+          continue;
+        }
+        if (frame.expect_reply) { requester_[bus][id] = index + 1; }
+        tx_can_[tx_size++] = frame;
+        if (!top && top_in_cycle) { merged++; }
+      }
+      complete[index] = slot.tx.empty();
+    }
+
+    for (int i = 0; i < BrokerShared::kMaxClients; i++) {
+      if (active_[i] && (shared_->clients[i].flags &
+                         BrokerClientSlot::kSubscribeAttitude)) {
+        input.request_attitude = true;
+      }
+    }
+
+    Attitude attitude;
+    input.tx_can = {tx_can_.data(), tx_size};
+    input.rx_can = {rx_can_.data(), rx_can_.size()};
+    input.attitude = &attitude;
+
+    const auto output = transport_->Cycle(input);
+
+    for (size_t i = 0; i < output.rx_can_size; i++) {
+      Route(rx_can_[i]);
+    }
+
+    if (output.attitude_present) {
+      const auto seq = shared_->attitude_seq.load(std::memory_order_relaxed);
+      shared_->attitude_seq.store(seq + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      shared_->attitude = attitude;
+      shared_->attitude_seq.store(seq + 2, std::memory_order_release);
+    }
+
+    for (int p = 0; p < pending_count; p++) {
+      const int index = pending[p];
+      if (!complete[index]) { continue; }
+      auto& slot = shared_->clients[index];
+      slot.reply_error = output.error;
+      slot.reply_attitude_present =
+          output.attitude_present && slot.request.request_attitude;
+      if (slot.reply_attitude_present) { slot.reply_attitude = attitude; }
+      served_[index] = request_seq_[index];
+      slot.reply_seq.store(request_seq_[index], std::memory_order_release);
+    }
+
+    shared_->cycles.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void Route(const CanFrame& frame) {
+    const int bus = frame.bus;
+    const int source = (frame.id >> 8) & 0x7f;
+    int destination = 0;
+    if (bus >= 1 && bus <= BrokerClientSlot::kMaxBus) {
+      destination = owner_[bus][source] ? owner_[bus][source] :
+          requester_[bus][source];
+    }
+
+    for (int i = 0; i < BrokerShared::kMaxClients; i++) {
+      if (!active_[i]) { continue; }
+      auto& slot = shared_->clients[i];
+      if (destination != i + 1 &&
+          !(slot.flags & BrokerClientSlot::kMonitorCan)) {
+        continue;
+      }
+      if (!slot.rx.Push(frame)) {
+        slot.dropped_frames.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+  }
+
+  Transport* const transport_;
+  BrokerShared* const shared_;
+  const Options options_;
+
+  std::vector<CanFrame> tx_can_;
+  std::vector<CanFrame> rx_can_;
+
+  // The (index + 1) of the client owning each bus and ID, or 0.
+  uint8_t owner_[BrokerClientSlot::kMaxBus + 1][BrokerClientSlot::kMaxId];
+  // The (index + 1) of the client which addressed each bus and ID in
+  // the current cycle, or 0.
+  uint8_t requester_[BrokerClientSlot::kMaxBus + 1][BrokerClientSlot::kMaxId];
+
+  bool active_[BrokerShared::kMaxClients] = {};
+  // Slots which had no pid at the last liveness check.
+  bool unnamed_[BrokerShared::kMaxClients] = {};
+  uint64_t served_[BrokerShared::kMaxClients] = {};
+  uint64_t request_seq_[BrokerShared::kMaxClients] = {};
+  int pending_[BrokerShared::kMaxClients] = {};
+
+  int64_t last_top_request_ns_ = 0;
+  int64_t last_liveness_ns_ = 0;
+};
+
+/// A client of a Broker, for use anywhere a Transport is.
+class BrokerTransport : public Transport {
+ public:
+  struct Options {
+    // Higher values are serviced first.  The realtime control loop
+    // should have the highest priority of all attached clients.
+    int priority = 0;
+
+    // (bus, id) pairs which only this client may command.
+    std::vector<std::pair<int, int>> owned_ids;
+
+    // If true, every frame received by the broker is also returned
+    // from Cycle and ReadMonitor.
+    bool monitor_can = false;
+
+    // If true, the broker reads the attitude every cycle, so that
+    // ReadAttitude() stays current.
+    bool subscribe_attitude = false;
+
+    // How long to wait for the broker to accept this client, and to
+    // complete each cycle, before throwing.
+    int64_t timeout_ns = 1000000000;
+
+    Options() {}
+  };
+
+  /// Attach to the broker serving the shared memory object @p name.
+  /// This may throw an instance of `Error`.
+  BrokerTransport(const std::string& name, const Options& options = Options())
+      : memory_(new BrokerSharedMemory(name, BrokerSharedMemory::kOpen)),
+        shared_(memory_->get()),
+        options_(options) {
+    Attach();
+  }
+
+  /// Attach through an existing mapping, which must outlive this.
+  BrokerTransport(BrokerShared* shared, const Options& options = Options())
+      : shared_(shared),
+        options_(options) {
+    Attach();
+  }
+
+  ~BrokerTransport() {
+    slot_->state.store(BrokerClientSlot::kDetaching,
+                       std::memory_order_release);
+  }
+
+  BrokerTransport(const BrokerTransport&) = delete;
+  BrokerTransport& operator=(const BrokerTransport&) = delete;
+
+  Pi3Hat::Output Cycle(const Pi3Hat::Input& input) override {
+    // Checked up front, so that a cycle which is refused leaves no
+    // frames behind to be sent with the next one.
+    if (input.tx_can.size() > slot_->tx.capacity() - slot_->tx.size()) {
+      throw Error("pi3hat broker: too many frames in one cycle");
+    }
+    for (const auto& frame : input.tx_can) {
+      slot_->tx.Push(frame);
+    }
+
+    auto& request = slot_->request;
+    request.timeout_ns = input.timeout_ns;
+    request.min_tx_wait_ns = input.min_tx_wait_ns;
+    request.rx_extra_wait_ns = input.rx_extra_wait_ns;
+    request.force_can_check = input.force_can_check;
+    request.request_attitude = input.request_attitude;
+
+    const auto seq = ++seq_;
+    slot_->request_seq.store(seq, std::memory_order_release);
+
+    const auto start = detail::BrokerNowNs();
+    while (slot_->reply_seq.load(std::memory_order_acquire) != seq) {
+      if (detail::BrokerNowNs() - start > options_.timeout_ns) {
+        throw Error("pi3hat broker: no reply from broker");
+      }
+    }
+
+    Pi3Hat::Output result;
+    result.error = slot_->reply_error;
+    result.rx_can_size = ReadMonitor(input.rx_can);
+    if (slot_->reply_attitude_present && input.attitude) {
+      *input.attitude = slot_->reply_attitude;
+      result.attitude_present = true;
+    }
+    return result;
+  }
+
+  int64_t now_ns() override { return detail::BrokerNowNs(); }
+
+  /// Return frames received for this client without requesting a
+  /// cycle.  With 'monitor_can', this is every frame the broker has
+  /// received since the last call, up to the capacity of the ring.
+  size_t ReadMonitor(const Span<CanFrame>& rx_can) {
+    size_t result = 0;
+    while (result < rx_can.size() && slot_->rx.Pop(&rx_can[result])) {
+      result++;
+    }
+    return result;
+  }
+
+  /// Copy the most recent attitude read by the broker.  Returns false
+  /// if none has been read yet.
+  bool ReadAttitude(Attitude* attitude) const {
+    while (true) {
+      const auto before =
+          shared_->attitude_seq.load(std::memory_order_acquire);
+      if (before == 0) { return false; }
+      if (before & 1) { continue; }
+      *attitude = shared_->attitude;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (shared_->attitude_seq.load(std::memory_order_relaxed) == before) {
+        return true;
+      }
+    }
+  }
+
+  /// Frames refused because another client owns their ID.
+  uint64_t rejected_frames() const {
+    return slot_->rejected_frames.load(std::memory_order_relaxed);
+  }
+
+  /// Frames for this client lost because its ring was full.
+  uint64_t dropped_frames() const {
+    return slot_->dropped_frames.load(std::memory_order_relaxed);
+  }
+
+ private:
+  void Attach() {
+    for (auto& slot : shared_->clients) {
+      uint32_t expected = BrokerClientSlot::kFree;
+      if (slot.state.compare_exchange_strong(
+              expected, BrokerClientSlot::kClaimed,
+              std::memory_order_acq_rel)) {
+        slot_ = &slot;
+        break;
+      }
+    }
+    if (!slot_) { throw Error("pi3hat broker: no free client slots"); }
+
+    slot_->pid = ::getpid();
+    slot_->priority = options_.priority;
+    slot_->flags = 0;
+    if (options_.monitor_can) {
+      slot_->flags |= BrokerClientSlot::kMonitorCan;
+    }
+    if (options_.subscribe_attitude) {
+      slot_->flags |= BrokerClientSlot::kSubscribeAttitude;
+    }
+    std::memset(slot_->owned, 0, sizeof(slot_->owned));
+    for (const auto& pair : options_.owned_ids) {
+      const int bus = pair.first;
+      const int id = pair.second;
+      if (bus < 1 || bus > BrokerClientSlot::kMaxBus ||
+          id < 0 || id >= BrokerClientSlot::kMaxId) {
+        slot_->state.store(BrokerClientSlot::kFree, std::memory_order_release);
+        throw std::invalid_argument("pi3hat broker: owned ID out of range");
+      }
+      slot_->owned[bus][id / 64] |= 1ull << (id % 64);
+    }
+    seq_ = slot_->request_seq.load(std::memory_order_relaxed);
+    slot_->state.store(BrokerClientSlot::kAttaching,
+                       std::memory_order_release);
+
+    const auto start = detail::BrokerNowNs();
+    while (true) {
+      const auto state = slot_->state.load(std::memory_order_acquire);
+      if (state == BrokerClientSlot::kActive) { return; }
+      if (state == BrokerClientSlot::kRejected) {
+        slot_->state.store(BrokerClientSlot::kDetaching,
+                           std::memory_order_release);
+        throw Error("pi3hat broker: an owned ID belongs to another client");
+      }
+      if (detail::BrokerNowNs() - start > options_.timeout_ns) {
+        slot_->state.store(BrokerClientSlot::kDetaching,
+                           std::memory_order_release);
+        throw Error("pi3hat broker: broker did not accept client");
+      }
+      std::this_thread::yield();
+    }
+  }
+
+  std::unique_ptr<BrokerSharedMemory> memory_;
+  BrokerShared* const shared_;
+  const Options options_;
+  BrokerClientSlot* slot_ = nullptr;
+  uint64_t seq_ = 0;
+};
+
+}
+}
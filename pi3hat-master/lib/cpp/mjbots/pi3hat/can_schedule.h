@@ -0,0 +1,236 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "pi3hat.h"
+
+namespace mjbots {
+namespace pi3hat {
+
+/// Return the smallest CAN-FD payload size which can hold @p value
+/// bytes, or 0 if none can.
+inline size_t RoundUpDlc(size_t value) {
+  if (value <= 8) { return value; }
+  if (value <= 12) { return 12; }
+  if (value <= 16) { return 16; }
+  if (value <= 20) { return 20; }
+  if (value <= 24) { return 24; }
+  if (value <= 32) { return 32; }
+  if (value <= 48) { return 48; }
+  if (value <= 64) { return 64; }
+  return 0;
+}
+
+/// Estimate how long @p frame occupies a bus configured as @p config,
+/// in nanoseconds.
+///
+/// The arbitration and trailing fields are sent at the slow bitrate,
+/// and with BRS the control, data and CRC fields at the fast
+/// bitrate.  Dynamic bit stuffing is approximated as one bit in ten.
+inline int64_t EstimateCanFrameNs(
+    const Pi3Hat::CanConfiguration& config, const CanFrame& frame) {
+  const bool extended = frame.id > 0x7ff;
+  const int data_bytes = static_cast<int>(RoundUpDlc(frame.size));
+  const bool fd = config.fdcan_frame;
+
+  // SOF, identifier, and the RTR/IDE/FDF/r0/BRS or equivalent bits.
+  const int arbitration_bits = extended ? 38 : 19;
+  // CRC delimiter, ACK, EOF and interframe space.
+  const int trailer_bits = 13;
+  // ESI and DLC, then the CRC with its fixed stuff bits.
+  const int crc_bits = !fd ? 15 : (data_bytes <= 16 ? 22 : 27);
+  const int data_bits = 5 + 8 * data_bytes + crc_bits;
+
+  const int64_t slow_bps = std::max(1, config.slow_bitrate);
+  const int64_t fast_bps =
+      (fd && config.bitrate_switch) ?
+      std::max(1, config.fast_bitrate) : slow_bps;
+
+  const int64_t slow_ns =
+      (arbitration_bits + trailer_bits) * 1100000000ll / slow_bps;
+  const int64_t fast_ns = data_bits * 1100000000ll / fast_bps;
+  return slow_ns + fast_ns;
+}
+
+/// Orders outgoing CAN frames so that the last reply of a cycle
+/// arrives as early as possible.
+///
+/// Each frame's round trip is estimated as its own bus time, plus
+/// the same again if it expects a reply, as moteus replies are
+/// similar in size to the commands that prompt them.  Then:
+///
+///  * Within a bus, frames expecting a reply go first, longest round
+///    trip first, followed by all others in their original order.
+///    Frames for the same destination ID are never reordered, as the
+///    servo handles them in the order they arrive.
+///
+///  * Across buses, each frame is given to the bus which is about to
+///    go idle and has the most work remaining.  Every frame is
+///    assumed to take 'spi_frame_ns' to hand over, during which the
+///    busy buses keep transmitting.
+///
+/// No memory is allocated once the internal storage has grown to
+/// the largest cycle seen.
+///
+/// Interleave and Finish rely on the estimates from Plan, so they
+/// throw Error unless the same @p packets were planned since the last
+/// Clear.
+class CanTxScheduler {
+ public:
+  static constexpr int kMaxBus = 5;
+
+  using Packets = std::vector<int>[kMaxBus + 1];
+
+  /// Sort each entry of @p packets, which holds indices into
+  /// @p frames, and estimate the work on each bus.
+  void Plan(const Span<CanFrame>& frames,
+            const Pi3Hat::CanConfiguration (&config)[kMaxBus],
+            Packets* packets) {
+    planned_ = packets;
+    round_trip_ns_.resize(frames.size());
+    for (size_t i = 0; i < frames.size(); i++) {
+      const auto& frame = frames[i];
+      const int bus = frame.bus;
+      const auto frame_ns =
+          (bus >= 1 && bus <= kMaxBus) ?
+          EstimateCanFrameNs(config[bus - 1], frame) : 0;
+      round_trip_ns_[i] = frame_ns * (frame.expect_reply ? 2 : 1);
+    }
+
+    for (int bus = 0; bus <= kMaxBus; bus++) {
+      auto& list = (*packets)[bus];
+      work_ns_[bus] = 0;
+      for (const auto index : list) {
+        work_ns_[bus] += round_trip_ns_[index];
+      }
+
+      // An insertion sort, as std::stable_sort may allocate, and
+      // there are rarely more than a handful of frames per bus.
+      for (size_t i = 1; i < list.size(); i++) {
+        const int value = list[i];
+        size_t j = i;
+        while (j > 0 && Before(frames, value, list[j - 1])) {
+          list[j] = list[j - 1];
+          j--;
+        }
+        list[j] = value;
+      }
+    }
+  }
+
+  /// Discard the most recent Plan.  This should be called whenever a
+  /// new cycle's frames are sorted into the packet lists.
+  void Clear() {
+    planned_ = nullptr;
+  }
+
+  /// The total estimated round trip time of every frame on @p bus
+  /// from the most recent Plan.
+  int64_t work_ns(int bus) const { return work_ns_[bus]; }
+
+  /// Call @p emit(bus, index) once for every frame on the
+  /// @p bus_count buses listed in @p buses, in the order they should
+  /// be transmitted.
+  template <typename Emit>
+  void Interleave(const Packets& packets, const int* buses, int bus_count,
+                  int64_t spi_frame_ns, Emit emit) {
+    CheckPlanned(packets);
+
+    int64_t remaining_ns[kMaxBus + 1] = {};
+    int64_t busy_until_ns[kMaxBus + 1] = {};
+    size_t offset[kMaxBus + 1] = {};
+    for (int i = 0; i < bus_count; i++) {
+      remaining_ns[buses[i]] = work_ns_[buses[i]];
+    }
+
+    int64_t now_ns = 0;
+    while (true) {
+      int best = -1;
+      bool best_idle = false;
+      int64_t best_finish_ns = 0;
+      for (int i = 0; i < bus_count; i++) {
+        const int bus = buses[i];
+        if (offset[bus] >= packets[bus].size()) { continue; }
+
+        const bool idle = busy_until_ns[bus] <= (now_ns + spi_frame_ns);
+        const int64_t finish_ns =
+            std::max(now_ns, busy_until_ns[bus]) + remaining_ns[bus];
+        if (best < 0 ||
+            (idle && !best_idle) ||
+            (idle == best_idle && finish_ns > best_finish_ns)) {
+          best = bus;
+          best_idle = idle;
+          best_finish_ns = finish_ns;
+        }
+      }
+      if (best < 0) { return; }
+
+      const int index = packets[best][offset[best]++];
+      emit(best, index);
+
+      now_ns += spi_frame_ns;
+      busy_until_ns[best] =
+          std::max(now_ns, busy_until_ns[best]) + round_trip_ns_[index];
+      remaining_ns[best] -= round_trip_ns_[index];
+    }
+  }
+
+  /// The estimated time at which the busiest of @p buses would
+  /// finish, if it were serviced first.  This is used to decide which
+  /// group of buses to service first.
+  int64_t Finish(const Packets& packets, const int* buses, int bus_count,
+                 int64_t spi_frame_ns) const {
+    CheckPlanned(packets);
+
+    int64_t result = 0;
+    for (int i = 0; i < bus_count; i++) {
+      const int bus = buses[i];
+      if (packets[bus].empty()) { continue; }
+      result = std::max(result, spi_frame_ns + work_ns_[bus]);
+    }
+    return result;
+  }
+
+ private:
+  void CheckPlanned(const Packets& packets) const {
+    if (planned_ != &packets) {
+      throw Error("CanTxScheduler: packets used without a Plan");
+    }
+  }
+
+  /// The insertion sort in Plan only moves a frame ahead of those it
+  /// is Before, so this being false for a shared destination keeps
+  /// those frames in order.
+  bool Before(const Span<CanFrame>& frames, int lhs, int rhs) const {
+    if ((frames[lhs].id & 0x7f) == (frames[rhs].id & 0x7f)) { return false; }
+    const bool lhs_reply = frames[lhs].expect_reply;
+    const bool rhs_reply = frames[rhs].expect_reply;
+    if (lhs_reply != rhs_reply) { return lhs_reply; }
+    if (!lhs_reply) { return false; }
+    return round_trip_ns_[lhs] > round_trip_ns_[rhs];
+  }
+
+  const Packets* planned_ = nullptr;
+  std::vector<int64_t> round_trip_ns_;
+  int64_t work_ns_[kMaxBus + 1] = {};
+};
+
+}
+}
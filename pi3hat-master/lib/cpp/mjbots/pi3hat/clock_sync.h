@@ -0,0 +1,112 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+
+namespace mjbots {
+namespace pi3hat {
+
+/// Maps times from a free running 32 bit microsecond device clock,
+/// like that of the pi3 hat, onto a host clock.
+///
+/// Each observation pairs a device time with a host time which is
+/// known to be no earlier than it.  Their difference is the clock
+/// offset plus some non-negative latency.  This tracks the lower
+/// envelope of that difference: a smaller difference is always
+/// accepted, while a larger one can only raise the estimate at a
+/// rate which bounds the relative drift of the two oscillators.
+/// Latency spikes then have little effect, and the estimate is only
+/// late by the smallest latency seen recently.
+///
+/// Device times passed to 'ToHost' must be within ~35 minutes of the
+/// most recent observation.
+class ClockSync {
+ public:
+  struct Options {
+    // The largest rate at which the host clock can gain on the
+    // device clock.  Crystal oscillators are typically within 50ppm
+    // of nominal.
+    double max_drift = 100e-6;
+
+    // An observation this far from the estimate, in either direction,
+    // restarts it.  This happens if the device resets.
+    int64_t reset_ns = 100000000;
+
+    Options() {}
+  };
+
+  ClockSync(const Options& options = Options()) : options_(options) {}
+
+  /// 'device_us' was current no later than 'host_ns'.
+  void Observe(uint32_t device_us, int64_t host_ns) {
+    if (!valid_) {
+      Reset(device_us, host_ns);
+      return;
+    }
+
+    const int64_t device_ns = Unwrap(device_us) * 1000;
+    const int64_t sample_ns = host_ns - device_ns;
+    if (std::abs(sample_ns - offset_ns_) > options_.reset_ns) {
+      Reset(device_us, host_ns);
+      return;
+    }
+
+    const int64_t elapsed_ns =
+        std::max<int64_t>(0, device_ns - extended_us_ * 1000);
+    const int64_t allowed_ns =
+        offset_ns_ + static_cast<int64_t>(options_.max_drift * elapsed_ns);
+
+    offset_ns_ = std::min(sample_ns, allowed_ns);
+    extended_us_ = Unwrap(device_us);
+    last_us_ = device_us;
+  }
+
+  /// Return the host time corresponding to 'device_us', or 0 if
+  /// nothing has been observed yet.
+  int64_t ToHost(uint32_t device_us) const {
+    if (!valid_) { return 0; }
+    return Unwrap(device_us) * 1000 + offset_ns_;
+  }
+
+  bool valid() const { return valid_; }
+
+  /// The current estimate of host time minus device time.
+  int64_t offset_ns() const { return offset_ns_; }
+
+ private:
+  void Reset(uint32_t device_us, int64_t host_ns) {
+    valid_ = true;
+    last_us_ = device_us;
+    extended_us_ = device_us;
+    offset_ns_ = host_ns - extended_us_ * 1000;
+  }
+
+  int64_t Unwrap(uint32_t device_us) const {
+    return extended_us_ + static_cast<int32_t>(device_us - last_us_);
+  }
+
+  const Options options_;
+
+  bool valid_ = false;
+  uint32_t last_us_ = 0;
+  int64_t extended_us_ = 0;
+  int64_t offset_ns_ = 0;
+};
+
+}
+}
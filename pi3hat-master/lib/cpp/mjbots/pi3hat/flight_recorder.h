@@ -0,0 +1,475 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+// We purposefully don't use the full path here so that this file can
+// be compiled in a wide range of build configurations.
+#include "pi3hat.h"
+
+/// @file
+///
+/// A black box recorder which keeps the most recent cycles in a fixed
+/// size ring, stored in a memory mapped file.  Recording never
+/// allocates, locks, or makes a system call, so it is safe to use
+/// from the realtime thread.  As the file is a shared mapping, its
+/// contents survive the process crashing, and can be decoded
+/// afterwards with flight_recorder_tool.
+///
+/// File layout:
+///
+///  * byte 0-4095: 'FlightRecorder::FileHeader'
+///  * byte 4096+: the ring, of 'FileHeader::capacity' bytes
+///
+/// Each ring entry is a 'RecordHeader' followed by its payload,
+/// padded to a multiple of 8 bytes.  Entries never wrap around the
+/// end of the ring.  If there is not room for a header before the
+/// end, the remainder of the ring is skipped, otherwise a padding
+/// record fills it.
+
+namespace mjbots {
+namespace pi3hat {
+
+class FlightRecorder {
+ public:
+  // Version 2 added Attitude::timestamp_ns.
+  static constexpr uint32_t kVersion = 2;
+  static constexpr size_t kHeaderSize = 4096;
+
+  struct FileHeader {
+    char magic[8] = {};
+    uint32_t version = 0;
+    uint32_t header_size = 0;
+    uint64_t capacity = 0;
+
+    // The total number of bytes ever written to the ring.
+    std::atomic<uint64_t> head{0};
+    // The position, in the same units as 'head', of the oldest
+    // complete record.
+    std::atomic<uint64_t> tail{0};
+  };
+
+  enum RecordType : uint32_t {
+    kPadding = 0,
+    kCycle = 1,
+
+    // Applications may use any type from here on.
+    kUser = 0x10000,
+  };
+
+  struct RecordHeader {
+    // The size of the entire record, including this header.
+    uint32_t size = 0;
+    uint32_t type = 0;
+    uint64_t sequence = 0;
+    int64_t timestamp_ns = 0;
+  };
+
+  /// The payload of a kCycle record.  It is followed by 'tx_count'
+  /// then 'rx_count' instances of a FrameHeader and its data.
+  struct CycleHeader {
+    int64_t start_ns = 0;
+    int64_t end_ns = 0;
+    int32_t error = 0;
+    uint16_t tx_count = 0;
+    uint16_t rx_count = 0;
+    uint8_t attitude_present = 0;
+    uint8_t reserved[7] = {};
+    Attitude attitude;
+  };
+
+  struct FrameHeader {
+    uint32_t id = 0;
+    uint8_t bus = 0;
+    uint8_t size = 0;
+    uint8_t expect_reply = 0;
+    uint8_t reserved = 0;
+  };
+
+  struct Options {
+    // The size of the ring in bytes.  It is rounded up to a multiple
+    // of 8.
+    size_t size = 16 << 20;
+
+    // If true, the whole file is locked into memory, so that no
+    // recording ever takes a page fault.
+    bool lock = true;
+
+    Options() {}
+  };
+
+  /// Create (or truncate) @p filename and map it.  This may throw an
+  /// instance of `Error`.
+  FlightRecorder(const std::string& filename,
+                 const Options& options = Options())
+      : capacity_((std::max<size_t>(options.size, 4096) + 7) & ~size_t(7)) {
+    fd_ = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                 0644);
+    if (fd_ < 0) {
+      throw Error("FlightRecorder: could not open " + filename);
+    }
+    const size_t total = kHeaderSize + capacity_;
+    if (::ftruncate(fd_, total) < 0) {
+      ::close(fd_);
+      throw Error("FlightRecorder: could not size " + filename);
+    }
+    void* const ptr = ::mmap(nullptr, total, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, fd_, 0);
+    if (ptr == MAP_FAILED) {
+      ::close(fd_);
+      throw Error("FlightRecorder: could not map " + filename);
+    }
+    if (options.lock) {
+      // This is best effort, as it requires privileges.
+      ::mlock(ptr, total);
+    }
+    base_ = static_cast<uint8_t*>(ptr);
+    ring_ = base_ + kHeaderSize;
+
+    header_ = new (base_) FileHeader();
+    std::memcpy(header_->magic, magic(), sizeof(header_->magic));
+    header_->version = kVersion;
+    header_->header_size = kHeaderSize;
+    header_->capacity = capacity_;
+  }
+
+  ~FlightRecorder() {
+    ::msync(base_, kHeaderSize + capacity_, MS_ASYNC);
+    ::munmap(base_, kHeaderSize + capacity_);
+    ::close(fd_);
+  }
+
+  FlightRecorder(const FlightRecorder&) = delete;
+  FlightRecorder& operator=(const FlightRecorder&) = delete;
+
+  /// Append one cycle.  Only one thread may record at a time.
+  void RecordCycle(const Pi3Hat::Input& input, const Pi3Hat::Output& output,
+                   int64_t start_ns, int64_t end_ns) {
+    const size_t tx_count = input.tx_can.size();
+    const size_t rx_count = output.rx_can_size;
+
+    size_t payload = sizeof(CycleHeader);
+    for (size_t i = 0; i < tx_count; i++) {
+      payload += sizeof(FrameHeader) + input.tx_can[i].size;
+    }
+    for (size_t i = 0; i < rx_count; i++) {
+      payload += sizeof(FrameHeader) + input.rx_can[i].size;
+    }
+
+    uint8_t* ptr = Begin(kCycle, end_ns, payload);
+    if (ptr == nullptr) { return; }
+
+    CycleHeader cycle;
+    cycle.start_ns = start_ns;
+    cycle.end_ns = end_ns;
+    cycle.error = output.error;
+    cycle.tx_count = tx_count;
+    cycle.rx_count = rx_count;
+    cycle.attitude_present = output.attitude_present ? 1 : 0;
+    if (output.attitude_present && input.attitude) {
+      cycle.attitude = *input.attitude;
+    }
+    std::memcpy(ptr, &cycle, sizeof(cycle));
+    ptr += sizeof(cycle);
+
+    for (size_t i = 0; i < tx_count; i++) {
+      ptr = WriteFrame(ptr, input.tx_can[i]);
+    }
+    for (size_t i = 0; i < rx_count; i++) {
+      ptr = WriteFrame(ptr, input.rx_can[i]);
+    }
+
+    Commit();
+  }
+
+  /// Append an arbitrary record.  @p type should be kUser or greater.
+  void Record(uint32_t type, int64_t timestamp_ns,
+              const void* data, size_t size) {
+    uint8_t* const ptr = Begin(type, timestamp_ns, size);
+    if (ptr == nullptr) { return; }
+    std::memcpy(ptr, data, size);
+    Commit();
+  }
+
+  /// The number of records which were too large to ever fit.
+  uint64_t dropped() const { return dropped_; }
+
+  /// The first 8 bytes of every file.
+  static const char* magic() { return "pi3hatFR"; }
+
+  static constexpr size_t Align(size_t value) {
+    return (value + 7) & ~size_t(7);
+  }
+
+ private:
+  static uint8_t* WriteFrame(uint8_t* ptr, const CanFrame& frame) {
+    FrameHeader header;
+    header.id = frame.id;
+    header.bus = frame.bus;
+    header.size = frame.size;
+    header.expect_reply = frame.expect_reply ? 1 : 0;
+    std::memcpy(ptr, &header, sizeof(header));
+    std::memcpy(ptr + sizeof(header), frame.data, frame.size);
+    return ptr + sizeof(header) + frame.size;
+  }
+
+  /// Reserve room for a record, and return where its payload should
+  /// be written, or nullptr if it can never fit.
+  uint8_t* Begin(uint32_t type, int64_t timestamp_ns, size_t payload) {
+    const size_t size = Align(sizeof(RecordHeader) + payload);
+    if (size > capacity_ / 2) {
+      dropped_++;
+      return nullptr;
+    }
+
+    uint64_t head = head_;
+    size_t offset = head % capacity_;
+    const size_t remaining = capacity_ - offset;
+    if (remaining < size) {
+      // This record will not fit before the end, so skip to the
+      // beginning.
+      MakeRoom(head + remaining);
+      if (remaining >= sizeof(RecordHeader)) {
+        RecordHeader padding;
+        padding.size = remaining;
+        padding.type = kPadding;
+        std::memcpy(&ring_[offset], &padding, sizeof(padding));
+      }
+      head += remaining;
+      offset = 0;
+    }
+
+    MakeRoom(head + size);
+    pending_head_ = head + size;
+
+    RecordHeader header;
+    header.size = size;
+    header.type = type;
+    header.sequence = sequence_++;
+    header.timestamp_ns = timestamp_ns;
+    std::memcpy(&ring_[offset], &header, sizeof(header));
+
+    return &ring_[offset + sizeof(header)];
+  }
+
+  void Commit() {
+    head_ = pending_head_;
+    header_->head.store(head_, std::memory_order_release);
+  }
+
+  /// Discard the oldest records until everything before @p end fits
+  /// in the ring.
+  void MakeRoom(uint64_t end) {
+    uint64_t tail = tail_;
+    while (end - tail > capacity_) {
+      const size_t offset = tail % capacity_;
+      const size_t remaining = capacity_ - offset;
+      if (remaining < sizeof(RecordHeader)) {
+        tail += remaining;
+        continue;
+      }
+      RecordHeader header;
+      std::memcpy(&header, &ring_[offset], sizeof(header));
+      tail += header.size;
+    }
+    if (tail == tail_) { return; }
+
+    tail_ = tail;
+    header_->tail.store(tail_, std::memory_order_relaxed);
+    // A reader which observes any of the overwritten data is
+    // guaranteed to also observe the new tail.
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  const size_t capacity_;
+  int fd_ = -1;
+  uint8_t* base_ = nullptr;
+  uint8_t* ring_ = nullptr;
+  FileHeader* header_ = nullptr;
+
+  uint64_t head_ = 0;
+  uint64_t pending_head_ = 0;
+  uint64_t tail_ = 0;
+  uint64_t sequence_ = 0;
+  uint64_t dropped_ = 0;
+};
+
+/// Reads the records from a file written by FlightRecorder, oldest
+/// first.  The file may still be in the process of being written.
+class FlightRecordReader {
+ public:
+  using Recorder = FlightRecorder;
+
+  struct Record {
+    Recorder::RecordHeader header;
+    std::vector<uint8_t> data;
+  };
+
+  struct Cycle {
+    Recorder::CycleHeader header;
+    std::vector<CanFrame> tx_can;
+    std::vector<CanFrame> rx_can;
+  };
+
+  /// This may throw an instance of `Error`.
+  FlightRecordReader(const std::string& filename) {
+    fd_ = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_ < 0) {
+      throw Error("FlightRecordReader: could not open " + filename);
+    }
+    struct stat st = {};
+    if (::fstat(fd_, &st) < 0 ||
+        static_cast<size_t>(st.st_size) < Recorder::kHeaderSize) {
+      ::close(fd_);
+      throw Error("FlightRecordReader: file too small " + filename);
+    }
+    size_ = st.st_size;
+    void* const ptr = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd_, 0);
+    if (ptr == MAP_FAILED) {
+      ::close(fd_);
+      throw Error("FlightRecordReader: could not map " + filename);
+    }
+    base_ = static_cast<const uint8_t*>(ptr);
+    header_ = reinterpret_cast<const Recorder::FileHeader*>(base_);
+
+    if (std::memcmp(header_->magic, Recorder::magic(),
+                    sizeof(header_->magic)) != 0 ||
+        header_->version != Recorder::kVersion ||
+        header_->header_size + header_->capacity > size_) {
+      ::munmap(const_cast<uint8_t*>(base_), size_);
+      ::close(fd_);
+      throw Error("FlightRecordReader: not a flight record " + filename);
+    }
+    ring_ = base_ + header_->header_size;
+    capacity_ = header_->capacity;
+
+    Rewind();
+  }
+
+  ~FlightRecordReader() {
+    ::munmap(const_cast<uint8_t*>(base_), size_);
+    ::close(fd_);
+  }
+
+  FlightRecordReader(const FlightRecordReader&) = delete;
+  FlightRecordReader& operator=(const FlightRecordReader&) = delete;
+
+  /// Start again from the oldest record currently present.
+  void Rewind() {
+    end_ = header_->head.load(std::memory_order_acquire);
+    position_ = header_->tail.load(std::memory_order_acquire);
+  }
+
+  /// Fill @p record with the next record, skipping padding.  Returns
+  /// false once there are no more.
+  bool Next(Record* record) {
+    while (position_ < end_) {
+      const size_t offset = position_ % capacity_;
+      const size_t remaining = capacity_ - offset;
+      if (remaining < sizeof(Recorder::RecordHeader)) {
+        position_ += remaining;
+        continue;
+      }
+
+      std::memcpy(&record->header, &ring_[offset], sizeof(record->header));
+      const size_t size = record->header.size;
+      if (size < sizeof(Recorder::RecordHeader) || size > remaining) {
+        // The file is corrupt.
+        position_ = end_;
+        return false;
+      }
+      record->data.assign(&ring_[offset + sizeof(record->header)],
+                          &ring_[offset + size]);
+
+      // If the writer has overwritten this while we were copying,
+      // then we have lost our place.
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (header_->tail.load(std::memory_order_relaxed) > position_) {
+        position_ = header_->tail.load(std::memory_order_relaxed);
+        continue;
+      }
+
+      position_ += size;
+      if (record->header.type == Recorder::kPadding) { continue; }
+      return true;
+    }
+    return false;
+  }
+
+  /// Decode a kCycle record.  Returns false if it is malformed.
+  static bool ParseCycle(const Record& record, Cycle* cycle) {
+    if (record.header.type != Recorder::kCycle) { return false; }
+    const uint8_t* ptr = record.data.data();
+    const uint8_t* const end = ptr + record.data.size();
+    if (static_cast<size_t>(end - ptr) < sizeof(cycle->header)) {
+      return false;
+    }
+    std::memcpy(&cycle->header, ptr, sizeof(cycle->header));
+    ptr += sizeof(cycle->header);
+
+    auto read_frames = [&](size_t count, std::vector<CanFrame>* frames) {
+      frames->clear();
+      for (size_t i = 0; i < count; i++) {
+        Recorder::FrameHeader header;
+        if (static_cast<size_t>(end - ptr) < sizeof(header)) { return false; }
+        std::memcpy(&header, ptr, sizeof(header));
+        ptr += sizeof(header);
+        if (header.size > 64 ||
+            static_cast<size_t>(end - ptr) < header.size) {
+          return false;
+        }
+        CanFrame frame;
+        frame.id = header.id;
+        frame.bus = header.bus;
+        frame.size = header.size;
+        frame.expect_reply = header.expect_reply != 0;
+        std::memcpy(frame.data, ptr, header.size);
+        ptr += header.size;
+        frames->push_back(frame);
+      }
+      return true;
+    };
+
+    return read_frames(cycle->header.tx_count, &cycle->tx_can) &&
+        read_frames(cycle->header.rx_count, &cycle->rx_can);
+  }
+
+ private:
+  int fd_ = -1;
+  size_t size_ = 0;
+  const uint8_t* base_ = nullptr;
+  const uint8_t* ring_ = nullptr;
+  const Recorder::FileHeader* header_ = nullptr;
+  size_t capacity_ = 0;
+
+  uint64_t position_ = 0;
+  uint64_t end_ = 0;
+};
+
+}
+}
@@ -0,0 +1,173 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+///
+/// Decode a file written by FlightRecorder as text, one record per
+/// line, with any CAN frames and attitude on following lines.
+///
+/// NOTE: This needs nothing from the Raspberry Pi, and can be
+/// compiled on any host using:
+///
+/// g++ -std=c++11 flight_recorder_tool.cc -o flight_recorder_tool
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "flight_recorder.h"
+
+namespace mjbots {
+namespace pi3hat {
+
+namespace {
+
+struct Arguments {
+  Arguments(const std::vector<std::string>& args) {
+    for (size_t i = 0; i < args.size(); i++) {
+      const auto& arg = args[i];
+      if (arg == "-h" || arg == "--help") {
+        help = true;
+      } else if (arg == "-n" || arg == "--last") {
+        last = std::stoul(args.at(++i));
+      } else if (arg == "--no-frames") {
+        frames = false;
+      } else if (filename.empty()) {
+        filename = arg;
+      } else {
+        throw std::runtime_error("Unknown argument: " + arg);
+      }
+    }
+  }
+
+  bool help = false;
+  size_t last = 0;
+  bool frames = true;
+  std::string filename;
+};
+
+void DisplayUsage() {
+  std::cout << "Usage: flight_recorder_tool [options] FILE\n";
+  std::cout << "\n";
+  std::cout << "  -h,--help       display this usage message\n";
+  std::cout << "  -n,--last N     only display the last N records\n";
+  std::cout << "  --no-frames     do not display individual CAN frames\n";
+}
+
+std::string FormatCanFrame(const CanFrame& frame) {
+  char buf[16] = {};
+  std::string result = std::to_string(frame.bus) + ",";
+  ::snprintf(buf, sizeof(buf) - 1, "%X", frame.id);
+  result += std::string(buf) + ",";
+  for (size_t i = 0; i < frame.size; i++) {
+    ::snprintf(buf, sizeof(buf) - 1, "%02X", frame.data[i]);
+    result += buf;
+  }
+  if (frame.expect_reply) { result += ",r"; }
+  return result;
+}
+
+void DisplayRecord(const FlightRecordReader::Record& record,
+                   const Arguments& args) {
+  char buf[512] = {};
+  const auto& header = record.header;
+
+  if (header.type != FlightRecorder::kCycle) {
+    ::snprintf(buf, sizeof(buf) - 1,
+               "%llu %lld TYPE %u size=%u\n",
+               static_cast<unsigned long long>(header.sequence),
+               static_cast<long long>(header.timestamp_ns),
+               header.type,
+               static_cast<unsigned>(record.data.size()));
+    std::cout << buf;
+    return;
+  }
+
+  FlightRecordReader::Cycle cycle;
+  if (!FlightRecordReader::ParseCycle(record, &cycle)) {
+    ::snprintf(buf, sizeof(buf) - 1, "%llu malformed cycle\n",
+               static_cast<unsigned long long>(header.sequence));
+    std::cout << buf;
+    return;
+  }
+
+  const auto& c = cycle.header;
+  ::snprintf(buf, sizeof(buf) - 1,
+             "%llu %lld CYCLE %.1fus tx=%d rx=%d error=%d\n",
+             static_cast<unsigned long long>(header.sequence),
+             static_cast<long long>(c.start_ns),
+             (c.end_ns - c.start_ns) * 1e-3,
+             c.tx_count, c.rx_count, c.error);
+  std::cout << buf;
+
+  if (args.frames) {
+    for (const auto& frame : cycle.tx_can) {
+      std::cout << "  TX " << FormatCanFrame(frame) << "\n";
+    }
+    for (const auto& frame : cycle.rx_can) {
+      std::cout << "  RX " << FormatCanFrame(frame) << "\n";
+    }
+  }
+
+  if (c.attitude_present) {
+    const auto& a = c.attitude;
+    ::snprintf(buf, sizeof(buf) - 1,
+               "  ATT w=%.4f x=%.4f y=%.4f z=%.4f "
+               "dps=(%.2f,%.2f,%.2f) a=(%.2f,%.2f,%.2f)\n",
+               a.attitude.w, a.attitude.x, a.attitude.y, a.attitude.z,
+               a.rate_dps.x, a.rate_dps.y, a.rate_dps.z,
+               a.accel_mps2.x, a.accel_mps2.y, a.accel_mps2.z);
+    std::cout << buf;
+  }
+}
+
+int do_main(int argc, char** argv) {
+  Arguments args({argv + 1, argv + argc});
+
+  if (args.help || args.filename.empty()) {
+    DisplayUsage();
+    return args.help ? 0 : 1;
+  }
+
+  FlightRecordReader reader{args.filename};
+  FlightRecordReader::Record record;
+
+  size_t skip = 0;
+  if (args.last) {
+    size_t count = 0;
+    while (reader.Next(&record)) { count++; }
+    skip = (count > args.last) ? (count - args.last) : 0;
+    reader.Rewind();
+  }
+
+  while (reader.Next(&record)) {
+    if (skip) {
+      skip--;
+      continue;
+    }
+    DisplayRecord(record, args);
+  }
+
+  return 0;
+}
+
+}  // namespace
+}  // namespace pi3hat
+}  // namespace mjbots
+
+int main(int argc, char** argv) {
+  return mjbots::pi3hat::do_main(argc, argv);
+}
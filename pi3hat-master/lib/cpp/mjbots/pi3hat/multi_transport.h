@@ -0,0 +1,252 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+// We purposefully don't use the full path here so that this file can
+// be compiled in a wide range of build configurations.
+#include "transport.h"
+#include "worker_thread.h"
+
+/// @file
+///
+/// A transport which spreads each cycle across several others, for
+/// instance a pi3hat and some SocketCAN adapters, so that more buses
+/// can be used from one control loop.
+
+namespace mjbots {
+namespace pi3hat {
+
+/// Each device's buses are given a contiguous range of bus numbers.
+/// Frames are sent to whichever device owns their bus, all devices
+/// are cycled at once, and their replies are merged with their bus
+/// numbers translated back.
+class MultiTransport : public Transport {
+ public:
+  struct Device {
+    // This must outlive the MultiTransport.
+    Transport* transport = nullptr;
+
+    // Buses 1 to 'bus_count' on this device are addressed as buses
+    // 'bus_offset' + 1 to 'bus_offset' + 'bus_count'.
+    int bus_offset = 0;
+    int bus_count = 5;
+
+    // If true, this device is cycled from a WorkerThread of its own,
+    // which busy waits for work and so should be given its own CPU.
+    // Otherwise it is cycled from the calling thread, after all
+    // others are started.
+    bool own_thread = false;
+    int cpu = -1;
+    int realtime_priority = -1;
+
+    // If true, attitude and RF requests are sent to this device.  At
+    // most one device may set this.
+    bool primary = false;
+  };
+
+  struct Options {
+    std::vector<Device> devices;
+
+    Options() {}
+  };
+
+  MultiTransport(const Options& options)
+      : options_(options) {
+    std::fill(std::begin(bus_device_), std::end(bus_device_), -1);
+
+    int primary_count = 0;
+    for (const auto& device : options_.devices) {
+      if (!device.transport) {
+        throw std::logic_error("MultiTransport: device has no transport");
+      }
+      if (device.bus_offset < 0 || device.bus_count < 1 ||
+          device.bus_offset + device.bus_count > kMaxBus) {
+        throw std::logic_error("MultiTransport: bus range out of bounds");
+      }
+      for (int bus = device.bus_offset + 1;
+           bus <= device.bus_offset + device.bus_count; bus++) {
+        if (bus_device_[bus] >= 0) {
+          throw std::logic_error("MultiTransport: overlapping bus ranges");
+        }
+        bus_device_[bus] = static_cast<int>(devices_.size());
+      }
+      if (device.primary) { primary_count++; }
+
+      devices_.emplace_back(new DeviceState(device));
+    }
+    if (primary_count > 1) {
+      throw std::logic_error("MultiTransport: more than one primary device");
+    }
+  }
+
+  ~MultiTransport() {
+    // Stop all the threads before anything they use is destroyed.
+    devices_.clear();
+  }
+
+  Pi3Hat::Output Cycle(const Pi3Hat::Input& input) override {
+    for (auto& device : devices_) {
+      device->tx_can.clear();
+      device->rx_can.resize(input.rx_can.size());
+      device->force_can_check = 0;
+    }
+
+    for (const auto& frame : input.tx_can) {
+      if (frame.bus < 0 || frame.bus > kMaxBus || bus_device_[frame.bus] < 0) {
+        unrouted_frames_++;
+        continue;
+      }
+      auto& device = *devices_[bus_device_[frame.bus]];
+      device.tx_can.push_back(frame);
+      device.tx_can.back().bus -= device.options.bus_offset;
+    }
+    for (int bus = 1; bus <= kMaxBus; bus++) {
+      if ((input.force_can_check & (1u << bus)) == 0) { continue; }
+      if (bus_device_[bus] < 0) { continue; }
+      auto& device = *devices_[bus_device_[bus]];
+      device.force_can_check |= 1u << (bus - device.options.bus_offset);
+    }
+
+    for (auto& device : devices_) {
+      auto& child = device->input;
+      child = input;
+      child.tx_can = {device->tx_can.data(), device->tx_can.size()};
+      child.rx_can = {device->rx_can.data(), device->rx_can.size()};
+      child.force_can_check = device->force_can_check;
+      if (!device->options.primary) {
+        child.tx_rf = {};
+        child.rx_rf = {};
+        child.request_attitude = false;
+        child.request_attitude_detail = false;
+        child.wait_for_attitude = false;
+        child.request_rf = false;
+        child.attitude = nullptr;
+        child.request_imu_fifo = false;
+        child.rx_imu = {};
+      }
+    }
+
+    for (auto& device : devices_) {
+      if (device->worker) { device->worker->Start(); }
+    }
+    // Every device is finished before the first error is passed on,
+    // so that no worker is still using 'input' when we return.
+    std::exception_ptr error;
+    for (auto& device : devices_) {
+      if (device->worker) { continue; }
+      try {
+        device->Cycle();
+      } catch (...) {
+        if (!error) { error = std::current_exception(); }
+      }
+    }
+    for (auto& device : devices_) {
+      if (!device->worker) { continue; }
+      try {
+        device->worker->Wait();
+      } catch (...) {
+        if (!error) { error = std::current_exception(); }
+      }
+    }
+    if (error) { std::rethrow_exception(error); }
+
+    Pi3Hat::Output result;
+    for (auto& device : devices_) {
+      const auto& output = device->output;
+      if (output.error && !result.error) { result.error = output.error; }
+      if (device->options.primary) {
+        result.attitude_present = output.attitude_present;
+        result.rx_rf_size = output.rx_rf_size;
+        result.rf_lock_age_ms = output.rf_lock_age_ms;
+        result.rx_imu_size = output.rx_imu_size;
+        result.imu_fifo_overflow_count = output.imu_fifo_overflow_count;
+      }
+      for (size_t i = 0; i < output.rx_can_size; i++) {
+        if (result.rx_can_size >= input.rx_can.size()) {
+          dropped_frames_++;
+          continue;
+        }
+        auto& out = input.rx_can[result.rx_can_size++];
+        out = device->rx_can[i];
+        out.bus += device->options.bus_offset;
+      }
+    }
+
+    return result;
+  }
+
+  /// Returns the clock of the first device.
+  int64_t now_ns() override {
+    return devices_.empty() ? 0 : devices_[0]->options.transport->now_ns();
+  }
+
+  /// The number of frames sent to a bus that no device owns.
+  uint64_t unrouted_frames() const { return unrouted_frames_; }
+
+  /// The number of received frames for which 'rx_can' had no room.
+  uint64_t dropped_frames() const { return dropped_frames_; }
+
+  static constexpr int kMaxBus = 31;
+
+ private:
+  struct DeviceState {
+    DeviceState(const Device& options_in)
+        : options(options_in) {
+      if (options.own_thread) {
+        WorkerThread::Options worker_options;
+        worker_options.cpu = options.cpu;
+        worker_options.realtime_priority = options.realtime_priority;
+        worker.reset(
+            new WorkerThread([this]() { Cycle(); }, worker_options));
+      }
+    }
+
+    ~DeviceState() {
+      worker.reset();
+    }
+
+    void Cycle() {
+      output = options.transport->Cycle(input);
+    }
+
+    const Device options;
+
+    std::vector<CanFrame> tx_can;
+    std::vector<CanFrame> rx_can;
+    uint32_t force_can_check = 0;
+    Pi3Hat::Input input;
+    Pi3Hat::Output output;
+
+    std::unique_ptr<WorkerThread> worker;
+  };
+
+  const Options options_;
+  std::vector<std::unique_ptr<DeviceState>> devices_;
+  // The index into 'devices_' for each bus, or -1.
+  int bus_device_[kMaxBus + 1] = {};
+
+  uint64_t unrouted_frames_ = 0;
+  uint64_t dropped_frames_ = 0;
+};
+
+}
+}
@@ -15,23 +15,39 @@
 // We purposefully don't use the full path here so that this file can
 // be compiled in a wide range of build configurations.
 #include "pi3hat.h"
+#include "can_schedule.h"
+#include "clock_sync.h"
+#include "flight_recorder.h"
+#include "reply_timeout.h"
+#include "spi_framing.h"
+#include "spi_tuning.h"
+#include "worker_thread.h"
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
 #include <cstdlib>
 #include <fstream>
+#include <functional>
 #include <memory>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <bcm_host.h>
@@ -49,25 +65,10 @@ namespace {
 ///////////////////////////////////////////////
 /// Random utility functions
 
-size_t RoundUpDlc(size_t value) {
-  if (value == 0) { return 0; }
-  if (value == 1) { return 1; }
-  if (value == 2) { return 2; }
-  if (value == 3) { return 3; }
-  if (value == 4) { return 4; }
-  if (value == 5) { return 5; }
-  if (value == 6) { return 6; }
-  if (value == 7) { return 7; }
-  if (value == 8) { return 8; }
-  if (value <= 12) { return 12; }
-  if (value <= 16) { return 16; }
-  if (value <= 20) { return 20; }
-  if (value <= 24) { return 24; }
-  if (value <= 32) { return 32; }
-  if (value <= 48) { return 48; }
-  if (value <= 64) { return 64; }
-  return 0;
-}
+// The CAN buses attached to the auxiliary processors, in chip select
+// order, and to the primary processor.
+constexpr int kAuxCanBuses[4] = { 1, 2, 3, 4 };
+constexpr int kPrimaryCanBus[1] = { 5 };
 
 char g_format_buf[2048] = {};
 
@@ -108,6 +109,15 @@ int64_t GetNow() {
       static_cast<int64_t>(ts.tv_nsec);
 }
 
+/// Unlike GetNow, this is in the same timebase as other system
+/// timestamps, like those of sockets.
+int64_t GetMonotonicNow() {
+  struct timespec ts = {};
+  ::clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000000ll +
+      static_cast<int64_t>(ts.tv_nsec);
+}
+
 void BusyWaitUs(int64_t us) {
   // We wait to ensure that setup and hold times are properly
   // enforced.  Allowing data stores and loads to be re-ordered around
@@ -238,7 +248,7 @@ class Rpi3Gpio {
  public:
   static constexpr uint32_t GPIO_BASE          = 0x00200000;
 
-  // static constexpr uint32_t INPUT = 0;
+  static constexpr uint32_t INPUT = 0;
   static constexpr uint32_t OUTPUT = 1;
   static constexpr uint32_t ALT_0 = 4;
   // static constexpr uint32_t ALT_1 = 5;
@@ -268,6 +278,11 @@ class Rpi3Gpio {
     }
   }
 
+  bool GetGpioInput(uint32_t gpio) const {
+    const uint32_t reg_offset = gpio / 32 + 13;
+    return (gpio_[reg_offset] >> (gpio % 32)) & 1;
+  }
+
   volatile uint32_t& operator[](int index) { return gpio_[index]; }
   const volatile uint32_t& operator[](int index) const { return gpio_[index]; }
 
@@ -292,12 +307,229 @@ class Rpi3Gpio {
 };
 
 
+/// Manages a block of physically contiguous, uncached memory
+/// allocated from the VideoCore through the mailbox interface, as is
+/// required for anything the DMA controller touches.
+class VcMemory {
+ public:
+  VcMemory(int dev_mem_fd, size_t size) : size_(size) {
+    vcio_fd_ = ::open("/dev/vcio", 0);
+    ThrowIfErrno(vcio_fd_ < 0, "pi3hat: could not open /dev/vcio");
+
+    // The direct uncached alias is needed on everything but the
+    // original Pi, which only has the L2 coherent alias.
+    const uint32_t flags =
+        (bcm_host_get_sdram_address() == 0x40000000) ? 0x0c : 0x04;
+
+    handle_ = Property(0x3000c, size_, 4096, flags);
+    ThrowIf(handle_ == 0, []() { return "pi3hat: could not allocate VC memory"; });
+
+    bus_address_ = Property(0x3000d, handle_);
+    ThrowIf(bus_address_ == 0, []() { return "pi3hat: could not lock VC memory"; });
+
+    mmap_ = SystemMmap(dev_mem_fd, size_, bus_address_ & ~0xc0000000);
+    ptr_ = static_cast<char*>(mmap_.ptr());
+    ::memset(ptr_, 0, size_);
+  }
+
+  ~VcMemory() {
+    // Who cares about errors here?
+    Property(0x3000e, handle_);
+    Property(0x3000f, handle_);
+  }
+
+  VcMemory(const VcMemory&) = delete;
+  VcMemory& operator=(const VcMemory&) = delete;
+
+  /// Return the VideoCore bus address of the given location in this
+  /// block.
+  uint32_t bus_address(const volatile void* ptr) const {
+    return bus_address_ + static_cast<uint32_t>(
+        reinterpret_cast<const volatile char*>(ptr) - ptr_);
+  }
+
+  char* ptr() { return ptr_; }
+
+ private:
+  template <typename... Args>
+  uint32_t Property(uint32_t tag, Args... args) {
+    uint32_t values[] = { static_cast<uint32_t>(args)... };
+    constexpr size_t kNumValues = sizeof...(Args);
+
+    uint32_t buf[32] = {};
+    size_t i = 0;
+    buf[i++] = 0;  // size, filled in below
+    buf[i++] = 0;  // process request
+    buf[i++] = tag;
+    buf[i++] = kNumValues * sizeof(uint32_t);
+    buf[i++] = kNumValues * sizeof(uint32_t);
+    for (auto value : values) { buf[i++] = value; }
+    buf[i++] = 0;  // end tag
+    buf[0] = i * sizeof(uint32_t);
+
+    if (::ioctl(vcio_fd_, _IOWR(100, 0, char*), buf) < 0) { return 0; }
+    return buf[5];
+  }
+
+  SystemFd vcio_fd_;
+  const size_t size_;
+  uint32_t handle_ = 0;
+  uint32_t bus_address_ = 0;
+  SystemMmap mmap_;
+  char* ptr_ = nullptr;
+};
+
+/// A minimal driver for one channel of the BCM2835/6/7/2711 "legacy"
+/// DMA controller.
+class Bcm2835Dma {
+ public:
+  static constexpr uint32_t DMA_BASE = 0x007000;
+
+  static constexpr uint32_t DMA_CS_ACTIVE = 1 << 0;
+  static constexpr uint32_t DMA_CS_END = 1 << 1;
+  static constexpr uint32_t DMA_CS_ERROR = 1 << 8;
+  static constexpr uint32_t DMA_CS_RESET = 1u << 31;
+  static constexpr uint32_t DMA_CS_WAIT_FOR_WRITES = 1 << 28;
+
+  static constexpr uint32_t DMA_TI_WAIT_RESP = 1 << 3;
+  static constexpr uint32_t DMA_TI_DEST_INC = 1 << 4;
+  static constexpr uint32_t DMA_TI_DEST_DREQ = 1 << 6;
+  static constexpr uint32_t DMA_TI_SRC_INC = 1 << 8;
+  static constexpr uint32_t DMA_TI_SRC_DREQ = 1 << 10;
+  static constexpr uint32_t DMA_TI_PERMAP_SHIFT = 16;
+
+  static constexpr uint32_t kDreqSpiTx = 6;
+  static constexpr uint32_t kDreqSpiRx = 7;
+
+  /// The DMA engine reads these from memory, so they must live in a
+  /// VcMemory block, aligned to 32 bytes.
+  struct ControlBlock {
+    uint32_t ti;
+    uint32_t source_ad;
+    uint32_t dest_ad;
+    uint32_t txfr_len;
+    uint32_t stride;
+    uint32_t nextconbk;
+    uint32_t reserved[2];
+  };
+
+  // Channels 11-14 are DMA4 engines on the BCM2711, with a different
+  // register layout, so only those which are legacy or "lite" on
+  // every SoC are used.
+  static constexpr int kMaxChannel = 10;
+
+  /// Open @p channel.  There is no way to reserve a channel from user
+  /// space, so one which is in use, or was left with work queued, is
+  /// refused rather than reset.
+  Bcm2835Dma(int dev_mem_fd, int channel)
+      : channel_(channel),
+        mmap_(dev_mem_fd, 4096, bcm_host_get_peripheral_address() + DMA_BASE),
+        regs_(reinterpret_cast<volatile Registers*>(
+                  static_cast<char*>(mmap_.ptr()) + channel * 0x100)) {
+    ThrowIf(channel < 0 || channel > kMaxChannel,
+            [&]() { return Format("pi3hat: invalid DMA channel %d", channel); });
+    ThrowIfBusy();
+
+    auto* const enable = reinterpret_cast<volatile uint32_t*>(
+        static_cast<char*>(mmap_.ptr()) + 0xff0);
+    *enable = *enable | (1 << channel);
+
+    regs_->cs = DMA_CS_RESET;
+  }
+
+  /// The channels the kernel may give to its own drivers, from the
+  /// device tree, or 0 if that could not be read.  Channels outside
+  /// this are kept by the VideoCore firmware.
+  static uint32_t KernelChannelMask() {
+    for (const auto* node : { "dma@7e007000", "dma-controller@7e007000" }) {
+      const auto data = ReadContents(
+          std::string("/proc/device-tree/soc/") + node +
+          "/brcm,dma-channel-mask");
+      if (data.size() != 4) { continue; }
+      // Device tree cells are big endian.
+      return (static_cast<uint32_t>(static_cast<uint8_t>(data[0])) << 24) |
+          (static_cast<uint32_t>(static_cast<uint8_t>(data[1])) << 16) |
+          (static_cast<uint32_t>(static_cast<uint8_t>(data[2])) << 8) |
+          static_cast<uint32_t>(static_cast<uint8_t>(data[3]));
+    }
+    return 0;
+  }
+
+  /// Open the first of the kernel's channels, from highest to lowest,
+  /// which is not @p skip and is idle.  The kernel hands its channels
+  /// to drivers lowest first, so the highest are the least likely to
+  /// be claimed later.
+  static std::unique_ptr<Bcm2835Dma> OpenIdle(int dev_mem_fd, int skip) {
+    const uint32_t mask = KernelChannelMask();
+    ThrowIf(mask == 0, []() {
+        return "pi3hat: could not read the DMA channel mask, "
+            "select DMA channels explicitly";
+      });
+    for (int channel = kMaxChannel; channel >= 0; channel--) {
+      if (channel == skip || (mask & (1u << channel)) == 0) { continue; }
+      try {
+        return std::unique_ptr<Bcm2835Dma>(
+            new Bcm2835Dma(dev_mem_fd, channel));
+      } catch (Error&) {
+        // It is in use, try the next.
+      }
+    }
+    throw Error("pi3hat: no idle DMA channel found");
+  }
+
+  void Start(uint32_t control_block_bus_address) {
+    // Something else may have started using the channel since we
+    // opened it.  Resetting it would break that user, so give up.
+    ThrowIfBusy();
+
+    regs_->cs = DMA_CS_END;
+    regs_->conblk_ad = control_block_bus_address;
+    regs_->cs = DMA_CS_ACTIVE | DMA_CS_WAIT_FOR_WRITES | (8 << 16);
+  }
+
+  /// Stop any transfer in progress.
+  void Abort() {
+    regs_->cs = DMA_CS_RESET;
+  }
+
+  bool active() const { return (regs_->cs & DMA_CS_ACTIVE) != 0; }
+  bool error() const { return (regs_->cs & DMA_CS_ERROR) != 0; }
+
+  int channel() const { return channel_; }
+
+ private:
+  void ThrowIfBusy() const {
+    // A finished or reset channel has no control block loaded.
+    ThrowIf(active() || regs_->conblk_ad != 0, [&]() {
+        return Format("pi3hat: DMA channel %d is in use", channel_);
+      });
+  }
+
+  struct Registers {
+    uint32_t cs;
+    uint32_t conblk_ad;
+    uint32_t ti;
+    uint32_t source_ad;
+    uint32_t dest_ad;
+    uint32_t txfr_len;
+    uint32_t stride;
+    uint32_t nextconbk;
+    uint32_t debug;
+  };
+
+  const int channel_;
+  SystemMmap mmap_;
+  volatile Registers* const regs_;
+};
+
 constexpr uint32_t kSpi0CS0 = 8;
 constexpr uint32_t kSpi0CS1 = 7;
 constexpr uint32_t kSpi0CS[] = {kSpi0CS0, kSpi0CS1};
 
 constexpr uint32_t SPI_BASE = 0x204000;
 constexpr uint32_t SPI_CS_TA = 1 << 7;
+constexpr uint32_t SPI_CS_DMAEN = 1 << 8;
+constexpr uint32_t SPI_CS_ADCS = 1 << 11;
 constexpr uint32_t SPI_CS_DONE = 1 << 16;
 constexpr uint32_t SPI_CS_RXD = 1 << 17;
 constexpr uint32_t SPI_CS_TXD = 1 << 18;
@@ -320,13 +552,34 @@ class PrimarySpi {
     int cs_hold_us = 3;
     int address_hold_us = 3;
 
+    // If true, data phases of at least 'dma_min_size' bytes are
+    // transferred by the DMA controller rather than by feeding the
+    // FIFO from the CPU.  Negative channels are chosen with
+    // Bcm2835Dma::OpenIdle.
+    bool dma = false;
+    int dma_tx_channel = -1;
+    int dma_rx_channel = -1;
+    size_t dma_min_size = 16;
+
+    // DMA transfers expected to take at least this long sleep for
+    // most of their duration, releasing the CPU, rather than polling
+    // throughout.  This must be well above the scheduler's wakeup
+    // latency to be worthwhile.
+    int64_t dma_sleep_min_ns = 150000;
+
     Options() {}
   };
 
-  PrimarySpi(const Options& options = Options()) {
+  PrimarySpi(const Options& options = Options()) : options_(options) {
     fd_ = ::open("/dev/mem", O_RDWR | O_SYNC);
     ThrowIfErrno(fd_ < 0, "pi3hat: could not open /dev/mem");
 
+    if (options_.dma) {
+      dma_memory_.reset(new VcMemory(fd_, 4096));
+      dma_tx_ = OpenDma(options_.dma_tx_channel, -1);
+      dma_rx_ = OpenDma(options_.dma_rx_channel, dma_tx_->channel());
+    }
+
     spi_mmap_ = SystemMmap(
         fd_, 4096, bcm_host_get_peripheral_address() + SPI_BASE);
     spi_ = reinterpret_cast<volatile Bcm2835Spi*>(
@@ -365,9 +618,7 @@ class PrimarySpi {
                 );
 
     // Configure the SPI peripheral.
-    const int clkdiv =
-        std::max(0, std::min(65535, 400000000 / options.speed_hz));
-    spi_->clk = clkdiv;
+    SetClock(options.speed_hz);
   }
 
   ~PrimarySpi() {}
@@ -375,6 +626,15 @@ class PrimarySpi {
   PrimarySpi(const PrimarySpi&) = delete;
   PrimarySpi& operator=(const PrimarySpi&) = delete;
 
+  /// Change the clock and hold times.  This must not be called while
+  /// a transfer is in progress.
+  void SetTiming(const Pi3Hat::SpiTiming& timing) {
+    options_.speed_hz = timing.speed_hz;
+    options_.cs_hold_us = timing.cs_hold_us;
+    options_.address_hold_us = timing.address_hold_us;
+    SetClock(timing.speed_hz);
+  }
+
   Rpi3Gpio* gpio() {
     return gpio_.get();
   }
@@ -396,7 +656,7 @@ class PrimarySpi {
       // Wait our address hold time.
       BusyWaitUs(options_.address_hold_us);
 
-      size_t offset = 0;
+      size_t offset = DmaTransfer(data, nullptr, size);
       while (offset < size) {
         while ((spi_->cs & SPI_CS_TXD) == 0);
         spi_->fifo =  data[offset];
@@ -415,6 +675,17 @@ class PrimarySpi {
   }
 
   void Read(int cs, int address, char* data, size_t size) {
+    ReadVariable(cs, address, data, size, [](const char*) { return 0; });
+  }
+
+  /// Read a register whose total length is not known in advance.
+  /// First 'header_size' bytes are read, then 'remaining_size' is
+  /// invoked with them to determine how many more bytes to read
+  /// while CS remains asserted.  Returns the total number of bytes
+  /// read.
+  template <typename RemainingSize>
+  size_t ReadVariable(int cs, int address, char* data, size_t header_size,
+                      RemainingSize remaining_size) {
     BusyWaitUs(options_.cs_hold_us);
     Rpi3Gpio::ActiveLow cs_holder(gpio_.get(), kSpi0CS[cs]);
     BusyWaitUs(options_.cs_hold_us);
@@ -427,36 +698,186 @@ class PrimarySpi {
     while ((spi_->cs & SPI_CS_RXD) == 0);
     (void) spi_->fifo;
 
-    if (size != 0) {
+    size_t total = header_size;
+    if (header_size != 0) {
       // Wait our address hold time.
       BusyWaitUs(options_.address_hold_us);
 
-      // Now we write out dummy values, reading values in.
-      std::size_t remaining_read = size;
-      std::size_t remaining_write = remaining_read;
-      char* ptr = data;
-      while (remaining_read) {
-        // Make sure we don't write more than we have read spots remaining
-        // so that we can never overflow the RX fifo.
-        const bool can_write = (remaining_read - remaining_write) < 16;
-        if (can_write &&
-            remaining_write && (spi_->cs & SPI_CS_TXD) != 0) {
-          spi_->fifo = 0x00;
-          remaining_write--;
-        }
-
-        if (remaining_read && (spi_->cs & SPI_CS_RXD) != 0) {
-          *ptr = spi_->fifo & 0xff;
-          ptr++;
-          remaining_read--;
-        }
-      }
+      ReadBytes(data, header_size);
+      const size_t remaining = remaining_size(data);
+      ReadBytes(data + header_size, remaining);
+      total += remaining;
     }
 
     spi_->cs = (spi_->cs & (~SPI_CS_TA));
+
+    return total;
   }
 
  private:
+  void SetClock(int speed_hz) {
+    spi_->clk = std::max(0, std::min(65535, 400000000 / speed_hz));
+  }
+
+  std::unique_ptr<Bcm2835Dma> OpenDma(int channel, int skip) {
+    if (channel >= 0) {
+      return std::unique_ptr<Bcm2835Dma>(new Bcm2835Dma(fd_, channel));
+    }
+    return Bcm2835Dma::OpenIdle(fd_, skip);
+  }
+
+  // The layout of our VcMemory block.
+  static constexpr size_t kDmaTxCbOffset = 0;
+  static constexpr size_t kDmaRxCbOffset = 32;
+  static constexpr size_t kDmaTxOffset = 256;
+  static constexpr size_t kDmaRxOffset = 2048;
+  static constexpr size_t kDmaMaxSize = 1024;
+
+  static constexpr uint32_t kSpiFifoBusAddress = 0x7e204004;
+
+  // A transfer is abandoned once it has taken twice as long as
+  // expected plus this.  The doubling allows for the core clock being
+  // below the 400MHz ExpectedTransferNs assumes, and this margin for
+  // scheduling latency.  At the slowest clocks, kDmaMaxSize bytes take
+  // tens of milliseconds, so no fixed limit is suitable.
+  static constexpr int64_t kDmaTimeoutMarginNs = 2000000;
+
+  // How much sooner than the estimated end of a DMA transfer we ask
+  // to be woken, to cover scheduler latency.
+  static constexpr int64_t kDmaWakeEarlyNs = 50000;
+
+  /// Transfer as much of 'size' as possible using DMA, transmitting
+  /// from 'tx' (or zeros if null) and receiving into 'rx' (if
+  /// non-null).  TA must be set on entry, and is set on exit.
+  ///
+  /// The DMA controller moves whole 32 bit words, so only a multiple
+  /// of 4 bytes is transferred.  The number of bytes actually
+  /// transferred is returned, the caller must handle the remainder.
+  size_t DmaTransfer(const char* tx, char* rx, size_t size) {
+    if (!options_.dma || size < options_.dma_min_size) { return 0; }
+
+    const size_t dma_size = std::min(size, kDmaMaxSize - 4) & ~3;
+
+    char* const base = dma_memory_->ptr();
+    auto* const tx_cb = reinterpret_cast<volatile Bcm2835Dma::ControlBlock*>(
+        base + kDmaTxCbOffset);
+    auto* const rx_cb = reinterpret_cast<volatile Bcm2835Dma::ControlBlock*>(
+        base + kDmaRxCbOffset);
+    auto* const tx_buf = reinterpret_cast<uint32_t*>(base + kDmaTxOffset);
+    char* const rx_buf = base + kDmaRxOffset;
+
+    // In DMA mode, the first word written to the FIFO configures DLEN
+    // and the low byte of CS.
+    tx_buf[0] = (dma_size << 16) | SPI_CS_TA;
+    if (tx) {
+      ::memcpy(&tx_buf[1], tx, dma_size);
+    } else {
+      ::memset(&tx_buf[1], 0, dma_size);
+    }
+
+    tx_cb->ti = (Bcm2835Dma::DMA_TI_DEST_DREQ |
+                 Bcm2835Dma::DMA_TI_SRC_INC |
+                 Bcm2835Dma::DMA_TI_WAIT_RESP |
+                 (Bcm2835Dma::kDreqSpiTx << Bcm2835Dma::DMA_TI_PERMAP_SHIFT));
+    tx_cb->source_ad = dma_memory_->bus_address(tx_buf);
+    tx_cb->dest_ad = kSpiFifoBusAddress;
+    tx_cb->txfr_len = dma_size + 4;
+    tx_cb->stride = 0;
+    tx_cb->nextconbk = 0;
+
+    rx_cb->ti = (Bcm2835Dma::DMA_TI_SRC_DREQ |
+                 Bcm2835Dma::DMA_TI_DEST_INC |
+                 (Bcm2835Dma::kDreqSpiRx << Bcm2835Dma::DMA_TI_PERMAP_SHIFT));
+    rx_cb->source_ad = kSpiFifoBusAddress;
+    rx_cb->dest_ad = dma_memory_->bus_address(rx_buf);
+    rx_cb->txfr_len = dma_size;
+    rx_cb->stride = 0;
+    rx_cb->nextconbk = 0;
+
+    // Hand the SPI peripheral over to the DMA engine.  It will set TA
+    // from the first FIFO word and clear it again when DLEN bytes are
+    // complete.
+    spi_->cs = (spi_->cs & ~SPI_CS_TA) | SPI_CS_DMAEN | SPI_CS_ADCS | (3 << 4);
+
+    __sync_synchronize();
+    dma_rx_->Start(dma_memory_->bus_address(rx_cb));
+    dma_tx_->Start(dma_memory_->bus_address(tx_cb));
+
+    // No per-byte servicing is required.  Long transfers sleep for
+    // most of their expected duration, so the CPU can be used by
+    // other threads, and then we poll for the end.
+    const int64_t expected_ns = ExpectedTransferNs(dma_size + 4);
+    const int64_t deadline = GetNow() + 2 * expected_ns + kDmaTimeoutMarginNs;
+    const int64_t sleep_ns = expected_ns - kDmaWakeEarlyNs;
+    if (expected_ns >= options_.dma_sleep_min_ns && sleep_ns > 0) {
+      struct timespec ts = {};
+      ts.tv_sec = sleep_ns / 1000000000;
+      ts.tv_nsec = sleep_ns % 1000000000;
+      ::clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, nullptr);
+    }
+    bool failed = false;
+    while (dma_rx_->active() || (spi_->cs & SPI_CS_DONE) == 0) {
+      if (dma_rx_->error() || dma_tx_->error() || GetNow() > deadline) {
+        failed = true;
+        break;
+      }
+    }
+    if (failed) {
+      const bool error = dma_rx_->error() || dma_tx_->error();
+      dma_tx_->Abort();
+      dma_rx_->Abort();
+      spi_->cs = (spi_->cs & ~(SPI_CS_DMAEN | SPI_CS_ADCS | SPI_CS_TA)) |
+          (3 << 4);
+      throw Error(error ? "pi3hat: SPI DMA error" : "pi3hat: SPI DMA timeout");
+    }
+    __sync_synchronize();
+
+    if (rx) {
+      ::memcpy(rx, rx_buf, dma_size);
+    }
+
+    // And return to CPU driven mode.
+    spi_->cs = (spi_->cs & ~(SPI_CS_DMAEN | SPI_CS_ADCS)) |
+        SPI_CS_TA | (3 << 4);
+
+    return dma_size;
+  }
+
+  /// How long @p bytes take at the current clock, using the same
+  /// core clock assumption as SetClock.
+  int64_t ExpectedTransferNs(size_t bytes) const {
+    const int64_t divider = std::max<uint32_t>(1, spi_->clk & 0xffff);
+    return static_cast<int64_t>(bytes) * 8 * divider * 1000000000ll /
+        400000000;
+  }
+
+  void ReadBytes(char* data, size_t size) {
+    const size_t dma_size = DmaTransfer(nullptr, data, size);
+    data += dma_size;
+    size -= dma_size;
+
+    // Now we write out dummy values, reading values in.
+    std::size_t remaining_read = size;
+    std::size_t remaining_write = remaining_read;
+    char* ptr = data;
+    while (remaining_read) {
+      // Make sure we don't write more than we have read spots remaining
+      // so that we can never overflow the RX fifo.
+      const bool can_write = (remaining_read - remaining_write) < 16;
+      if (can_write &&
+          remaining_write && (spi_->cs & SPI_CS_TXD) != 0) {
+        spi_->fifo = 0x00;
+        remaining_write--;
+      }
+
+      if (remaining_read && (spi_->cs & SPI_CS_RXD) != 0) {
+        *ptr = spi_->fifo & 0xff;
+        ptr++;
+        remaining_read--;
+      }
+    }
+  }
+
   // This is the memory layout of the SPI peripheral.
   struct Bcm2835Spi {
     uint32_t cs;
@@ -467,12 +888,16 @@ class PrimarySpi {
     uint32_t dc;
   };
 
-  const Options options_;
+  Options options_;
   SystemFd fd_;
   SystemMmap spi_mmap_;
   volatile Bcm2835Spi* spi_ = nullptr;
 
   std::unique_ptr<Rpi3Gpio> gpio_;
+
+  std::unique_ptr<VcMemory> dma_memory_;
+  std::unique_ptr<Bcm2835Dma> dma_tx_;
+  std::unique_ptr<Bcm2835Dma> dma_rx_;
 };
 
 constexpr uint32_t AUX_BASE           = 0x00215000;
@@ -485,6 +910,9 @@ constexpr uint32_t kSpi1CS[] = {
   kSpi1CS2,
 };
 
+// The IRQ line of each CAN processor (can1, can2, aux).
+constexpr uint32_t kCanIrq[] = {26, 5, 22};
+
 constexpr int AUXSPI_STAT_TX_FULL = 1 << 10;
 constexpr int AUXSPI_STAT_TX_EMPTY = 1 << 9;
 constexpr int AUXSPI_STAT_RX_EMPTY = 1 << 7;
@@ -508,7 +936,7 @@ class AuxSpi {
 
   static constexpr int kPack = 3;
 
-  AuxSpi(const Options& options = Options()) {
+  AuxSpi(const Options& options = Options()) : options_(options) {
     fd_ = ::open("/dev/mem", O_RDWR | O_SYNC);
     ThrowIfErrno(fd_ < 0, "rpi3_aux_spi: could not open /dev/mem");
 
@@ -544,11 +972,9 @@ class AuxSpi {
     spi_->cntl0 = (1 << 9); // clear fifos
 
     // Configure the SPI peripheral.
-    const int clkdiv =
-        std::max(0, std::min(4095, 250000000 / 2 / options.speed_hz - 1));
     spi_->cntl0 = (
         0
-        | (clkdiv << 20)
+        | (ClockDivider(options.speed_hz) << 20)
         | (0 << 17) // chip select defaults
         | (0 << 16) // post-input mode
         | (0 << 15) // variable CS
@@ -578,6 +1004,16 @@ class AuxSpi {
   AuxSpi(const AuxSpi&) = delete;
   AuxSpi& operator=(const AuxSpi&) = delete;
 
+  /// Change the clock and hold times.  This must not be called while
+  /// a transfer is in progress.
+  void SetTiming(const Pi3Hat::SpiTiming& timing) {
+    options_.speed_hz = timing.speed_hz;
+    options_.cs_hold_us = timing.cs_hold_us;
+    options_.address_hold_us = timing.address_hold_us;
+    spi_->cntl0 = (spi_->cntl0 & 0x000fffff) |
+        (ClockDivider(timing.speed_hz) << 20);
+  }
+
   void Write(int cs, int address, const char* data, size_t size) {
     BusyWaitUs(options_.cs_hold_us);
     Rpi3Gpio::ActiveLow cs_holder(gpio_.get(), kSpi1CS[cs]);
@@ -648,6 +1084,14 @@ class AuxSpi {
   }
 
   void Read(int cs, int address, char* data, size_t size) {
+    ReadVariable(cs, address, data, size, [](const char*) { return 0; });
+  }
+
+  /// Read a register whose total length is not known in advance, as
+  /// for PrimarySpi::ReadVariable.
+  template <typename RemainingSize>
+  size_t ReadVariable(int cs, int address, char* data, size_t header_size,
+                      RemainingSize remaining_size) {
     BusyWaitUs(options_.cs_hold_us);
     Rpi3Gpio::ActiveLow cs_holder(gpio_.get(), kSpi1CS[cs]);
     BusyWaitUs(options_.cs_hold_us);
@@ -657,7 +1101,7 @@ class AuxSpi {
                            | (8 << 24) // data width
                            | ((address & 0xff) << 16) // data
                            ;
-    if (size != 0) {
+    if (header_size != 0) {
       spi_->txhold = value;
     } else {
       spi_->io = value;
@@ -671,7 +1115,7 @@ class AuxSpi {
       }
     }
 
-    if (size == 0) { return; }
+    if (header_size == 0) { return 0; }
 
     // Wait our address hold time.
     BusyWaitUs(options_.address_hold_us);
@@ -681,6 +1125,19 @@ class AuxSpi {
       (void) spi_->io;
     }
 
+    ReadBytes(data, header_size);
+    const size_t remaining = remaining_size(data);
+    ReadBytes(data + header_size, remaining);
+
+    return header_size + remaining;
+  }
+
+ private:
+  static uint32_t ClockDivider(int speed_hz) {
+    return std::max(0, std::min(4095, 250000000 / 2 / speed_hz - 1));
+  }
+
+  void ReadBytes(char* data, size_t size) {
     // Now we write out dummy values, reading values in.
     std::size_t remaining_read = size;
     std::size_t remaining_write = remaining_read;
@@ -727,7 +1184,6 @@ class AuxSpi {
     }
   }
 
- private:
   // This is the memory layout of the SPI peripheral.
   struct Bcm2835AuxSpi {
     uint32_t cntl0;
@@ -742,7 +1198,7 @@ class AuxSpi {
     uint32_t txhold;
   };
 
-  const Options options_;
+  Options options_;
   SystemFd fd_;
   SystemMmap spi_mmap_;
   volatile uint32_t* auxenb_ = nullptr;
@@ -768,6 +1224,9 @@ struct DeviceAttitudeData {
   float a_x_mps2 = 0;
   float a_y_mps2 = 0;
   float a_z_mps2 = 0;
+  // Present in version 0x23 and later.  Earlier versions have the
+  // remaining fields at this offset instead.
+  uint32_t timestamp_us = 0;
   float bias_x_dps = 0;
   float bias_y_dps = 0;
   float bias_z_dps = 0;
@@ -781,17 +1240,47 @@ struct DeviceAttitudeData {
   uint8_t padding[4] = {};
 } __attribute__((packed));
 
+/// This is the format of each sample exported by register 38.
+struct DeviceImuSample {
+  uint32_t timestamp_us = 0;
+  float gx_dps = 0;
+  float gy_dps = 0;
+  float gz_dps = 0;
+  float ax_mps2 = 0;
+  float ay_mps2 = 0;
+  float az_mps2 = 0;
+} __attribute__((packed));
+
+/// And the register as a whole.
+struct DeviceImuFifo {
+  static constexpr int kMaxSamples = 64;
+
+  uint16_t count = 0;
+  uint16_t reserved = 0;
+  uint32_t overflow_count = 0;
+  DeviceImuSample samples[kMaxSamples] = {};
+  uint8_t slack[4] = {};
+} __attribute__((packed));
+
+constexpr int kDeviceImuFifoHeaderSize = 8;
+// Samples are only removed once this many bytes past them are read.
+constexpr int kDeviceImuFifoSlack = 4;
+
 struct DeviceImuConfiguration {
   float roll_deg = 0;
   float pitch_deg = 0;
   float yaw_deg = 0;
   uint32_t rate_hz = 0;
+  // Present in version 0x22 and later.  0 is the quaternion filter,
+  // and 1 the error state filter.
+  uint32_t filter = 0;
 
   bool operator==(const DeviceImuConfiguration& rhs) const {
     return yaw_deg == rhs.yaw_deg &&
         pitch_deg == rhs.pitch_deg &&
         roll_deg == rhs.roll_deg &&
-        rate_hz == rhs.rate_hz;
+        rate_hz == rhs.rate_hz &&
+        filter == rhs.filter;
   }
 
   bool operator!=(const DeviceImuConfiguration& rhs) const {
@@ -810,6 +1299,48 @@ struct DeviceRfStatus {
   uint32_t lock_age_ms = 0;
 } __attribute__((packed));
 
+/// This is the format of each slot exported by register 53.
+struct DeviceRfBulkSlot {
+  uint8_t slot = 0;
+  uint8_t size = 0;
+  uint32_t age_ms = 0;
+  uint8_t data[16] = {};
+} __attribute__((packed));
+
+constexpr int kDeviceRfNumSlots = 15;
+constexpr size_t kDeviceRfBulkHeaderSize = 12;
+// The firmware only considers a slot read once this many more bytes
+// have been read after it.
+constexpr size_t kDeviceRfBulkSlack = 4;
+
+/// This is the format of registers 56 and 57.
+struct DeviceRfSchedule {
+  float rate_hz[kDeviceRfNumSlots] = {};
+  uint32_t budget_bytes_per_s = 0;
+
+  bool operator==(const DeviceRfSchedule& rhs) const {
+    for (int i = 0; i < kDeviceRfNumSlots; i++) {
+      if (rate_hz[i] != rhs.rate_hz[i]) { return false; }
+    }
+    return budget_bytes_per_s == rhs.budget_bytes_per_s;
+  }
+
+  bool operator!=(const DeviceRfSchedule& rhs) const {
+    return !(*this == rhs);
+  }
+} __attribute__((packed));
+
+/// This is the format exported by register 53.
+struct DeviceRfBulkRead {
+  uint8_t present = 0;
+  uint8_t count = 0;
+  uint16_t reserved = 0;
+  uint32_t bitfield = 0;
+  uint32_t basis = 0;
+  DeviceRfBulkSlot slots[kDeviceRfNumSlots] = {};
+  uint8_t slack[kDeviceRfBulkSlack] = {};
+} __attribute__((packed));
+
 struct DeviceDeviceInfo {
   uint8_t git_hash[20] = {};
   uint8_t dirty = 0;
@@ -821,6 +1352,19 @@ struct DevicePerformance {
   uint32_t min_cycles_per_ms = 0;
 } __attribute__((packed));
 
+struct DeviceSubsystemProfile {
+  uint32_t max_cycles = 0;
+  uint32_t count = 0;
+  uint32_t average_cycles_per_ms = 0;
+  uint32_t peak_cycles_per_ms = 0;
+  uint16_t histogram[16] = {};
+} __attribute__((packed));
+
+struct DeviceProfile {
+  uint32_t clock_hz = 0;
+  DeviceSubsystemProfile subsystems[4] = {};
+} __attribute__((packed));
+
 struct DeviceCanRate {
   int8_t prescaler = -1;
   int8_t sync_jump_width = -1;
@@ -839,6 +1383,26 @@ struct DeviceCanRate {
   }
 } __attribute__((packed));
 
+struct DeviceCanFilter {
+  uint32_t id1 = 0;
+  uint32_t id2 = 0;
+  uint8_t mode = 0;
+  uint8_t action = 0;
+  uint8_t type = 0;
+
+  bool operator==(const DeviceCanFilter& rhs) const {
+    return id1 == rhs.id1 &&
+        id2 == rhs.id2 &&
+        mode == rhs.mode &&
+        action == rhs.action &&
+        type == rhs.type;
+  }
+
+  bool operator!=(const DeviceCanFilter& rhs) const {
+    return !(*this == rhs);
+  }
+} __attribute__((packed));
+
 struct DeviceCanConfiguration {
   int32_t slow_bitrate = 1000000;
   int32_t fast_bitrate = 5000000;
@@ -854,7 +1418,18 @@ struct DeviceCanConfiguration {
   DeviceCanRate std_rate;
   DeviceCanRate fd_rate;
 
+  // Only present in CAN protocol version 6 and later.
+  int8_t rx_queue_depth = 24;
+
+  // Only present in CAN protocol version 7 and later.
+  int8_t global_std_action = 1;
+  int8_t global_ext_action = 1;
+  DeviceCanFilter filters[Pi3Hat::CanConfiguration::kMaxFilters] = {};
+
   bool operator==(const DeviceCanConfiguration& rhs) const {
+    for (int i = 0; i < Pi3Hat::CanConfiguration::kMaxFilters; i++) {
+      if (filters[i] != rhs.filters[i]) { return false; }
+    }
     return slow_bitrate == rhs.slow_bitrate &&
         fast_bitrate == rhs.fast_bitrate &&
         fdcan_frame == rhs.fdcan_frame &&
@@ -863,7 +1438,10 @@ struct DeviceCanConfiguration {
         restricted_mode == rhs.restricted_mode &&
         bus_monitor == rhs.bus_monitor &&
         std_rate == rhs.std_rate &&
-        fd_rate == rhs.fd_rate;
+        fd_rate == rhs.fd_rate &&
+        rx_queue_depth == rhs.rx_queue_depth &&
+        global_std_action == rhs.global_std_action &&
+        global_ext_action == rhs.global_ext_action;
   }
 
   bool operator!=(const DeviceCanConfiguration& rhs) const {
@@ -894,6 +1472,142 @@ Pi3Hat::PerformanceInfo GetPerformance(Spi* spi, int cs) {
   result.min_cycles_per_ms = dp.min_cycles_per_ms;
   return result;
 }
+
+template <typename Spi>
+Pi3Hat::ProcessorProfile GetProfile(Spi* spi, int cs) {
+  DeviceProfile dp;
+  spi->Read(cs, 101, reinterpret_cast<char*>(&dp), sizeof(dp));
+
+  const auto convert = [](const DeviceSubsystemProfile& in) {
+    Pi3Hat::SubsystemProfile result;
+    result.max_cycles = in.max_cycles;
+    result.count = in.count;
+    result.average_cycles_per_ms = in.average_cycles_per_ms;
+    result.peak_cycles_per_ms = in.peak_cycles_per_ms;
+    std::copy(std::begin(in.histogram), std::end(in.histogram),
+              std::begin(result.histogram));
+    return result;
+  };
+
+  Pi3Hat::ProcessorProfile result;
+  result.clock_hz = dp.clock_hz;
+  result.spi_isr = convert(dp.subsystems[0]);
+  result.can_poll = convert(dp.subsystems[1]);
+  result.imu = convert(dp.subsystems[2]);
+  result.rf = convert(dp.subsystems[3]);
+  return result;
+}
+
+///////////////////////////////////////////////
+/// Cycle statistics
+
+/// Increment an atomic which has only a single writer, so that no
+/// read-modify-write operation is needed.
+template <typename T, typename U>
+void SingleWriterAdd(std::atomic<T>* value, U amount) {
+  value->store(value->load(std::memory_order_relaxed) + amount,
+               std::memory_order_relaxed);
+}
+
+/// A LatencyHistogram which may be read from any thread while it is
+/// being updated.  Only one thread may record into a given instance.
+class AtomicHistogram {
+ public:
+  using Histogram = Pi3Hat::LatencyHistogram;
+
+  void Record(int64_t ns) {
+    if (ns < 0) { ns = 0; }
+    SingleWriterAdd(&counts_[Histogram::Bucket(ns)], 1);
+
+    const auto count = count_.load(std::memory_order_relaxed);
+    if (count == 0 || ns < min_ns_.load(std::memory_order_relaxed)) {
+      min_ns_.store(ns, std::memory_order_relaxed);
+    }
+    if (ns > max_ns_.load(std::memory_order_relaxed)) {
+      max_ns_.store(ns, std::memory_order_relaxed);
+    }
+    SingleWriterAdd(&total_ns_, ns);
+    count_.store(count + 1, std::memory_order_relaxed);
+  }
+
+  void Get(Histogram* output) const {
+    output->count = count_.load(std::memory_order_relaxed);
+    for (int i = 0; i < Histogram::kBuckets; i++) {
+      output->counts[i] = counts_[i].load(std::memory_order_relaxed);
+    }
+    output->total_ns = total_ns_.load(std::memory_order_relaxed);
+    output->min_ns = min_ns_.load(std::memory_order_relaxed);
+    output->max_ns = max_ns_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  std::atomic<uint64_t> counts_[Histogram::kBuckets] = {};
+  std::atomic<uint64_t> count_{0};
+  std::atomic<int64_t> total_ns_{0};
+  std::atomic<int64_t> min_ns_{0};
+  std::atomic<int64_t> max_ns_{0};
+};
+
+/// Everything recorded when 'Configuration::enable_statistics' is set.
+/// Each member has a single writer: the bus 5 statistics and, in
+/// parallel mode, 'rf' and 'attitude' are recorded from the helper
+/// thread, and everything else from the thread calling Cycle.
+struct StatisticsRecorder {
+  struct Bus {
+    AtomicHistogram reply;
+    std::atomic<uint64_t> replies{0};
+    std::atomic<uint64_t> timeouts{0};
+  };
+
+  std::atomic<uint64_t> cycles{0};
+
+  AtomicHistogram cycle;
+  AtomicHistogram send;
+  AtomicHistogram rf;
+  AtomicHistogram attitude;
+  AtomicHistogram can_read;
+
+  Bus bus[6];
+
+  std::atomic<int64_t> last_start_ns{0};
+  std::atomic<int64_t> last_send_ns{0};
+  std::atomic<int64_t> last_rf_ns{0};
+  std::atomic<int64_t> last_attitude_ns{0};
+  std::atomic<int64_t> last_can_ns{0};
+
+  void Finish(const Pi3Hat::CycleTiming& timing) {
+    cycle.Record(timing.can_ns - timing.start_ns);
+
+    last_start_ns.store(timing.start_ns, std::memory_order_relaxed);
+    last_send_ns.store(timing.send_ns, std::memory_order_relaxed);
+    last_rf_ns.store(timing.rf_ns, std::memory_order_relaxed);
+    last_attitude_ns.store(timing.attitude_ns, std::memory_order_relaxed);
+    last_can_ns.store(timing.can_ns, std::memory_order_relaxed);
+
+    SingleWriterAdd(&cycles, 1);
+  }
+
+  void Get(Pi3Hat::CycleStatistics* output) const {
+    output->cycles = cycles.load(std::memory_order_relaxed);
+    cycle.Get(&output->cycle);
+    send.Get(&output->send);
+    rf.Get(&output->rf);
+    attitude.Get(&output->attitude);
+    can_read.Get(&output->can_read);
+    for (int i = 0; i < 6; i++) {
+      bus[i].reply.Get(&output->bus[i].reply);
+      output->bus[i].replies = bus[i].replies.load(std::memory_order_relaxed);
+      output->bus[i].timeouts =
+          bus[i].timeouts.load(std::memory_order_relaxed);
+    }
+    output->last.start_ns = last_start_ns.load(std::memory_order_relaxed);
+    output->last.send_ns = last_send_ns.load(std::memory_order_relaxed);
+    output->last.rf_ns = last_rf_ns.load(std::memory_order_relaxed);
+    output->last.attitude_ns =
+        last_attitude_ns.load(std::memory_order_relaxed);
+    output->last.can_ns = last_can_ns.load(std::memory_order_relaxed);
+  }
+};
 }
 
 
@@ -904,6 +1618,9 @@ class Pi3Hat::Impl {
         primary_spi_{[&]() {
             PrimarySpi::Options options;
             options.speed_hz = configuration.spi_speed_hz;
+            options.dma = configuration.spi_dma;
+            options.dma_tx_channel = configuration.spi_dma_tx_channel;
+            options.dma_rx_channel = configuration.spi_dma_rx_channel;
             return options;
     }()},
         aux_spi_{[&]() {
@@ -936,13 +1653,42 @@ class Pi3Hat::Impl {
     // Verify the versions of all peripherals we will use.
     VerifyVersions();
 
+    if (config_.spi_tuning.enable) {
+      TuneSpi();
+    }
+
     if (config_.enable_aux) {
       ConfigureAux();
     }
     ConfigureCan();
+
+    for (int i = 0; i < 3; i++) {
+      if (CanIrq(i)) {
+        primary_spi_.gpio()->SetGpioMode(kCanIrq[i], Rpi3Gpio::INPUT);
+      }
+    }
+
+    if (config_.enable_statistics) {
+      statistics_.reset(new StatisticsRecorder());
+    }
+
+    if (config_.adaptive_timeout.enable) {
+      reply_timeout_.reset(new ReplyTimeoutLearner(config_.adaptive_timeout));
+    }
+
+    if (config_.parallel_spi) {
+      WorkerThread::Options options;
+      options.cpu = config_.parallel_spi_cpu;
+      options.realtime_priority = config_.parallel_spi_realtime_priority;
+      primary_worker_.reset(new PrimaryWorker(this, options));
+    }
   }
 
   ~Impl() {
+    // Ensure the helper thread is stopped before anything it uses is
+    // destroyed.
+    primary_worker_.reset();
+
     if (lock_file_fd_ >= 0) {
       // Who cares about errors here?
       ::close(lock_file_fd_);
@@ -950,12 +1696,21 @@ class Pi3Hat::Impl {
   }
 
   void ConfigureAux() {
+    // Older firmware has no filter selection, so we neither send nor
+    // expect it.
+    const bool has_filter = attitude_version_ >= 0x22;
+    ThrowIf(!has_filter && config_.attitude_error_state, []() {
+        return "pi3hat: firmware does not support attitude_error_state"; });
+    const size_t imu_config_size =
+        has_filter ? sizeof(DeviceImuConfiguration) :
+        (sizeof(DeviceImuConfiguration) - sizeof(uint32_t));
+
     // See if we need to update the IMU configuration.
     DeviceImuConfiguration original_imu_configuration;
     primary_spi_.Read(
         0, 35,
         reinterpret_cast<char*>(&original_imu_configuration),
-        sizeof(original_imu_configuration));
+        imu_config_size);
 
     DeviceImuConfiguration desired_imu;
     desired_imu.yaw_deg = config_.mounting_deg.yaw;
@@ -963,12 +1718,13 @@ class Pi3Hat::Impl {
     desired_imu.roll_deg = config_.mounting_deg.roll;
     desired_imu.rate_hz =
         std::min<uint32_t>(1000, config_.attitude_rate_hz);
+    desired_imu.filter = config_.attitude_error_state ? 1 : 0;
 
     if (desired_imu != original_imu_configuration) {
       primary_spi_.Write(
           0, 36,
           reinterpret_cast<const char*>(&desired_imu),
-          sizeof(desired_imu));
+          imu_config_size);
 
       // Give it some time to work.
       ::usleep(1000);
@@ -976,7 +1732,7 @@ class Pi3Hat::Impl {
       primary_spi_.Read(
           0, 35,
           reinterpret_cast<char*>(&config_verify),
-          sizeof(config_verify));
+          imu_config_size);
       ThrowIf(
           desired_imu != config_verify,
           [&]() {
@@ -1016,13 +1772,43 @@ class Pi3Hat::Impl {
                           id_verify);
           });
     }
+
+    DeviceRfSchedule desired_schedule;
+    for (int i = 0; i < kDeviceRfNumSlots; i++) {
+      desired_schedule.rate_hz[i] = config_.rf_slot_rate_hz[i];
+    }
+    desired_schedule.budget_bytes_per_s = config_.rf_budget_bytes_per_s;
+    if (rf_version_ >= 0x12) {
+      DeviceRfSchedule original_schedule;
+      primary_spi_.Read(
+          0, 56, reinterpret_cast<char*>(&original_schedule),
+          sizeof(original_schedule));
+      if (original_schedule != desired_schedule) {
+        primary_spi_.Write(
+            0, 57, reinterpret_cast<const char*>(&desired_schedule),
+            sizeof(desired_schedule));
+      }
+    } else {
+      ThrowIf(desired_schedule != DeviceRfSchedule(), []() {
+          return "pi3hat: firmware does not support RF schedules"; });
+    }
+
+    if (rf_version_ >= 0x11) {
+      // The hat remembers which slots it has sent through the bulk
+      // register, possibly to a previous process.  Start from what we
+      // have seen.
+      primary_spi_.Write(
+          0, 55,
+          reinterpret_cast<const char*>(&last_bitfield_), sizeof(uint32_t));
+    }
   }
 
+  /// @p version is the CAN protocol version VerifyVersions found for
+  /// this processor.
   template <typename Spi>
-  void UpdateCanConfig(Spi* spi, int cs, int canbus,
+  void UpdateCanConfig(Spi* spi, int cs, int canbus, int version,
                        const CanConfiguration& can_config) {
     // If the version is before 3, then we can't config anything.
-    const auto version = ReadByte(spi, cs, 0);
     if (version < 3) { return; }
 
     // Populate what we want our config to look like.
@@ -1044,11 +1830,48 @@ class Pi3Hat::Impl {
     out.fd_rate.time_seg1 = can_config.fd_rate.time_seg1;
     out.fd_rate.time_seg2 = can_config.fd_rate.time_seg2;
 
+    out.rx_queue_depth = can_config.rx_queue_depth;
+
+    bool any_filters = false;
+    for (int i = 0; i < CanConfiguration::kMaxFilters; i++) {
+      const auto& in = can_config.filters[i];
+      auto& filter = out.filters[i];
+      filter.id1 = in.id1;
+      filter.id2 = in.id2;
+      filter.mode = static_cast<uint8_t>(in.mode);
+      filter.action = static_cast<uint8_t>(in.action);
+      filter.type = static_cast<uint8_t>(in.type);
+      if (in.action != CanFilter::kDisable) { any_filters = true; }
+    }
+    out.global_std_action = static_cast<int8_t>(can_config.global_std_action);
+    out.global_ext_action = static_cast<int8_t>(can_config.global_ext_action);
+    if (can_config.global_std_action == CanFilter::kReject ||
+        can_config.global_ext_action == CanFilter::kReject) {
+      any_filters = true;
+    }
+
+    ThrowIf(
+        any_filters && version < 7,
+        [&]() {
+          return Format(
+              "CAN filters require protocol version 7, found %d", version);
+        });
+
+    // Older firmware has a shorter configuration structure.  In that
+    // case, the fields it does not know about are left as they are
+    // in 'out' so that they compare equal.
+    const size_t config_size =
+        (version >= 7) ?
+        sizeof(DeviceCanConfiguration) :
+        (version >= 6) ?
+        offsetof(DeviceCanConfiguration, global_std_action) :
+        offsetof(DeviceCanConfiguration, rx_queue_depth);
+
     // Check to see if this is what is already there.
-    DeviceCanConfiguration original_config;
+    DeviceCanConfiguration original_config = out;
     spi->Read(cs, canbus ? 8 : 7,
               reinterpret_cast<char*>(&original_config),
-              sizeof(original_config));
+              config_size);
     if (original_config == out) {
       // We have nothing to do, so just bail early.
       return;
@@ -1056,13 +1879,13 @@ class Pi3Hat::Impl {
 
     // Update the configuration on the device.
     spi->Write(cs, canbus ? 10 : 9,
-               reinterpret_cast<const char*>(&out), sizeof(out));
+               reinterpret_cast<const char*>(&out), config_size);
 
     // Give it some time to work.
     ::usleep(100);
-    DeviceCanConfiguration verify;
+    DeviceCanConfiguration verify = out;
     spi->Read(cs, canbus ? 8 : 7,
-              reinterpret_cast<char*>(&verify), sizeof(verify));
+              reinterpret_cast<char*>(&verify), config_size);
     ThrowIf(
         out != verify,
         [&]() {
@@ -1071,12 +1894,14 @@ class Pi3Hat::Impl {
   }
 
   void ConfigureCan() {
-    UpdateCanConfig(&aux_spi_, 0, 0, config_.can[0]);
-    UpdateCanConfig(&aux_spi_, 0, 1, config_.can[1]);
-    UpdateCanConfig(&aux_spi_, 1, 0, config_.can[2]);
-    UpdateCanConfig(&aux_spi_, 1, 1, config_.can[3]);
+    // Each configuration is only written if it differs from what the
+    // processor already has, as writing one resets that bus.
+    UpdateCanConfig(&aux_spi_, 0, 0, can_version_[0], config_.can[0]);
+    UpdateCanConfig(&aux_spi_, 0, 1, can_version_[0], config_.can[1]);
+    UpdateCanConfig(&aux_spi_, 1, 0, can_version_[1], config_.can[2]);
+    UpdateCanConfig(&aux_spi_, 1, 1, can_version_[1], config_.can[3]);
     if (config_.enable_aux) {
-      UpdateCanConfig(&primary_spi_, 0, 0, config_.can[4]);
+      UpdateCanConfig(&primary_spi_, 0, 0, can_version_[2], config_.can[4]);
     }
   }
 
@@ -1104,79 +1929,322 @@ class Pi3Hat::Impl {
   }
 
   template <typename Spi>
-  void TestCan(Spi* spi, int cs, const char* name) {
+  int TestCan(Spi* spi, int cs, const char* name) {
     const auto version = ReadByte(spi, cs, 0);
-    if (version != 2 && version != 3) {
+    if (version < 2 || version > 9) {
       throw std::runtime_error(
           Format(
-              "Processor '%s' has incorrect CAN SPI version %d != [2,3]",
+              "Processor '%s' has incorrect CAN SPI version %d != [2,9]",
               name, version));
     }
+    return version;
   }
 
   void VerifyVersions() {
-    constexpr int kAttitudeVersion = 0x20;
-    constexpr int kRfVersion = 0x10;
+    // Version 0x21 added the IMU FIFO, 0x22 the filter selection, and
+    // 0x23 the attitude timestamp.
+    constexpr int kMinAttitudeVersion = 0x20;
+    constexpr int kMaxAttitudeVersion = 0x23;
+    // Version 0x11 added the bulk slot registers, and 0x12 the
+    // schedule.
+    constexpr int kMinRfVersion = 0x10;
+    constexpr int kMaxRfVersion = 0x12;
 
     if (config_.enable_aux) {
-      TestCan(&primary_spi_, 0, "aux");
+      can_version_[2] = TestCan(&primary_spi_, 0, "aux");
     }
-    TestCan(&aux_spi_, 0, "can1");
-    TestCan(&aux_spi_, 1, "can2");
+    can_version_[0] = TestCan(&aux_spi_, 0, "can1");
+    can_version_[1] = TestCan(&aux_spi_, 1, "can2");
 
     if (config_.enable_aux) {
       const auto attitude_version = ReadByte(&primary_spi_, 0, 32);
-      if (attitude_version != kAttitudeVersion) {
+      if (attitude_version < kMinAttitudeVersion ||
+          attitude_version > kMaxAttitudeVersion) {
         throw std::runtime_error(
             Format(
-                "Incorrect attitude version %d != %d",
-                attitude_version, kAttitudeVersion));
+                "Incorrect attitude version %d != [%d,%d]",
+                attitude_version, kMinAttitudeVersion, kMaxAttitudeVersion));
       }
+      attitude_version_ = attitude_version;
 
 
       const auto rf_version = ReadByte(&primary_spi_, 0, 48);
-      if (rf_version != kRfVersion) {
+      if (rf_version < kMinRfVersion || rf_version > kMaxRfVersion) {
         throw std::runtime_error(
             Format(
-                "Incorrect RF version %d != %d",
-                rf_version, kRfVersion));
+                "Incorrect RF version %d != [%d,%d]",
+                rf_version, kMinRfVersion, kMaxRfVersion));
       }
+      rf_version_ = rf_version;
     }
   }
 
-  DeviceInfo device_info() {
-    DeviceInfo result;
-    // Now get the device information from all three processors.
-    result.can1 = GetProcessorInfo(&aux_spi_, 0);
-    result.can2 = GetProcessorInfo(&aux_spi_, 1);
-    if (config_.enable_aux) {
-      result.aux = GetProcessorInfo(&primary_spi_, 0);
-    }
+  template <typename Spi>
+  static Pi3Hat::SpiTiming ConfiguredTiming(int speed_hz) {
+    const typename Spi::Options options;
+    Pi3Hat::SpiTiming result;
+    result.speed_hz = speed_hz;
+    result.cs_hold_us = options.cs_hold_us;
+    result.address_hold_us = options.address_hold_us;
     return result;
   }
 
-  DevicePerformance device_performance() {
-    DevicePerformance result;
-    // Now get the device information from all three processors.
-    result.can1 = GetPerformance(&aux_spi_, 0);
-    result.can2 = GetPerformance(&aux_spi_, 1);
-    if (config_.enable_aux) {
-      result.aux = GetPerformance(&primary_spi_, 0);
+  /// Read the receive queue sizes of one processor, followed by their
+  /// checksum, and return true if it matched.
+  template <typename Spi>
+  static bool ReadQueueSizes(Spi& spi, int cs, uint8_t (&sizes)[7]) {
+    spi.Read(cs, 2, reinterpret_cast<char*>(&sizes[0]), sizeof(sizes));
+    return QueueSizeChecksum(sizes, 6) == sizes[6];
+  }
+
+  template <typename Spi>
+  static bool CheckSpi(Spi& spi, int cs, const DeviceDeviceInfo& expected) {
+    DeviceDeviceInfo di;
+    spi.Read(cs, 97, reinterpret_cast<char*>(&di), sizeof(di));
+    if (::memcmp(&di, &expected, sizeof(di)) != 0) { return false; }
+    uint8_t sizes[7] = {};
+    return ReadQueueSizes(spi, cs, sizes);
+  }
+
+  /// One line of the SPI tuning cache.
+  struct SpiCacheEntry {
+    std::string link;
+    std::string key;
+    Pi3Hat::SpiTiming timing;
+  };
+
+  static std::vector<SpiCacheEntry> ReadSpiCache(const std::string& path) {
+    std::vector<SpiCacheEntry> result;
+    if (path.empty()) { return result; }
+    std::ifstream inf(path);
+    SpiCacheEntry entry;
+    while (inf >> entry.link >> entry.key >> entry.timing.speed_hz >>
+           entry.timing.cs_hold_us >> entry.timing.address_hold_us) {
+      result.push_back(entry);
     }
     return result;
   }
 
-  void ReadSpi(int spi_bus, int address, char* data, size_t size) {
-    if (spi_bus == 0) {
-      aux_spi_.Read(0, address, data, size);
-    } else if (spi_bus == 1) {
-      aux_spi_.Read(1, address, data, size);
-    } else if (spi_bus == 2) {
-      primary_spi_.Read(0, address, data, size);
+  /// The cache is only an optimization, so failing to write it is
+  /// not an error.  It is written to a new file which is then renamed
+  /// into place, so that a symlink planted at either name is never
+  /// followed.
+  static void WriteSpiCache(const std::string& path,
+                            const std::vector<SpiCacheEntry>& entries) {
+    if (path.empty()) { return; }
+
+    std::ostringstream contents;
+    for (const auto& entry : entries) {
+      contents << entry.link << " " << entry.key << " "
+               << entry.timing.speed_hz << " " << entry.timing.cs_hold_us << " "
+               << entry.timing.address_hold_us << "\n";
+    }
+    const auto data = contents.str();
+
+    const auto temp_path = path + Format(".%d", ::getpid());
+    const int fd = ::open(temp_path.c_str(),
+                          O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                          0644);
+    if (fd < 0) { return; }
+    const bool written =
+        ::write(fd, data.data(), data.size()) ==
+        static_cast<ssize_t>(data.size());
+    ::close(fd);
+    if (!written || ::rename(temp_path.c_str(), path.c_str()) != 0) {
+      ::unlink(temp_path.c_str());
     }
   }
 
-  bool GetAttitude(Attitude* output, bool wait, bool detail) {
+  /// Identifies the firmware and serial number of every processor on
+  /// a link.
+  static std::string SpiCacheKey(const DeviceDeviceInfo* infos, int count) {
+    std::string result;
+    for (int i = 0; i < count; i++) {
+      const auto* bytes = reinterpret_cast<const uint8_t*>(&infos[i]);
+      for (size_t j = 0; j < sizeof(infos[i]); j++) {
+        result += Format("%02x", bytes[j]);
+      }
+    }
+    return result;
+  }
+
+  template <typename Spi>
+  void TuneSpiLink(Spi& spi, const char* link, const int* cs, int cs_count,
+                   SpiLinkTuner* tuner, std::vector<SpiCacheEntry>* cache) {
+    // The reference is read at the configured timing, which was
+    // already good enough for VerifyVersions.
+    DeviceDeviceInfo expected[2];
+    for (int i = 0; i < cs_count; i++) {
+      spi.Read(cs[i], 97, reinterpret_cast<char*>(&expected[i]),
+               sizeof(expected[i]));
+    }
+    const auto key = SpiCacheKey(expected, cs_count);
+
+    const int trials = config_.spi_tuning.trials;
+    const auto test = [&](const Pi3Hat::SpiTiming& timing) {
+      spi.SetTiming(timing);
+      for (int trial = 0; trial < trials; trial++) {
+        for (int i = 0; i < cs_count; i++) {
+          if (!CheckSpi(spi, cs[i], expected[i])) { return false; }
+        }
+      }
+      return true;
+    };
+
+    auto it = std::find_if(
+        cache->begin(), cache->end(),
+        [&](const SpiCacheEntry& entry) { return entry.link == link; });
+    if (it != cache->end() && it->key == key &&
+        tuner->Restore(it->timing, test)) {
+      return;
+    }
+
+    tuner->Calibrate(test);
+
+    // A link which could not be calibrated is left out of the cache,
+    // so that the next start tries again rather than restoring the
+    // configured timing as if it had been tuned.
+    if (!tuner->status().tuned) {
+      if (it != cache->end()) { cache->erase(it); }
+      return;
+    }
+
+    if (it == cache->end()) {
+      cache->push_back(SpiCacheEntry());
+      it = cache->end() - 1;
+    }
+    it->link = link;
+    it->key = key;
+    it->timing = tuner->timing();
+  }
+
+  void TuneSpi() {
+    const auto& tuning = config_.spi_tuning;
+    auto cache = ReadSpiCache(tuning.cache_path);
+
+    aux_tuner_.reset(new SpiLinkTuner(
+        tuning, ConfiguredTiming<AuxSpi>(config_.spi_speed_hz)));
+    const int aux_cs[] = {0, 1};
+    TuneSpiLink(aux_spi_, "aux", aux_cs, 2, aux_tuner_.get(), &cache);
+
+    if (config_.enable_aux) {
+      primary_tuner_.reset(new SpiLinkTuner(
+          tuning, ConfiguredTiming<PrimarySpi>(config_.spi_speed_hz)));
+      const int primary_cs[] = {0};
+      TuneSpiLink(primary_spi_, "primary", primary_cs, 1,
+                  primary_tuner_.get(), &cache);
+    }
+
+    WriteSpiCache(tuning.cache_path, cache);
+
+    // Stagger the probes so they do not all land in one cycle.
+    for (int i = 0; i < 3; i++) {
+      spi_probe_countdown_[i] =
+          1 + (i * tuning.probe_interval) / 3;
+    }
+  }
+
+  /// Note the result of a checked transfer with the processor
+  /// serving @p bus_start, falling back if necessary.
+  void RecordSpiCheck(int bus_start, bool ok) {
+    if (bus_start == 5) {
+      if (primary_tuner_->Record(ok)) {
+        primary_spi_.SetTiming(primary_tuner_->timing());
+      }
+    } else {
+      if (aux_tuner_->Record(ok)) {
+        aux_spi_.SetTiming(aux_tuner_->timing());
+      }
+    }
+  }
+
+  bool SpiTuned(int bus_start) const {
+    return bus_start == 5 ? !!primary_tuner_ : !!aux_tuner_;
+  }
+
+  /// Every 'probe_interval' calls for a given processor, check its
+  /// link once.
+  void ProbeSpi(int processor) {
+    const int bus_start = processor * 2 + 1;
+    if (!SpiTuned(bus_start)) { return; }
+    if (--spi_probe_countdown_[processor] > 0) { return; }
+    spi_probe_countdown_[processor] = config_.spi_tuning.probe_interval;
+
+    uint8_t sizes[7] = {};
+    const bool ok = (processor == 2) ?
+        ReadQueueSizes(primary_spi_, 0, sizes) :
+        ReadQueueSizes(aux_spi_, processor, sizes);
+    RecordSpiCheck(bus_start, ok);
+  }
+
+  SpiStatus spi_status() const {
+    SpiStatus result;
+    if (aux_tuner_) {
+      result.aux = aux_tuner_->status();
+    } else {
+      result.aux.timing = ConfiguredTiming<AuxSpi>(config_.spi_speed_hz);
+    }
+    if (primary_tuner_) {
+      result.primary = primary_tuner_->status();
+    } else {
+      result.primary.timing =
+          ConfiguredTiming<PrimarySpi>(config_.spi_speed_hz);
+    }
+    return result;
+  }
+
+  DeviceInfo device_info() {
+    DeviceInfo result;
+    // Now get the device information from all three processors.
+    result.can1 = GetProcessorInfo(&aux_spi_, 0);
+    result.can2 = GetProcessorInfo(&aux_spi_, 1);
+    if (config_.enable_aux) {
+      result.aux = GetProcessorInfo(&primary_spi_, 0);
+    }
+    return result;
+  }
+
+  DevicePerformance device_performance() {
+    DevicePerformance result;
+    // Now get the device information from all three processors.
+    result.can1 = GetPerformance(&aux_spi_, 0);
+    result.can2 = GetPerformance(&aux_spi_, 1);
+    if (config_.enable_aux) {
+      result.aux = GetPerformance(&primary_spi_, 0);
+    }
+    return result;
+  }
+
+  DeviceProfile device_profile() {
+    DeviceProfile result;
+    result.can1 = GetProfile(&aux_spi_, 0);
+    result.can2 = GetProfile(&aux_spi_, 1);
+    if (config_.enable_aux) {
+      result.aux = GetProfile(&primary_spi_, 0);
+    }
+    return result;
+  }
+
+  void ResetDeviceProfile() {
+    const char data = 1;
+    aux_spi_.Write(0, 102, &data, 1);
+    aux_spi_.Write(1, 102, &data, 1);
+    if (config_.enable_aux) {
+      primary_spi_.Write(0, 102, &data, 1);
+    }
+  }
+
+  void ReadSpi(int spi_bus, int address, char* data, size_t size) {
+    if (spi_bus == 0) {
+      aux_spi_.Read(0, address, data, size);
+    } else if (spi_bus == 1) {
+      aux_spi_.Read(1, address, data, size);
+    } else if (spi_bus == 2) {
+      primary_spi_.Read(0, address, data, size);
+    }
+  }
+
+  bool GetAttitude(Attitude* output, bool wait, bool detail) {
     device_attitude_ = {};
 
     // Busy loop until we get something.
@@ -1191,18 +2259,46 @@ class Pi3Hat::Impl {
       } while (true);
     }
 
+    const bool has_timestamp = attitude_version_ >= 0x23;
+    constexpr size_t kShortSize = offsetof(DeviceAttitudeData, timestamp_us);
+    constexpr size_t kTimestampSize = sizeof(uint32_t);
+    const size_t size =
+        (detail ? sizeof(device_attitude_) : (kShortSize + kTimestampSize)) -
+        (has_timestamp ? 0 : kTimestampSize);
+
+    int64_t read_start_ns = 0;
     do {
+      read_start_ns = GetMonotonicNow();
       primary_spi_.Read(
           0, 34,
           reinterpret_cast<char*>(&device_attitude_),
-          detail ? sizeof(device_attitude_) : 42);
+          size);
     } while (wait && ((device_attitude_.present & 0x01) == 0));
 
     if ((device_attitude_.present & 0x01) == 0) {
       return false;
     }
 
-    const auto& da = device_attitude_;
+    auto& da = device_attitude_;
+    if (has_timestamp) {
+      // The register was captured just as the read began, so the data
+      // was published no later than that.  It was published
+      // 'update_time_10us' after the sample was taken.
+      clock_sync_.Observe(
+          da.timestamp_us + da.update_time_10us * 10u, read_start_ns);
+      output->timestamp_ns = clock_sync_.ToHost(da.timestamp_us);
+    } else {
+      // Older firmware has the detail fields directly after the short
+      // ones.
+      char* const base = reinterpret_cast<char*>(&da);
+      if (detail) {
+        std::memmove(base + kShortSize + kTimestampSize, base + kShortSize,
+                     size - kShortSize);
+      }
+      da.timestamp_us = 0;
+      output->timestamp_ns = 0;
+    }
+
     auto& o = *output;
     o.attitude = { da.w, da.x, da.y, da.z };
     o.rate_dps = { da.x_dps, da.y_dps, da.z_dps };
@@ -1223,42 +2319,42 @@ class Pi3Hat::Impl {
     return true;
   }
 
+  /// Read as many IMU samples as are queued and fit in 'rx_imu' with
+  /// a single SPI transaction.  The firmware only discards what it
+  /// knows was read.
+  void ReadImuFifo(const Input& input, Output* output) {
+    if (attitude_version_ < 0x21) { return; }
+
+    const size_t max_samples = std::min<size_t>(
+        input.rx_imu.size(), DeviceImuFifo::kMaxSamples);
+    auto& fifo = device_imu_fifo_;
+    fifo.count = 0;
+    primary_spi_.Read(
+        0, 38, reinterpret_cast<char*>(&fifo),
+        kDeviceImuFifoHeaderSize + max_samples * sizeof(DeviceImuSample) +
+        kDeviceImuFifoSlack);
+
+    const size_t count = std::min<size_t>(fifo.count, max_samples);
+    for (size_t i = 0; i < count; i++) {
+      const auto& ds = fifo.samples[i];
+      auto& o = input.rx_imu[i];
+      o.timestamp_us = ds.timestamp_us;
+      o.rate_dps = { ds.gx_dps, ds.gy_dps, ds.gz_dps };
+      o.accel_mps2 = { ds.ax_mps2, ds.ay_mps2, ds.az_mps2 };
+    }
+    output->rx_imu_size = count;
+    output->imu_fifo_overflow_count = fifo.overflow_count;
+  }
+
   template <typename Spi>
   void SendCanPacketSpi(Spi& spi,
                         int cs, int cpu_bus,
                         const CanFrame& can_frame) {
-    const auto size = RoundUpDlc(can_frame.size);
     char buf[70] = {};
 
     int spi_address = 0;
-    int spi_size = 0;
-
-    buf[0] = ((cpu_bus == 1) ? 0x80 : 0x00) | (size & 0x7f);
-
-    if (can_frame.id <= 0xffff) {
-      // We'll use the 2 byte ID formulation, cmd 5
-      spi_address = 5;
-      buf[1] = (can_frame.id >> 8) & 0xff;
-      buf[2] = can_frame.id & 0xff;
-      ::memcpy(&buf[3], can_frame.data, can_frame.size);
-      for (std::size_t i = 3 + can_frame.size; i < (3 + size); i++) {
-        buf[i] = 0x50;
-      }
-      spi_size = 3 + size;
-    } else {
-      // 4 byte formulation, cmd 4
-      spi_address = 4;
-
-      buf[1] = (can_frame.id >> 24) & 0xff;
-      buf[2] = (can_frame.id >> 16) & 0xff;
-      buf[3] = (can_frame.id >> 8) & 0xff;
-      buf[4] = (can_frame.id >> 0) & 0xff;
-      ::memcpy(&buf[5], can_frame.data, can_frame.size);
-      for (std::size_t i = 5 + can_frame.size; i < (5 + size); i++) {
-        buf[i] = 0x50;
-      }
-      spi_size = 5 + size;
-    }
+    const int spi_size =
+        EncodeCanFrame(buf, cpu_bus, can_frame, false, &spi_address);
 
     spi.Write(cs, spi_address, buf, spi_size);
   }
@@ -1290,16 +2386,129 @@ class Pi3Hat::Impl {
     }
   }
 
+  /// Accumulates frames destined for a single chip select so that
+  /// they can be sent with the batched transmit register.
+  struct CanBatch {
+    // This matches CanBridge::kMaxBatchSize in the firmware.
+    static constexpr int kMaxSize = 6 * 70;
+    static constexpr int kMaxFrames = 6;
+
+    char data[kMaxSize] = {};
+    int size = 0;
+    int frames = 0;
+  };
+
+  template <typename Spi>
+  void FlushCanBatch(Spi& spi, int cs, int processor, CanBatch* batch) {
+    if (batch->frames == 0) { return; }
+    if (CanTxStatus(processor)) {
+      WaitCanTxFree(spi, cs, processor, batch->frames);
+    }
+    spi.Write(cs, 11, batch->data, batch->size);
+    can_tx_free_[processor] =
+        std::max(0, can_tx_free_[processor] - batch->frames);
+    batch->size = 0;
+    batch->frames = 0;
+  }
+
+  /// Wait until 'processor' has at least 'frames' free transmit
+  /// buffers, as it discards whatever does not fit.  The count is
+  /// only read from the processor when the frames written since it
+  /// was last read could have used up the buffers.  If they do not
+  /// free in time, for instance because nothing is acknowledging on
+  /// the bus, the batch is sent anyway and the processor counts what
+  /// it drops.
+  template <typename Spi>
+  void WaitCanTxFree(Spi& spi, int cs, int processor, int frames) {
+    // Draining a full set of buffers takes a few frame times, even
+    // at the lowest common bitrates.
+    constexpr int64_t kTimeoutNs = 2000000;
+
+    int64_t deadline = 0;
+    while (can_tx_free_[processor] < frames) {
+      can_tx_free_[processor] = ReadByte(&spi, cs, 15);
+      if (can_tx_free_[processor] >= frames) { return; }
+
+      const auto now = GetNow();
+      if (deadline == 0) {
+        deadline = now + kTimeoutNs;
+      } else if (now > deadline) {
+        return;
+      }
+      BusyWaitUs(10);
+    }
+  }
+
+  template <typename Spi>
+  void AddCanBatch(Spi& spi, int cs, int processor, int cpu_bus,
+                   const CanFrame& can_frame, CanBatch* batch) {
+    if (batch->frames >= CanBatch::kMaxFrames ||
+        (batch->size + 5 + static_cast<int>(RoundUpDlc(can_frame.size))) >
+        CanBatch::kMaxSize) {
+      FlushCanBatch(spi, cs, processor, batch);
+    }
+
+    int spi_address = 0;
+    batch->size += EncodeCanFrame(
+        &batch->data[batch->size], cpu_bus, can_frame, true, &spi_address);
+    batch->frames++;
+  }
+
+  // Version 4 of the CAN bridge protocol added batched transmission
+  // and version 5 batched reception.
+  bool CanBatchTx(int processor) const { return can_version_[processor] >= 4; }
+  bool CanBatchRx(int processor) const { return can_version_[processor] >= 5; }
+  // Version 8 added the IRQ target reply count.
+  bool CanIrq(int processor) const {
+    return config_.can_irq_wait && can_version_[processor] >= 8;
+  }
+  // Version 9 added the transmit buffer status.
+  bool CanTxStatus(int processor) const {
+    return can_version_[processor] >= 9;
+  }
+
   struct ExpectedReply {
     std::array<int, 6> count = { {} };
   };
 
   ExpectedReply SendCan(const Input& input) {
+    const auto result = PrepareCan(input);
+    if (!config_.can_tx_schedule) {
+      SendCanAux(input);
+      SendCanPrimary(input);
+      return result;
+    }
+
+    // JC5 is on its own SPI bus, so it can start before or after
+    // JC1-4, whichever is expected to finish later.
+    const int64_t spi_ns = SpiFrameNs();
+    const bool primary_first =
+        can_scheduler_.Finish(can_packets_, kPrimaryCanBus, 1, spi_ns) >
+        can_scheduler_.Finish(can_packets_, kAuxCanBuses, 4, spi_ns);
+    if (primary_first) { SendCanPrimary(input); }
+    SendCanAux(input);
+    if (!primary_first) { SendCanPrimary(input); }
+    return result;
+  }
+
+  /// A rough estimate of how long it takes to hand one CAN frame to
+  /// the auxiliary processors, for use by can_scheduler_.
+  int64_t SpiFrameNs() const {
+    constexpr int64_t kOverheadNs = 5000;
+    constexpr int64_t kTypicalBytes = 24;
+    return kOverheadNs +
+        kTypicalBytes * 8 * 1000000000ll /
+        std::max(1, config_.spi_speed_hz);
+  }
+
+  /// Sort the frames from 'input' by bus into can_packets_, and
+  /// count the number of replies we expect on each.  With
+  /// can_tx_schedule, this also plans their order, so every path
+  /// which sends from can_packets_ must start here.
+  ExpectedReply PrepareCan(const Input& input) {
     ExpectedReply result;
 
-    // We try to send packets on alternating buses if possible, so we
-    // can reduce the average latency before the first data goes out
-    // on any bus.  Always send data on the low speed bus out last.
+    can_scheduler_.Clear();
     for (auto& bus_packets : can_packets_) {
       bus_packets.resize(0);
     }
@@ -1311,6 +2520,31 @@ class Pi3Hat::Impl {
       }
     }
 
+    if (config_.can_tx_schedule) {
+      can_scheduler_.Plan(input.tx_can, config_.can, &can_packets_);
+    }
+
+    return result;
+  }
+
+  /// Send all frames for JC1-4, which are connected to the auxiliary
+  /// SPI bus.
+  void SendCanAux(const Input& input) {
+    if (CanBatchTx(0) || CanBatchTx(1)) {
+      SendCanAuxBatched(input);
+      return;
+    }
+
+    if (config_.can_tx_schedule) {
+      can_scheduler_.Interleave(
+          can_packets_, kAuxCanBuses, 4, SpiFrameNs(),
+          [&](int, int index) { SendCanPacket(input.tx_can[index]); });
+      return;
+    }
+
+    // We try to send packets on alternating buses if possible, so we
+    // can reduce the average latency before the first data goes out
+    // on any bus.
     int bus_offset[5] = {};
     while (true) {
       // We try to send out packets to buses in this order to minimize
@@ -1330,18 +2564,93 @@ class Pi3Hat::Impl {
 
       if (!any_sent) { break; }
     }
+  }
 
-    // Now send out all the low speed packets.
-    for (const auto index : can_packets_[5]) {
-      SendCanPacket(input.tx_can[index]);
+  /// Send all frames for each chip select in as few SPI transactions
+  /// as possible, alternating between the two ports of each
+  /// processor.  Processors without batch support fall back to one
+  /// transaction per frame.
+  void SendCanAuxBatched(const Input& input) {
+    if (config_.can_tx_schedule) {
+      SendCanAuxScheduled(input);
+      return;
     }
 
-    return result;
+    for (int cs = 0; cs < 2; cs++) {
+      const int bus_a = 1 + cs * 2;
+      const int bus_b = bus_a + 1;
+      const auto& packets_a = can_packets_[bus_a];
+      const auto& packets_b = can_packets_[bus_b];
+
+      const size_t count = std::max(packets_a.size(), packets_b.size());
+      for (size_t i = 0; i < count; i++) {
+        for (const auto* packets : { &packets_a, &packets_b }) {
+          if (i >= packets->size()) { continue; }
+          const auto& can_packet = input.tx_can[(*packets)[i]];
+          if (CanBatchTx(cs)) {
+            AddCanBatch(aux_spi_, cs, cs, (packets == &packets_a) ? 0 : 1,
+                        can_packet, &can_batch_);
+          } else {
+            SendCanPacket(can_packet);
+          }
+        }
+      }
+      FlushCanBatch(aux_spi_, cs, cs, &can_batch_);
+    }
+  }
+
+  /// The can_tx_schedule version of SendCanAuxBatched.  Each chip
+  /// select is still sent as a whole, but the one expected to finish
+  /// last goes first, and its two ports are interleaved by
+  /// can_scheduler_.
+  void SendCanAuxScheduled(const Input& input) {
+    const int64_t spi_ns = SpiFrameNs();
+    const int* const cs_buses[2] = { &kAuxCanBuses[0], &kAuxCanBuses[2] };
+    const bool cs1_first =
+        can_scheduler_.Finish(can_packets_, cs_buses[1], 2, spi_ns) >
+        can_scheduler_.Finish(can_packets_, cs_buses[0], 2, spi_ns);
+
+    for (const int cs : { cs1_first ? 1 : 0, cs1_first ? 0 : 1 }) {
+      can_scheduler_.Interleave(
+          can_packets_, cs_buses[cs], 2, spi_ns,
+          [&](int bus, int index) {
+            const auto& can_packet = input.tx_can[index];
+            if (CanBatchTx(cs)) {
+              AddCanBatch(aux_spi_, cs, cs, (bus - 1) % 2, can_packet,
+                          &can_batch_);
+            } else {
+              SendCanPacket(can_packet);
+            }
+          });
+      FlushCanBatch(aux_spi_, cs, cs, &can_batch_);
+    }
+  }
+
+  /// Send all frames for JC5, which is connected to the primary SPI
+  /// bus.  Without can_tx_schedule, the low speed bus is always sent
+  /// last.
+  void SendCanPrimary(const Input& input) {
+    if (!config_.enable_aux) { return; }
+
+    for (const auto index : can_packets_[5]) {
+      if (CanBatchTx(2)) {
+        AddCanBatch(primary_spi_, 0, 2, 0, input.tx_can[index],
+                    &can_batch_primary_);
+      } else {
+        SendCanPacket(input.tx_can[index]);
+      }
+    }
+    FlushCanBatch(primary_spi_, 0, 2, &can_batch_primary_);
   }
 
   void SendRf(const Span<RfSlot>& slots) {
     if (!config_.enable_aux) { return; }
 
+    if (rf_version_ >= 0x11 && slots.size() > 1) {
+      SendRfBulk(slots);
+      return;
+    }
+
     constexpr int kHeaderSize = 5;
     constexpr int kMaxDataSize = 16;
     uint8_t buf[kHeaderSize + kMaxDataSize] = {};
@@ -1361,9 +2670,43 @@ class Pi3Hat::Impl {
     }
   }
 
+  /// Write every slot with one SPI transaction per 15 slots, using
+  /// register 54.
+  void SendRfBulk(const Span<RfSlot>& slots) {
+    constexpr int kEntryHeaderSize = 6;
+    constexpr int kMaxDataSize = 16;
+    uint8_t buf[1 + kDeviceRfNumSlots * (kEntryHeaderSize + kMaxDataSize)];
+
+    size_t i = 0;
+    while (i < slots.size()) {
+      int count = 0;
+      size_t pos = 1;
+      for (; i < slots.size() && count < kDeviceRfNumSlots; i++, count++) {
+        const auto& slot = slots[i];
+        const uint8_t size = std::min<uint8_t>(kMaxDataSize, slot.size);
+        buf[pos + 0] = slot.slot;
+        buf[pos + 1] = size;
+        buf[pos + 2] = (slot.priority >> 0) & 0xff;
+        buf[pos + 3] = (slot.priority >> 8) & 0xff;
+        buf[pos + 4] = (slot.priority >> 16) & 0xff;
+        buf[pos + 5] = (slot.priority >> 24) & 0xff;
+        ::memcpy(&buf[pos + kEntryHeaderSize], slot.data, size);
+        pos += kEntryHeaderSize + size;
+      }
+      buf[0] = count;
+
+      primary_spi_.Write(
+          0, 54, reinterpret_cast<const char*>(&buf[0]), pos);
+    }
+  }
+
   void ReadRf(const Input& input, Output* output) {
     if (!config_.enable_aux) { return; }
 
+    // Register 52 is read even when register 53 is available.  It is
+    // the only source of the lock age, and at 8 bytes it lets the
+    // common cycle with nothing new skip a 53 read sized for every
+    // slot.
     DeviceRfStatus rf_status;
     primary_spi_.Read(
         0, 52, reinterpret_cast<char*>(&rf_status), sizeof(rf_status));
@@ -1373,6 +2716,11 @@ class Pi3Hat::Impl {
     const auto bitfield_delta = rf_status.bitfield ^ last_bitfield_;
     if (bitfield_delta == 0) { return; }
 
+    if (rf_version_ >= 0x11) {
+      ReadRfBulk(input, output, bitfield_delta);
+      return;
+    }
+
     DeviceSlotData slot_data;
 
     for (int i = 0; i < 15; i++) {
@@ -1397,12 +2745,72 @@ class Pi3Hat::Impl {
     }
   }
 
+  /// Read every changed slot which fits in 'rx_rf' with a single SPI
+  /// transaction of register 53.
+  void ReadRfBulk(const Input& input, Output* output,
+                  uint32_t bitfield_delta) {
+    size_t changed = 0;
+    for (int i = 0; i < kDeviceRfNumSlots; i++) {
+      if (bitfield_delta & (3 << (i * 2))) { changed++; }
+    }
+    const size_t expected = std::min(
+        changed, input.rx_rf.size() - output->rx_rf_size);
+    if (expected == 0) { return; }
+
+    auto& bulk = device_rf_bulk_;
+    bulk.present = 0;
+    primary_spi_.Read(
+        0, 53, reinterpret_cast<char*>(&bulk),
+        kDeviceRfBulkHeaderSize + expected * sizeof(DeviceRfBulkSlot) +
+        kDeviceRfBulkSlack);
+
+    // The hat has yet to catch up with what it last sent us.
+    if (bulk.present == 0) { return; }
+
+    // The hat now considers every slot read as of 'basis', except for
+    // those we just received, which are read as of 'bitfield'.
+    last_bitfield_ = bulk.basis;
+    const size_t count = std::min<size_t>(bulk.count, expected);
+    for (size_t i = 0; i < count; i++) {
+      const auto& slot_data = bulk.slots[i];
+      const uint32_t mask = 3 << (slot_data.slot * 2);
+      last_bitfield_ = (last_bitfield_ & ~mask) | (bulk.bitfield & mask);
+
+      auto& output_slot = input.rx_rf[output->rx_rf_size++];
+      output_slot.slot = slot_data.slot;
+      output_slot.age_ms = slot_data.age_ms;
+      output_slot.size = std::min<uint8_t>(16, slot_data.size);
+      ::memcpy(output_slot.data, slot_data.data, output_slot.size);
+    }
+  }
+
   template <typename Spi>
   int ReadCanFrames(Spi& spi, int cs, int bus_start,
                     const Span<CanFrame>* rx_can, Output* output) {
     // Is there any room?
     if (output->rx_can_size >= rx_can->size()) { return 0; }
 
+    // Reading every frame at once is only possible if we are sure
+    // there is room for all of them.
+    constexpr size_t kMaxQueuedFrames = 6;
+    if (CanBatchRx(bus_start / 2) &&
+        (rx_can->size() - output->rx_can_size) >= kMaxQueuedFrames) {
+      // Each read returns at most kMaxQueuedFrames.  Newer firmware
+      // can queue more than that, so a full read means we should
+      // look again.
+      int count = 0;
+      while (true) {
+        const int this_count =
+            ReadCanFramesBatch(spi, cs, bus_start, rx_can, output);
+        count += this_count;
+        if (this_count < static_cast<int>(kMaxQueuedFrames) ||
+            (rx_can->size() - output->rx_can_size) < kMaxQueuedFrames) {
+          break;
+        }
+      }
+      return count;
+    }
+
     int count = 0;
 
     // Purposefully not initialized for speed.
@@ -1411,14 +2819,22 @@ class Pi3Hat::Impl {
     while (true) {
       // Read until no more frames are available or until the output
       // buffer is full.
-      uint8_t queue_sizes[6] = {};
-      spi.Read(cs, 2,
-               reinterpret_cast<char*>(&queue_sizes[0]), sizeof(queue_sizes));
+      uint8_t queue_sizes[7] = {};
+      if (SpiTuned(bus_start)) {
+        // With tuning, every read of the sizes is checked, and a bad
+        // one is treated as if nothing were queued.
+        const bool ok = ReadQueueSizes(spi, cs, queue_sizes);
+        RecordSpiCheck(bus_start, ok);
+        if (!ok) { break; }
+      } else {
+        spi.Read(cs, 2, reinterpret_cast<char*>(&queue_sizes[0]), 6);
+      }
 
       bool any_read = false;
 
       // Read all we can until our buffer is full.
-      for (int size : queue_sizes) {
+      for (int i = 0; i < 6; i++) {
+        int size = queue_sizes[i];
         if (output->rx_can_size >= rx_can->size()) {
           // We're full and can't read any more.
           break;
@@ -1438,6 +2854,8 @@ class Pi3Hat::Impl {
           continue;
         }
 
+        any_read = true;
+
         auto& output_frame = (*rx_can)[output->rx_can_size++];
         count++;
 
@@ -1450,7 +2868,7 @@ class Pi3Hat::Impl {
         ::memcpy(output_frame.data, &buf[5], size - 5);
       }
 
-      if (!any_read) {
+      if (!any_read || output->rx_can_size >= rx_can->size()) {
         break;
       }
     }
@@ -1458,89 +2876,428 @@ class Pi3Hat::Impl {
     return count;
   }
 
+  /// Read the entire receive queue of one processor using a single
+  /// SPI transaction of register 12.
+  template <typename Spi>
+  int ReadCanFramesBatch(Spi& spi, int cs, int bus_start,
+                         const Span<CanFrame>* rx_can, Output* output) {
+    constexpr size_t kHeaderSize = 3;
+    constexpr size_t kMaxData = 6 * 70;
+
+    int count = 0;
+
+    // Purposefully not initialized for speed.
+    uint8_t buf[kHeaderSize + kMaxData];
+
+    const auto total = spi.ReadVariable(
+        cs, 12, reinterpret_cast<char*>(&buf[0]), kHeaderSize,
+        [&](const char* header) {
+          const size_t size =
+              static_cast<uint8_t>(header[1]) |
+              (static_cast<uint8_t>(header[2]) << 8);
+          return std::min(size, kMaxData);
+        });
+
+    size_t offset = kHeaderSize;
+    for (int i = 0; i < buf[0]; i++) {
+      if (offset >= total) { break; }
+
+      const uint8_t* const frame = &buf[offset];
+      if (frame[0] == 0) {
+        // This shouldn't happen, and means the rest is malformed.
+        break;
+      }
+      const size_t payload = (frame[0] & 0x7f) - 1;
+      if (payload > 64 || (offset + 5 + payload) > total) { break; }
+
+      auto& output_frame = (*rx_can)[output->rx_can_size++];
+      count++;
+
+      output_frame.bus = bus_start + ((frame[0] & 0x80) ? 1 : 0);
+      output_frame.id = (frame[1] << 24) |
+                        (frame[2] << 16) |
+                        (frame[3] << 8) |
+                        (frame[4] << 0);
+      output_frame.size = payload;
+      ::memcpy(output_frame.data, &frame[5], payload);
+
+      offset += 5 + payload;
+
+      if (output->rx_can_size >= rx_can->size()) { break; }
+    }
+
+    return count;
+  }
+
+  // Bitmasks selecting which processors ReadCan should service.
+  static constexpr uint32_t kProcessorCan1 = 1 << 0;
+  static constexpr uint32_t kProcessorCan2 = 1 << 1;
+  static constexpr uint32_t kProcessorAux = 1 << 2;
+  static constexpr uint32_t kProcessorAll =
+      kProcessorCan1 | kProcessorCan2 | kProcessorAux;
+
+  static uint32_t BusProcessor(int bus) {
+    if (bus == 1 || bus == 2) { return kProcessorCan1; }
+    if (bus == 3 || bus == 4) { return kProcessorCan2; }
+    if (bus == 5) { return kProcessorAux; }
+    return 0;
+  }
+
   void ReadCan(const Input& input, const ExpectedReply& expected_replies,
                Output* output) {
-    int bus_replies[] = {
-      expected_replies.count[1] + expected_replies.count[2],
-      expected_replies.count[3] + expected_replies.count[4],
-      expected_replies.count[5],
-    };
+    ReadCan(input, expected_replies, kProcessorAll, input.rx_can, output);
+  }
 
-    const bool to_check[] = {
-      bus_replies[0] || input.force_can_check & 0x06,
-      bus_replies[1] || input.force_can_check & 0x18,
-      bus_replies[2] || input.force_can_check & 0x20,
-    };
+  /// The state necessary to incrementally collect CAN replies.
+  struct CanReadState {
+    int bus_replies[3] = {};
+    bool to_check[3] = {};
+    // Processors which are only read once their IRQ line is asserted.
+    bool irq[3] = {};
+    // These are only maintained when statistics are enabled, and are
+    // 1 indexed to match the bus naming.
+    int expected[6] = {};
+    int received[6] = {};
+    int64_t start_now = 0;
+    int64_t last_reply = 0;
+    // With adaptive timeouts, how long after 'start_now' to wait, or
+    // -1 to use the timeouts given in 'Input'.
+    int64_t window_ns = -1;
+    // With adaptive timeouts, the IDs still expected to reply on each
+    // bus, one bit per ID.
+    uint64_t pending[6][2] = {};
+  };
 
-    const auto start_now = GetNow();
-    int64_t last_reply = start_now;
+  CanReadState StartReadCan(const Input& input,
+                            const ExpectedReply& expected_replies,
+                            uint32_t processors) {
+    CanReadState result;
+    auto& bus_replies = result.bus_replies;
+    bus_replies[0] = (processors & kProcessorCan1) ?
+        (expected_replies.count[1] + expected_replies.count[2]) : 0;
+    bus_replies[1] = (processors & kProcessorCan2) ?
+        (expected_replies.count[3] + expected_replies.count[4]) : 0;
+    bus_replies[2] = (processors & kProcessorAux) ?
+        expected_replies.count[5] : 0;
+
+    result.to_check[0] = (processors & kProcessorCan1) &&
+        (bus_replies[0] || input.force_can_check & 0x06);
+    result.to_check[1] = (processors & kProcessorCan2) &&
+        (bus_replies[1] || input.force_can_check & 0x18);
+    result.to_check[2] = (processors & kProcessorAux) &&
+        (bus_replies[2] || input.force_can_check & 0x20);
+
+    for (int bus = 1; bus < 6; bus++) {
+      if (processors & BusProcessor(bus)) {
+        result.expected[bus] = expected_replies.count[bus];
+      }
+    }
 
-    while (true) {
-      bool any_found = false;
-      // Then check for CAN responses as necessary.
-      if (to_check[0]) {
-        const int count = ReadCanFrames(aux_spi_, 0, 1, &input.rx_can, output);
-        bus_replies[0] -= count;
-        if (count) {
-          last_reply = GetNow();
-          any_found = true;
-        }
+    if (reply_timeout_) {
+      StartReplyWindow(input, processors, &result);
+    }
+
+    for (int i = 0; i < 3; i++) {
+      if (result.to_check[i]) { ProbeSpi(i); }
+    }
+
+    for (int i = 0; i < 3; i++) {
+      if (!result.to_check[i] || !CanIrq(i)) { continue; }
+      if (i == 2 && !config_.enable_aux) { continue; }
+      SetCanIrqTarget(i, bus_replies[i]);
+      result.irq[i] = true;
+    }
+
+    result.start_now = GetNow();
+    result.last_reply = result.start_now;
+    return result;
+  }
+
+  /// Note which servos are expected to reply, and if all of them
+  /// have replied often enough, how long to wait for them.
+  void StartReplyWindow(const Input& input, uint32_t processors,
+                        CanReadState* state) {
+    int64_t window_ns = 0;
+    bool any = false;
+    for (const auto& frame : input.tx_can) {
+      if (!frame.expect_reply) { continue; }
+      const int bus = frame.bus;
+      if (!(processors & BusProcessor(bus))) { continue; }
+
+      const int id = frame.id & 0x7f;
+      state->pending[bus][id / 64] |= (1ull << (id % 64));
+      any = true;
+
+      const auto servo_ns = reply_timeout_->WindowNs(bus, id);
+      if (servo_ns < 0 || window_ns < 0) {
+        window_ns = -1;
+      } else {
+        window_ns = std::max(window_ns, servo_ns);
       }
-      if (to_check[1]) {
-        const int count = ReadCanFrames(aux_spi_, 1, 3, &input.rx_can, output);
-        bus_replies[1] -= count;
-        if (count) {
-          last_reply = GetNow();
-          any_found = true;
-        }
+    }
+    // Forced checks are for frames nothing asked for, so the learned
+    // window says nothing about how long to listen.  Those cycles, and
+    // those with nothing to wait for, use the timeouts in 'Input'.
+    bool forced = false;
+    for (int bus = 1; bus < 6; bus++) {
+      if ((input.force_can_check & (1u << bus)) &&
+          (processors & BusProcessor(bus))) {
+        forced = true;
       }
-      if (to_check[2] && config_.enable_aux) {
-        const int count = ReadCanFrames(primary_spi_, 0, 5, &input.rx_can, output);
-        bus_replies[2] -= count;
-        if (count) {
-          last_reply = GetNow();
-          any_found = true;
+    }
+    state->window_ns = (any && !forced) ? window_ns : -1;
+  }
+
+  void LearnReplies(CanReadState* state, const Span<CanFrame>& rx_can,
+                    size_t begin, size_t end) {
+    if (begin == end) { return; }
+    const auto latency_ns = GetNow() - state->start_now;
+    for (size_t i = begin; i < end; i++) {
+      const int bus = rx_can[i].bus;
+      if (bus < 1 || bus > 5) { continue; }
+      const int id = (rx_can[i].id >> 8) & 0x7f;
+      auto& word = state->pending[bus][id / 64];
+      const uint64_t bit = 1ull << (id % 64);
+      // Only replies this cycle asked for are learned from.
+      if (!(word & bit)) { continue; }
+      word &= ~bit;
+      reply_timeout_->Record(bus, id, latency_ns);
+    }
+  }
+
+  /// Servos which did not reply within the window are recorded as
+  /// replying at its end, so that the window grows for those which
+  /// have become slower.  Those which have never replied, or have
+  /// stopped replying, stay on the timeouts given in 'Input'.
+  void LearnMissingReplies(const CanReadState& state) {
+    if (state.window_ns < 0) { return; }
+    if (GetNow() - state.start_now < state.window_ns) { return; }
+    for (int bus = 1; bus < 6; bus++) {
+      for (int word = 0; word < 2; word++) {
+        const auto bits = state.pending[bus][word];
+        if (!bits) { continue; }
+        for (int bit = 0; bit < 64; bit++) {
+          if (bits & (1ull << bit)) {
+            reply_timeout_->RecordMiss(bus, word * 64 + bit, state.window_ns);
+          }
         }
       }
+    }
+  }
 
-      if (output->rx_can_size >= input.rx_can.size()) {
-        // Our buffer is full, so no more frames could have been
-        // returned.
-        return;
+  /// Check each processor for CAN replies exactly once.  Returns true
+  /// if reading is complete, either because everything expected has
+  /// arrived or the timeout has expired.
+  bool ReadCanStep(const Input& input, CanReadState* state,
+                   const Span<CanFrame>& rx_can, Output* output,
+                   bool* any_found) {
+    const size_t rx_start = output->rx_can_size;
+    const bool done = PollCan(input, state, rx_can, output, any_found);
+    if (statistics_) {
+      RecordReplies(state, rx_can, rx_start, output->rx_can_size);
+      if (done) { RecordTimeouts(*state); }
+    }
+    if (reply_timeout_) {
+      LearnReplies(state, rx_can, rx_start, output->rx_can_size);
+      if (done) { LearnMissingReplies(*state); }
+    }
+    return done;
+  }
+
+  bool PollCan(const Input& input, CanReadState* state,
+               const Span<CanFrame>& rx_can, Output* output,
+               bool* any_found) {
+    auto& bus_replies = state->bus_replies;
+    const auto& to_check = state->to_check;
+
+    *any_found = false;
+    // Then check for CAN responses as necessary.
+    if (to_check[0] && CanIrqAsserted(*state, 0)) {
+      const int count = ReadCanFrames(aux_spi_, 0, 1, &rx_can, output);
+      bus_replies[0] -= count;
+      if (count) {
+        state->last_reply = GetNow();
+        *any_found = true;
+      }
+    }
+    if (to_check[1] && CanIrqAsserted(*state, 1)) {
+      const int count = ReadCanFrames(aux_spi_, 1, 3, &rx_can, output);
+      bus_replies[1] -= count;
+      if (count) {
+        state->last_reply = GetNow();
+        *any_found = true;
+      }
+    }
+    if (to_check[2] && config_.enable_aux && CanIrqAsserted(*state, 2)) {
+      const int count = ReadCanFrames(primary_spi_, 0, 5, &rx_can, output);
+      bus_replies[2] -= count;
+      if (count) {
+        state->last_reply = GetNow();
+        *any_found = true;
       }
+    }
 
-      const auto cur_now = GetNow();
-      const auto delta_ns = cur_now - start_now;
-      const auto since_last_ns = cur_now - last_reply;
-
-      if (bus_replies[0] <= 0 &&
-          bus_replies[1] <= 0 &&
-          bus_replies[2] <= 0 &&
-          delta_ns > input.min_tx_wait_ns &&
-          since_last_ns > input.rx_extra_wait_ns) {
-        // We've read all the replies we are expecting and have polled
-        // everything at least once if requested.
-        return;
+    if (output->rx_can_size >= rx_can.size()) {
+      // Our buffer is full, so no more frames could have been
+      // returned.
+      return true;
+    }
+
+    const auto cur_now = GetNow();
+    const auto delta_ns = cur_now - state->start_now;
+    const auto since_last_ns = cur_now - state->last_reply;
+
+    const bool adaptive = state->window_ns >= 0;
+    if (bus_replies[0] <= 0 &&
+        bus_replies[1] <= 0 &&
+        bus_replies[2] <= 0 &&
+        delta_ns > input.min_tx_wait_ns &&
+        (adaptive || since_last_ns > input.rx_extra_wait_ns)) {
+      // We've read all the replies we are expecting and have polled
+      // everything at least once if requested.
+      return true;
+    }
+
+    const bool expired = adaptive ?
+        (delta_ns > state->window_ns && delta_ns >= input.min_tx_wait_ns) :
+        (delta_ns > input.timeout_ns && !
+         (delta_ns < input.min_tx_wait_ns ||
+          since_last_ns < input.rx_extra_wait_ns));
+    if (expired) {
+      // The timeout has expired.  If some replies never arrived, the
+      // IRQ target was not reached, so poll everything once more to
+      // collect those which did.
+      if (AnyCanIrq(*state)) {
+        for (auto& irq : state->irq) { irq = false; }
+        return false;
       }
+      return true;
+    }
+
+    return false;
+  }
+
+  void SetCanIrqTarget(int processor, int count) {
+    const char target = static_cast<char>(std::max(0, std::min(count, 255)));
+    if (processor == 2) {
+      primary_spi_.Write(0, 14, &target, 1);
+    } else {
+      aux_spi_.Write(processor, 14, &target, 1);
+    }
+  }
 
-      if (delta_ns > input.timeout_ns && !
-          (delta_ns < input.min_tx_wait_ns ||
-           since_last_ns < input.rx_extra_wait_ns)) {
-        // The timeout has expired.
+  bool CanIrqAsserted(const CanReadState& state, int processor) {
+    if (!state.irq[processor]) { return true; }
+    return primary_spi_.gpio()->GetGpioInput(kCanIrq[processor]);
+  }
+
+  static bool AnyCanIrq(const CanReadState& state) {
+    return state.irq[0] || state.irq[1] || state.irq[2];
+  }
+
+  void RecordReplies(CanReadState* state, const Span<CanFrame>& rx_can,
+                     size_t begin, size_t end) {
+    if (begin == end) { return; }
+    const auto latency_ns = GetNow() - state->start_now;
+    for (size_t i = begin; i < end; i++) {
+      const int bus = rx_can[i].bus;
+      if (bus < 1 || bus > 5) { continue; }
+      state->received[bus]++;
+      auto& stats = statistics_->bus[bus];
+      stats.reply.Record(latency_ns);
+      SingleWriterAdd(&stats.replies, 1);
+    }
+  }
+
+  void RecordTimeouts(const CanReadState& state) {
+    for (int bus = 1; bus < 6; bus++) {
+      if (state.received[bus] >= state.expected[bus]) { continue; }
+      SingleWriterAdd(&statistics_->bus[bus].timeouts, 1);
+    }
+  }
+
+  enum Phase {
+    kSendPhase,
+    kRfPhase,
+    kAttitudePhase,
+    kCanPhase,
+  };
+
+  /// Return the current time if anything will make use of it.
+  int64_t TimingNow() const {
+    return (statistics_ || config_.flight_recorder) ? GetNow() : 0;
+  }
+
+  /// Record the duration of a phase which began at @p since, and
+  /// return the current time, or 0 if statistics are disabled.
+  int64_t MarkPhase(Phase phase, int64_t since) {
+    if (!statistics_) { return 0; }
+    const auto now = GetNow();
+    auto& histogram = [&]() -> AtomicHistogram& {
+      switch (phase) {
+        case kSendPhase: { return statistics_->send; }
+        case kRfPhase: { return statistics_->rf; }
+        case kAttitudePhase: { return statistics_->attitude; }
+        case kCanPhase: { break; }
+      }
+      return statistics_->can_read;
+    }();
+    histogram.Record(now - since);
+    return now;
+  }
+
+  void FinishCycleRecording(const Input& input, const Output& output,
+                            const CycleTiming& timing) {
+    if (config_.flight_recorder) {
+      config_.flight_recorder->RecordCycle(
+          input, output, timing.start_ns,
+          timing.can_ns ? timing.can_ns : GetNow());
+    }
+    if (statistics_) {
+      statistics_->Finish(timing);
+    }
+  }
+
+  CycleStatistics Statistics() {
+    CycleStatistics result;
+    if (statistics_) { statistics_->Get(&result); }
+    return result;
+  }
+
+  void ReadCan(const Input& input, const ExpectedReply& expected_replies,
+               uint32_t processors, const Span<CanFrame>& rx_can,
+               Output* output) {
+    auto state = StartReadCan(input, expected_replies, processors);
+
+    while (true) {
+      bool any_found = false;
+      if (ReadCanStep(input, &state, rx_can, output, &any_found)) {
         return;
       }
 
-      if (!any_found) {
-        // Give the controllers a chance to rest.
+      if (!any_found && !AnyCanIrq(state)) {
+        // Give the controllers a chance to rest.  When waiting on
+        // IRQ lines, we just spin on the GPIO level instead, as that
+        // costs the controllers nothing.
         BusyWaitUs(20);
       }
     }
   }
 
   Output Cycle(const Input& input) {
+    if (primary_worker_) {
+      return CycleParallel(input);
+    }
+
+    CycleTiming timing;
+    timing.start_ns = TimingNow();
+
     // Send off all our CAN data to all buses.
     auto expected_replies = SendCan(input);
 
+    timing.send_ns = MarkPhase(kSendPhase, timing.start_ns);
+    int64_t mark = timing.send_ns;
+
     Output result;
 
     // While those are sending, do our other work.
@@ -1552,22 +3309,284 @@ class Pi3Hat::Impl {
       ReadRf(input, &result);
     }
 
+    if (input.tx_rf.size() || input.request_rf) {
+      mark = timing.rf_ns = MarkPhase(kRfPhase, mark);
+    }
+
     if (input.request_attitude) {
       result.attitude_present =
           GetAttitude(input.attitude, input.wait_for_attitude,
                       input.request_attitude_detail);
     }
+    if (input.request_imu_fifo) {
+      ReadImuFifo(input, &result);
+    }
+    if (input.request_attitude || input.request_imu_fifo) {
+      mark = timing.attitude_ns = MarkPhase(kAttitudePhase, mark);
+    }
 
     ReadCan(input, expected_replies, &result);
 
+    timing.can_ns = MarkPhase(kCanPhase, mark);
+    FinishCycleRecording(input, result, timing);
+
+    ToggleDebug();
+
+    return result;
+  }
+
+  /// Perform a cycle with all primary SPI operations (JC5, RF, and
+  /// attitude) run on the helper thread, concurrently with the
+  /// auxiliary SPI operations (JC1-4) on the calling thread.
+  Output CycleParallel(const Input& input) {
+    CycleTiming timing;
+    timing.start_ns = TimingNow();
+
+    const auto expected_replies = PrepareCan(input);
+
+    if (primary_rx_can_.size() < input.rx_can.size()) {
+      primary_rx_can_.resize(input.rx_can.size());
+    }
+
+    primary_worker_->Start(input, expected_replies);
+
+    Output result;
+    SendCanAux(input);
+    timing.send_ns = MarkPhase(kSendPhase, timing.start_ns);
+
+    ReadCan(input, expected_replies, kProcessorCan1 | kProcessorCan2,
+            input.rx_can, &result);
+
+    const auto& primary_output = primary_worker_->Wait();
+
+    // Merge in everything the helper thread found.
+    for (size_t i = 0; i < primary_output.rx_can_size &&
+             result.rx_can_size < input.rx_can.size(); i++) {
+      input.rx_can[result.rx_can_size++] = primary_rx_can_[i];
+    }
+    result.rx_rf_size = primary_output.rx_rf_size;
+    result.rf_lock_age_ms = primary_output.rf_lock_age_ms;
+    result.attitude_present = primary_output.attitude_present;
+    result.rx_imu_size = primary_output.rx_imu_size;
+    result.imu_fifo_overflow_count = primary_output.imu_fifo_overflow_count;
+
+    timing.rf_ns = primary_timing_.rf_ns;
+    timing.attitude_ns = primary_timing_.attitude_ns;
+    timing.can_ns = MarkPhase(kCanPhase, timing.send_ns);
+    FinishCycleRecording(input, result, timing);
+
+    ToggleDebug();
+
+    return result;
+  }
+
+  /// Everything which happens on the primary SPI bus during a cycle.
+  /// This is run from the helper thread in parallel mode.
+  void CyclePrimary(const Input& input, const ExpectedReply& expected_replies,
+                    Output* output) {
+    primary_timing_ = CycleTiming();
+    SendCanPrimary(input);
+    int64_t mark = TimingNow();
+
+    if (input.tx_rf.size()) {
+      SendRf(input.tx_rf);
+    }
+
+    if (input.request_rf) {
+      ReadRf(input, output);
+    }
+
+    if (input.tx_rf.size() || input.request_rf) {
+      mark = primary_timing_.rf_ns = MarkPhase(kRfPhase, mark);
+    }
+
+    if (input.request_attitude) {
+      output->attitude_present =
+          GetAttitude(input.attitude, input.wait_for_attitude,
+                      input.request_attitude_detail);
+    }
+    if (input.request_imu_fifo) {
+      ReadImuFifo(input, output);
+    }
+    if (input.request_attitude || input.request_imu_fifo) {
+      primary_timing_.attitude_ns = MarkPhase(kAttitudePhase, mark);
+    }
+
+    if (config_.enable_aux) {
+      ReadCan(input, expected_replies, kProcessorAux,
+              Span<CanFrame>(primary_rx_can_.data(), input.rx_can.size()),
+              output);
+    }
+  }
+
+  void StartCycle(const Input& input) {
+    ThrowIf(async_.state != AsyncState::kIdle,
+            []() { return "pi3hat: StartCycle called with a cycle in progress"; });
+
+    async_ = AsyncCycle();
+    async_.timing.start_ns = TimingNow();
+    async_.input = &input;
+    async_.expected_replies = PrepareCan(input);
+
+    if (primary_worker_) {
+      if (primary_rx_can_.size() < input.rx_can.size()) {
+        primary_rx_can_.resize(input.rx_can.size());
+      }
+      primary_worker_->Start(input, async_.expected_replies);
+      SendCanAux(input);
+      async_.can = StartReadCan(
+          input, async_.expected_replies, kProcessorCan1 | kProcessorCan2);
+    } else {
+      SendCanAux(input);
+      SendCanPrimary(input);
+      if (input.tx_rf.size()) {
+        SendRf(input.tx_rf);
+      }
+      async_.can = StartReadCan(
+          input, async_.expected_replies, kProcessorAll);
+    }
+
+    async_.timing.send_ns = MarkPhase(kSendPhase, async_.timing.start_ns);
+    async_.state = AsyncState::kReading;
+  }
+
+  bool PollCycle() {
+    if (async_.state == AsyncState::kIdle) { return true; }
+    if (async_.state == AsyncState::kComplete) { return true; }
+
+    const auto& input = *async_.input;
+    auto& output = async_.output;
+
+    if (!primary_worker_) {
+      if (input.request_rf && !async_.rf_done) {
+        ReadRf(input, &output);
+        async_.rf_done = true;
+      }
+
+      if (input.request_imu_fifo && !async_.imu_fifo_done) {
+        ReadImuFifo(input, &output);
+        async_.imu_fifo_done = true;
+      }
+
+      if (input.request_attitude && !async_.attitude_done) {
+        bool ready = true;
+        if (input.wait_for_attitude) {
+          char buf[2] = {};
+          primary_spi_.Read(0, 96, buf, sizeof(buf));
+          ready = (buf[1] == 1);
+        }
+        if (ready) {
+          output.attitude_present =
+              GetAttitude(input.attitude, false, input.request_attitude_detail);
+          async_.attitude_done =
+              output.attitude_present || !input.wait_for_attitude;
+        }
+      }
+    }
+
+    if (!async_.can_done) {
+      // If we spam the STM32s too hard, then they don't have any
+      // cycles left to actually receive anything.
+      const auto now = GetNow();
+      if (async_.any_found || AnyCanIrq(async_.can) ||
+          (now - async_.last_poll) > 20000) {
+        async_.last_poll = now;
+        async_.can_done = ReadCanStep(
+            input, &async_.can, input.rx_can, &output, &async_.any_found);
+      }
+    }
+
+    const bool attitude_complete =
+        primary_worker_ || !input.request_attitude || async_.attitude_done;
+    const bool primary_complete =
+        !primary_worker_ || primary_worker_->done();
+
+    if (async_.can_done && attitude_complete && primary_complete) {
+      async_.state = AsyncState::kComplete;
+      return true;
+    }
+    return false;
+  }
+
+  Output FinishCycle() {
+    ThrowIf(async_.state == AsyncState::kIdle,
+            []() { return "pi3hat: FinishCycle called with no cycle started"; });
+
+    while (!PollCycle());
+
+    const auto& input = *async_.input;
+    Output result = async_.output;
+    // If the helper thread failed, its exception is passed on below,
+    // and the next cycle may be started regardless.
+    async_.state = AsyncState::kIdle;
+
+    if (primary_worker_) {
+      const auto& primary_output = primary_worker_->Wait();
+      for (size_t i = 0; i < primary_output.rx_can_size &&
+               result.rx_can_size < input.rx_can.size(); i++) {
+        input.rx_can[result.rx_can_size++] = primary_rx_can_[i];
+      }
+      result.rx_rf_size = primary_output.rx_rf_size;
+      result.rf_lock_age_ms = primary_output.rf_lock_age_ms;
+      result.attitude_present = primary_output.attitude_present;
+      result.rx_imu_size = primary_output.rx_imu_size;
+      result.imu_fifo_overflow_count = primary_output.imu_fifo_overflow_count;
+
+      async_.timing.rf_ns = primary_timing_.rf_ns;
+      async_.timing.attitude_ns = primary_timing_.attitude_ns;
+    }
+
+    async_.timing.can_ns = MarkPhase(kCanPhase, async_.timing.send_ns);
+    FinishCycleRecording(input, result, async_.timing);
+
+    ToggleDebug();
+
+    return result;
+  }
+
+  void ToggleDebug() {
     primary_spi_.gpio()->SetGpioMode(13, Rpi3Gpio::OUTPUT);
     static bool debug_toggle = false;
     primary_spi_.gpio()->SetGpioOutput(13, debug_toggle);
     debug_toggle = !debug_toggle;
-
-    return result;
   }
 
+  /// Owns the helper thread used for parallel cycles, and the
+  /// arguments passed to it.
+  class PrimaryWorker {
+   public:
+    PrimaryWorker(Impl* parent, const WorkerThread::Options& options)
+        : parent_(parent),
+          thread_([this]() {
+              parent_->CyclePrimary(*input_, expected_replies_, &output_);
+            }, options) {}
+
+    void Start(const Input& input, const ExpectedReply& expected_replies) {
+      // A cycle whose caller failed may still be running.
+      thread_.Abandon();
+      input_ = &input;
+      expected_replies_ = expected_replies;
+      output_ = Output();
+      thread_.Start();
+    }
+
+    const Output& Wait() {
+      thread_.Wait();
+      return output_;
+    }
+
+    bool done() const { return thread_.done(); }
+
+   private:
+    Impl* const parent_;
+
+    const Input* input_ = nullptr;
+    ExpectedReply expected_replies_;
+    Output output_;
+
+    WorkerThread thread_;
+  };
+
   const Configuration config_;
 
   int lock_file_fd_ = -1;
@@ -1576,15 +3595,73 @@ class Pi3Hat::Impl {
   AuxSpi aux_spi_;
 
   DeviceAttitudeData device_attitude_;
+  DeviceImuFifo device_imu_fifo_;
+  int attitude_version_ = 0;
+  ClockSync clock_sync_;
 
   // This is a member variable purely so that in steady state we don't
   // have to allocate memory.
   //
   // It is 1 indexed to match the bus naming.
   std::vector<int> can_packets_[6];
+  CanTxScheduler can_scheduler_;
+
+  // The CAN SPI protocol version of each processor (can1, can2, aux).
+  int can_version_[3] = {};
+
+  enum class AsyncState {
+    kIdle,
+    kReading,
+    kComplete,
+  };
+
+  /// Everything associated with a cycle begun with StartCycle.
+  struct AsyncCycle {
+    AsyncState state = AsyncState::kIdle;
+    const Input* input = nullptr;
+    ExpectedReply expected_replies;
+    CanReadState can;
+    Output output;
+    bool rf_done = false;
+    bool attitude_done = false;
+    bool imu_fifo_done = false;
+    bool can_done = false;
+    bool any_found = false;
+    int64_t last_poll = 0;
+    CycleTiming timing;
+  };
+
+  AsyncCycle async_;
+
+  // Only used in parallel mode, to hold frames received from JC5 on
+  // the helper thread.
+  std::vector<CanFrame> primary_rx_can_;
+  std::unique_ptr<PrimaryWorker> primary_worker_;
+  // Written only by the helper thread while it is working.
+  CycleTiming primary_timing_;
+
+  std::unique_ptr<StatisticsRecorder> statistics_;
+  // Only present when 'Configuration::adaptive_timeout' is enabled.
+  std::unique_ptr<ReplyTimeoutLearner> reply_timeout_;
+
+  // Only present when 'Configuration::spi_tuning' is enabled.  The
+  // aux tuner is only used from the thread calling Cycle, and the
+  // primary one from whichever thread performs primary SPI work.
+  std::unique_ptr<SpiLinkTuner> aux_tuner_;
+  std::unique_ptr<SpiLinkTuner> primary_tuner_;
+  // Indexed like CanReadState::to_check.
+  int spi_probe_countdown_[3] = {};
+
+  CanBatch can_batch_;
+  CanBatch can_batch_primary_;
+  // The number of transmit buffers each processor had free when last
+  // read, less the frames written since.
+  int can_tx_free_[3] = {};
 
   // To keep track of which RF slots we have processed.
   uint32_t last_bitfield_ = 0;
+  int rf_version_ = 0;
+  DeviceRfBulkRead device_rf_bulk_;
 };
 
 Pi3Hat::Pi3Hat(const Configuration& configuration)
@@ -1598,17 +3675,84 @@ Pi3Hat::Output Pi3Hat::Cycle(const Input& input) {
   return impl_->Cycle(input);
 }
 
+void Pi3Hat::StartCycle(const Input& input) {
+  impl_->StartCycle(input);
+}
+
+bool Pi3Hat::PollCycle() {
+  return impl_->PollCycle();
+}
+
+Pi3Hat::Output Pi3Hat::FinishCycle() {
+  return impl_->FinishCycle();
+}
+
 Pi3Hat::DeviceInfo Pi3Hat::device_info() {
   return impl_->device_info();
 }
 
+Pi3Hat::SpiStatus Pi3Hat::spi_status() {
+  return impl_->spi_status();
+}
+
 Pi3Hat::DevicePerformance Pi3Hat::device_performance() {
   return impl_->device_performance();
 }
 
+Pi3Hat::DeviceProfile Pi3Hat::device_profile() {
+  return impl_->device_profile();
+}
+
+void Pi3Hat::ResetDeviceProfile() {
+  impl_->ResetDeviceProfile();
+}
+
 void Pi3Hat::ReadSpi(int spi_bus, int address, char* data, size_t size) {
   impl_->ReadSpi(spi_bus, address, data, size);
 }
 
+Pi3Hat::CycleStatistics Pi3Hat::Statistics() {
+  return impl_->Statistics();
+}
+
+int Pi3Hat::LatencyHistogram::Bucket(int64_t ns) {
+  if (ns < kSubBuckets) { return ns < 0 ? 0 : static_cast<int>(ns); }
+  // The index of the most significant bit, which is at least 3.
+  const int msb = 63 - __builtin_clzll(static_cast<uint64_t>(ns));
+  const int group = msb - 2;
+  const int sub = static_cast<int>(ns >> (msb - 3)) & (kSubBuckets - 1);
+  return std::min(group * kSubBuckets + sub, kBuckets - 1);
+}
+
+int64_t Pi3Hat::LatencyHistogram::BucketStartNs(int bucket) {
+  const int group = bucket / kSubBuckets;
+  const int sub = bucket % kSubBuckets;
+  if (group == 0) { return sub; }
+  return static_cast<int64_t>(kSubBuckets + sub) << (group - 1);
+}
+
+void Pi3Hat::LatencyHistogram::Record(int64_t ns) {
+  if (ns < 0) { ns = 0; }
+  counts[Bucket(ns)]++;
+  if (count == 0 || ns < min_ns) { min_ns = ns; }
+  if (ns > max_ns) { max_ns = ns; }
+  total_ns += ns;
+  count++;
+}
+
+int64_t Pi3Hat::LatencyHistogram::Percentile(double fraction) const {
+  if (count == 0) { return 0; }
+  const uint64_t target = std::max<uint64_t>(
+      1, static_cast<uint64_t>(std::ceil(fraction * count)));
+  uint64_t seen = 0;
+  for (int i = 0; i < kBuckets; i++) {
+    seen += counts[i];
+    if (seen < target) { continue; }
+    if (i + 1 >= kBuckets) { return max_ns; }
+    return std::max(min_ns, std::min(max_ns, BucketStartNs(i + 1) - 1));
+  }
+  return max_ns;
+}
+
 }
 }
@@ -24,6 +24,7 @@
 #include <cstdint>
 #include <cstdlib>
 #include <stdexcept>
+#include <string>
 
 namespace mjbots {
 namespace pi3hat {
@@ -105,6 +106,24 @@ struct Attitude {
   Point3D bias_dps;
   Quaternion attitude_uncertainty;
   Point3D bias_uncertainty_dps;
+
+  /// The time the underlying IMU sample was taken, in CLOCK_MONOTONIC
+  /// nanoseconds.  The hat's clock is mapped onto the host's using
+  /// the attitude reads themselves, so this can be late by about the
+  /// smallest recent delay between a new attitude and its read.  That
+  /// is a few microseconds with 'wait_for_attitude', and usually tens
+  /// of microseconds without.  It is 0 if the firmware does not
+  /// support timestamps.
+  int64_t timestamp_ns = 0;
+};
+
+/// One raw, but mounting corrected, IMU sample from the firmware FIFO.
+struct ImuSample {
+  /// The time of the sample in the hat's own microsecond clock.  This
+  /// wraps every ~71 minutes.
+  uint32_t timestamp_us = 0;
+  Point3D rate_dps;
+  Point3D accel_mps2;
 };
 
 struct RfSlot {
@@ -115,6 +134,8 @@ struct RfSlot {
   uint32_t age_ms = 0;
 };
 
+class FlightRecorder;
+
 class Error : public std::runtime_error {
  public:
   using std::runtime_error::runtime_error;
@@ -143,6 +164,34 @@ class Pi3Hat {
     int time_seg2 = -1;
   };
 
+  /// A hardware acceptance filter, as implemented by the FDCAN
+  /// peripheral.  Frames rejected by a filter are never queued for
+  /// the host.
+  struct CanFilter {
+    enum Mode {
+      kRange,  // id1 <= ID <= id2
+      kDual,  // ID == id1 or ID == id2
+      kMask,  // (ID & id2) == (id1 & id2)
+    };
+
+    enum Action {
+      kDisable,
+      kAccept,
+      kReject,
+    };
+
+    enum Type {
+      kStandard,
+      kExtended,
+    };
+
+    uint32_t id1 = 0;
+    uint32_t id2 = 0;
+    Mode mode = kRange;
+    Action action = kDisable;
+    Type type = kStandard;
+  };
+
   struct CanConfiguration {
     int slow_bitrate = 1000000;
     int fast_bitrate = 5000000;
@@ -154,11 +203,139 @@ class Pi3Hat {
 
     CanRateOverride std_rate;
     CanRateOverride fd_rate;
+
+    // The number of received frames which the firmware will queue
+    // for this bus while waiting to be read, from 1 to 24.  This is
+    // ignored by firmware older than CAN protocol version 6, which
+    // can only queue 6 frames.
+    int rx_queue_depth = 24;
+
+    // Filters are evaluated in order, separately for standard and
+    // extended IDs.  Frames matching none of them have the
+    // corresponding global action applied.  These require CAN
+    // protocol version 7 or later, and configuring them on older
+    // firmware is an error.
+    //
+    // Note that moteus replies use extended IDs.
+    static constexpr int kMaxFilters = 8;
+    CanFilter filters[kMaxFilters] = {};
+    CanFilter::Action global_std_action = CanFilter::kAccept;
+    CanFilter::Action global_ext_action = CanFilter::kAccept;
+  };
+
+  /// Controls learning of CAN reply wait windows.  When enabled, the
+  /// latency of every reply is recorded per bus and per servo, and
+  /// each cycle waits for its expected replies only as long as the
+  /// slowest of them would usually take.
+  ///
+  /// Replies are matched to the frames that prompted them with the
+  /// moteus convention: the destination is in bits 0-6 of the
+  /// arbitration ID and the source of a reply is in bits 8-14.
+  struct AdaptiveTimeout {
+    bool enable = false;
+
+    // Each cycle waits until this fraction of previous replies from
+    // every expected servo would have arrived...
+    double percentile = 0.99;
+
+    // ... scaled by this, plus this much more.
+    double margin = 1.25;
+    uint32_t guard_ns = 20000;
+
+    // The learned window is limited to this range.
+    uint32_t min_ns = 50000;
+    uint32_t max_ns = 5000000;
+
+    // Until a servo has replied this many times, cycles expecting a
+    // reply from it use the timeouts given in 'Input'.
+    int min_samples = 16;
+
+    // Once this many replies have been recorded for a servo, older
+    // ones are given half the weight, so that the window follows
+    // changes in bus load.
+    int decay_samples = 1024;
+
+    // A servo which misses this many consecutive windows is taken to
+    // have stopped replying, and cycles expecting it use the timeouts
+    // given in 'Input' until it replies again.
+    int max_misses = 3;
+  };
+
+  struct SpiTiming {
+    int speed_hz = 0;
+    int cs_hold_us = 0;
+    int address_hold_us = 0;
+  };
+
+  /// Controls tuning of the SPI links to the pi3hat's processors.
+  /// At startup, each link is tried at progressively slower clocks,
+  /// then with shorter hold times, until every one of 'trials'
+  /// checked reads sees the expected data.  During operation, those
+  /// checks continue on a fraction of reads, and a link which sees
+  /// too many errors falls back to the next slower clock.
+  ///
+  /// Checks compare the processor identification against a copy read
+  /// at the configured timing, and verify the checksum the firmware
+  /// appends to its receive queue sizes.  Writes are not checked, but
+  /// use the same clock as the reads which are.
+  struct SpiTuning {
+    bool enable = false;
+
+    // Clocks from this down to 'Configuration::spi_speed_hz' are
+    // tried, each 'speed_step' times the last.
+    int max_speed_hz = 20000000;
+    double speed_step = 0.8;
+
+    // The link runs this many clock steps slower than the fastest
+    // which passed.
+    int margin_steps = 1;
+
+    // Hold times as short as this are tried.
+    int min_hold_us = 1;
+
+    // Checked reads each candidate must pass on every processor.
+    int trials = 50;
+
+    // During operation, the receive queue sizes of each processor are
+    // checked every this many cycles, in addition to every time they
+    // are read anyway.
+    int probe_interval = 100;
+
+    // If more than 'max_errors' of 'error_window' consecutive checks
+    // fail, the link falls back.
+    int error_window = 200;
+    int max_errors = 1;
+
+    // The timing chosen for each link is saved here, along with the
+    // identity of the processors it was chosen for.  On the next
+    // start with the same processors, it is checked once and used
+    // without calibrating again.  Empty disables the cache.  As this
+    // is normally written by root, it should be in a directory only
+    // root can write, like /var/lib/pi3hat.
+    std::string cache_path;
   };
 
   struct Configuration {
+    // With 'spi_tuning' enabled, this is also the slowest clock the
+    // links will fall back to.
     int spi_speed_hz = 10000000;
 
+    // If true, long SPI transfers are performed by the DMA controller
+    // instead of CPU polling.  This applies only to the primary SPI
+    // bus (JC5, IMU and RF), as the auxiliary SPI peripheral used for
+    // JC1-4 has no DMA support.  Transfers long enough to be worth it
+    // sleep while the controller works, releasing the CPU.  Shorter
+    // ones are still polled, so the CPU is only saved on large RF,
+    // IMU FIFO or batched CAN reads.
+    bool spi_dma = false;
+
+    // The legacy DMA channels (0-10) used for 'spi_dma'.  If negative,
+    // the highest idle channels the kernel's dma-channel-mask lists
+    // are used.  A channel found in use is refused, as user space has
+    // no way to reserve one from the kernel.
+    int spi_dma_tx_channel = -1;
+    int spi_dma_rx_channel = -1;
+
     // All attitude data will be transformed by this mounting angle.
     Euler mounting_deg;
 
@@ -167,16 +344,79 @@ class Pi3Hat {
     // sample at will result in more noise.
     uint32_t attitude_rate_hz = 400;
 
+    // If true, attitude is estimated with a 6 state error state
+    // filter rather than the original 7 state quaternion filter.  It
+    // needs less CPU on the hat, leaving more headroom at high
+    // attitude rates.  Both report the same data.
+    bool attitude_error_state = false;
+
     // RF communication will be with a transmitter having this ID.
     uint32_t rf_id = 5678;
 
+    // If non-zero, the given RF slot is sent at up to this rate, and
+    // its priority only serves to enable it.  The hat skips such a
+    // slot while its data is unchanged, apart from a refresh once a
+    // second, so it may simply be re-sent every cycle.
+    float rf_slot_rate_hz[15] = {};
+
+    // If non-zero, at most this many bytes of slot data are sent over
+    // RF each second.
+    uint32_t rf_budget_bytes_per_s = 0;
+
     bool enable_aux = true;
 
     CanConfiguration can[5] = {};
 
+    // If true, CAN replies are waited for by watching the IRQ line of
+    // each CAN processor, rather than by repeatedly polling it over
+    // SPI.  The firmware is told how many replies to expect, so the
+    // line is only asserted once all of them are queued.  Processors
+    // with firmware too old to support this are polled as usual.
+    bool can_irq_wait = false;
+
+    // If true, outgoing CAN frames are ordered using estimates of
+    // their time on the bus, so that the frames whose replies will
+    // take longest, and the busiest buses, are serviced first.
+    // Otherwise, buses are serviced in a fixed order with JC5 last.
+    bool can_tx_schedule = true;
+
+    // If enabled, 'Input::timeout_ns' and 'Input::rx_extra_wait_ns'
+    // are replaced by windows learned from past replies, and reading
+    // ends as soon as every expected reply has arrived, though never
+    // before 'Input::min_tx_wait_ns'.  Cycles with any
+    // 'Input::force_can_check' buses use the timeouts in 'Input'.
+    AdaptiveTimeout adaptive_timeout;
+
+    SpiTuning spi_tuning;
+
     // If true, nothing is guaranteed to work but ReadSpi.
     bool raw_spi_only = false;
 
+    // If true, each Cycle performs all operations on the primary SPI
+    // bus (JC5, RF, and attitude) from a helper thread, concurrently
+    // with those on the auxiliary SPI bus (JC1-4).  The helper thread
+    // busy waits for work, and so should be given a CPU of its own.
+    bool parallel_spi = false;
+
+    // If non-negative, the helper thread is pinned to this CPU.  When
+    // parallel_spi_realtime_priority is also set, this must not be a
+    // CPU the calling thread runs on, as the spinning helper would
+    // starve a caller of lower priority.  Errors from the helper
+    // thread are thrown from Cycle or FinishCycle.
+    int parallel_spi_cpu = -1;
+
+    // If non-negative, the helper thread is run with SCHED_FIFO at
+    // this priority.
+    int parallel_spi_realtime_priority = -1;
+
+    // If true, the duration of each phase of every cycle is recorded
+    // and made available through Statistics().
+    bool enable_statistics = false;
+
+    // If set, every cycle is appended to this recorder, which must
+    // outlive the Pi3Hat.  See flight_recorder.h.
+    FlightRecorder* flight_recorder = nullptr;
+
     Configuration() {}
   };
 
@@ -223,6 +463,11 @@ class Pi3Hat {
 
     bool request_rf = false;
 
+    // If true, then every IMU sample since the last such request is
+    // read, up to the size of 'rx_imu'.  This lets the IMU be
+    // consumed at its full rate even if cycles are much slower.
+    bool request_imu_fifo = false;
+
     // A bitmask indicating CAN buses to check for data even if no
     // replies are expected.
     //  * bit 0 is unused, so the used bits start from 1
@@ -232,6 +477,7 @@ class Pi3Hat {
     Span<CanFrame> rx_can;
     Span<RfSlot> rx_rf;
     Attitude* attitude = nullptr;
+    Span<ImuSample> rx_imu;
   };
 
   struct Output {
@@ -242,6 +488,12 @@ class Pi3Hat {
 
     // This will only be updated if 'Input::request_rf' is true
     uint32_t rf_lock_age_ms = 0;
+
+    // These will only be updated if 'Input::request_imu_fifo' is
+    // true.  The overflow count is the total number of samples lost
+    // because they were not read in time.
+    size_t rx_imu_size = 0;
+    uint32_t imu_fifo_overflow_count = 0;
   };
 
   /// Do some or all of the following:
@@ -253,6 +505,23 @@ class Pi3Hat {
   ///  * Return any RF slots that may have been received
   Output Cycle(const Input& input);
 
+  /// The following three methods provide the same operation as
+  /// Cycle, split into phases so that the caller can perform other
+  /// work while waiting for CAN replies.  Only one cycle may be
+  /// outstanding at a time, and 'input' (along with everything it
+  /// points to) must remain valid until FinishCycle returns.
+  ///
+  /// StartCycle sends all CAN frames and RF slots, then returns
+  /// without waiting for any replies.
+  void StartCycle(const Input& input);
+
+  /// Perform at most one round of polling without blocking.  Returns
+  /// true once the cycle is complete and FinishCycle will not block.
+  bool PollCycle();
+
+  /// Block until the cycle is complete, and return its results.
+  Output FinishCycle();
+
   struct ProcessorInfo {
     uint8_t git_hash[20] = {};
     bool dirty = false;
@@ -278,11 +547,142 @@ class Pi3Hat {
     PerformanceInfo aux;
   };
 
+
   DevicePerformance device_performance();
 
+  struct SpiLinkStatus {
+    SpiTiming timing;
+    // False if tuning was disabled, or the configured timing itself
+    // failed its checks, in which case it is used unchanged.
+    bool tuned = false;
+    uint64_t checks = 0;
+    uint64_t errors = 0;
+    int fallbacks = 0;
+  };
+
+  struct SpiStatus {
+    // JC1-4.
+    SpiLinkStatus aux;
+    // JC5, the IMU, and RF.
+    SpiLinkStatus primary;
+  };
+
+  /// This must not be called concurrently with any cycle.
+  SpiStatus spi_status();
+
+  /// The time spent in one firmware subsystem, measured in CPU
+  /// cycles.
+  struct SubsystemProfile {
+    uint32_t max_cycles = 0;
+    uint32_t count = 0;
+    // Over the most recent 20ms.
+    uint32_t average_cycles_per_ms = 0;
+    // The worst single millisecond since the last reset.
+    uint32_t peak_cycles_per_ms = 0;
+
+    // Bucket N counts durations of [2^(N+4), 2^(N+5)) cycles, with
+    // the first and last open ended.
+    static constexpr int kBuckets = 16;
+    uint16_t histogram[kBuckets] = {};
+  };
+
+  struct ProcessorProfile {
+    // The CPU clock, or 0 if the firmware does not support profiling.
+    uint32_t clock_hz = 0;
+
+    SubsystemProfile spi_isr;
+    SubsystemProfile can_poll;
+    // These are only present on the auxiliary processor.
+    SubsystemProfile imu;
+    SubsystemProfile rf;
+  };
+
+  struct DeviceProfile {
+    ProcessorProfile can1;
+    ProcessorProfile can2;
+    ProcessorProfile aux;
+  };
+
+  DeviceProfile device_profile();
+
+  /// Clear the worst case values and histograms on all processors.
+  void ResetDeviceProfile();
+
   /// Read raw SPI data.
   void ReadSpi(int spi_bus, int address, char* data, size_t size);
 
+  /// A histogram of durations in nanoseconds, in the style of
+  /// HdrHistogram.  Each power of two is split into kSubBuckets
+  /// linear buckets, so any value is known to within 1/kSubBuckets of
+  /// itself.
+  struct LatencyHistogram {
+    static constexpr int kSubBuckets = 8;
+    // This covers up to 2^40ns, or about 18 minutes.  Longer
+    // durations are counted in the final bucket.
+    static constexpr int kBuckets = kSubBuckets * 39;
+
+    uint64_t counts[kBuckets] = {};
+    uint64_t count = 0;
+    int64_t total_ns = 0;
+    int64_t min_ns = 0;
+    int64_t max_ns = 0;
+
+    static int Bucket(int64_t ns);
+    static int64_t BucketStartNs(int bucket);
+
+    void Record(int64_t ns);
+
+    /// Return the largest duration which was no longer than
+    /// @p fraction (from 0 to 1) of all samples, or 0 if empty.
+    int64_t Percentile(double fraction) const;
+
+    double mean_ns() const {
+      return count ? static_cast<double>(total_ns) / count : 0.0;
+    }
+  };
+
+  /// The time at which each phase of a cycle completed.  All are in
+  /// nanoseconds of CLOCK_MONOTONIC_RAW, and are 0 if the phase was
+  /// not performed.
+  struct CycleTiming {
+    int64_t start_ns = 0;
+    int64_t send_ns = 0;
+    int64_t rf_ns = 0;
+    int64_t attitude_ns = 0;
+    int64_t can_ns = 0;
+  };
+
+  struct BusStatistics {
+    // Measured from the start of the CAN reading phase to the receipt
+    // of each frame.
+    LatencyHistogram reply;
+    uint64_t replies = 0;
+
+    // The number of cycles which finished with fewer replies than
+    // were expected on this bus.
+    uint64_t timeouts = 0;
+  };
+
+  struct CycleStatistics {
+    uint64_t cycles = 0;
+
+    LatencyHistogram cycle;
+    LatencyHistogram send;
+    LatencyHistogram rf;
+    LatencyHistogram attitude;
+    LatencyHistogram can_read;
+
+    // This is 1 indexed to match the bus naming.
+    BusStatistics bus[6];
+
+    CycleTiming last;
+  };
+
+  /// Return the statistics accumulated since construction.  This is
+  /// safe to call from any thread, and is empty unless
+  /// 'Configuration::enable_statistics' was set.
+  CycleStatistics Statistics();
+
  private:
   class Impl;
   Impl* const impl_;
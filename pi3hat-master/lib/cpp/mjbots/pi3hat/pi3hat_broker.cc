@@ -0,0 +1,196 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+///
+/// Owns the pi3hat on behalf of other processes, which attach with
+/// BrokerTransport.  See broker.h.
+///
+/// With --monitor, this instead attaches to a running broker and
+/// prints every CAN frame it receives, and the attitude.
+
+#include <signal.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mjbots/moteus/realtime.h"
+
+#include "broker.h"
+#include "pi3hat.h"
+#include "transport.h"
+
+namespace mjbots {
+namespace pi3hat {
+
+namespace {
+
+std::atomic<bool> g_done{false};
+
+void HandleSignal(int) {
+  g_done.store(true);
+}
+
+struct Arguments {
+  Arguments(const std::vector<std::string>& args) {
+    for (size_t i = 0; i < args.size(); i++) {
+      const auto& arg = args[i];
+      if (arg == "-h" || arg == "--help") {
+        help = true;
+      } else if (arg == "--name") {
+        name = args.at(++i);
+      } else if (arg == "--realtime") {
+        realtime = std::stoi(args.at(++i));
+      } else if (arg == "--spi-speed") {
+        spi_speed_hz = std::stoi(args.at(++i));
+      } else if (arg == "--can-irq") {
+        can_irq_wait = true;
+      } else if (arg == "--attitude-rate") {
+        attitude_rate_hz = std::stoi(args.at(++i));
+      } else if (arg == "--max-merged") {
+        max_merged_frames = std::stoi(args.at(++i));
+      } else if (arg == "--idle-us") {
+        idle_us = std::stoi(args.at(++i));
+      } else if (arg == "--monitor") {
+        monitor = true;
+      } else {
+        throw std::runtime_error("Unknown argument: " + arg);
+      }
+    }
+  }
+
+  bool help = false;
+  std::string name = "/pi3hat-broker";
+  int realtime = -1;
+  int spi_speed_hz = -1;
+  bool can_irq_wait = false;
+  int attitude_rate_hz = 400;
+  int max_merged_frames = Broker::Options().max_merged_frames;
+  int idle_us = static_cast<int>(Broker::Options().idle_ns / 1000);
+  bool monitor = false;
+};
+
+void DisplayUsage() {
+  std::cout << "Usage: pi3hat_broker [options]\n";
+  std::cout << "\n";
+  std::cout << "  -h,--help           display this usage message\n";
+  std::cout << "  --name NAME         the shared memory object to serve\n";
+  std::cout << "  --realtime CPU      run in a realtime configuration on a CPU\n";
+  std::cout << "  --spi-speed HZ      set the SPI speed\n";
+  std::cout << "  --can-irq           wait on the CAN IRQ lines, not SPI polls\n";
+  std::cout << "  --attitude-rate HZ  set the attitude rate\n";
+  std::cout << "  --max-merged N      frames lower priority clients may add\n";
+  std::cout << "                      to each realtime cycle\n";
+  std::cout << "  --idle-us US        give lower priority clients cycles of\n";
+  std::cout << "                      their own after this long\n";
+  std::cout << "  --monitor           print what a running broker receives\n";
+}
+
+void Monitor(const Arguments& args) {
+  BrokerTransport::Options options;
+  // Lower than any realistic client, so this never takes a cycle
+  // from anyone.
+  options.priority = -1000;
+  options.monitor_can = true;
+  options.subscribe_attitude = true;
+  BrokerTransport client(args.name, options);
+
+  std::vector<CanFrame> rx_can(256);
+  int64_t last_attitude_ns = 0;
+  char buf[256] = {};
+
+  while (!g_done.load()) {
+    const auto count = client.ReadMonitor({rx_can.data(), rx_can.size()});
+    for (size_t i = 0; i < count; i++) {
+      const auto& frame = rx_can[i];
+      std::string data;
+      for (size_t j = 0; j < frame.size; j++) {
+        ::snprintf(buf, sizeof(buf) - 1, "%02X", frame.data[j]);
+        data += buf;
+      }
+      ::snprintf(buf, sizeof(buf) - 1, "CAN %d %X ", frame.bus, frame.id);
+      std::cout << buf << data << "\n";
+    }
+
+    const auto now = client.now_ns();
+    Attitude attitude;
+    if (now - last_attitude_ns > 100000000 && client.ReadAttitude(&attitude)) {
+      last_attitude_ns = now;
+      const auto& a = attitude.attitude;
+      ::snprintf(buf, sizeof(buf) - 1,
+                 "ATT w=%.4f x=%.4f y=%.4f z=%.4f\n", a.w, a.x, a.y, a.z);
+      std::cout << buf;
+    }
+
+    if (count == 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+}
+
+int do_main(int argc, char** argv) {
+  Arguments args({argv + 1, argv + argc});
+
+  if (args.help) {
+    DisplayUsage();
+    return 0;
+  }
+
+  ::signal(SIGINT, HandleSignal);
+  ::signal(SIGTERM, HandleSignal);
+
+  if (args.monitor) {
+    Monitor(args);
+    return 0;
+  }
+
+  Pi3Hat::Configuration config;
+  if (args.spi_speed_hz >= 0) { config.spi_speed_hz = args.spi_speed_hz; }
+  config.can_irq_wait = args.can_irq_wait;
+  config.attitude_rate_hz = args.attitude_rate_hz;
+
+  if (args.realtime >= 0) {
+    moteus::RealtimeOptions realtime_options;
+    realtime_options.cpu = args.realtime;
+    const auto realtime = moteus::SetupRealtime(realtime_options);
+    for (const auto& warning : realtime.warnings) {
+      std::cout << "Warning: " << warning << "\n";
+    }
+  }
+
+  Pi3HatTransport transport(config);
+  BrokerSharedMemory memory(args.name, BrokerSharedMemory::kCreate);
+
+  Broker::Options options;
+  options.max_merged_frames = args.max_merged_frames;
+  options.idle_ns = static_cast<int64_t>(args.idle_us) * 1000;
+  Broker broker(&transport, memory.get(), options);
+
+  broker.Run(g_done);
+
+  return 0;
+}
+
+}  // namespace
+}  // namespace pi3hat
+}  // namespace mjbots
+
+int main(int argc, char** argv) {
+  return mjbots::pi3hat::do_main(argc, argv);
+}
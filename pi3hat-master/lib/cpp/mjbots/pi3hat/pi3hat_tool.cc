@@ -184,6 +184,24 @@ struct Arguments {
         can_help = true;
       } else if (arg == "--spi-speed") {
         spi_speed_hz = std::stoi(args.at(++i));
+      } else if (arg == "--spi-dma") {
+        spi_dma = true;
+      } else if (arg == "--spi-dma-channels") {
+        spi_dma = true;
+        const auto channels = args.at(++i);
+        const auto comma = channels.find(',');
+        spi_dma_tx_channel = std::stoi(channels.substr(0, comma));
+        spi_dma_rx_channel = std::stoi(channels.substr(comma + 1));
+      } else if (arg == "--can-irq") {
+        can_irq_wait = true;
+      } else if (arg == "--no-can-schedule") {
+        can_tx_schedule = false;
+      } else if (arg == "--adaptive-timeout") {
+        adaptive_timeout = true;
+      } else if (arg == "--spi-tune") {
+        spi_tune = true;
+      } else if (arg == "--parallel-spi") {
+        parallel_spi_cpu = std::stoi(args.at(++i));
       } else if (arg == "--disable-aux") {
         disable_aux = true;
       } else if (arg == "--mount-y") {
@@ -194,8 +212,14 @@ struct Arguments {
         mounting_deg.roll = std::stod(args.at(++i));
       } else if (arg == "--attitude-rate") {
         attitude_rate_hz = std::stol(args.at(++i));
+      } else if (arg == "--attitude-error-state") {
+        attitude_error_state = true;
       } else if (arg == "--rf-id") {
         rf_id = std::stoul(args.at(++i));
+      } else if (arg == "--rf-rate") {
+        rf_rate.push_back(args.at(++i));
+      } else if (arg == "--rf-budget") {
+        rf_budget_bytes_per_s = std::stoul(args.at(++i));
       } else if (arg == "--can-config") {
         can_config.push_back(args.at(++i));
       } else if (arg == "-c" || arg == "--write-can") {
@@ -218,12 +242,34 @@ struct Arguments {
         read_rf = true;
       } else if (arg == "--read-att") {
         read_attitude = true;
+      } else if (arg == "--read-imu-fifo") {
+        read_imu_fifo = true;
       } else if (arg == "--read-spi") {
         read_spi = args.at(++i);
       } else if (arg == "--info") {
         info = true;
       } else if (arg == "--performance") {
         performance = true;
+      } else if (arg == "--profile") {
+        profile = true;
+      } else if (arg == "--profile-reset") {
+        profile_reset = true;
+      } else if (arg == "--benchmark") {
+        benchmark_s = std::stod(args.at(++i));
+      } else if (arg == "--bench-buses") {
+        bench_buses = args.at(++i);
+      } else if (arg == "--bench-frames") {
+        bench_frames = std::stoi(args.at(++i));
+      } else if (arg == "--bench-size") {
+        bench_size = std::stoi(args.at(++i));
+      } else if (arg == "--bench-id") {
+        bench_id = std::stoul(args.at(++i), nullptr, 16);
+      } else if (arg == "--bench-reply") {
+        bench_reply = true;
+      } else if (arg == "--bench-period-us") {
+        bench_period_us = std::stoi(args.at(++i));
+      } else if (arg == "--stats") {
+        stats = true;
       } else if (arg == "-r" || arg == "--run") {
         run = true;
       } else {
@@ -235,13 +281,25 @@ struct Arguments {
   bool help = false;
   bool can_help = false;
   bool run = false;
+  bool stats = false;
   std::string time_log;
 
   int spi_speed_hz = -1;
+  bool spi_dma = false;
+  int spi_dma_tx_channel = -1;
+  int spi_dma_rx_channel = -1;
+  int parallel_spi_cpu = -1;
+  bool can_irq_wait = false;
+  bool can_tx_schedule = true;
+  bool adaptive_timeout = false;
+  bool spi_tune = false;
   bool disable_aux = false;
   Euler mounting_deg;
   uint32_t attitude_rate_hz = 400;
+  bool attitude_error_state = false;
   uint32_t rf_id = 5678;
+  std::vector<std::string> rf_rate;
+  uint32_t rf_budget_bytes_per_s = 0;
 
   std::vector<std::string> can_config;
   std::vector<std::string> write_can;
@@ -254,10 +312,21 @@ struct Arguments {
   std::vector<std::string> write_rf;
   bool read_rf = false;
   bool read_attitude = false;
+  bool read_imu_fifo = false;
   std::string read_spi;
 
   bool info = false;
   bool performance = false;
+  bool profile = false;
+  bool profile_reset = false;
+
+  double benchmark_s = 0.0;
+  std::string bench_buses = "1,2,3,4,5";
+  int bench_frames = 1;
+  int bench_size = 8;
+  uint32_t bench_id = 0x7f;
+  bool bench_reply = false;
+  int bench_period_us = 0;
 };
 
 void DisplayUsage() {
@@ -268,12 +337,22 @@ void DisplayUsage() {
   std::cout << "\n";
   std::cout << "Configuration\n";
   std::cout << "  --spi-speed HZ      set the SPI speed\n";
+  std::cout << "  --spi-dma           use DMA for primary SPI transfers\n";
+  std::cout << "  --spi-dma-channels TX,RX  use these DMA channels\n";
+  std::cout << "  --parallel-spi CPU  run primary SPI work on a thread on CPU\n";
+  std::cout << "  --can-irq           wait on the CAN IRQ lines, not SPI polls\n";
+  std::cout << "  --no-can-schedule   send CAN frames in the order given\n";
+  std::cout << "  --adaptive-timeout  learn how long to wait for CAN replies\n";
+  std::cout << "  --spi-tune          run SPI at the fastest reliable clock\n";
   std::cout << "  --disable-aux       disable the auxiliary processor\n";
   std::cout << "  --mount-y DEG       set the mounting yaw angle\n";
   std::cout << "  --mount-p DEG       set the mounting pitch angle\n";
   std::cout << "  --mount-r DEG       set the mounting roll angle\n";
   std::cout << "  --attitude-rate HZ  set the attitude rate\n";
+  std::cout << "  --attitude-error-state  use the error state attitude filter\n";
   std::cout << "  --rf-id ID          set the RF id\n";
+  std::cout << "  --rf-rate SLOT,HZ   send an RF slot at a fixed rate\n";
+  std::cout << "  --rf-budget BPS     limit RF slot data to BPS bytes/s\n";
   std::cout << "  --can-config CFG    configure a specific CAN bus\n";
   std::cout << "  --can-timeout-ns T  set the receive timeout\n";
   std::cout << "  --can-min-wait-ns T set the receive timeout\n";
@@ -288,12 +367,25 @@ void DisplayUsage() {
   std::cout << "     SLOT,PRIORITY,DATA\n";
   std::cout << "  --read-rf       request any RF data\n";
   std::cout << "  --read-att      request attitude data\n";
+  std::cout << "  --read-imu-fifo drain the raw IMU sample FIFO\n";
   std::cout << "  --read-spi      read raw SPI data\n";
   std::cout << "     SPIBUS,ADDRESS,SIZE\n";
   std::cout << "  --info          display device info\n";
   std::cout << "  --performance   print runtime performance\n";
+  std::cout << "  --profile       print firmware subsystem profiles\n";
+  std::cout << "  --profile-reset clear firmware worst case profiles\n";
   std::cout << "  -r,--run        run a sample high rate cycle\n";
   std::cout << "  --time-log F    when running, write a delta-t log\n";
+  std::cout << "  --stats         print cycle timing statistics\n";
+  std::cout << "  --benchmark S   cycle for S seconds and print a JSON report\n";
+  std::cout << "     in addition to any --write-can, --read-rf, --read-att\n";
+  std::cout << "  --bench-buses L comma separated buses to send on (1,2,3,4,5)\n";
+  std::cout << "  --bench-frames N  frames sent per bus per cycle (1)\n";
+  std::cout << "  --bench-size B  payload size of each frame (8)\n";
+  std::cout << "  --bench-id HEX  CAN ID of each frame (7f)\n";
+  std::cout << "  --bench-reply   expect a reply to each frame\n";
+  std::cout << "  --bench-period-us P  start a cycle every P us and count\n";
+  std::cout << "                  the deadlines which were missed\n";
 }
 
 void DisplayCanConfigurationUsage() {
@@ -310,11 +402,17 @@ void DisplayCanConfigurationUsage() {
   std::cout << "     [sf]jN: (std|fd)_rate.sync_jump_width\n";
   std::cout << "     [sf]1N: (std|fd)_rate.time_seg1\n";
   std::cout << "     [sf]2N: (std|fd)_rate.time_seg2\n";
+  std::cout << "     qN: rx_queue_depth\n";
+  std::cout << "     F[ar][se][rdm]ID1/ID2: add a filter\n";
+  std::cout << "       accept/reject, standard/extended, range/dual/mask\n";
+  std::cout << "       ID1 and ID2 are hexadecimal\n";
+  std::cout << "     G[se][ar]: global std/ext action accept/reject\n";
 }
 
 template <typename Iterator>
 Pi3Hat::CanConfiguration ParseCanConfig(Iterator begin, Iterator end) {
   Pi3Hat::CanConfiguration result;
+  int filter_count = 0;
   for (auto it = begin; it != end; ++it) {
     const auto item = *it;
     if (item.at(0) == 'r') {
@@ -337,6 +435,31 @@ Pi3Hat::CanConfiguration ParseCanConfig(Iterator begin, Iterator end) {
       result.bus_monitor = false;
     } else if (item == "M") {
       result.bus_monitor = true;
+    } else if (item.at(0) == 'q') {
+      result.rx_queue_depth = std::stoi(item.substr(1));
+    } else if (item.at(0) == 'F') {
+      if (filter_count >= Pi3Hat::CanConfiguration::kMaxFilters) {
+        throw std::runtime_error("Too many CAN filters: " + item);
+      }
+      const auto slash = item.find('/');
+      if (item.size() < 5 || slash == std::string::npos) {
+        throw std::runtime_error("Malformed CAN filter: " + item);
+      }
+      auto& filter = result.filters[filter_count++];
+      using F = Pi3Hat::CanFilter;
+      filter.action = (item.at(1) == 'r') ? F::kReject : F::kAccept;
+      filter.type = (item.at(2) == 'e') ? F::kExtended : F::kStandard;
+      filter.mode =
+          (item.at(3) == 'd') ? F::kDual :
+          (item.at(3) == 'm') ? F::kMask :
+          F::kRange;
+      filter.id1 = std::stoul(item.substr(4, slash - 4), nullptr, 16);
+      filter.id2 = std::stoul(item.substr(slash + 1), nullptr, 16);
+    } else if (item.at(0) == 'G' && item.size() == 3) {
+      auto& action = (item.at(1) == 'e') ?
+          result.global_ext_action : result.global_std_action;
+      action = (item.at(2) == 'r') ?
+          Pi3Hat::CanFilter::kReject : Pi3Hat::CanFilter::kAccept;
     } else if (item.at(0) == 's' ||
                item.at(0) == 'f') {
       auto& rate = (item.at(0) == 's') ? result.std_rate : result.fd_rate;
@@ -365,12 +488,38 @@ Pi3Hat::Configuration MakeConfig(const Arguments& args) {
   if (args.spi_speed_hz >= 0) {
     config.spi_speed_hz = args.spi_speed_hz;
   }
+  config.spi_dma = args.spi_dma;
+  config.spi_dma_tx_channel = args.spi_dma_tx_channel;
+  config.spi_dma_rx_channel = args.spi_dma_rx_channel;
+  config.can_irq_wait = args.can_irq_wait;
+  config.can_tx_schedule = args.can_tx_schedule;
+  config.adaptive_timeout.enable = args.adaptive_timeout;
+  config.spi_tuning.enable = args.spi_tune;
+  config.enable_statistics = args.stats;
+  if (args.parallel_spi_cpu >= 0) {
+    config.parallel_spi = true;
+    config.parallel_spi_cpu = args.parallel_spi_cpu;
+  }
   config.mounting_deg.yaw = args.mounting_deg.yaw;
   config.mounting_deg.pitch = args.mounting_deg.pitch;
   config.mounting_deg.roll = args.mounting_deg.roll;
   config.attitude_rate_hz = args.attitude_rate_hz;
+  config.attitude_error_state = args.attitude_error_state;
   config.enable_aux = !args.disable_aux;
 
+  for (const auto& rf_rate : args.rf_rate) {
+    const auto fields = Split(rf_rate);
+    if (fields.size() != 2) {
+      throw std::runtime_error("Error parsing rf rate: " + rf_rate);
+    }
+    const int slot = std::stoi(fields.at(0));
+    if (slot < 0 || slot >= 15) {
+      throw std::runtime_error("Invalid rf slot: " + rf_rate);
+    }
+    config.rf_slot_rate_hz[slot] = std::stod(fields.at(1));
+  }
+  config.rf_budget_bytes_per_s = args.rf_budget_bytes_per_s;
+
   if (args.rf_id != 0) {
     config.rf_id = args.rf_id;
   }
@@ -558,6 +707,11 @@ struct Input {
     if (args.read_rf) {
       pi.request_rf = true;
     }
+    if (args.read_imu_fifo) {
+      pi.request_imu_fifo = true;
+      imu_samples.resize(64);
+      pi.rx_imu = { &imu_samples[0], imu_samples.size() };
+    }
     pi.force_can_check = args.read_can;
     for (const auto& can_string : args.write_can) {
       can_frames.push_back(ParseCanString(can_string));
@@ -597,8 +751,39 @@ struct Input {
   std::vector<CanFrame> rx_frames;
   std::vector<RfSlot> rf_slots;
   std::vector<RfSlot> rx_rf_data;
+  std::vector<ImuSample> imu_samples;
 };
 
+std::string FormatHistogram(const Pi3Hat::LatencyHistogram& h) {
+  char buf[256] = {};
+  ::snprintf(
+      buf, sizeof(buf) - 1,
+      "n=%8llu mean=%8.1f p50=%8.1f p99=%8.1f p99.9=%8.1f max=%8.1f us",
+      static_cast<unsigned long long>(h.count),
+      h.mean_ns() * 1e-3,
+      h.Percentile(0.5) * 1e-3,
+      h.Percentile(0.99) * 1e-3,
+      h.Percentile(0.999) * 1e-3,
+      h.max_ns * 1e-3);
+  return buf;
+}
+
+void DisplayStatistics(Pi3Hat* pi3hat) {
+  const auto s = pi3hat->Statistics();
+  std::cout << "cycles: " << s.cycles << "\n";
+  std::cout << "  cycle    " << FormatHistogram(s.cycle) << "\n";
+  std::cout << "  send     " << FormatHistogram(s.send) << "\n";
+  std::cout << "  rf       " << FormatHistogram(s.rf) << "\n";
+  std::cout << "  attitude " << FormatHistogram(s.attitude) << "\n";
+  std::cout << "  can_read " << FormatHistogram(s.can_read) << "\n";
+  for (int bus = 1; bus < 6; bus++) {
+    const auto& b = s.bus[bus];
+    if (b.replies == 0 && b.timeouts == 0) { continue; }
+    std::cout << "  bus " << bus << "    " << FormatHistogram(b.reply)
+              << " timeouts=" << b.timeouts << "\n";
+  }
+}
+
 void Run(Pi3Hat* pi3hat, const Arguments& args) {
   Input input{args};
 
@@ -610,6 +795,10 @@ void Run(Pi3Hat* pi3hat, const Arguments& args) {
   char buf[2048] = {};
   double filtered_period_s = 0.0;
   int64_t old_now = GetNow();
+  int64_t last_stats = old_now;
+  uint64_t imu_sample_count = 0;
+  uint32_t imu_last_us = 0;
+  double filtered_imu_hz = 0.0;
 
   while (true) {
     const auto result = pi3hat->Cycle(input.pi3hat_input);
@@ -626,6 +815,12 @@ void Run(Pi3Hat* pi3hat, const Arguments& args) {
       if (time_of) {
         *time_of << delta_ns << "\n";
       }
+
+      if (args.stats && (now - last_stats) > 1000000000ll) {
+        last_stats = now;
+        std::cout << "\n";
+        DisplayStatistics(pi3hat);
+      }
     }
 
     if (input.pi3hat_input.wait_for_attitude && !result.attitude_present) {
@@ -636,6 +831,28 @@ void Run(Pi3Hat* pi3hat, const Arguments& args) {
       std::cout << FormatAttitude(input.attitude) << " ";
     }
 
+    if (input.pi3hat_input.request_imu_fifo) {
+      imu_sample_count += result.rx_imu_size;
+      if (result.rx_imu_size) {
+        const auto& last = input.imu_samples[result.rx_imu_size - 1];
+        if (imu_last_us != 0) {
+          const double alpha = 0.98;
+          filtered_imu_hz =
+              alpha * filtered_imu_hz + (1.0 - alpha) *
+              (1e6 * result.rx_imu_size /
+               static_cast<double>(last.timestamp_us - imu_last_us));
+        }
+        imu_last_us = last.timestamp_us;
+      }
+      ::snprintf(
+          buf, sizeof(buf) - 1,
+          "imu=%llu (%6.1f Hz, %u lost) ",
+          static_cast<unsigned long long>(imu_sample_count),
+          filtered_imu_hz,
+          static_cast<unsigned>(result.imu_fifo_overflow_count));
+      std::cout << buf;
+    }
+
     {
       ::snprintf(
           buf, sizeof(buf) - 1,
@@ -649,6 +866,157 @@ void Run(Pi3Hat* pi3hat, const Arguments& args) {
   }
 }
 
+std::string FormatHistogramJson(const Pi3Hat::LatencyHistogram& h) {
+  char buf[256] = {};
+  ::snprintf(
+      buf, sizeof(buf) - 1,
+      "{\"mean\": %.2f, \"p50\": %.2f, \"p99\": %.2f, "
+      "\"p99.9\": %.2f, \"max\": %.2f}",
+      h.mean_ns() * 1e-3,
+      h.Percentile(0.5) * 1e-3,
+      h.Percentile(0.99) * 1e-3,
+      h.Percentile(0.999) * 1e-3,
+      h.max_ns * 1e-3);
+  return buf;
+}
+
+/// Cycle as fast as possible, or at a fixed period, for a set
+/// duration with a synthetic traffic mix, then report the cycle
+/// times achieved as JSON.
+void Benchmark(Pi3Hat* pi3hat, const Arguments& args) {
+  Input input{args};
+
+  const int size = args.bench_size;
+  if (size < 0 || (size > 8 && size != 12 && size != 16 && size != 20 &&
+                   size != 24 && size != 32 && size != 48 && size != 64)) {
+    throw std::runtime_error(
+        "--bench-size must be a valid CAN-FD size: " +
+        std::to_string(size));
+  }
+
+  for (const auto& bus_string : Split(args.bench_buses)) {
+    const int bus = std::stoi(bus_string);
+    if (bus < 1 || bus > 5) {
+      throw std::runtime_error("Invalid benchmark bus: " + bus_string);
+    }
+    for (int i = 0; i < args.bench_frames; i++) {
+      CanFrame frame;
+      frame.id = args.bench_id;
+      frame.bus = bus;
+      frame.size = size;
+      for (int j = 0; j < frame.size; j++) { frame.data[j] = j; }
+      frame.expect_reply = args.bench_reply;
+      input.can_frames.push_back(frame);
+    }
+  }
+
+  auto& pi = input.pi3hat_input;
+  if (!input.can_frames.empty()) {
+    pi.tx_can = { &input.can_frames[0], input.can_frames.size() };
+  }
+  input.rx_frames.resize(std::max<size_t>(input.can_frames.size() * 2, 20u));
+  pi.rx_can = { &input.rx_frames[0], input.rx_frames.size() };
+
+  int tx_per_cycle[6] = {};
+  int replies_per_cycle[6] = {};
+  for (const auto& frame : input.can_frames) {
+    tx_per_cycle[frame.bus]++;
+    if (frame.expect_reply) { replies_per_cycle[frame.bus]++; }
+  }
+
+  Pi3Hat::LatencyHistogram cycle_time;
+  uint64_t rx_frames[6] = {};
+  uint64_t reply_misses[6] = {};
+  uint64_t skipped_deadlines = 0;
+  uint64_t missing_attitude = 0;
+
+  const int64_t period_ns = args.bench_period_us * 1000ll;
+  const int64_t start = GetNow();
+  const int64_t end = start + static_cast<int64_t>(args.benchmark_s * 1e9);
+  int64_t next = start;
+
+  while (true) {
+    const auto cycle_start = GetNow();
+    if (cycle_start >= end) { break; }
+
+    const auto result = pi3hat->Cycle(pi);
+    CheckError(result.error);
+
+    const auto cycle_end = GetNow();
+    cycle_time.Record(cycle_end - cycle_start);
+
+    int rx_this_cycle[6] = {};
+    for (size_t i = 0; i < result.rx_can_size; i++) {
+      const int bus = input.rx_frames[i].bus;
+      if (bus < 1 || bus > 5) { continue; }
+      rx_this_cycle[bus]++;
+      rx_frames[bus]++;
+    }
+    for (int bus = 1; bus < 6; bus++) {
+      if (rx_this_cycle[bus] < replies_per_cycle[bus]) {
+        reply_misses[bus]++;
+      }
+    }
+    if (pi.request_attitude && !result.attitude_present) {
+      missing_attitude++;
+    }
+
+    if (period_ns > 0) {
+      next += period_ns;
+      if (cycle_end > next) {
+        const int64_t missed = (cycle_end - next) / period_ns + 1;
+        skipped_deadlines += missed;
+        next += missed * period_ns;
+      }
+      while (GetNow() < next);
+    }
+  }
+
+  const double elapsed_s = (GetNow() - start) * 1e-9;
+  const auto di = pi3hat->device_info();
+
+  std::cout << "{\n";
+  std::cout << "  \"config\": {"
+            << "\"spi_speed_hz\": " << MakeConfig(args).spi_speed_hz << ", "
+            << "\"can_irq\": " << (args.can_irq_wait ? "true" : "false")
+            << ", "
+            << "\"frames_per_bus\": " << args.bench_frames << ", "
+            << "\"size\": " << args.bench_size << ", "
+            << "\"reply\": " << (args.bench_reply ? "true" : "false")
+            << ", "
+            << "\"attitude\": " << (args.read_attitude ? "true" : "false")
+            << ", "
+            << "\"rf\": "
+            << ((args.read_rf || !args.write_rf.empty()) ? "true" : "false")
+            << ", "
+            << "\"period_us\": " << args.bench_period_us << "},\n";
+  std::cout << "  \"firmware\": {"
+            << "\"can1\": \"" << FormatHexBytes(di.can1.git_hash, 20)
+            << "\", "
+            << "\"can2\": \"" << FormatHexBytes(di.can2.git_hash, 20)
+            << "\", "
+            << "\"aux\": \"" << FormatHexBytes(di.aux.git_hash, 20)
+            << "\"},\n";
+  std::cout << "  \"duration_s\": " << elapsed_s << ",\n";
+  std::cout << "  \"cycles\": " << cycle_time.count << ",\n";
+  std::cout << "  \"hz\": " << (cycle_time.count / elapsed_s) << ",\n";
+  std::cout << "  \"cycle_us\": " << FormatHistogramJson(cycle_time)
+            << ",\n";
+  std::cout << "  \"skipped_deadlines\": " << skipped_deadlines << ",\n";
+  std::cout << "  \"missing_attitude\": " << missing_attitude << ",\n";
+  std::cout << "  \"buses\": {";
+  for (int bus = 1; bus < 6; bus++) {
+    std::cout << (bus == 1 ? "\n" : ",\n")
+              << "    \"" << bus << "\": {"
+              << "\"tx_fps\": "
+              << (tx_per_cycle[bus] * cycle_time.count / elapsed_s) << ", "
+              << "\"rx_fps\": " << (rx_frames[bus] / elapsed_s) << ", "
+              << "\"reply_misses\": " << reply_misses[bus] << "}";
+  }
+  std::cout << "\n  }\n";
+  std::cout << "}\n";
+}
+
 std::string FormatProcessorInfo(const Pi3Hat::ProcessorInfo& pi) {
   std::string result = FormatHexBytes(&pi.git_hash[0], 20) + " ";
   result += (pi.dirty ? "dirty" : "clean");
@@ -661,6 +1029,16 @@ void DoInfo(Pi3Hat* pi3hat) {
   std::cout << "CAN1: " << FormatProcessorInfo(di.can1) << "\n";
   std::cout << "CAN2: " << FormatProcessorInfo(di.can2) << "\n";
   std::cout << "AUX:  " << FormatProcessorInfo(di.aux) << "\n";
+
+  const auto spi = pi3hat->spi_status();
+  const auto format_link = [](const Pi3Hat::SpiLinkStatus& link) {
+    return std::to_string(link.timing.speed_hz) + "Hz" +
+        " cs_hold:" + std::to_string(link.timing.cs_hold_us) + "us" +
+        " address_hold:" + std::to_string(link.timing.address_hold_us) +
+        "us" + (link.tuned ? " tuned" : "");
+  };
+  std::cout << "SPI aux:     " << format_link(spi.aux) << "\n";
+  std::cout << "SPI primary: " << format_link(spi.primary) << "\n";
 }
 
 void ReadSpi(Pi3Hat* pi3hat, const std::string& command) {
@@ -689,6 +1067,53 @@ void DoPerformance(Pi3Hat* pi3hat) {
   std::cout << "AUX:  " << FormatPerformance(dp.aux) << "\n";
 }
 
+std::string FormatSubsystemProfile(const Pi3Hat::SubsystemProfile& p,
+                                   uint32_t clock_hz) {
+  char buf[256] = {};
+  const double us_per_cycle = 1e6 / clock_hz;
+  const double cycles_per_ms = clock_hz / 1000.0;
+  ::snprintf(buf, sizeof(buf) - 1,
+             "max:%.1fus load:%.1f%% peak:%.1f%% count:%u hist:",
+             p.max_cycles * us_per_cycle,
+             100.0 * p.average_cycles_per_ms / cycles_per_ms,
+             100.0 * p.peak_cycles_per_ms / cycles_per_ms,
+             p.count);
+  std::string result = buf;
+  for (int i = 0; i < Pi3Hat::SubsystemProfile::kBuckets; i++) {
+    if (p.histogram[i] == 0) { continue; }
+    // Label each bucket with its lower bound.
+    ::snprintf(buf, sizeof(buf) - 1, " %.2fus=%u",
+               (i == 0 ? 0 : (1u << (i + 4))) * us_per_cycle,
+               p.histogram[i]);
+    result += buf;
+  }
+  return result;
+}
+
+void DisplayProcessorProfile(const std::string& name,
+                             const Pi3Hat::ProcessorProfile& p,
+                             bool aux) {
+  if (p.clock_hz == 0) {
+    std::cout << name << ": not supported\n";
+    return;
+  }
+  const auto clock = p.clock_hz;
+  std::cout << name << ":\n";
+  std::cout << "  SPI ISR:  " << FormatSubsystemProfile(p.spi_isr, clock) << "\n";
+  std::cout << "  CAN poll: " << FormatSubsystemProfile(p.can_poll, clock) << "\n";
+  if (aux) {
+    std::cout << "  IMU:      " << FormatSubsystemProfile(p.imu, clock) << "\n";
+    std::cout << "  RF:       " << FormatSubsystemProfile(p.rf, clock) << "\n";
+  }
+}
+
+void DoProfile(Pi3Hat* pi3hat) {
+  const auto dp = pi3hat->device_profile();
+  DisplayProcessorProfile("CAN1", dp.can1, false);
+  DisplayProcessorProfile("CAN2", dp.can2, false);
+  DisplayProcessorProfile("AUX", dp.aux, true);
+}
+
 void SingleCycle(Pi3Hat* pi3hat, const Arguments& args) {
   Input input{args};
 
@@ -710,6 +1135,10 @@ void SingleCycle(Pi3Hat* pi3hat, const Arguments& args) {
   if (result.attitude_present) {
     std::cout << "ATT " << FormatAttitude(input.attitude) << "\n";
   }
+
+  if (args.stats) {
+    DisplayStatistics(pi3hat);
+  }
 }
 
 void ConfigureRealtime(const Arguments& args) {
@@ -763,12 +1192,18 @@ int do_main(int argc, char** argv) {
 
   if (args.run) {
     Run(&pi3hat, args);
+  } else if (args.benchmark_s > 0.0) {
+    Benchmark(&pi3hat, args);
   } else if (args.info) {
     DoInfo(&pi3hat);
   } else if (!args.read_spi.empty()) {
     ReadSpi(&pi3hat, args.read_spi);
   } else if (args.performance) {
     DoPerformance(&pi3hat);
+  } else if (args.profile_reset) {
+    pi3hat.ResetDeviceProfile();
+  } else if (args.profile) {
+    DoProfile(&pi3hat);
   } else {
     SingleCycle(&pi3hat, args);
   }
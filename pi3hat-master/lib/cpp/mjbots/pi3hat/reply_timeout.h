@@ -0,0 +1,169 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#include "pi3hat.h"
+
+namespace mjbots {
+namespace pi3hat {
+
+/// Learns how long replies take to arrive from each servo, so that a
+/// cycle need wait no longer than its slowest expected reply usually
+/// takes.  See Pi3Hat::AdaptiveTimeout.
+///
+/// Latencies are kept in a small logarithmic histogram for each bus
+/// and ID, with four buckets per octave from 1us to 8ms.  Percentiles
+/// are reported as the upper edge of their bucket, so they err on
+/// the side of waiting too long.
+///
+/// Each bus may be recorded and queried from a different thread, but
+/// any one bus must only be used from one thread at a time.  No
+/// memory is allocated after construction.
+class ReplyTimeoutLearner {
+ public:
+  static constexpr int kMaxBus = 5;
+  static constexpr int kMaxId = 128;
+
+  static constexpr int kOctaves = 13;
+  static constexpr int kBuckets = 1 + 4 * kOctaves;
+
+  explicit ReplyTimeoutLearner(const Pi3Hat::AdaptiveTimeout& options)
+      : options_(options),
+        servos_((kMaxBus + 1) * kMaxId) {
+    if (!(options.percentile > 0.0 && options.percentile <= 1.0)) {
+      throw std::invalid_argument(
+          "adaptive_timeout.percentile must be in (0, 1]");
+    }
+    if (!(options.margin >= 1.0)) {
+      throw std::invalid_argument("adaptive_timeout.margin must be >= 1");
+    }
+    if (options.min_ns > options.max_ns) {
+      throw std::invalid_argument(
+          "adaptive_timeout.min_ns must not exceed max_ns");
+    }
+    if (options.max_misses < 1) {
+      throw std::invalid_argument(
+          "adaptive_timeout.max_misses must be at least 1");
+    }
+    if (options.min_samples < 1 ||
+        options.decay_samples < 2 * options.min_samples ||
+        options.decay_samples > 65535) {
+      throw std::invalid_argument(
+          "adaptive_timeout.decay_samples must be at least twice "
+          "min_samples and at most 65535");
+    }
+  }
+
+  static int Bucket(int64_t ns) {
+    if (ns < 1024) { return 0; }
+    const int msb = 63 - __builtin_clzll(static_cast<uint64_t>(ns));
+    const int octave = msb - 10;
+    if (octave >= kOctaves) { return kBuckets - 1; }
+    const int sub = static_cast<int>(ns >> (msb - 2)) & 3;
+    return 1 + octave * 4 + sub;
+  }
+
+  /// The smallest duration which is too long for @p bucket.
+  static int64_t BucketEndNs(int bucket) {
+    if (bucket == 0) { return 1024; }
+    const int octave = (bucket - 1) / 4;
+    const int sub = (bucket - 1) % 4;
+    return static_cast<int64_t>(5 + sub) << (octave + 8);
+  }
+
+  /// Note that a reply from @p id on @p bus arrived @p latency_ns
+  /// after reading began.  Out of range buses and IDs are ignored.
+  void Record(int bus, int id, int64_t latency_ns) {
+    if (bus < 1 || bus > kMaxBus || id < 0 || id >= kMaxId) { return; }
+    auto& servo = servos_[bus * kMaxId + id];
+    servo.misses = 0;
+    Add(&servo, latency_ns);
+  }
+
+  /// Note that @p id on @p bus did not reply within @p window_ns.  It
+  /// is recorded as replying at the end of the window, so that the
+  /// window grows for a servo which has become slower.  Once
+  /// 'max_misses' have been recorded in a row, the servo is assumed
+  /// to have stopped replying; nothing more is recorded, and WindowNs
+  /// returns -1 until it replies again.
+  void RecordMiss(int bus, int id, int64_t window_ns) {
+    if (bus < 1 || bus > kMaxBus || id < 0 || id >= kMaxId) { return; }
+    auto& servo = servos_[bus * kMaxId + id];
+    if (servo.misses >= options_.max_misses) { return; }
+    servo.misses++;
+    Add(&servo, window_ns);
+  }
+
+  /// The fraction 'percentile' of replies from @p id on @p bus
+  /// arrived within this time, or -1 if too few have been seen.
+  int64_t PercentileNs(int bus, int id) const {
+    if (bus < 1 || bus > kMaxBus || id < 0 || id >= kMaxId) { return -1; }
+    const auto& servo = servos_[bus * kMaxId + id];
+    if (servo.total < options_.min_samples) { return -1; }
+    if (servo.misses >= options_.max_misses) { return -1; }
+
+    const int target = std::max(
+        1, static_cast<int>(std::ceil(options_.percentile * servo.total)));
+    int seen = 0;
+    for (int i = 0; i < kBuckets; i++) {
+      seen += servo.counts[i];
+      if (seen >= target) { return BucketEndNs(i); }
+    }
+    return BucketEndNs(kBuckets - 1);
+  }
+
+  /// How long to wait for a reply from @p id on @p bus, measured from
+  /// when reading begins, or -1 if too few replies have been seen.
+  int64_t WindowNs(int bus, int id) const {
+    const auto percentile_ns = PercentileNs(bus, id);
+    if (percentile_ns < 0) { return -1; }
+    const auto result = static_cast<int64_t>(
+        percentile_ns * options_.margin) + options_.guard_ns;
+    return std::max<int64_t>(
+        options_.min_ns, std::min<int64_t>(options_.max_ns, result));
+  }
+
+ private:
+  struct Servo {
+    uint16_t counts[kBuckets] = {};
+    int total = 0;
+    int misses = 0;
+  };
+
+  void Add(Servo* servo, int64_t latency_ns) {
+    servo->counts[Bucket(std::max<int64_t>(0, latency_ns))]++;
+    servo->total++;
+
+    if (servo->total >= options_.decay_samples) {
+      servo->total = 0;
+      for (auto& count : servo->counts) {
+        count = static_cast<uint16_t>(count / 2);
+        servo->total += count;
+      }
+    }
+  }
+
+  const Pi3Hat::AdaptiveTimeout options_;
+  std::vector<Servo> servos_;
+};
+
+}
+}
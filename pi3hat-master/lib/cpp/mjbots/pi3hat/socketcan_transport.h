@@ -0,0 +1,472 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <errno.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <linux/net_tstamp.h>
+#include <net/if.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+// We purposefully don't use the full path here so that this file can
+// be compiled in a wide range of build configurations.
+#include "can_schedule.h"
+#include "transport.h"
+
+/// @file
+///
+/// A transport which sends and receives CAN frames through Linux
+/// SocketCAN interfaces, so that the same control software can be
+/// used on computers without a pi3hat.  It only provides CAN; no
+/// attitude or RF data is ever returned.
+
+namespace mjbots {
+namespace pi3hat {
+
+/// Each SocketCAN interface is addressed as one bus.  All the frames
+/// for an interface are written with a single sendmmsg, and replies
+/// are read with recvmmsg, so the number of system calls per cycle
+/// does not grow with the number of servos.
+///
+/// Replies are awaited with the same rules as Pi3Hat::Cycle, using
+/// 'timeout_ns', 'min_tx_wait_ns', 'rx_extra_wait_ns' and
+/// 'force_can_check'.
+class SocketCanTransport : public Transport {
+ public:
+  struct Bus {
+    // The SocketCAN interface name, like "can0".
+    std::string interface;
+
+    // The bus number this interface is addressed as in CanFrame::bus.
+    int bus = 0;
+  };
+
+  struct Options {
+    std::vector<Bus> buses;
+
+    // If true, frames are sent as CAN-FD, as moteus requires by
+    // default.  Otherwise, frames are classic CAN and may be at most
+    // 8 bytes.
+    bool fd = true;
+    bool bitrate_switch = true;
+
+    // If true, and the adapter supports it, receive timestamps come
+    // from the adapter's own clock rather than the kernel's.  These
+    // are not comparable to 'now_ns'.
+    bool hardware_timestamps = false;
+
+    Options() {}
+  };
+
+  /// Build options with each of @p interfaces assigned bus numbers
+  /// starting from 1, in order.
+  static Options MakeOptions(const std::vector<std::string>& interfaces) {
+    Options result;
+    for (size_t i = 0; i < interfaces.size(); i++) {
+      Bus bus;
+      bus.interface = interfaces[i];
+      bus.bus = static_cast<int>(i) + 1;
+      result.buses.push_back(bus);
+    }
+    return result;
+  }
+
+  static constexpr int kMaxBus = 31;
+
+  /// This may throw an instance of `Error`.
+  SocketCanTransport(const Options& options = Options())
+      : options_(options) {
+    std::fill(std::begin(bus_socket_), std::end(bus_socket_), -1);
+
+    for (const auto& bus : options_.buses) {
+      if (bus.bus < 1 || bus.bus > kMaxBus) {
+        throw Error("SocketCanTransport: bus out of range for " +
+                    bus.interface);
+      }
+      if (bus_socket_[bus.bus] >= 0) {
+        throw Error("SocketCanTransport: duplicate bus for " +
+                    bus.interface);
+      }
+      bus_socket_[bus.bus] = static_cast<int>(sockets_.size());
+      sockets_.emplace_back(new Socket(bus, options_));
+    }
+  }
+
+  Pi3Hat::Output Cycle(const Pi3Hat::Input& input) override {
+    Pi3Hat::Output result;
+
+    // Kernel software timestamps are in CLOCK_REALTIME, so measure
+    // its offset once per cycle to report them in our own clock.
+    clock_offset_ns_ = GetNs(CLOCK_REALTIME) - now_ns();
+
+    for (auto& socket : sockets_) {
+      socket->tx.clear();
+      socket->expected = 0;
+      socket->check = false;
+    }
+
+    for (const auto& frame : input.tx_can) {
+      if (frame.bus < 0 || frame.bus > kMaxBus || bus_socket_[frame.bus] < 0) {
+        unrouted_frames_++;
+        continue;
+      }
+      auto& socket = *sockets_[bus_socket_[frame.bus]];
+      socket.tx.push_back({});
+      EncodeFrame(frame, &socket.tx.back());
+      if (frame.expect_reply) { socket.expected++; }
+    }
+
+    const int64_t start_ns = now_ns();
+    for (auto& socket : sockets_) {
+      Send(input, start_ns, socket.get());
+      socket->check =
+          socket->expected > 0 ||
+          (input.force_can_check & (1u << socket->options.bus)) != 0;
+    }
+
+    rx_timestamps_ns_.resize(input.rx_can.size());
+    Read(input, &result);
+
+    return result;
+  }
+
+  int64_t now_ns() override {
+    return GetNs(CLOCK_MONOTONIC);
+  }
+
+  /// The kernel receive time of each frame returned by the most
+  /// recent Cycle, indexed the same as 'rx_can'.  These are in the
+  /// same clock as 'now_ns', unless hardware timestamps are enabled.
+  /// A value of 0 means no timestamp was available.
+  const std::vector<int64_t>& rx_timestamps_ns() const {
+    return rx_timestamps_ns_;
+  }
+
+  /// The number of frames sent to a bus that no interface owns.
+  uint64_t unrouted_frames() const { return unrouted_frames_; }
+
+  /// The number of frames which could not be queued before the
+  /// timeout, because the interface's transmit queue was full.
+  uint64_t tx_dropped_frames() const { return tx_dropped_frames_; }
+
+ private:
+  static constexpr int kRxBatch = 32;
+
+  struct RxSlot {
+    struct canfd_frame frame = {};
+    struct iovec iov = {};
+    // SCM_TIMESTAMPING carries three timestamps.
+    char control[CMSG_SPACE(3 * sizeof(struct timespec))] = {};
+  };
+
+  struct Socket {
+    Socket(const Bus& options_in, const Options& transport_options)
+        : options(options_in) {
+      fd = ::socket(PF_CAN, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, CAN_RAW);
+      ThrowIfErrno(fd < 0, "could not open socket");
+
+      if (transport_options.fd) {
+        const int enable = 1;
+        ThrowIfErrno(::setsockopt(fd, SOL_CAN_RAW, CAN_RAW_FD_FRAMES,
+                                  &enable, sizeof(enable)) < 0,
+                     "could not enable CAN-FD");
+      }
+
+      int timestamping =
+          SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+      if (transport_options.hardware_timestamps) {
+        timestamping |=
+            SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+      }
+      ThrowIfErrno(::setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING,
+                                &timestamping, sizeof(timestamping)) < 0,
+                   "could not enable timestamps");
+
+      const unsigned int index = ::if_nametoindex(options.interface.c_str());
+      ThrowIfErrno(index == 0, "unknown interface");
+
+      struct sockaddr_can addr = {};
+      addr.can_family = AF_CAN;
+      addr.can_ifindex = static_cast<int>(index);
+      ThrowIfErrno(::bind(fd, reinterpret_cast<struct sockaddr*>(&addr),
+                          sizeof(addr)) < 0,
+                   "could not bind");
+
+      for (auto& slot : rx) {
+        slot.iov.iov_base = &slot.frame;
+        slot.iov.iov_len = sizeof(slot.frame);
+      }
+    }
+
+    ~Socket() {
+      if (fd >= 0) { ::close(fd); }
+    }
+
+    void ThrowIfErrno(bool value, const std::string& message) {
+      if (!value) { return; }
+      const int error = errno;
+      if (fd >= 0) { ::close(fd); }
+      fd = -1;
+      throw Error("SocketCanTransport: " + message + " for " +
+                  options.interface + " : " + std::strerror(error));
+    }
+
+    const Bus options;
+    int fd = -1;
+
+    std::vector<struct canfd_frame> tx;
+    std::vector<struct iovec> tx_iov;
+    std::vector<struct mmsghdr> tx_msgs;
+
+    RxSlot rx[kRxBatch];
+    struct mmsghdr rx_msgs[kRxBatch] = {};
+
+    int expected = 0;
+    bool check = false;
+  };
+
+  void EncodeFrame(const CanFrame& frame, struct canfd_frame* out) const {
+    std::memset(out, 0, sizeof(*out));
+    out->can_id = frame.id;
+    if (frame.id > CAN_SFF_MASK) { out->can_id |= CAN_EFF_FLAG; }
+
+    const size_t size = options_.fd ? RoundUpDlc(frame.size) : frame.size;
+    if (!options_.fd && size > CAN_MAX_DLEN) {
+      throw Error("SocketCanTransport: frame too large for classic CAN");
+    }
+    if (size < frame.size) {
+      throw Error("SocketCanTransport: frame too large for CAN-FD");
+    }
+    out->len = static_cast<uint8_t>(size);
+    std::memcpy(out->data, frame.data, frame.size);
+    // Pad in the same manner as the pi3hat, which moteus interprets as
+    // no-ops.
+    for (size_t i = frame.size; i < size; i++) { out->data[i] = 0x50; }
+
+    if (options_.fd && options_.bitrate_switch) { out->flags |= CANFD_BRS; }
+  }
+
+  void Send(const Pi3Hat::Input& input, int64_t start_ns, Socket* socket) {
+    const size_t count = socket->tx.size();
+    if (count == 0) { return; }
+
+    // These only grow, so a steady state cycle does not allocate.
+    if (socket->tx_iov.size() < count) {
+      socket->tx_iov.resize(count);
+      socket->tx_msgs.resize(count);
+    }
+    const size_t mtu = options_.fd ? CANFD_MTU : CAN_MTU;
+    for (size_t i = 0; i < count; i++) {
+      socket->tx_iov[i].iov_base = &socket->tx[i];
+      socket->tx_iov[i].iov_len = mtu;
+      socket->tx_msgs[i] = {};
+      socket->tx_msgs[i].msg_hdr.msg_iov = &socket->tx_iov[i];
+      socket->tx_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    size_t sent = 0;
+    while (sent < count) {
+      const int r = ::sendmmsg(socket->fd, &socket->tx_msgs[sent],
+                               static_cast<unsigned int>(count - sent),
+                               MSG_DONTWAIT);
+      if (r > 0) {
+        sent += static_cast<size_t>(r);
+        continue;
+      }
+      if (r < 0 && errno != EAGAIN && errno != ENOBUFS && errno != EINTR) {
+        socket->ThrowIfErrno(true, "could not send");
+      }
+
+      // The transmit queue is full.  Wait for room, but no longer than
+      // we would wait for replies.
+      const int64_t remaining_ns = start_ns + input.timeout_ns - now_ns();
+      if (remaining_ns <= 0) { break; }
+      struct pollfd pfd = {};
+      pfd.fd = socket->fd;
+      pfd.events = POLLOUT;
+      const struct timespec timeout = MakeTimespec(remaining_ns);
+      if (::ppoll(&pfd, 1, &timeout, nullptr) == 0) { break; }
+    }
+    tx_dropped_frames_ += count - sent;
+  }
+
+  void Read(const Pi3Hat::Input& input, Pi3Hat::Output* output) {
+    size_t poll_count = 0;
+    for (auto& socket : sockets_) {
+      if (!socket->check) { continue; }
+      pollfds_[poll_count] = {};
+      pollfds_[poll_count].fd = socket->fd;
+      pollfds_[poll_count].events = POLLIN;
+      poll_sockets_[poll_count] = socket.get();
+      poll_count++;
+    }
+    if (poll_count == 0) { return; }
+
+    const int64_t start_ns = now_ns();
+    int64_t last_reply_ns = start_ns;
+
+    while (true) {
+      bool any_expected = false;
+      for (size_t i = 0; i < poll_count; i++) {
+        if (poll_sockets_[i]->expected > 0) { any_expected = true; }
+      }
+
+      // These are the same conditions under which Pi3Hat::Cycle
+      // stops waiting.
+      int64_t deadline_ns = std::max(start_ns + input.min_tx_wait_ns,
+                                     last_reply_ns + input.rx_extra_wait_ns);
+      if (any_expected) {
+        deadline_ns = std::max(deadline_ns, start_ns + input.timeout_ns);
+      }
+      const int64_t remaining_ns = deadline_ns - now_ns();
+      if (remaining_ns <= 0) { return; }
+
+      const struct timespec timeout = MakeTimespec(remaining_ns);
+      const int r = ::ppoll(pollfds_, poll_count, &timeout, nullptr);
+      if (r < 0 && errno != EINTR) {
+        poll_sockets_[0]->ThrowIfErrno(true, "could not poll");
+      }
+      if (r <= 0) { continue; }
+
+      for (size_t i = 0; i < poll_count; i++) {
+        if ((pollfds_[i].revents & POLLIN) == 0) { continue; }
+        if (Receive(input, poll_sockets_[i], output)) {
+          last_reply_ns = now_ns();
+        }
+        if (output->rx_can_size >= input.rx_can.size()) {
+          // Our buffer is full, so no more frames could be returned.
+          return;
+        }
+      }
+    }
+  }
+
+  /// Read everything available from @p socket with one recvmmsg.
+  /// Returns true if any frames were received.
+  bool Receive(const Pi3Hat::Input& input, Socket* socket,
+               Pi3Hat::Output* output) {
+    const size_t room = input.rx_can.size() - output->rx_can_size;
+    const unsigned int count =
+        static_cast<unsigned int>(std::min<size_t>(room, kRxBatch));
+
+    for (unsigned int i = 0; i < count; i++) {
+      auto& msg = socket->rx_msgs[i];
+      msg = {};
+      msg.msg_hdr.msg_iov = &socket->rx[i].iov;
+      msg.msg_hdr.msg_iovlen = 1;
+      msg.msg_hdr.msg_control = socket->rx[i].control;
+      msg.msg_hdr.msg_controllen = sizeof(socket->rx[i].control);
+    }
+
+    const int r = ::recvmmsg(socket->fd, socket->rx_msgs, count,
+                             MSG_DONTWAIT, nullptr);
+    if (r < 0) {
+      if (errno == EAGAIN || errno == EINTR) { return false; }
+      socket->ThrowIfErrno(true, "could not receive");
+    }
+
+    bool any = false;
+    for (int i = 0; i < r; i++) {
+      const auto& msg = socket->rx_msgs[i];
+      const auto& in = socket->rx[i].frame;
+      if (msg.msg_len != CAN_MTU && msg.msg_len != CANFD_MTU) { continue; }
+      if (in.can_id & (CAN_ERR_FLAG | CAN_RTR_FLAG)) { continue; }
+
+      const size_t index = output->rx_can_size++;
+      auto& out = input.rx_can[index];
+      out = {};
+      out.id = in.can_id &
+          ((in.can_id & CAN_EFF_FLAG) ? CAN_EFF_MASK : CAN_SFF_MASK);
+      out.size = std::min<uint8_t>(in.len, sizeof(out.data));
+      std::memcpy(out.data, in.data, out.size);
+      out.bus = socket->options.bus;
+
+      rx_timestamps_ns_[index] = ReadTimestamp(msg.msg_hdr);
+
+      socket->expected--;
+      any = true;
+    }
+    return any;
+  }
+
+  int64_t ReadTimestamp(const struct msghdr& msg) const {
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+         cmsg = CMSG_NXTHDR(const_cast<struct msghdr*>(&msg), cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET ||
+          cmsg->cmsg_type != SCM_TIMESTAMPING) {
+        continue;
+      }
+      struct timespec stamps[3] = {};
+      std::memcpy(stamps, CMSG_DATA(cmsg), sizeof(stamps));
+
+      // Entry 2 is the raw hardware stamp, and entry 0 the software.
+      if (options_.hardware_timestamps &&
+          (stamps[2].tv_sec || stamps[2].tv_nsec)) {
+        return ToNs(stamps[2]);
+      }
+      if (stamps[0].tv_sec || stamps[0].tv_nsec) {
+        return ToNs(stamps[0]) - clock_offset_ns_;
+      }
+    }
+    return 0;
+  }
+
+  static int64_t ToNs(const struct timespec& ts) {
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000ll + ts.tv_nsec;
+  }
+
+  static int64_t GetNs(clockid_t clock) {
+    struct timespec ts = {};
+    ::clock_gettime(clock, &ts);
+    return ToNs(ts);
+  }
+
+  static struct timespec MakeTimespec(int64_t ns) {
+    struct timespec result = {};
+    result.tv_sec = static_cast<time_t>(ns / 1000000000ll);
+    result.tv_nsec = static_cast<long>(ns % 1000000000ll);
+    return result;
+  }
+
+  const Options options_;
+  std::vector<std::unique_ptr<Socket>> sockets_;
+  // The index into 'sockets_' for each bus, or -1.
+  int bus_socket_[kMaxBus + 1] = {};
+
+  struct pollfd pollfds_[kMaxBus] = {};
+  Socket* poll_sockets_[kMaxBus] = {};
+
+  std::vector<int64_t> rx_timestamps_ns_;
+  int64_t clock_offset_ns_ = 0;
+
+  uint64_t unrouted_frames_ = 0;
+  uint64_t tx_dropped_frames_ = 0;
+};
+
+}
+}
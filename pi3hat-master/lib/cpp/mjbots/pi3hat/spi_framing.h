@@ -0,0 +1,63 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+
+#include "can_schedule.h"
+#include "pi3hat.h"
+
+namespace mjbots {
+namespace pi3hat {
+
+/// Format a single CAN frame in the layout expected by CAN bridge
+/// registers 4 and 5, and return the number of bytes used.  If
+/// 'force_long_id' is true, or the ID will not fit in 2 bytes,
+/// register 4's format is used.
+inline int EncodeCanFrame(char* buf, int cpu_bus, const CanFrame& can_frame,
+                          bool force_long_id, int* spi_address) {
+  const auto size = RoundUpDlc(can_frame.size);
+
+  buf[0] = ((cpu_bus == 1) ? 0x80 : 0x00) | (size & 0x7f);
+
+  if (can_frame.id <= 0xffff && !force_long_id) {
+    // We'll use the 2 byte ID formulation, cmd 5
+    *spi_address = 5;
+    buf[1] = (can_frame.id >> 8) & 0xff;
+    buf[2] = can_frame.id & 0xff;
+    ::memcpy(&buf[3], can_frame.data, can_frame.size);
+    for (std::size_t i = 3 + can_frame.size; i < (3 + size); i++) {
+      buf[i] = 0x50;
+    }
+    return 3 + size;
+  }
+
+  // 4 byte formulation, cmd 4
+  *spi_address = 4;
+
+  buf[1] = (can_frame.id >> 24) & 0xff;
+  buf[2] = (can_frame.id >> 16) & 0xff;
+  buf[3] = (can_frame.id >> 8) & 0xff;
+  buf[4] = (can_frame.id >> 0) & 0xff;
+  ::memcpy(&buf[5], can_frame.data, can_frame.size);
+  for (std::size_t i = 5 + can_frame.size; i < (5 + size); i++) {
+    buf[i] = 0x50;
+  }
+  return 5 + size;
+}
+
+}
+}
@@ -0,0 +1,200 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#include "pi3hat.h"
+
+namespace mjbots {
+namespace pi3hat {
+
+/// Return the checksum the firmware appends to the receive queue
+/// sizes of register 2.
+inline uint8_t QueueSizeChecksum(const uint8_t* sizes, int count) {
+  uint8_t result = 0;
+  for (int i = 0; i < count; i++) { result += sizes[i]; }
+  return result ^ 0xff;
+}
+
+/// Chooses the timing of one SPI link, then watches its error rate
+/// and falls back to slower clocks as required.  See
+/// Pi3Hat::SpiTuning.
+class SpiLinkTuner {
+ public:
+  using Timing = Pi3Hat::SpiTiming;
+
+  /// @p base is the configured timing, which is both the slowest
+  /// candidate and what is used if tuning fails.
+  SpiLinkTuner(const Pi3Hat::SpiTuning& options, const Timing& base)
+      : options_(options), base_(base), timing_(base) {
+    if (!(options.speed_step > 0.0 && options.speed_step < 1.0)) {
+      throw std::invalid_argument("spi_tuning.speed_step must be in (0, 1)");
+    }
+    if (options.trials < 1 || options.error_window < 1 ||
+        options.max_errors < 0 || options.probe_interval < 1) {
+      throw std::invalid_argument("spi_tuning has an invalid count");
+    }
+
+    for (double speed = options.max_speed_hz;
+         speed > base.speed_hz; speed *= options.speed_step) {
+      speeds_.push_back(static_cast<int>(speed));
+    }
+    speeds_.push_back(base.speed_hz);
+    speed_index_ = speeds_.size() - 1;
+  }
+
+  /// The clocks which may be used, fastest first.
+  const std::vector<int>& speeds() const { return speeds_; }
+
+  /// Select a timing.  @p test(timing) should configure the link with
+  /// the given timing and return true only if every trial passed.
+  /// When this returns, the link must be configured with timing().
+  template <typename Test>
+  void Calibrate(Test test) {
+    tuned_ = false;
+    timing_ = base_;
+    speed_index_ = speeds_.size() - 1;
+
+    size_t fastest = speeds_.size();
+    for (size_t i = 0; i < speeds_.size(); i++) {
+      if (test(WithSpeed(i))) {
+        fastest = i;
+        break;
+      }
+    }
+    if (fastest == speeds_.size()) {
+      // Even the configured timing failed, so the checks themselves
+      // are probably not supported.  Leave things as they were.
+      test(base_);
+      return;
+    }
+
+    speed_index_ = std::min(
+        fastest + static_cast<size_t>(std::max(0, options_.margin_steps)),
+        speeds_.size() - 1);
+    timing_ = WithSpeed(speed_index_);
+
+    const int max_hold = std::max(base_.cs_hold_us, base_.address_hold_us);
+    for (int hold = std::max(0, options_.min_hold_us);
+         hold < max_hold; hold++) {
+      auto candidate = timing_;
+      candidate.cs_hold_us = std::min(hold, base_.cs_hold_us);
+      candidate.address_hold_us = std::min(hold, base_.address_hold_us);
+      if (test(candidate)) {
+        timing_ = candidate;
+        break;
+      }
+    }
+
+    test(timing_);
+    tuned_ = true;
+  }
+
+  /// Adopt @p timing, from a previous Calibrate, if it is among the
+  /// candidates and passes @p test.  Otherwise, or if it fails, the
+  /// link is left at the configured timing and false is returned.
+  template <typename Test>
+  bool Restore(const Timing& timing, Test test) {
+    const auto it = std::find(speeds_.begin(), speeds_.end(), timing.speed_hz);
+    if (it == speeds_.end() ||
+        timing.cs_hold_us < std::max(0, options_.min_hold_us) ||
+        timing.cs_hold_us > base_.cs_hold_us ||
+        timing.address_hold_us < std::max(0, options_.min_hold_us) ||
+        timing.address_hold_us > base_.address_hold_us) {
+      return false;
+    }
+    if (!test(timing)) {
+      test(base_);
+      return false;
+    }
+    speed_index_ = it - speeds_.begin();
+    timing_ = timing;
+    tuned_ = true;
+    return true;
+  }
+
+  /// Note the result of one checked transfer.  Returns true if the
+  /// link should now be configured with a new timing().
+  bool Record(bool ok) {
+    checks_++;
+    if (!ok) { errors_++; }
+    if (!tuned_) { return false; }
+
+    window_count_++;
+    if (!ok) { window_errors_++; }
+
+    if (window_errors_ > options_.max_errors) {
+      window_count_ = 0;
+      window_errors_ = 0;
+      if (speed_index_ + 1 >= speeds_.size() &&
+          timing_.cs_hold_us == base_.cs_hold_us &&
+          timing_.address_hold_us == base_.address_hold_us) {
+        // Nothing slower is available.
+        return false;
+      }
+      speed_index_ = std::min(speed_index_ + 1, speeds_.size() - 1);
+      timing_ = WithSpeed(speed_index_);
+      fallbacks_++;
+      return true;
+    }
+
+    if (window_count_ >= options_.error_window) {
+      window_count_ = 0;
+      window_errors_ = 0;
+    }
+    return false;
+  }
+
+  const Timing& timing() const { return timing_; }
+
+  Pi3Hat::SpiLinkStatus status() const {
+    Pi3Hat::SpiLinkStatus result;
+    result.timing = timing_;
+    result.tuned = tuned_;
+    result.checks = checks_;
+    result.errors = errors_;
+    result.fallbacks = fallbacks_;
+    return result;
+  }
+
+ private:
+  Timing WithSpeed(size_t index) const {
+    auto result = base_;
+    result.speed_hz = speeds_[index];
+    return result;
+  }
+
+  const Pi3Hat::SpiTuning options_;
+  const Timing base_;
+  std::vector<int> speeds_;
+
+  Timing timing_;
+  size_t speed_index_ = 0;
+  bool tuned_ = false;
+
+  int window_count_ = 0;
+  int window_errors_ = 0;
+
+  uint64_t checks_ = 0;
+  uint64_t errors_ = 0;
+  int fallbacks_ = 0;
+};
+
+}
+}
@@ -0,0 +1,239 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <time.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+
+// We purposefully don't use the full path here so that this file can
+// be compiled in a wide range of build configurations.
+#include "flight_recorder.h"
+#include "pi3hat.h"
+
+/// @file
+///
+/// An abstract interface for anything which can perform a Pi3Hat
+/// cycle, so that the same control software can run against the real
+/// hardware, a recorded log, or a simulation.
+///
+/// Each transport has its own clock, available from 'now_ns'.  The
+/// non-hardware transports advance it virtually, and by default do
+/// not sleep, so that they run as fast as the host allows.
+
+namespace mjbots {
+namespace pi3hat {
+
+class Transport {
+ public:
+  virtual ~Transport() {}
+
+  /// Has the same semantics as Pi3Hat::Cycle.
+  virtual Pi3Hat::Output Cycle(const Pi3Hat::Input& input) = 0;
+
+  /// The current time in this transport's clock.
+  virtual int64_t now_ns() = 0;
+};
+
+/// Operates the actual pi3hat hardware.
+class Pi3HatTransport : public Transport {
+ public:
+  /// This may throw an instance of `Error`.
+  Pi3HatTransport(const Pi3Hat::Configuration& config =
+                  Pi3Hat::Configuration())
+      : pi3hat_(new Pi3Hat(config)) {}
+
+  Pi3Hat::Output Cycle(const Pi3Hat::Input& input) override {
+    return pi3hat_->Cycle(input);
+  }
+
+  int64_t now_ns() override {
+    struct timespec ts = {};
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000ll + ts.tv_nsec;
+  }
+
+  Pi3Hat* pi3hat() { return pi3hat_.get(); }
+
+ private:
+  std::unique_ptr<Pi3Hat> pi3hat_;
+};
+
+/// Appends every cycle of another transport to a FlightRecorder.
+/// The hardware transport records for itself, through
+/// Pi3Hat::Configuration::flight_recorder, so this is for the others.
+class RecordingTransport : public Transport {
+ public:
+  /// Both @p base and @p recorder must outlive this.
+  RecordingTransport(Transport* base, FlightRecorder* recorder)
+      : base_(base), recorder_(recorder) {}
+
+  Pi3Hat::Output Cycle(const Pi3Hat::Input& input) override {
+    const int64_t start_ns = base_->now_ns();
+    const auto result = base_->Cycle(input);
+    recorder_->RecordCycle(input, result, start_ns, base_->now_ns());
+    return result;
+  }
+
+  int64_t now_ns() override { return base_->now_ns(); }
+
+ private:
+  Transport* const base_;
+  FlightRecorder* const recorder_;
+};
+
+/// Plays back the cycles stored by a FlightRecorder.  Each call to
+/// Cycle returns the CAN frames and attitude from the next recorded
+/// cycle, regardless of what was requested.
+class ReplayTransport : public Transport {
+ public:
+  struct Options {
+    // If true, Cycle sleeps so that cycles are returned at the same
+    // rate they were recorded.
+    bool realtime = false;
+
+    // If true, then once the end of the log is reached, it begins
+    // again from the start.
+    bool loop = false;
+
+    Options() {}
+  };
+
+  /// This may throw an instance of `Error`.
+  ReplayTransport(const std::string& filename,
+                  const Options& options = Options())
+      : options_(options),
+        reader_(filename) {}
+
+  Pi3Hat::Output Cycle(const Pi3Hat::Input& input) override {
+    Pi3Hat::Output result;
+    if (!NextCycle()) {
+      finished_ = true;
+      return result;
+    }
+
+    const auto& header = cycle_.header;
+    if (options_.realtime) { Pace(); }
+    now_ns_ = header.end_ns;
+    cycles_++;
+
+    if (!SameFrames(input.tx_can, cycle_.tx_can)) { tx_mismatches_++; }
+
+    const size_t rx_size = std::min(input.rx_can.size(), cycle_.rx_can.size());
+    std::copy(cycle_.rx_can.begin(), cycle_.rx_can.begin() + rx_size,
+              input.rx_can.data());
+    result.rx_can_size = rx_size;
+    result.error = header.error;
+
+    if (header.attitude_present && input.attitude) {
+      *input.attitude = header.attitude;
+      result.attitude_present = true;
+    }
+
+    return result;
+  }
+
+  /// Returns the recorded time of the most recently replayed cycle.
+  int64_t now_ns() override { return now_ns_; }
+
+  /// True once the end of the log was reached, after which every
+  /// cycle is empty.
+  bool finished() const { return finished_; }
+
+  /// The number of cycles replayed so far.
+  uint64_t cycles() const { return cycles_; }
+
+  /// The number of cycles whose transmitted frames differed from
+  /// those recorded.  A non-zero value means the software under test
+  /// no longer behaves as it did when the log was recorded.
+  uint64_t tx_mismatches() const { return tx_mismatches_; }
+
+ private:
+  bool NextCycle() {
+    if (finished_) { return false; }
+
+    bool rewound = false;
+    while (true) {
+      if (!reader_.Next(&record_)) {
+        if (!options_.loop || rewound) { return false; }
+        reader_.Rewind();
+        rewound = true;
+        pace_valid_ = false;
+        continue;
+      }
+      if (record_.header.type != FlightRecorder::kCycle) { continue; }
+      if (FlightRecordReader::ParseCycle(record_, &cycle_)) { return true; }
+    }
+  }
+
+  void Pace() {
+    const int64_t wall = WallNs();
+    if (pace_valid_) {
+      const int64_t delay =
+          (cycle_.header.end_ns - pace_log_ns_) - (wall - pace_wall_ns_);
+      if (delay > 0) {
+        std::this_thread::sleep_for(std::chrono::nanoseconds(delay));
+      }
+    } else {
+      pace_log_ns_ = cycle_.header.end_ns;
+      pace_wall_ns_ = wall;
+      pace_valid_ = true;
+    }
+  }
+
+  static int64_t WallNs() {
+    struct timespec ts = {};
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000ll + ts.tv_nsec;
+  }
+
+  static bool SameFrames(const Span<CanFrame>& lhs,
+                         const std::vector<CanFrame>& rhs) {
+    if (lhs.size() != rhs.size()) { return false; }
+    for (size_t i = 0; i < rhs.size(); i++) {
+      const auto& a = lhs[i];
+      const auto& b = rhs[i];
+      if (a.id != b.id || a.bus != b.bus || a.size != b.size ||
+          std::memcmp(a.data, b.data, a.size) != 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  const Options options_;
+  FlightRecordReader reader_;
+
+  FlightRecordReader::Record record_;
+  FlightRecordReader::Cycle cycle_;
+
+  bool finished_ = false;
+  uint64_t cycles_ = 0;
+  uint64_t tx_mismatches_ = 0;
+  int64_t now_ns_ = 0;
+
+  bool pace_valid_ = false;
+  int64_t pace_log_ns_ = 0;
+  int64_t pace_wall_ns_ = 0;
+};
+
+}
+}
@@ -0,0 +1,138 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <thread>
+#include <utility>
+
+namespace mjbots {
+namespace pi3hat {
+
+/// A thread which runs the same piece of work each time it is
+/// started, for splitting one control cycle across several CPUs.
+///
+/// Both the thread and any caller of Wait busy wait, yielding between
+/// checks, as waking a sleeping thread would cost more than most of
+/// the work given to it.  sched_yield only gives way to threads of
+/// the same or higher priority, so when 'realtime_priority' is set,
+/// 'cpu' should be one which the calling thread does not run on, or a
+/// caller of lower priority on that CPU will never run again.
+///
+/// An exception thrown by the work is caught on the thread and
+/// rethrown from Wait, so that it can be handled by the caller.
+class WorkerThread {
+ public:
+  struct Options {
+    // If non-negative, the thread is pinned to this CPU.
+    int cpu = -1;
+
+    // If non-negative, the thread is run with SCHED_FIFO at this
+    // priority.
+    int realtime_priority = -1;
+
+    Options() {}
+  };
+
+  WorkerThread(std::function<void ()> work, const Options& options = {})
+      : work_(std::move(work)),
+        thread_(std::bind(&WorkerThread::Run, this, options)) {}
+
+  ~WorkerThread() {
+    done_.store(true);
+    thread_.join();
+  }
+
+  WorkerThread(const WorkerThread&) = delete;
+  WorkerThread& operator=(const WorkerThread&) = delete;
+
+  /// Run the work once.  If the previous run was never waited for,
+  /// because the caller failed first, it is Abandoned.
+  void Start() {
+    Abandon();
+    state_.store(kWorking, std::memory_order_release);
+  }
+
+  /// Wait for any run in progress and discard what it threw.  After
+  /// this, anything the work uses may be changed.
+  void Abandon() {
+    while (!done()) { std::this_thread::yield(); }
+    error_ = nullptr;
+  }
+
+  /// Wait for the work to finish, and rethrow anything it threw.
+  void Wait() {
+    while (!done()) { std::this_thread::yield(); }
+    if (error_) {
+      auto error = error_;
+      error_ = nullptr;
+      std::rethrow_exception(error);
+    }
+  }
+
+  bool done() const {
+    return state_.load(std::memory_order_acquire) == kIdle;
+  }
+
+ private:
+  void Run(const Options& options) {
+    if (options.cpu >= 0) {
+      cpu_set_t cpuset = {};
+      CPU_ZERO(&cpuset);
+      CPU_SET(options.cpu, &cpuset);
+      ::pthread_setaffinity_np(::pthread_self(), sizeof(cpuset), &cpuset);
+    }
+    if (options.realtime_priority >= 0) {
+      struct sched_param params = {};
+      params.sched_priority = options.realtime_priority;
+      ::pthread_setschedparam(::pthread_self(), SCHED_FIFO, &params);
+    }
+
+    while (!done_.load()) {
+      if (state_.load(std::memory_order_acquire) != kWorking) {
+        std::this_thread::yield();
+        continue;
+      }
+      try {
+        work_();
+      } catch (...) {
+        error_ = std::current_exception();
+      }
+      state_.store(kIdle, std::memory_order_release);
+    }
+  }
+
+  enum State {
+    kIdle,
+    kWorking,
+  };
+
+  const std::function<void ()> work_;
+  std::atomic<bool> done_{false};
+  std::atomic<int> state_{kIdle};
+  // Only touched by the thread while working, and by the caller
+  // while idle.
+  std::exception_ptr error_;
+
+  std::thread thread_;
+};
+
+}
+}
@@ -18,7 +18,9 @@ controller."""
 import argparse
 
 from moteus_pi3hat.pi3hat_router import (
-    Pi3HatRouter, CanAttitudeWrapper, CanConfiguration, CanRateOverride)
+    Pi3HatRouter, CanAttitudeWrapper, CanBatch, CanConfiguration,
+    CanRateOverride, Mode, PositionResolution, QueryCommand, Resolution,
+    ServoBatch, SimulationOptions)
 
 class Pi3HatFactory():
     PRIORITY = 5
@@ -70,6 +72,13 @@ __all__ = [
     'Pi3HatRouter',
     'Pi3HatFactory',
     'CanAttitudeWrapper',
+    'CanBatch',
     'CanConfiguration',
     'CanRateOverride',
+    'Mode',
+    'PositionResolution',
+    'QueryCommand',
+    'Resolution',
+    'ServoBatch',
+    'SimulationOptions',
 ]
@@ -12,22 +12,34 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <algorithm>
+#include <array>
+#include <cstring>
 #include <functional>
 #include <future>
 #include <iostream>
 #include <string>
+#include <system_error>
 #include <thread>
 
+#include <sys/eventfd.h>
+#include <unistd.h>
+
 #include <pybind11/numpy.h>
 #include <pybind11/pybind11.h>
-#include <pybind11/functional.h>
 #include <pybind11/stl.h>
 
 #include "mjbots/pi3hat/pi3hat.h"
+#include "mjbots/pi3hat/transport.h"
+#include "mjbots/moteus/moteus_cached_parser.h"
+#include "mjbots/moteus/moteus_simulator.h"
+#include "mjbots/moteus/pi3hat_moteus_interface.h"
 #include "mjbots/moteus/realtime.h"
+#include "mjbots/moteus/realtime_allocation.h"
 
 namespace py = pybind11;
 namespace pi3hat = mjbots::pi3hat;
+namespace moteus = mjbots::moteus;
 
 namespace {
 struct SingleCan {
@@ -64,6 +76,129 @@ struct Output {
   Attitude attitude;
 };
 
+/// The same as Input, except that frames are passed in caller owned
+/// arrays rather than as individual objects.  Each array is indexed
+/// by frame, and 'tx_data' and 'rx_data' have 64 bytes per frame.
+///
+/// The receive arrays are filled in place, so they must be writeable,
+/// and the caller can reuse the same arrays on every cycle.
+struct BatchInput {
+  py::array tx_id;  // uint32
+  py::array tx_bus;  // uint8
+  py::array tx_data;  // uint8, N x 64
+  py::array tx_size;  // uint8
+  py::array tx_expect_reply;  // bool
+  int tx_count = 0;
+
+  py::array rx_id;  // uint32
+  py::array rx_bus;  // uint8
+  py::array rx_data;  // uint8, N x 64
+  py::array rx_size;  // uint8
+
+  uint32_t force_can_check = 0;
+  int32_t max_rx = -1;
+  bool request_attitude = false;
+  uint32_t timeout_ns = 0;
+  uint32_t min_tx_wait_ns = 200000;
+  uint32_t rx_extra_wait_ns = 40000;
+};
+
+struct BatchOutput {
+  // The number of entries of the receive arrays which were filled.
+  int rx_count = 0;
+  bool attitude_present = false;
+  Attitude attitude;
+};
+
+/// One entry of the 'commands' array passed to 'submit_servos'.  The
+/// matching numpy dtype is exported as 'servo_command_dtype'.  These
+/// are plain records so that numpy can describe them, and the python
+/// ServoBatch fills in the defaults.
+struct ServoCommandRecord {
+  int32_t id;
+  int32_t bus;
+
+  // A moteus::Mode.  Only kStopped, kPosition and kZeroVelocity are
+  // supported.
+  int32_t mode;
+
+  // If true, the servo is asked to reply with the registers in
+  // ServoInput::query.
+  bool query;
+
+  // These are only used for kPosition and kZeroVelocity.
+  double position;
+  double velocity;
+  double feedforward_torque;
+  double kp_scale;
+  double kd_scale;
+  double maximum_torque;
+  double stop_position;
+  double watchdog_timeout;
+};
+
+/// One entry of the 'replies' array, exported as 'servo_reply_dtype'.
+/// replies[i] always holds the reply from commands[i].  Registers not
+/// present in the reply are NaN, or 0 for the integral ones.
+struct ServoReplyRecord {
+  int32_t id;
+  int32_t bus;
+
+  // True if this was refreshed in the most recent cycle.
+  bool updated;
+
+  int32_t mode;
+  double position;
+  double velocity;
+  double torque;
+  double q_current;
+  double d_current;
+  bool rezero_state;
+  double voltage;
+  double temperature;
+  int32_t fault;
+};
+
+struct ServoInput {
+  py::array commands;
+  py::array replies;
+
+  moteus::PositionResolution resolution;
+  moteus::QueryCommand query;
+
+  uint32_t force_can_check = 0;
+  bool request_attitude = false;
+  uint32_t timeout_ns = 0;
+  uint32_t min_tx_wait_ns = 200000;
+  uint32_t rx_extra_wait_ns = 40000;
+};
+
+int MakeEventFd() {
+  const int result = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (result < 0) {
+    throw std::system_error(errno, std::generic_category(), "eventfd");
+  }
+  return result;
+}
+
+constexpr size_t kCanPayloadSize = sizeof(pi3hat::CanFrame::data);
+
+template <typename T>
+void CheckArray(const py::array& array, const char* name,
+                size_t min_size, size_t columns) {
+  if (!py::isinstance<py::array_t<T, py::array::c_style>>(array)) {
+    throw std::invalid_argument(
+        std::string(name) + " must be a contiguous array of " +
+        py::str(py::dtype::of<T>()).cast<std::string>());
+  }
+  const size_t ndim = (columns == 0) ? 1 : 2;
+  if (static_cast<size_t>(array.ndim()) != ndim ||
+      static_cast<size_t>(array.shape(0)) < min_size ||
+      (columns != 0 && static_cast<size_t>(array.shape(1)) != columns)) {
+    throw std::invalid_argument(std::string(name) + " has the wrong shape");
+  }
+}
+
 Euler ConvertEulerRad(const pi3hat::Quaternion& q) {
   Euler result_rad;
 
@@ -95,15 +230,39 @@ class Pi3HatRouter {
  public:
   struct Options : pi3hat::Pi3Hat::Configuration {
     int cpu = 3;
+
+    // If non-empty, cycles are replayed from this flight record
+    // instead of using the hardware.
+    std::string replay;
+
+    // If true, the servos are simulated instead of using the
+    // hardware.
+    bool simulate = false;
+
+    // For 'replay' and 'simulate', whether cycles take as long as
+    // they would on the hardware, or complete immediately.
+    bool realtime = false;
+
+    mjbots::moteus::SimulatedMoteusTransport::Options simulation;
+
+    // If non-zero, room for this many transmit frames, and twice as
+    // many received frames, is allocated up front, and larger cycles
+    // are rejected.  Otherwise, the buffers grow on first use.
+    int max_frames = 0;
   };
 
   Pi3HatRouter(const Options& options)
       : options_(options),
+        event_fd_(MakeEventFd()),
         thread_(std::bind(&Pi3HatRouter::CHILD_Run, this)) {
+    tx_can_.reserve(options_.max_frames);
+    rx_can_.reserve(options_.max_frames * 2);
+
     auto future = init_promise_.get_future();
     auto ep = future.get();
     if (ep) {
       thread_.join();
+      ::close(event_fd_);
       std::rethrow_exception(ep);
     }
   }
@@ -115,26 +274,95 @@ class Pi3HatRouter {
       condition_.notify_one();
     }
     thread_.join();
+    ::close(event_fd_);
   }
 
-  using CallbackFunction = std::function<void (Output)>;
+  /// This becomes readable whenever a submitted cycle completes.
+  /// Once it is, 'Fetch' returns the result.
+  ///
+  /// The child thread never needs the GIL, so other python threads
+  /// and tasks continue to run for the entire SPI transaction.
+  int event_fd() const { return event_fd_; }
 
-  void Cycle(const Input& input, CallbackFunction callback) {
+  void Submit(const Input& input) {
     std::unique_lock<std::mutex> lock(mutex_);
-    if (active_) {
-      throw std::logic_error("cannot invoke multiple cycles at the same time");
-    }
+    PARENT_CheckIdle();
 
-    callback_ = std::move(callback);
-    active_ = true;
     PARENT_PopulateInput(input);
+    kind_ = kFrames;
+    active_ = true;
 
     condition_.notify_all();
   }
 
+  void SubmitBatch(const BatchInput& input) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    PARENT_CheckIdle();
+
+    PARENT_PopulateBatch(input);
+    kind_ = kBatch;
+    active_ = true;
+
+    condition_.notify_all();
+  }
+
+  /// Encode and send one command for each servo, and decode their
+  /// replies, entirely in C++.  The result is a BatchOutput whose
+  /// rx_count is the number of replies which were updated.
+  void SubmitServos(const ServoInput& input) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    PARENT_CheckIdle();
+
+    PARENT_PopulateServos(input);
+    kind_ = kServos;
+    active_ = true;
+
+    condition_.notify_all();
+  }
+
+  /// Return the Output, or for batch and servo cycles the
+  /// BatchOutput, of the most recently completed cycle, and clear the
+  /// event_fd.
+  py::object Fetch() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!complete_) {
+      throw std::logic_error("no cycle has completed");
+    }
+
+    uint64_t count = 0;
+    if (::read(event_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+      throw std::system_error(errno, std::generic_category(), "read");
+    }
+
+    complete_ = false;
+    batch_hold_ = py::object();
+    if (kind_ != kFrames) { return py::cast(batch_output_); }
+    return py::cast(std::move(output_));
+  }
+
  private:
+  void PARENT_CheckIdle() const {
+    if (active_ || complete_) {
+      throw std::logic_error("cannot invoke multiple cycles at the same time");
+    }
+  }
+
+  /// Size the frame buffers, which never allocates when max_frames
+  /// is set.
+  void PARENT_ResizeFrames(size_t tx_size, size_t rx_size) {
+    const size_t max_frames = options_.max_frames;
+    if (max_frames != 0 &&
+        (tx_size > max_frames || rx_size > max_frames * 2)) {
+      throw std::invalid_argument("more frames than max_frames");
+    }
+    tx_can_.resize(tx_size);
+    rx_can_.resize(rx_size);
+  }
+
   void PARENT_PopulateInput(const Input& input) {
-    tx_can_.resize(input.tx_can.size());
+    PARENT_ResizeFrames(
+        input.tx_can.size(),
+        (input.max_rx >= 0) ? input.max_rx : input.tx_can.size() * 2);
     for (size_t i = 0; i < input.tx_can.size(); i++) {
       auto& out = tx_can_[i];
       auto& in = input.tx_can[i];
@@ -150,18 +378,152 @@ class Pi3HatRouter {
     timeout_ns_ = input.timeout_ns;
     min_tx_wait_ns_ = input.min_tx_wait_ns;
     rx_extra_wait_ns_ = input.rx_extra_wait_ns;
-    if (input.max_rx >= 0) {
-      rx_can_.resize(input.max_rx);
-    } else {
-      rx_can_.resize(tx_can_.size() * 2);
+  }
+
+  void PARENT_PopulateBatch(const BatchInput& input) {
+    if (input.tx_count < 0) {
+      throw std::invalid_argument("tx_count must be non-negative");
     }
+    const size_t tx_count = input.tx_count;
+    CheckArray<uint32_t>(input.tx_id, "tx_id", tx_count, 0);
+    CheckArray<uint8_t>(input.tx_bus, "tx_bus", tx_count, 0);
+    CheckArray<uint8_t>(input.tx_data, "tx_data", tx_count, kCanPayloadSize);
+    CheckArray<uint8_t>(input.tx_size, "tx_size", tx_count, 0);
+    CheckArray<bool>(input.tx_expect_reply, "tx_expect_reply", tx_count, 0);
+
+    CheckArray<uint32_t>(input.rx_id, "rx_id", 0, 0);
+    const size_t rx_capacity = input.rx_id.shape(0);
+    CheckArray<uint8_t>(input.rx_bus, "rx_bus", rx_capacity, 0);
+    CheckArray<uint8_t>(input.rx_data, "rx_data", rx_capacity, kCanPayloadSize);
+    CheckArray<uint8_t>(input.rx_size, "rx_size", rx_capacity, 0);
+
+    const auto* tx_id = static_cast<const uint32_t*>(input.tx_id.data());
+    const auto* tx_bus = static_cast<const uint8_t*>(input.tx_bus.data());
+    const auto* tx_data = static_cast<const uint8_t*>(input.tx_data.data());
+    const auto* tx_size = static_cast<const uint8_t*>(input.tx_size.data());
+    const auto* tx_expect_reply =
+        static_cast<const bool*>(input.tx_expect_reply.data());
+
+    // The vectors keep their capacity between cycles, so this only
+    // allocates when more frames are used than ever before.
+    PARENT_ResizeFrames(
+        tx_count,
+        (input.max_rx >= 0) ?
+        std::min<size_t>(input.max_rx, rx_capacity) : rx_capacity);
+    for (size_t i = 0; i < tx_count; i++) {
+      if (tx_size[i] > kCanPayloadSize) {
+        throw std::invalid_argument("tx_size exceeds 64 bytes");
+      }
+      auto& out = tx_can_[i];
+      out.id = tx_id[i];
+      out.size = tx_size[i];
+      std::memcpy(&out.data[0], &tx_data[i * kCanPayloadSize], out.size);
+      out.bus = tx_bus[i];
+      out.expect_reply = tx_expect_reply[i];
+    }
+
+    force_can_check_ = input.force_can_check;
+    request_attitude_ = input.request_attitude;
+    timeout_ns_ = input.timeout_ns;
+    min_tx_wait_ns_ = input.min_tx_wait_ns;
+    rx_extra_wait_ns_ = input.rx_extra_wait_ns;
+
+    // The child thread writes into these without the GIL, so we keep
+    // references to ensure they outlive the cycle.  mutable_data
+    // throws if any is read only.
+    batch_rx_id_ = static_cast<uint32_t*>(input.rx_id.mutable_data());
+    batch_rx_bus_ = static_cast<uint8_t*>(input.rx_bus.mutable_data());
+    batch_rx_data_ = static_cast<uint8_t*>(input.rx_data.mutable_data());
+    batch_rx_size_ = static_cast<uint8_t*>(input.rx_size.mutable_data());
+    batch_hold_ = py::make_tuple(
+        input.rx_id, input.rx_bus, input.rx_data, input.rx_size);
+  }
+
+  void PARENT_PopulateServos(const ServoInput& input) {
+    CheckArray<ServoCommandRecord>(input.commands, "commands", 0, 0);
+    const size_t size = input.commands.shape(0);
+    CheckArray<ServoReplyRecord>(input.replies, "replies", size, 0);
+
+    const auto* commands =
+        static_cast<const ServoCommandRecord*>(input.commands.data());
+    auto* replies =
+        static_cast<ServoReplyRecord*>(input.replies.mutable_data());
+
+    for (auto& bus : reply_slot_) {
+      for (auto& slot : bus) { slot = -1; }
+    }
+
+    moteus::QueryCommand no_query;
+    no_query.mode = moteus::Resolution::kIgnore;
+    no_query.position = moteus::Resolution::kIgnore;
+    no_query.velocity = moteus::Resolution::kIgnore;
+    no_query.torque = moteus::Resolution::kIgnore;
+    no_query.voltage = moteus::Resolution::kIgnore;
+    no_query.temperature = moteus::Resolution::kIgnore;
+    no_query.fault = moteus::Resolution::kIgnore;
+
+    PARENT_ResizeFrames(size, size * 2);
+    for (size_t i = 0; i < size; i++) {
+      const auto& record = commands[i];
+      if (record.bus < 1 || record.bus > kMaxBus ||
+          record.id < 0 || record.id > kMaxId) {
+        throw std::invalid_argument("servo bus or id out of range");
+      }
+      auto& slot = reply_slot_[record.bus][record.id];
+      if (slot >= 0) {
+        throw std::invalid_argument("servo listed more than once");
+      }
+      slot = i;
+
+      moteus::Pi3HatMoteusInterface::ServoCommand cmd;
+      cmd.id = record.id;
+      cmd.bus = record.bus;
+      cmd.mode = static_cast<moteus::Mode>(record.mode);
+      cmd.position.position = record.position;
+      cmd.position.velocity = record.velocity;
+      cmd.position.feedforward_torque = record.feedforward_torque;
+      cmd.position.kp_scale = record.kp_scale;
+      cmd.position.kd_scale = record.kd_scale;
+      cmd.position.maximum_torque = record.maximum_torque;
+      cmd.position.stop_position = record.stop_position;
+      cmd.position.watchdog_timeout = record.watchdog_timeout;
+      cmd.resolution = input.resolution;
+      cmd.query = record.query ? input.query : no_query;
+
+      moteus::Pi3HatMoteusInterface::EncodeCommand(cmd, &tx_can_[i]);
+
+      replies[i].id = record.id;
+      replies[i].bus = record.bus;
+    }
+
+    force_can_check_ = input.force_can_check;
+    request_attitude_ = input.request_attitude;
+    timeout_ns_ = input.timeout_ns;
+    min_tx_wait_ns_ = input.min_tx_wait_ns;
+    rx_extra_wait_ns_ = input.rx_extra_wait_ns;
+
+    servo_replies_ = replies;
+    servo_count_ = size;
+    batch_hold_ = input.replies;
   }
 
   void CHILD_Run() {
     std::exception_ptr ep = nullptr;
     try {
       mjbots::moteus::ConfigureRealtime(options_.cpu);
-      pi3hat_.reset(new pi3hat::Pi3Hat(options_));
+      if (!options_.replay.empty()) {
+        pi3hat::ReplayTransport::Options replay_options;
+        replay_options.realtime = options_.realtime;
+        transport_.reset(
+            new pi3hat::ReplayTransport(options_.replay, replay_options));
+      } else if (options_.simulate) {
+        auto simulation = options_.simulation;
+        simulation.realtime = options_.realtime;
+        transport_.reset(
+            new mjbots::moteus::SimulatedMoteusTransport(simulation));
+      } else {
+        transport_.reset(new pi3hat::Pi3HatTransport(options_));
+      }
     } catch (...) {
       ep = std::current_exception();
     }
@@ -178,22 +540,37 @@ class Pi3HatRouter {
         }
       }
 
-      auto output = CHILD_Cycle();
-
-      // This will be a python object, so we need the GIL.
-      py::gil_scoped_acquire acquire;
+      // kind_ is fixed until active_ is cleared below.
+      switch (kind_) {
+        case kFrames: {
+          output_ = CHILD_Cycle();
+          break;
+        }
+        case kBatch: {
+          batch_output_ = CHILD_CycleBatch();
+          break;
+        }
+        case kServos: {
+          batch_output_ = CHILD_CycleServos();
+          break;
+        }
+      }
 
-      CallbackFunction callback_copy;
       {
         std::unique_lock<std::mutex> lock(mutex_);
         active_ = false;
-        std::swap(callback_copy, callback_);
+        complete_ = true;
+      }
+
+      const uint64_t one = 1;
+      if (::write(event_fd_, &one, sizeof(one)) < 0) {
+        std::cerr << "pi3hat_router: eventfd write failed: "
+                  << std::strerror(errno) << "\n";
       }
-      callback_copy(output);
     }
   }
 
-  Output CHILD_Cycle() {
+  pi3hat::Pi3Hat::Output CHILD_Transport() {
     pi3hat::Pi3Hat::Input input;
     input.tx_can = { tx_can_.data(), tx_can_.size() };
     input.rx_can = { rx_can_.data(), rx_can_.size() };
@@ -208,9 +585,74 @@ class Pi3HatRouter {
     input.min_tx_wait_ns = min_tx_wait_ns_;
     input.rx_extra_wait_ns = rx_extra_wait_ns_;
 
-    Output result;
+    moteus::NoAllocationScope no_allocation;
+    return transport_->Cycle(input);
+  }
+
+  BatchOutput CHILD_CycleBatch() {
+    const auto output = CHILD_Transport();
+
+    BatchOutput result;
+    for (size_t i = 0; i < output.rx_can_size; i++) {
+      const auto& in = rx_can_[i];
+      batch_rx_id_[i] = in.id;
+      batch_rx_bus_[i] = in.bus;
+      batch_rx_size_[i] = in.size;
+      std::memcpy(&batch_rx_data_[i * kCanPayloadSize], &in.data[0], in.size);
+    }
+    result.rx_count = output.rx_can_size;
+    result.attitude_present = output.attitude_present;
+    if (result.attitude_present) {
+      result.attitude = attitude_;
+      result.attitude.euler_rad = ConvertEulerRad(result.attitude.attitude);
+    }
+    return result;
+  }
+
+  BatchOutput CHILD_CycleServos() {
+    const auto output = CHILD_Transport();
+
+    for (size_t i = 0; i < servo_count_; i++) {
+      servo_replies_[i].updated = false;
+    }
 
-    const auto output = pi3hat_->Cycle(input);
+    BatchOutput result;
+    for (size_t i = 0; i < output.rx_can_size; i++) {
+      const auto& can = rx_can_[i];
+      const int id = (can.id >> 8) & 0x7f;
+      if (can.bus < 1 || can.bus > kMaxBus) { continue; }
+      const int slot = reply_slot_[can.bus][id];
+      if (slot < 0) { continue; }
+
+      // Every servo is normally sent the same query, so the cached
+      // layout rarely needs to be re-learned.
+      const auto parsed = query_parser_.Parse(can.data, can.size);
+      auto& reply = servo_replies_[slot];
+      reply.updated = true;
+      reply.mode = static_cast<int32_t>(parsed.mode);
+      reply.position = parsed.position;
+      reply.velocity = parsed.velocity;
+      reply.torque = parsed.torque;
+      reply.q_current = parsed.q_current;
+      reply.d_current = parsed.d_current;
+      reply.rezero_state = parsed.rezero_state;
+      reply.voltage = parsed.voltage;
+      reply.temperature = parsed.temperature;
+      reply.fault = parsed.fault;
+      result.rx_count++;
+    }
+    result.attitude_present = output.attitude_present;
+    if (result.attitude_present) {
+      result.attitude = attitude_;
+      result.attitude.euler_rad = ConvertEulerRad(result.attitude.attitude);
+    }
+    return result;
+  }
+
+  Output CHILD_Cycle() {
+    const auto output = CHILD_Transport();
+
+    Output result;
 
     for (size_t i = 0; i < output.rx_can_size; i++) {
       SingleCan out;
@@ -236,15 +678,14 @@ class Pi3HatRouter {
   std::mutex mutex_;
   std::condition_variable condition_;
   bool active_ = false;
+  bool complete_ = false;
   bool done_ = false;
-  CallbackFunction callback_;
+  py::object batch_hold_;
 
-  std::thread thread_;
-  std::promise<std::exception_ptr> init_promise_;
+  const int event_fd_;
 
   // Used in the child thread.
-  std::unique_ptr<pi3hat::Pi3Hat> pi3hat_;
-
+  std::unique_ptr<pi3hat::Transport> transport_;
 
   // These are populated in the parent thread when active_ == false,
   // and from the child thread when active_ == true.
@@ -259,6 +700,38 @@ class Pi3HatRouter {
   uint32_t rx_extra_wait_ns_ = 0;
   std::vector<pi3hat::CanFrame> rx_can_;
   Attitude attitude_;
+
+  // Selects which of these holds the result, and is controlled the
+  // same way as the above.
+  enum Kind {
+    kFrames,
+    kBatch,
+    kServos,
+  };
+  Kind kind_ = kFrames;
+  Output output_;
+  BatchOutput batch_output_;
+
+  // The receive arrays of the current batch cycle, kept alive by
+  // batch_hold_.
+  uint32_t* batch_rx_id_ = nullptr;
+  uint8_t* batch_rx_bus_ = nullptr;
+  uint8_t* batch_rx_data_ = nullptr;
+  uint8_t* batch_rx_size_ = nullptr;
+
+  // The replies of the current servo cycle, also kept alive by
+  // batch_hold_, and the index of the command for each bus and id.
+  static constexpr int kMaxBus = 5;
+  static constexpr int kMaxId = 127;
+  ServoReplyRecord* servo_replies_ = nullptr;
+  size_t servo_count_ = 0;
+  std::array<std::array<int16_t, kMaxId + 1>, kMaxBus + 1> reply_slot_ = {};
+  moteus::CachedQueryParser query_parser_;
+
+  // The child thread uses everything above, so it must be started
+  // last.
+  std::promise<std::exception_ptr> init_promise_;
+  std::thread thread_;
 };
 }
 
@@ -266,6 +739,72 @@ PYBIND11_MODULE(_pi3hat_router, m) {
   m.doc() = "implementation of pi3hat specific moteus functionality";
   using PH = pi3hat::Pi3Hat;
 
+  PYBIND11_NUMPY_DTYPE(
+      ServoCommandRecord, id, bus, mode, query, position, velocity,
+      feedforward_torque, kp_scale, kd_scale, maximum_torque,
+      stop_position, watchdog_timeout);
+  PYBIND11_NUMPY_DTYPE(
+      ServoReplyRecord, id, bus, updated, mode, position, velocity,
+      torque, q_current, d_current, rezero_state, voltage, temperature,
+      fault);
+  m.attr("servo_command_dtype") = py::dtype::of<ServoCommandRecord>();
+  m.attr("servo_reply_dtype") = py::dtype::of<ServoReplyRecord>();
+
+  py::enum_<moteus::Mode>(m, "Mode")
+      .value("STOPPED", moteus::Mode::kStopped)
+      .value("POSITION", moteus::Mode::kPosition)
+      .value("ZERO_VELOCITY", moteus::Mode::kZeroVelocity)
+      ;
+
+  py::enum_<moteus::Resolution>(m, "Resolution")
+      .value("INT8", moteus::Resolution::kInt8)
+      .value("INT16", moteus::Resolution::kInt16)
+      .value("INT32", moteus::Resolution::kInt32)
+      .value("FLOAT", moteus::Resolution::kFloat)
+      .value("IGNORE", moteus::Resolution::kIgnore)
+      ;
+
+  using PR = moteus::PositionResolution;
+  py::class_<PR>(m, "PositionResolution")
+      .def(py::init<>())
+      .def_readwrite("position", &PR::position)
+      .def_readwrite("velocity", &PR::velocity)
+      .def_readwrite("feedforward_torque", &PR::feedforward_torque)
+      .def_readwrite("kp_scale", &PR::kp_scale)
+      .def_readwrite("kd_scale", &PR::kd_scale)
+      .def_readwrite("maximum_torque", &PR::maximum_torque)
+      .def_readwrite("stop_position", &PR::stop_position)
+      .def_readwrite("watchdog_timeout", &PR::watchdog_timeout)
+      ;
+
+  using QC = moteus::QueryCommand;
+  py::class_<QC>(m, "QueryCommand")
+      .def(py::init<>())
+      .def_readwrite("mode", &QC::mode)
+      .def_readwrite("position", &QC::position)
+      .def_readwrite("velocity", &QC::velocity)
+      .def_readwrite("torque", &QC::torque)
+      .def_readwrite("q_current", &QC::q_current)
+      .def_readwrite("d_current", &QC::d_current)
+      .def_readwrite("rezero_state", &QC::rezero_state)
+      .def_readwrite("voltage", &QC::voltage)
+      .def_readwrite("temperature", &QC::temperature)
+      .def_readwrite("fault", &QC::fault)
+      ;
+
+  py::class_<ServoInput>(m, "ServoInput")
+      .def(py::init<>())
+      .def_readwrite("commands", &ServoInput::commands)
+      .def_readwrite("replies", &ServoInput::replies)
+      .def_readwrite("resolution", &ServoInput::resolution)
+      .def_readwrite("query", &ServoInput::query)
+      .def_readwrite("force_can_check", &ServoInput::force_can_check)
+      .def_readwrite("request_attitude", &ServoInput::request_attitude)
+      .def_readwrite("timeout_ns", &ServoInput::timeout_ns)
+      .def_readwrite("min_tx_wait_ns", &ServoInput::min_tx_wait_ns)
+      .def_readwrite("rx_extra_wait_ns", &ServoInput::rx_extra_wait_ns)
+      ;
+
   py::class_<PH::CanRateOverride>(m, "CanRateOverride")
       .def(py::init<>())
       .def_readwrite("prescaler", &PH::CanRateOverride::prescaler)
@@ -298,6 +837,11 @@ PYBIND11_MODULE(_pi3hat_router, m) {
       .def_readwrite("mounting_deg", &Pi3HatRouter::Options::mounting_deg)
       .def_readwrite("attitude_rate_hz", &Pi3HatRouter::Options::attitude_rate_hz)
       .def_readwrite("enable_aux", &Pi3HatRouter::Options::enable_aux)
+      .def_readwrite("replay", &Pi3HatRouter::Options::replay)
+      .def_readwrite("simulate", &Pi3HatRouter::Options::simulate)
+      .def_readwrite("realtime", &Pi3HatRouter::Options::realtime)
+      .def_readwrite("simulation", &Pi3HatRouter::Options::simulation)
+      .def_readwrite("max_frames", &Pi3HatRouter::Options::max_frames)
       // We rely on the fact that std::array has the same in-memory
       // layout as a C style array.
       .def_readwrite("can", reinterpret_cast<
@@ -305,6 +849,20 @@ PYBIND11_MODULE(_pi3hat_router, m) {
                      Pi3HatRouter::Options::*>(&Pi3HatRouter::Options::can))
       ;
 
+  using Simulation = mjbots::moteus::SimulatedMoteusTransport::Options;
+  py::class_<Simulation>(m, "SimulationOptions")
+      .def(py::init<>())
+      .def_readwrite("cycle_ns", &Simulation::cycle_ns)
+      .def_readwrite("frame_ns", &Simulation::frame_ns)
+      .def_readwrite("kp", &Simulation::kp)
+      .def_readwrite("kd", &Simulation::kd)
+      .def_readwrite("inertia", &Simulation::inertia)
+      .def_readwrite("max_torque", &Simulation::max_torque)
+      .def_readwrite("torque_constant", &Simulation::torque_constant)
+      .def_readwrite("voltage", &Simulation::voltage)
+      .def_readwrite("temperature", &Simulation::temperature)
+      ;
+
   py::class_<SingleCan>(m, "SingleCan")
       .def(py::init<>())
       .def_readwrite("arbitration_id", &SingleCan::arbitration_id)
@@ -338,6 +896,33 @@ PYBIND11_MODULE(_pi3hat_router, m) {
       .def_readwrite("attitude", &Output::attitude)
       ;
 
+  py::class_<BatchInput>(m, "BatchInput")
+      .def(py::init<>())
+      .def_readwrite("tx_id", &BatchInput::tx_id)
+      .def_readwrite("tx_bus", &BatchInput::tx_bus)
+      .def_readwrite("tx_data", &BatchInput::tx_data)
+      .def_readwrite("tx_size", &BatchInput::tx_size)
+      .def_readwrite("tx_expect_reply", &BatchInput::tx_expect_reply)
+      .def_readwrite("tx_count", &BatchInput::tx_count)
+      .def_readwrite("rx_id", &BatchInput::rx_id)
+      .def_readwrite("rx_bus", &BatchInput::rx_bus)
+      .def_readwrite("rx_data", &BatchInput::rx_data)
+      .def_readwrite("rx_size", &BatchInput::rx_size)
+      .def_readwrite("force_can_check", &BatchInput::force_can_check)
+      .def_readwrite("max_rx", &BatchInput::max_rx)
+      .def_readwrite("request_attitude", &BatchInput::request_attitude)
+      .def_readwrite("timeout_ns", &BatchInput::timeout_ns)
+      .def_readwrite("min_tx_wait_ns", &BatchInput::min_tx_wait_ns)
+      .def_readwrite("rx_extra_wait_ns", &BatchInput::rx_extra_wait_ns)
+      ;
+
+  py::class_<BatchOutput>(m, "BatchOutput")
+      .def(py::init<>())
+      .def_readwrite("rx_count", &BatchOutput::rx_count)
+      .def_readwrite("attitude_present", &BatchOutput::attitude_present)
+      .def_readwrite("attitude", &BatchOutput::attitude)
+      ;
+
   py::class_<Euler>(m, "Euler")
       .def(py::init<>())
       .def_readwrite("roll", &Euler::roll)
@@ -370,6 +955,10 @@ PYBIND11_MODULE(_pi3hat_router, m) {
 
   py::class_<Pi3HatRouter>(m, "Pi3HatRouter")
       .def(py::init<Pi3HatRouter::Options>())
-      .def("cycle", &Pi3HatRouter::Cycle)
+      .def("submit", &Pi3HatRouter::Submit)
+      .def("submit_batch", &Pi3HatRouter::SubmitBatch)
+      .def("submit_servos", &Pi3HatRouter::SubmitServos)
+      .def("fetch", &Pi3HatRouter::Fetch)
+      .def_property_readonly("event_fd", &Pi3HatRouter::event_fd)
       ;
 }
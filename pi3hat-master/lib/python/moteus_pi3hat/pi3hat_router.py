@@ -22,13 +22,13 @@ sys.path.insert(0, here)
 import _pi3hat_router
 
 
-def _set_future(future, output):
-    if not future.cancelled():
-        future.set_result(output)
-
-
 CanRateOverride = _pi3hat_router.CanRateOverride
 CanConfiguration = _pi3hat_router.CanConfiguration
+SimulationOptions = _pi3hat_router.SimulationOptions
+Mode = _pi3hat_router.Mode
+Resolution = _pi3hat_router.Resolution
+PositionResolution = _pi3hat_router.PositionResolution
+QueryCommand = _pi3hat_router.QueryCommand
 
 
 class CanAttitudeWrapper:
@@ -47,6 +47,111 @@ class CanAttitudeWrapper:
         self.euler_rad = attitude.euler_rad
 
 
+class CanBatch:
+    """Preallocated frame storage for Pi3HatRouter.cycle_batch.
+
+    Frames to send are written into the first 'tx_count' entries of
+    the tx_* arrays, and after each cycle the first 'rx_count' entries
+    of the rx_* arrays hold the received frames.  The same arrays are
+    reused for every cycle, so nothing is allocated per frame.
+
+    'tx_data' and 'rx_data' are (N, 64) uint8 arrays, with the valid
+    length of each row given by 'tx_size' and 'rx_size'.
+
+    This requires numpy.
+    """
+
+    def __init__(self, max_tx, max_rx=None):
+        import numpy
+
+        if max_rx is None:
+            max_rx = max_tx * 2
+
+        self.tx_id = numpy.zeros(max_tx, dtype=numpy.uint32)
+        self.tx_bus = numpy.ones(max_tx, dtype=numpy.uint8)
+        self.tx_data = numpy.zeros((max_tx, 64), dtype=numpy.uint8)
+        self.tx_size = numpy.zeros(max_tx, dtype=numpy.uint8)
+        self.tx_expect_reply = numpy.zeros(max_tx, dtype=numpy.bool_)
+        self.tx_count = 0
+
+        self.rx_id = numpy.zeros(max_rx, dtype=numpy.uint32)
+        self.rx_bus = numpy.zeros(max_rx, dtype=numpy.uint8)
+        self.rx_data = numpy.zeros((max_rx, 64), dtype=numpy.uint8)
+        self.rx_size = numpy.zeros(max_rx, dtype=numpy.uint8)
+        self.rx_count = 0
+
+        # Set after each cycle, or None if it was not requested.
+        self.attitude = None
+
+        self._input = _pi3hat_router.BatchInput()
+        self._input.tx_id = self.tx_id
+        self._input.tx_bus = self.tx_bus
+        self._input.tx_data = self.tx_data
+        self._input.tx_size = self.tx_size
+        self._input.tx_expect_reply = self.tx_expect_reply
+        self._input.rx_id = self.rx_id
+        self._input.rx_bus = self.rx_bus
+        self._input.rx_data = self.rx_data
+        self._input.rx_size = self.rx_size
+
+    def set_tx(self, index, arbitration_id, data, bus=1, expect_reply=False):
+        """Store one frame to send.  This does not allocate when 'data'
+        is a bytes-like object."""
+        size = len(data)
+        self.tx_id[index] = arbitration_id
+        self.tx_bus[index] = bus
+        self.tx_data[index, :size] = memoryview(data)
+        self.tx_size[index] = size
+        self.tx_expect_reply[index] = expect_reply
+
+
+class ServoBatch:
+    """Commands for, and replies from, a fixed set of servos, for use
+    with Pi3HatRouter.cycle_servos.
+
+    'commands' and 'replies' are numpy structured arrays with one
+    entry per servo.  Fields of 'commands' are: id, bus, mode, query,
+    position, velocity, feedforward_torque, kp_scale, kd_scale,
+    maximum_torque, stop_position and watchdog_timeout.  Fields of
+    'replies' are: id, bus, updated, mode, position, velocity,
+    torque, q_current, d_current, rezero_state, voltage, temperature
+    and fault.  replies[i] always holds the reply from commands[i].
+
+    'resolution' (a PositionResolution) and 'query' (a QueryCommand)
+    apply to every servo.  A servo whose 'query' field is False is
+    sent a command without a query.
+
+    This requires numpy.
+    """
+
+    def __init__(self, ids, buses=None):
+        import numpy
+
+        size = len(ids)
+        self.commands = numpy.zeros(
+            size, dtype=_pi3hat_router.servo_command_dtype)
+        self.replies = numpy.zeros(
+            size, dtype=_pi3hat_router.servo_reply_dtype)
+
+        self.commands['id'] = ids
+        self.commands['bus'] = buses if buses is not None else 1
+        self.commands['mode'] = int(Mode.STOPPED)
+        self.commands['query'] = True
+        self.commands['kp_scale'] = 1.0
+        self.commands['kd_scale'] = 1.0
+        self.commands['stop_position'] = numpy.nan
+
+        self.resolution = PositionResolution()
+        self.query = QueryCommand()
+
+        # Set after each cycle, or None if it was not requested.
+        self.attitude = None
+
+        self._input = _pi3hat_router.ServoInput()
+        self._input.commands = self.commands
+        self._input.replies = self.replies
+
+
 class Pi3HatRouter:
     """Permits communication using the pi3hat CAN interfaces.  This
     requires a dedicated Raspberry PI CPU to operate the hardware.  It
@@ -66,7 +171,12 @@ class Pi3HatRouter:
                  enable_aux = True,
                  disable_brs = False,
                  can = None,
-                 servo_bus_map = None):
+                 servo_bus_map = None,
+                 replay = None,
+                 simulate = False,
+                 realtime = False,
+                 simulation = None,
+                 max_frames = 0):
         """Initialize.
 
         :param cpu: The device interface will run on this CPU
@@ -75,6 +185,21 @@ class Pi3HatRouter:
 
         :param servo_bus_map: A map of buses to servo ids: {bus:
           [list, of, ids, ...})
+
+        :param replay: If set, the filename of a flight record to
+          replay instead of using the hardware
+
+        :param simulate: If True, simulate the servos instead of using
+          the hardware
+
+        :param realtime: When replaying or simulating, take as long
+          as the hardware would, rather than running as fast as
+          possible
+
+        :param simulation: An optional SimulationOptions
+
+        :param max_frames: If non-zero, the most frames sent in any
+          one cycle.  Buffers are then allocated once up front.
         """
 
         self.servo_bus_map = servo_bus_map or {}
@@ -83,6 +208,12 @@ class Pi3HatRouter:
         options.cpu = cpu
         options.spi_speed_hz = spi_speed_hz
         options.enable_aux = enable_aux
+        options.replay = replay or ''
+        options.simulate = simulate
+        options.realtime = realtime
+        options.max_frames = max_frames
+        if simulation:
+            options.simulation = simulation
 
         if mounting_deg:
             options.mounting_deg.pitch = mounting_deg['pitch']
@@ -107,6 +238,32 @@ class Pi3HatRouter:
 
         self._impl = _pi3hat_router.Pi3HatRouter(options)
 
+        # The event loop which is watching the completion eventfd,
+        # and the future for the cycle in progress, if any.
+        self._reader_loop = None
+        self._waiter = None
+
+    def close(self):
+        '''Stop watching for completions and release the pi3hat.
+
+        This is called automatically when the router is garbage
+        collected, but may be called earlier to release the hardware
+        deterministically.'''
+        impl = getattr(self, '_impl', None)
+        if impl is None:
+            return
+        # The event loop must forget the eventfd before the native
+        # object closes it, or it may end up watching an unrelated
+        # file which reuses the descriptor.
+        if (self._reader_loop is not None and
+            not self._reader_loop.is_closed()):
+            self._reader_loop.remove_reader(impl.event_fd)
+        self._reader_loop = None
+        self._impl = None
+
+    def __del__(self):
+        self.close()
+
     def _find_bus(self, destination):
         for key, value in self.servo_bus_map.items():
             if destination in value:
@@ -128,17 +285,27 @@ class Pi3HatRouter:
         result.expect_reply = command.reply_required
         return result
 
-    async def _cycle(self, input):
+    def _handle_complete(self):
+        # The result is fetched even if the waiter was cancelled, as
+        # no new cycle can be submitted until it is.
+        output = self._impl.fetch()
+        waiter, self._waiter = self._waiter, None
+        if waiter is not None and not waiter.cancelled():
+            waiter.set_result(output)
+
+    async def _invoke(self, submit):
         loop = asyncio.get_event_loop()
-        future = asyncio.Future(loop=loop)
+        if self._reader_loop is not loop:
+            if (self._reader_loop is not None and
+                not self._reader_loop.is_closed()):
+                self._reader_loop.remove_reader(self._impl.event_fd)
+            loop.add_reader(self._impl.event_fd, self._handle_complete)
+            self._reader_loop = loop
 
-        def handle_output(output):
-            if loop.is_closed():
-                print("LOOP UNEXPECTEDLY CLOSED")
-            else:
-                loop.call_soon_threadsafe(_set_future, future, output)
+        future = loop.create_future()
+        submit()
+        self._waiter = future
 
-        self._impl.cycle(input, handle_output)
         # We are forbidden to call "cycle" multiple times, thus we
         # have to actually wait for it to finish before we can let any
         # timeouts or other cancellations propagate up.
@@ -146,6 +313,9 @@ class Pi3HatRouter:
 
         return result
 
+    async def _cycle(self, input):
+        return await self._invoke(lambda: self._impl.submit(input))
+
     async def cycle(self, commands,
                     force_can_check=0,
                     max_rx=-1,
@@ -221,6 +391,76 @@ class Pi3HatRouter:
 
         return result
 
+    async def cycle_batch(self, batch,
+                          force_can_check=0,
+                          max_rx=-1,
+                          timeout_ns=1000000,
+                          min_tx_wait_ns=1000000,
+                          rx_extra_wait_ns=40000,
+                          request_attitude=False):
+        '''Operate one CAN cycle of the pi3hat using preallocated arrays
+
+        :param batch: A CanBatch.  The first 'batch.tx_count' frames
+          are sent, and on return 'batch.rx_count' and the rx arrays
+          describe the received frames.
+
+        The remaining parameters are the same as for 'cycle'.  Frames
+        are not parsed, so the caller is responsible for encoding and
+        decoding moteus payloads.
+
+        Returns the number of received frames.
+        '''
+        input = batch._input
+        input.tx_count = batch.tx_count
+        input.force_can_check = force_can_check
+        input.max_rx = max_rx
+        input.timeout_ns = timeout_ns
+        input.min_tx_wait_ns = min_tx_wait_ns
+        input.rx_extra_wait_ns = rx_extra_wait_ns
+        input.request_attitude = request_attitude
+
+        output = await self._invoke(lambda: self._impl.submit_batch(input))
+
+        batch.rx_count = output.rx_count
+        batch.attitude = (output.attitude if output.attitude_present
+                          else None)
+        return output.rx_count
+
+    def make_servo_batch(self, ids):
+        '''Return a ServoBatch for the given servo IDs, with buses
+        taken from the servo_bus_map.'''
+        return ServoBatch(ids, [self._find_bus(x) for x in ids])
+
+    async def cycle_servos(self, batch,
+                           force_can_check=0,
+                           timeout_ns=1000000,
+                           min_tx_wait_ns=1000000,
+                           rx_extra_wait_ns=40000,
+                           request_attitude=False):
+        '''Operate one CAN cycle, encoding 'batch.commands' and decoding
+        into 'batch.replies' natively
+
+        :param batch: A ServoBatch, possibly from make_servo_batch
+
+        The remaining parameters are the same as for 'cycle'.
+
+        Returns the number of servos whose replies were updated.
+        '''
+        input = batch._input
+        input.resolution = batch.resolution
+        input.query = batch.query
+        input.force_can_check = force_can_check
+        input.timeout_ns = timeout_ns
+        input.min_tx_wait_ns = min_tx_wait_ns
+        input.rx_extra_wait_ns = rx_extra_wait_ns
+        input.request_attitude = request_attitude
+
+        output = await self._invoke(lambda: self._impl.submit_servos(input))
+
+        batch.attitude = (output.attitude if output.attitude_present
+                          else None)
+        return output.rx_count
+
     async def write(self, command):
         '''Write a single message.'''
         input = _pi3hat_router.Input()